@@ -0,0 +1,48 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <arpa/inet.h>
+
+#include <cstring>
+
+#include "kale/aggregation.h"
+#include "kale/ipv4.h"
+
+namespace kale {
+namespace aggregation {
+
+size_t PacketLength(const uint8_t *data, size_t len) {
+  if (len < offsetof(ipv4::Rep, data)) {
+    return 0;
+  }
+  const ipv4::Rep *rep = reinterpret_cast<const ipv4::Rep *>(data);
+  if (rep->version != 4) {
+    return 0;
+  }
+  size_t total_len = ntohs(rep->total_length);
+  if (total_len < static_cast<size_t>(rep->ihl << 2) ||
+      total_len < offsetof(ipv4::Rep, data) || total_len > len) {
+    return 0;
+  }
+  return total_len;
+}
+
+void Aggregator::MoveTo(uint8_t *buffer) {
+  if (buffer != buffer_) {
+    ::memmove(buffer, buffer_, used_);
+    buffer_ = buffer;
+  }
+}
+
+bool Aggregator::Add(size_t len) {
+  if (count_ > 0 && used_ + len > limit_) {
+    return false;
+  }
+  used_ += len;
+  ++count_;
+  return true;
+}
+
+}  // namespace aggregation
+}  // namespace kale
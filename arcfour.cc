@@ -20,18 +20,26 @@ Cipher::Cipher(const uint8_t *key, size_t len) {
 }
 
 std::vector<uint8_t> Cipher::Encrypt(const uint8_t *buffer, size_t len) {
-  std::vector<uint8_t> result;
+  std::vector<uint8_t> result(buffer, buffer + len);
+  EncryptInPlace(result.data(), result.size());
+  return result;
+}
+
+std::vector<uint8_t> Cipher::Decrypt(const uint8_t *buffer, size_t len) {
+  return Encrypt(buffer, len);
+}
+
+void Cipher::EncryptInPlace(uint8_t *buffer, size_t len) {
   size_t j = 0, k = 0;
   for (size_t i = 0; i < len; ++i) {
     j = (j + 1) & 0xff;
     k = (k + state_[j]) & 0xff;
-    result.push_back(buffer[i] ^ state_[(state_[j] + state_[k]) & 0xff]);
+    buffer[i] ^= state_[(state_[j] + state_[k]) & 0xff];
   }
-  return result;
 }
 
-std::vector<uint8_t> Cipher::Decrypt(const uint8_t *buffer, size_t len) {
-  return Encrypt(buffer, len);
+void Cipher::DecryptInPlace(uint8_t *buffer, size_t len) {
+  EncryptInPlace(buffer, len);
 }
 
 }  // arcfour
@@ -0,0 +1,157 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// Loopback UDP packet rate of per-packet sendto/recvfrom against
+// sendmmsg/recvmmsg through kale::DatagramBatch.
+// usage: datagram_bench [num_packets] [packet_size] [batch_size]
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "kale/datagram.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+  double send_pps;
+  double recv_pps;
+  size_t received;
+};
+
+int ReceiverSocket(struct sockaddr_in *addr) {
+  int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    std::perror("socket");
+    ::exit(1);
+  }
+  int rcvbuf = 32 << 20;
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  // Receiver gives up once the sender has been quiet for a while
+  struct timeval timeout = {0, 200000};
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  ::memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(*addr);
+  if (::bind(fd, reinterpret_cast<struct sockaddr *>(addr), len) < 0 ||
+      ::getsockname(fd, reinterpret_cast<struct sockaddr *>(addr), &len) <
+          0) {
+    std::perror("bind");
+    ::exit(1);
+  }
+  return fd;
+}
+
+double PacketsPerSecond(size_t n, Clock::time_point start,
+                        Clock::time_point end) {
+  std::chrono::duration<double> diff = end - start;
+  return diff.count() > 0 ? n / diff.count() : 0;
+}
+
+template <typename SendAll, typename RecvSome>
+Result Run(size_t num_packets, SendAll &&send_all, RecvSome &&recv_some) {
+  struct sockaddr_in addr;
+  int recv_fd = ReceiverSocket(&addr);
+  int send_fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+  Result result = {0, 0, 0};
+  std::atomic<bool> ready(false);
+  std::thread receiver([&] {
+    Clock::time_point first, last;
+    ready.store(true);
+    while (result.received < num_packets) {
+      int n = recv_some(recv_fd);
+      if (n <= 0) {
+        break;
+      }
+      if (result.received == 0) {
+        first = Clock::now();
+      }
+      result.received += n;
+      last = Clock::now();
+    }
+    result.recv_pps = PacketsPerSecond(result.received, first, last);
+  });
+  while (!ready.load()) {
+  }
+  auto start = Clock::now();
+  send_all(send_fd, addr);
+  result.send_pps = PacketsPerSecond(num_packets, start, Clock::now());
+  receiver.join();
+  ::close(send_fd);
+  ::close(recv_fd);
+  return result;
+}
+
+void Report(const char *name, const Result &result, size_t num_packets) {
+  std::printf("%-10s send %12.0f pps, recv %12.0f pps, received %zu/%zu\n",
+              name, result.send_pps, result.recv_pps, result.received,
+              num_packets);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  size_t num_packets = argc > 1 ? std::atol(argv[1]) : 1 << 20;
+  size_t packet_size = argc > 2 ? std::atol(argv[2]) : 64;
+  size_t batch_size = argc > 3 ? std::atol(argv[3]) : 32;
+  if (num_packets == 0 || packet_size == 0 || batch_size == 0) {
+    std::fprintf(stderr, "usage: %s [num_packets] [packet_size] [batch_size]\n",
+                 argv[0]);
+    return 1;
+  }
+  std::vector<uint8_t> payload(packet_size, 0x6b);
+
+  auto single = Run(
+      num_packets,
+      [&](int fd, const struct sockaddr_in &addr) {
+        for (size_t i = 0; i < num_packets; ++i) {
+          ::sendto(fd, payload.data(), payload.size(), 0,
+                   reinterpret_cast<const struct sockaddr *>(&addr),
+                   sizeof(addr));
+        }
+      },
+      [&](int fd) {
+        char buf[65536];
+        return ::recvfrom(fd, buf, sizeof(buf), 0, nullptr, nullptr) < 0 ? 0
+                                                                          : 1;
+      });
+  Report("single", single, num_packets);
+
+  kale::DatagramBatch send_batch(batch_size, packet_size);
+  kale::DatagramBatch recv_batch(batch_size, 65536);
+  auto batched = Run(
+      num_packets,
+      [&](int fd, const struct sockaddr_in &addr) {
+        for (size_t i = 0; i < num_packets; ++i) {
+          send_batch.Add(payload.data(), payload.size(), addr);
+          if (send_batch.Full() || i + 1 == num_packets) {
+            send_batch.Send(fd);
+          }
+        }
+      },
+      [&](int fd) {
+        auto recv = recv_batch.Recv(fd);
+        return recv ? static_cast<int>(*recv) : 0;
+      });
+  Report("batched", batched, num_packets);
+  if (single.send_pps > 0) {
+    std::printf("send speedup %.2fx\n", batched.send_pps / single.send_pps);
+  }
+  if (single.recv_pps > 0) {
+    std::printf("recv speedup %.2fx\n", batched.recv_pps / single.recv_pps);
+  }
+  return 0;
+}
@@ -0,0 +1,161 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// Delivery latency of a packet stream over a lossy link with and without
+// kale::fec, and the cost of computing the parity. Packets are sent every
+// millisecond and take 20ms one way. A packet neither received nor rebuilt
+// is resent after a 200ms retransmit timeout, and may be lost again.
+// usage: fec_bench [loss_percent] [num_packets]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "kale/fec.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const double kIntervalMs = 1;
+const double kDelayMs = 20;
+const double kRtoMs = 200;
+const size_t kPayloadSize = 1200;
+
+struct Sent {
+  std::vector<uint8_t> bytes;
+  double time;
+};
+
+struct Result {
+  double p50, p99, p999;
+  // Datagrams sent per packet
+  double overhead;
+  double encode_mb_per_s;
+};
+
+double Percentile(std::vector<double> *latencies, double p) {
+  size_t i = static_cast<size_t>(p * (latencies->size() - 1));
+  std::nth_element(latencies->begin(), latencies->begin() + i,
+                   latencies->end());
+  return (*latencies)[i];
+}
+
+// @k == 0 sends packets unprotected.
+Result Simulate(size_t k, size_t m, double loss, size_t num_packets) {
+  std::mt19937 rng(7);
+  std::bernoulli_distribution lost(loss);
+  std::vector<Sent> sent;
+  sent.reserve(num_packets * 2);
+  std::vector<uint8_t> buffer(kPayloadSize + 1024);
+  double encode_s = 0;
+  if (k == 0) {
+    for (size_t seq = 0; seq < num_packets; ++seq) {
+      Sent datagram;
+      datagram.bytes.resize(kPayloadSize);
+      std::memcpy(datagram.bytes.data(), &seq, sizeof(seq));
+      datagram.time = seq * kIntervalMs;
+      sent.push_back(datagram);
+    }
+  } else {
+    kale::fec::Encoder encoder(k, m);
+    for (size_t seq = 0; seq < num_packets; ++seq) {
+      for (size_t i = 0; i < kPayloadSize; ++i) {
+        buffer[i] = rng();
+      }
+      std::memcpy(buffer.data(), &seq, sizeof(seq));
+      auto start = Clock::now();
+      auto protect = encoder.Protect(buffer.data(), kPayloadSize,
+                                     buffer.size());
+      encode_s += std::chrono::duration<double>(Clock::now() - start).count();
+      Sent datagram;
+      datagram.bytes.assign(buffer.begin(), buffer.begin() + *protect);
+      datagram.time = seq * kIntervalMs;
+      sent.push_back(datagram);
+      if (seq + 1 == num_packets) {
+        encoder.Flush();
+      }
+      while (encoder.PendingParity() > 0) {
+        start = Clock::now();
+        auto parity = encoder.NextParity(buffer.data(), buffer.size());
+        encode_s +=
+            std::chrono::duration<double>(Clock::now() - start).count();
+        datagram.bytes.assign(buffer.begin(), buffer.begin() + *parity);
+        sent.push_back(datagram);
+      }
+    }
+  }
+  std::vector<double> latencies(num_packets, -1);
+  kale::fec::Decoder decoder(64);
+  for (auto &datagram : sent) {
+    if (lost(rng)) {
+      continue;
+    }
+    double arrival = datagram.time + kDelayMs;
+    auto deliver = [&latencies, arrival](const uint8_t *payload, size_t len,
+                                         bool) {
+      size_t seq;
+      std::memcpy(&seq, payload, sizeof(seq));
+      if (latencies[seq] < 0) {
+        latencies[seq] = arrival - seq * kIntervalMs;
+      }
+    };
+    if (k == 0) {
+      deliver(datagram.bytes.data(), datagram.bytes.size(), false);
+    } else {
+      decoder.Receive(datagram.bytes.data(), datagram.bytes.size(), deliver);
+    }
+  }
+  for (auto &latency : latencies) {
+    if (latency >= 0) {
+      continue;
+    }
+    latency = kDelayMs + kRtoMs;
+    while (lost(rng)) {
+      latency += kRtoMs;
+    }
+  }
+  Result result;
+  result.p50 = Percentile(&latencies, 0.5);
+  result.p99 = Percentile(&latencies, 0.99);
+  result.p999 = Percentile(&latencies, 0.999);
+  result.overhead = static_cast<double>(sent.size()) / num_packets;
+  result.encode_mb_per_s =
+      k == 0 ? 0 : num_packets * kPayloadSize / encode_s / 1e6;
+  return result;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  double loss_percent = argc > 1 ? std::atof(argv[1]) : 2;
+  size_t num_packets = argc > 2 ? std::atol(argv[2]) : 1 << 18;
+  if (loss_percent < 0 || loss_percent >= 100 || num_packets == 0) {
+    std::fprintf(stderr, "usage: %s [loss_percent] [num_packets]\n", argv[0]);
+    return 1;
+  }
+  struct {
+    const char *name;
+    size_t k, m;
+  } configs[] = {
+      {"none", 0, 0},     {"xor 4+1", 4, 1},  {"xor 8+1", 8, 1},
+      {"rs 4+2", 4, 2},   {"rs 8+2", 8, 2},   {"rs 10+4", 10, 4},
+  };
+  std::printf("%.1f%% loss, %zu packets of %zu bytes\n", loss_percent,
+              num_packets, kPayloadSize);
+  std::printf("%-10s %9s %9s %9s %9s %12s\n", "fec", "p50 ms", "p99 ms",
+              "p99.9 ms", "overhead", "encode MB/s");
+  for (const auto &config : configs) {
+    Result result =
+        Simulate(config.k, config.m, loss_percent / 100, num_packets);
+    std::printf("%-10s %9.1f %9.1f %9.1f %9.2f %12.0f\n", config.name,
+                result.p50, result.p99, result.p999, result.overhead,
+                result.encode_mb_per_s);
+  }
+  return 0;
+}
@@ -0,0 +1,64 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// Cost of Use/GetLRU of kale::LRU against kale::ArenaLRU, with ids touched
+// in random order as a NAT touches its ports.
+// usage: lru_bench [num_entries] [num_ops]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "kale/lru.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Every 8th op takes the LRU, the others use a random id.
+template <typename L>
+double NanosPerOp(L *lru, const std::vector<uint32_t> &ids) {
+  uint64_t sink = 0;
+  auto start = Clock::now();
+  for (size_t i = 0; i < ids.size(); ++i) {
+    if ((i & 7) == 7) {
+      sink += lru->GetLRU();
+    } else {
+      sink += lru->Use(ids[i]);
+    }
+  }
+  std::chrono::duration<double, std::nano> diff = Clock::now() - start;
+  // Keep the loop from being optimized away
+  if (sink == 1) {
+    std::printf("\n");
+  }
+  return diff.count() / ids.size();
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  size_t num_entries = argc > 1 ? std::atol(argv[1]) : 1 << 16;
+  size_t num_ops = argc > 2 ? std::atol(argv[2]) : 1 << 24;
+  if (num_entries == 0 || num_ops == 0) {
+    std::fprintf(stderr, "usage: %s [num_entries] [num_ops]\n", argv[0]);
+    return 1;
+  }
+  std::mt19937 rng(1);
+  std::vector<uint32_t> ids(num_ops);
+  for (auto &id : ids) {
+    id = rng() % num_entries;
+  }
+  kale::LRU lru(num_entries);
+  kale::ArenaLRU arena(num_entries);
+  double map_ns = NanosPerOp(&lru, ids);
+  double arena_ns = NanosPerOp(&arena, ids);
+  std::printf("%zu entries, %zu ops\n", num_entries, num_ops);
+  std::printf("%-10s %8.1f ns/op\n", "LRU", map_ns);
+  std::printf("%-10s %8.1f ns/op\n", "ArenaLRU", arena_ns);
+  std::printf("speedup %.2fx\n", map_ns / arena_ns);
+  return 0;
+}
@@ -0,0 +1,197 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KALE_CHECKSUM_X86 1
+#endif
+
+#include "kale/checksum.h"
+
+namespace kale {
+namespace checksum {
+
+namespace {
+
+// Only the value modulo 0xffff matters for a one's complement sum, and
+// 2^16 == 1 (mod 0xffff), so wider words can be added as they are and folded
+// down at the end.
+uint32_t Fold(uint64_t sum) {
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return static_cast<uint32_t>(sum);
+}
+
+uint64_t ScalarAccumulate(const uint8_t *buffer, size_t len) {
+  uint64_t sum = 0;
+  while (len >= 8) {
+    uint64_t x;
+    ::memcpy(&x, buffer, sizeof(x));
+    sum += (x & 0xffffffff) + (x >> 32);
+    buffer += 8;
+    len -= 8;
+  }
+  while (len >= 2) {
+    uint16_t x;
+    ::memcpy(&x, buffer, sizeof(x));
+    sum += x;
+    buffer += 2;
+    len -= 2;
+  }
+  if (len) {
+    // pad the trailing byte with zero in memory order
+    uint16_t x = 0;
+    ::memcpy(&x, buffer, 1);
+    sum += x;
+  }
+  return sum;
+}
+
+uint32_t ScalarSum(const uint8_t *buffer, size_t len) {
+  return Fold(ScalarAccumulate(buffer, len));
+}
+
+#ifdef KALE_CHECKSUM_X86
+uint64_t FoldLanes(const uint64_t *lanes, size_t n) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += (lanes[i] & 0xffffffff) + (lanes[i] >> 32);
+  }
+  return sum;
+}
+
+// Each 32-bit word is widened into a 64-bit lane, so the accumulators can't
+// overflow for any buffer we can address.
+__attribute__((target("sse2"))) uint32_t SSE2Sum(const uint8_t *buffer,
+                                                 size_t len) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc0 = _mm_setzero_si128();
+  __m128i acc1 = _mm_setzero_si128();
+  while (len >= 32) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buffer));
+    __m128i y =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(buffer + 16));
+    acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(x, zero));
+    acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(x, zero));
+    acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(y, zero));
+    acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(y, zero));
+    buffer += 32;
+    len -= 32;
+  }
+  if (len >= 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buffer));
+    acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(x, zero));
+    acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(x, zero));
+    buffer += 16;
+    len -= 16;
+  }
+  uint64_t lanes[4];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes + 2), acc1);
+  return Fold(FoldLanes(lanes, 4) + ScalarAccumulate(buffer, len));
+}
+
+__attribute__((target("avx2"))) uint32_t AVX2Sum(const uint8_t *buffer,
+                                                 size_t len) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc0 = _mm256_setzero_si256();
+  __m256i acc1 = _mm256_setzero_si256();
+  while (len >= 64) {
+    __m256i x =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buffer));
+    __m256i y =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buffer + 32));
+    acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(x, zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(x, zero));
+    acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(y, zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(y, zero));
+    buffer += 64;
+    len -= 64;
+  }
+  if (len >= 32) {
+    __m256i x =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buffer));
+    acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(x, zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(x, zero));
+    buffer += 32;
+    len -= 32;
+  }
+  uint64_t lanes[8];
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc0);
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes + 4), acc1);
+  return Fold(FoldLanes(lanes, 8) + ScalarAccumulate(buffer, len));
+}
+#endif  // KALE_CHECKSUM_X86
+
+Kernel SelectKernel() {
+  if (Supports(kAVX2)) {
+    return kAVX2;
+  }
+  if (Supports(kSSE2)) {
+    return kSSE2;
+  }
+  return kScalar;
+}
+
+}  // namespace
+
+bool Supports(Kernel kernel) {
+  switch (kernel) {
+    case kScalar:
+      return true;
+#ifdef KALE_CHECKSUM_X86
+    case kSSE2:
+      return __builtin_cpu_supports("sse2");
+    case kAVX2:
+      return __builtin_cpu_supports("avx2");
+#endif
+    default:
+      return false;
+  }
+}
+
+Kernel ActiveKernel() {
+  static const Kernel kernel = SelectKernel();
+  return kernel;
+}
+
+const char *KernelName(Kernel kernel) {
+  switch (kernel) {
+    case kScalar:
+      return "scalar";
+    case kSSE2:
+      return "sse2";
+    case kAVX2:
+      return "avx2";
+  }
+  return "unknown";
+}
+
+uint32_t Sum(Kernel kernel, const uint8_t *buffer, size_t len) {
+  switch (kernel) {
+#ifdef KALE_CHECKSUM_X86
+    case kSSE2:
+      return SSE2Sum(buffer, len);
+    case kAVX2:
+      return AVX2Sum(buffer, len);
+#endif
+    default:
+      return ScalarSum(buffer, len);
+  }
+}
+
+uint32_t Sum(const uint8_t *buffer, size_t len) {
+  // Short buffers, e.g. addresses of the pseudo header, don't pay off the
+  // vector setup.
+  if (len < 32) {
+    return ScalarSum(buffer, len);
+  }
+  return Sum(ActiveKernel(), buffer, len);
+}
+
+}  // namespace checksum
+}  // namespace kale
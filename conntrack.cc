@@ -0,0 +1,127 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include "kale/conntrack.h"
+
+namespace kale {
+namespace conntrack {
+
+Timeouts DefaultTimeouts(uint32_t established) {
+  Timeouts timeouts;
+  timeouts.syn_sent = 120;
+  timeouts.syn_received = 60;
+  timeouts.established = established;
+  timeouts.closing = 120;
+  timeouts.time_wait = 30;
+  timeouts.closed = 10;
+  return timeouts;
+}
+
+const char *StateName(State state) {
+  switch (state) {
+    case kNone:
+      return "NONE";
+    case kSynSent:
+      return "SYN_SENT";
+    case kSynReceived:
+      return "SYN_RECV";
+    case kEstablished:
+      return "ESTABLISHED";
+    case kFinWait:
+      return "FIN_WAIT";
+    case kCloseWait:
+      return "CLOSE_WAIT";
+    case kTimeWait:
+      return "TIME_WAIT";
+    case kClosed:
+      return "CLOSED";
+  }
+  return "UNKNOWN";
+}
+
+bool IsClosing(State state) {
+  return state == kFinWait || state == kCloseWait;
+}
+
+bool IsClosed(State state) { return state == kTimeWait || state == kClosed; }
+
+uint32_t Timeout(const Timeouts &timeouts, State state) {
+  switch (state) {
+    case kSynSent:
+      return timeouts.syn_sent;
+    case kSynReceived:
+      return timeouts.syn_received;
+    case kFinWait:
+    case kCloseWait:
+      return timeouts.closing;
+    case kTimeWait:
+      return timeouts.time_wait;
+    case kClosed:
+      return timeouts.closed;
+    case kNone:
+    case kEstablished:
+      break;
+  }
+  return timeouts.established;
+}
+
+State Next(State state, Direction direction,
+           const ipv4::SegmentRef<ipv4::tcp::TCPRep> &segment) {
+  const ipv4::tcp::TCPRep *rep = segment.rep;
+  if (rep->rst) {
+    return kClosed;
+  }
+  if (rep->syn) {
+    if (direction == kOriginal && !rep->ack) {
+      // A new connection, possibly reusing the tuple of a closed one
+      if (state == kNone || state == kSynSent || IsClosed(state)) {
+        return kSynSent;
+      }
+      return state;
+    }
+    if (direction == kReply && rep->ack && state == kSynSent) {
+      return kSynReceived;
+    }
+    return state == kNone ? kEstablished : state;
+  }
+  if (rep->fin) {
+    switch (state) {
+      case kFinWait:
+        return direction == kReply ? kTimeWait : state;
+      case kCloseWait:
+        return direction == kOriginal ? kTimeWait : state;
+      case kTimeWait:
+      case kClosed:
+        return state;
+      default:
+        return direction == kOriginal ? kFinWait : kCloseWait;
+    }
+  }
+  switch (state) {
+    case kNone:
+      return kEstablished;
+    case kSynReceived:
+      return direction == kOriginal && rep->ack ? kEstablished : state;
+    default:
+      return state;
+  }
+}
+
+State Track(Nat *nat, const Endpoint &local, Direction direction,
+            const ipv4::SegmentRef<ipv4::tcp::TCPRep> &segment,
+            const Timeouts &timeouts) {
+  uint8_t current;
+  if (!nat->GetState(local, &current)) {
+    return kNone;
+  }
+  State state = static_cast<State>(current);
+  State next = Next(state, direction, segment);
+  if (next != state) {
+    nat->SetState(local, next, Timeout(timeouts, next));
+  }
+  return next;
+}
+
+}  // namespace conntrack
+}  // namespace kale
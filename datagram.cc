@@ -0,0 +1,108 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include "kale/datagram.h"
+
+namespace kale {
+
+DatagramBatch::DatagramBatch(size_t size, size_t buffer_size)
+    : buffer_size_(buffer_size),
+      count_(0),
+      buffers_(size * buffer_size),
+      iovecs_(size),
+      addrs_(size),
+      headers_(size) {
+  assert(size >= 1);
+  ::memset(headers_.data(), 0, headers_.size() * sizeof(headers_[0]));
+  ::memset(addrs_.data(), 0, addrs_.size() * sizeof(addrs_[0]));
+  for (size_t i = 0; i < size; ++i) {
+    headers_[i].msg_hdr.msg_iov = &iovecs_[i];
+    headers_[i].msg_hdr.msg_iovlen = 1;
+    headers_[i].msg_hdr.msg_name = &addrs_[i];
+    SetSlot(i, buffers_.data() + i * buffer_size_, buffer_size_);
+  }
+}
+
+void DatagramBatch::SetSlot(size_t i, void *data, size_t len) {
+  iovecs_[i].iov_base = data;
+  iovecs_[i].iov_len = len;
+  headers_[i].msg_hdr.msg_namelen = sizeof(addrs_[i]);
+  headers_[i].msg_hdr.msg_flags = 0;
+  headers_[i].msg_len = len;
+}
+
+kl::Result<size_t> DatagramBatch::Recv(int fd) {
+  // Slots might point at caller memory after Add
+  for (size_t i = 0; i < headers_.size(); ++i) {
+    SetSlot(i, buffers_.data() + i * buffer_size_, buffer_size_);
+  }
+  count_ = 0;
+  int n;
+  do {
+    n = ::recvmmsg(fd, headers_.data(), headers_.size(), MSG_WAITFORONE,
+                   nullptr);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return kl::Ok(static_cast<size_t>(0));
+    }
+    return kl::Err(errno, std::strerror(errno));
+  }
+  count_ = n;
+  return kl::Ok(count_);
+}
+
+uint8_t *DatagramBatch::NextBuffer() {
+  assert(!Full());
+  return buffers_.data() + count_ * buffer_size_;
+}
+
+void DatagramBatch::Commit(size_t len, const struct sockaddr_in &addr) {
+  assert(!Full());
+  assert(len <= buffer_size_);
+  SetSlot(count_, buffers_.data() + count_ * buffer_size_, len);
+  addrs_[count_] = addr;
+  ++count_;
+}
+
+void DatagramBatch::Add(const uint8_t *data, size_t len,
+                        const struct sockaddr_in &addr) {
+  assert(!Full());
+  SetSlot(count_, const_cast<uint8_t *>(data), len);
+  addrs_[count_] = addr;
+  ++count_;
+}
+
+kl::Result<size_t> DatagramBatch::Send(int fd) {
+  size_t sent = 0, next = 0;
+  int error = 0;
+  while (next < count_) {
+    int n = ::sendmmsg(fd, &headers_[next], count_ - next, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      // Skip the datagram that failed, e.g. unreachable destination
+      error = errno;
+      ++next;
+      continue;
+    }
+    sent += n;
+    next += n;
+  }
+  count_ = 0;
+  if (error != 0) {
+    return kl::Err(error, std::strerror(error));
+  }
+  return kl::Ok(sent);
+}
+
+}  // namespace kale
@@ -23,4 +23,21 @@ Coding DemoCoding(const uint8_t *key, size_t len) {
   return ret;
 }
 
+InplaceCoding DemoInplaceCoding(const uint8_t *key, size_t len) {
+  auto cipher = std::make_shared<arcfour::Cipher>(key, len);
+  InplaceCoding ret;
+  ret.max_overhead = 0;
+  ret.Encode = [cipher](uint8_t *buffer, size_t len,
+                        size_t capacity) -> kl::Result<size_t> {
+    cipher->EncryptInPlace(buffer, len);
+    return kl::Ok(len);
+  };
+  ret.Decode = [cipher](uint8_t *buffer, size_t len,
+                        size_t capacity) -> kl::Result<size_t> {
+    cipher->DecryptInPlace(buffer, len);
+    return kl::Ok(len);
+  };
+  return ret;
+}
+
 }  // namespace kale
@@ -0,0 +1,355 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <arpa/inet.h>
+
+#include <cctype>
+#include <cstring>
+
+#include "kale/dns.h"
+
+namespace kale {
+namespace dns {
+
+namespace {
+
+const size_t kMaxLabelLength = 63;
+
+// Calls @on_label(const uint8_t *label, size_t len) for the labels of the
+// name at @offset, following pointers, until it returns false.
+template <typename OnLabel>
+kl::Result<void> WalkName(const uint8_t *packet, size_t len, size_t offset,
+                          OnLabel on_label) {
+  size_t name_len = 0;
+  while (true) {
+    if (offset >= len) {
+      return kl::Err("name runs past the packet");
+    }
+    uint8_t count = packet[offset];
+    if ((count & 0xc0) == 0xc0) {
+      if (offset + 1 >= len) {
+        return kl::Err("pointer runs past the packet");
+      }
+      size_t target = (count & 0x3f) << 8 | packet[offset + 1];
+      // Backwards only, a pointer can't loop
+      if (target >= offset) {
+        return kl::Err("pointer at %u doesn't point backwards",
+                       static_cast<unsigned>(offset));
+      }
+      offset = target;
+      continue;
+    }
+    if (count & 0xc0) {
+      return kl::Err("unknown label type 0x%02x", count);
+    }
+    if (count == 0) {
+      return kl::Ok();
+    }
+    if (offset + 1 + count > len) {
+      return kl::Err("label runs past the packet");
+    }
+    name_len += count + 1;
+    if (name_len + 1 > kMaxNameLength) {
+      return kl::Err("name longer than %u",
+                     static_cast<unsigned>(kMaxNameLength));
+    }
+    if (!on_label(packet + offset + 1, count)) {
+      return kl::Ok();
+    }
+    offset += count + 1;
+  }
+}
+
+}  // namespace
+
+kl::Result<size_t> SkipName(const uint8_t *packet, size_t len, size_t offset) {
+  size_t start = offset;
+  while (true) {
+    if (offset >= len) {
+      return kl::Err("name runs past the packet");
+    }
+    uint8_t count = packet[offset];
+    if ((count & 0xc0) == 0xc0) {
+      if (offset + 2 > len) {
+        return kl::Err("pointer runs past the packet");
+      }
+      return kl::Ok(offset + 2);
+    }
+    if (count & 0xc0) {
+      return kl::Err("unknown label type 0x%02x", count);
+    }
+    offset += count + 1;
+    if (offset - start > kMaxNameLength) {
+      return kl::Err("name longer than %u",
+                     static_cast<unsigned>(kMaxNameLength));
+    }
+    if (count == 0) {
+      return kl::Ok(offset);
+    }
+  }
+}
+
+kl::Result<size_t> ReadName(const uint8_t *packet, size_t len, size_t offset,
+                            char *buf, size_t size) {
+  if (size == 0) {
+    return kl::Err("no room for the name");
+  }
+  size_t used = 0;
+  bool full = false;
+  auto walk = WalkName(packet, len, offset,
+                       [buf, size, &used, &full](const uint8_t *label,
+                                                 size_t count) {
+                         size_t dot = used > 0 ? 1 : 0;
+                         if (used + dot + count + 1 > size) {
+                           full = true;
+                           return false;
+                         }
+                         if (dot) {
+                           buf[used++] = '.';
+                         }
+                         std::memcpy(buf + used, label, count);
+                         used += count;
+                         return true;
+                       });
+  if (!walk) {
+    return kl::Err(walk.MoveErr());
+  }
+  if (full) {
+    return kl::Err("no room for the name");
+  }
+  buf[used] = '\0';
+  return kl::Ok(used);
+}
+
+bool NameEquals(const uint8_t *packet, size_t len, size_t offset,
+                const char *name) {
+  const char *rest = name;
+  bool equal = true;
+  auto walk = WalkName(
+      packet, len, offset,
+      [&rest, &equal, name](const uint8_t *label, size_t count) {
+        if (rest != name) {
+          if (*rest != '.') {
+            return equal = false;
+          }
+          ++rest;
+        }
+        for (size_t i = 0; i < count; ++i, ++rest) {
+          if (*rest == '\0' ||
+              std::tolower(label[i]) !=
+                  std::tolower(static_cast<unsigned char>(*rest))) {
+            return equal = false;
+          }
+        }
+        return true;
+      });
+  if (!walk || !equal) {
+    return false;
+  }
+  return *rest == '\0' || (rest[0] == '.' && rest[1] == '\0');
+}
+
+kl::Result<size_t> WriteName(const char *name, uint8_t *buf, size_t size) {
+  size_t used = 0;
+  const char *label = name;
+  while (*label != '\0') {
+    const char *end = std::strchr(label, '.');
+    size_t count = end ? end - label : std::strlen(label);
+    if (count == 0 || count > kMaxLabelLength) {
+      return kl::Err("bad label in %s", name);
+    }
+    if (used + 1 + count + 1 > kMaxNameLength) {
+      return kl::Err("name longer than %u",
+                     static_cast<unsigned>(kMaxNameLength));
+    }
+    if (used + 1 + count + 1 > size) {
+      return kl::Err("no room for the name");
+    }
+    buf[used] = count;
+    std::memcpy(buf + used + 1, label, count);
+    used += count + 1;
+    label += count;
+    if (*label == '.') {
+      ++label;
+    }
+  }
+  if (used + 1 > size) {
+    return kl::Err("no room for the name");
+  }
+  buf[used++] = 0;
+  return kl::Ok(used);
+}
+
+kl::Result<size_t> BuildQuery(const char *name, uint16_t id, uint16_t type,
+                              uint8_t *buf, size_t size) {
+  if (size < kHeaderSize + 1 + 4) {
+    return kl::Err("no room for the query");
+  }
+  std::memset(buf, 0, kHeaderSize);
+  Store16(buf, id);
+  // Recursion desired
+  buf[2] = 0x01;
+  Store16(buf + 4, 1);
+  auto write = WriteName(name, buf + kHeaderSize, size - kHeaderSize - 4);
+  if (!write) {
+    return kl::Err(write.MoveErr());
+  }
+  uint8_t *tail = buf + kHeaderSize + *write;
+  Store16(tail, type);
+  Store16(tail + 2, kClassIN);
+  return kl::Ok(kHeaderSize + *write + 4);
+}
+
+Reader::Reader(const uint8_t *packet, size_t len)
+    : packet_(packet),
+      len_(len),
+      offset_(kHeaderSize),
+      id_(0),
+      flags_(0),
+      counts_{0, 0, 0, 0},
+      section_(kQuestion),
+      read_(0) {}
+
+kl::Result<void> Reader::ReadHeader() {
+  if (len_ < kHeaderSize) {
+    return kl::Err("insufficient header length");
+  }
+  id_ = Load16(packet_);
+  flags_ = Load16(packet_ + 2);
+  for (int i = 0; i < 4; ++i) {
+    counts_[i] = Load16(packet_ + 4 + 2 * i);
+  }
+  offset_ = kHeaderSize;
+  section_ = kQuestion;
+  read_ = 0;
+  return kl::Ok();
+}
+
+kl::Result<bool> Reader::NextQuestion(Question *question) {
+  if (section_ != kQuestion || read_ == counts_[kQuestion]) {
+    return kl::Ok(false);
+  }
+  auto skip = SkipName(packet_, len_, offset_);
+  if (!skip) {
+    return kl::Err(skip.MoveErr());
+  }
+  if (*skip + 4 > len_) {
+    return kl::Err("question runs past the packet");
+  }
+  question->name = offset_;
+  question->type = Load16(packet_ + *skip);
+  question->cls = Load16(packet_ + *skip + 2);
+  offset_ = *skip + 4;
+  ++read_;
+  return kl::Ok(true);
+}
+
+kl::Result<bool> Reader::NextRecord(Record *record) {
+  Question question;
+  while (section_ == kQuestion) {
+    auto next = NextQuestion(&question);
+    if (!next) {
+      return kl::Err(next.MoveErr());
+    }
+    if (!*next) {
+      section_ = kAnswer;
+      read_ = 0;
+    }
+  }
+  while (section_ <= kAdditional && read_ == counts_[section_]) {
+    ++section_;
+    read_ = 0;
+  }
+  if (section_ > kAdditional) {
+    return kl::Ok(false);
+  }
+  auto skip = SkipName(packet_, len_, offset_);
+  if (!skip) {
+    return kl::Err(skip.MoveErr());
+  }
+  const uint8_t *fixed = packet_ + *skip;
+  if (*skip + 10 > len_) {
+    return kl::Err("record runs past the packet");
+  }
+  record->section = static_cast<Section>(section_);
+  record->name = offset_;
+  record->type = Load16(fixed);
+  record->cls = Load16(fixed + 2);
+  record->ttl = Load32(fixed + 4);
+  record->data_len = Load16(fixed + 8);
+  record->data = *skip + 10;
+  if (record->data + record->data_len > len_) {
+    return kl::Err("record data runs past the packet");
+  }
+  offset_ = record->data + record->data_len;
+  ++read_;
+  return kl::Ok(true);
+}
+
+kl::Result<size_t> FormatAddress(const Reader &reader, const Record &record,
+                                 char *buf, size_t size) {
+  int family;
+  if (record.type == kTypeA && record.data_len == 4) {
+    family = AF_INET;
+  } else if (record.type == kTypeAAAA && record.data_len == 16) {
+    family = AF_INET6;
+  } else {
+    return kl::Err("not an address record, type %u of length %u",
+                   record.type, record.data_len);
+  }
+  if (!::inet_ntop(family, reader.Data(record), buf, size)) {
+    return kl::Err(errno, std::strerror(errno));
+  }
+  return kl::Ok(std::strlen(buf));
+}
+
+kl::Result<size_t> TargetName(const Reader &reader, const Record &record) {
+  size_t skip;
+  switch (record.type) {
+    case kTypeNS:
+    case kTypeCNAME:
+    case kTypePTR:
+    case kTypeSOA:
+      skip = 0;
+      break;
+    case kTypeMX:
+      // Preference
+      skip = 2;
+      break;
+    case kTypeSRV:
+      // Priority, weight and port
+      skip = 6;
+      break;
+    default:
+      return kl::Err("no name in record of type %u", record.type);
+  }
+  if (skip >= record.data_len) {
+    return kl::Err("record of type %u too short", record.type);
+  }
+  return kl::Ok(record.data + skip);
+}
+
+kl::Result<uint32_t> SOAMinimum(const Reader &reader, const Record &record) {
+  if (record.type != kTypeSOA) {
+    return kl::Err("not an SOA record");
+  }
+  size_t end = record.data + record.data_len;
+  // Primary server and mailbox, then serial, refresh, retry, expire and
+  // minimum
+  auto mname = SkipName(reader.Packet(), end, record.data);
+  if (!mname) {
+    return kl::Err(mname.MoveErr());
+  }
+  auto rname = SkipName(reader.Packet(), end, *mname);
+  if (!rname) {
+    return kl::Err(rname.MoveErr());
+  }
+  if (*rname + 20 > end) {
+    return kl::Err("SOA record too short");
+  }
+  return kl::Ok(Load32(reader.Packet() + *rname + 16));
+}
+
+}  // namespace dns
+}  // namespace kale
@@ -0,0 +1,116 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <algorithm>
+#include <cctype>
+
+#include "kale/dns_cache.h"
+
+namespace kale {
+
+namespace {
+
+// A tenth of the TTL is left when a refresh is asked for, no less than this
+// so short TTLs get one too
+const std::chrono::seconds kMinRefreshAhead(1);
+
+}  // namespace
+
+DNSCache::DNSCache(size_t capacity, uint32_t negative_ttl)
+    : negative_ttl_(negative_ttl), slots_(capacity), lru_(capacity) {
+  for (auto &slot : slots_) {
+    slot.used = false;
+  }
+}
+
+DNSCache::Key DNSCache::MakeKey(const std::string &name, uint16_t type) {
+  Key key(name, type);
+  for (auto &c : key.first) {
+    c = std::tolower(static_cast<unsigned char>(c));
+  }
+  return key;
+}
+
+bool DNSCache::Lookup(const std::string &name, uint16_t type,
+                      Clock::time_point now, DNSAnswer *answer,
+                      bool *refresh) {
+  *refresh = false;
+  auto iter = index_.find(MakeKey(name, type));
+  if (iter == index_.end()) {
+    return false;
+  }
+  uint32_t i = iter->second;
+  Slot &slot = slots_[i];
+  if (now >= slot.expire) {
+    Release(i);
+    return false;
+  }
+  lru_.Use(i);
+  ++slot.hits;
+  if (!slot.refreshing && slot.hits > 1 &&
+      slot.expire - now <= slot.refresh_ahead) {
+    slot.refreshing = true;
+    *refresh = true;
+  }
+  *answer = slot.answer;
+  // What's left of the TTL
+  answer->ttl = std::chrono::duration_cast<std::chrono::seconds>(
+                    slot.expire - now)
+                    .count();
+  return true;
+}
+
+void DNSCache::Insert(const std::string &name, uint16_t type,
+                      const DNSAnswer &answer, Clock::time_point now) {
+  bool negative = answer.rcode != 0 || answer.records.empty();
+  uint32_t ttl = negative ? negative_ttl_ : answer.ttl;
+  Key key = MakeKey(name, type);
+  auto iter = index_.find(key);
+  if (ttl == 0) {
+    if (iter != index_.end()) {
+      Release(iter->second);
+    }
+    return;
+  }
+  uint32_t i;
+  if (iter != index_.end()) {
+    i = iter->second;
+    lru_.Use(i);
+  } else {
+    // A released slot is there before the least recently used entry
+    i = lru_.Tail();
+    if (slots_[i].used) {
+      Release(i);
+    }
+    lru_.Use(i);
+    index_.insert(std::make_pair(key, i));
+  }
+  Slot &slot = slots_[i];
+  slot.used = true;
+  slot.key = std::move(key);
+  slot.answer = answer;
+  slot.answer.ttl = ttl;
+  slot.expire = now + std::chrono::seconds(ttl);
+  slot.refresh_ahead = std::max<Clock::duration>(
+      kMinRefreshAhead, std::chrono::seconds(ttl) / 10);
+  slot.hits = 0;
+  slot.refreshing = false;
+}
+
+void DNSCache::Clear() {
+  for (uint32_t i = 0; i < slots_.size(); ++i) {
+    if (slots_[i].used) {
+      Release(i);
+    }
+  }
+}
+
+void DNSCache::Release(uint32_t slot) {
+  index_.erase(slots_[slot].key);
+  slots_[slot].used = false;
+  slots_[slot].answer.records.clear();
+  lru_.Drop(slot);
+}
+
+}  // namespace kale
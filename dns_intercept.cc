@@ -0,0 +1,160 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <arpa/inet.h>
+
+#include <cstring>
+
+#include "kale/dns.h"
+#include "kale/dns_intercept.h"
+#include "kale/ip.h"
+#include "kale/resolver.h"
+
+namespace kale {
+
+namespace {
+
+const size_t kUDPHeaderSize = 8;
+const uint16_t kDNSPort = 53;
+// Of a reply without EDNS
+const size_t kMaxReplySize = 512;
+const uint8_t kReplyTTL = 64;
+// Owner, type, class, TTL and data length
+const size_t kRecordHeaderSize = 12;
+
+// RETURNS: offset of the UDP payload of an unfragmented UDP/IPv4 @packet
+// to, or from if @response, port 53, 0 if it isn't one
+size_t DNSOffset(const uint8_t *packet, size_t len, bool response) {
+  if (len < 20 || packet[0] >> 4 != 4 || !ip::IsUDP(packet, len)) {
+    return 0;
+  }
+  size_t header_len = ip::IPHeaderLength(packet, len);
+  if (header_len < 20 || len < header_len + kUDPHeaderSize ||
+      dns::Load16(packet + 2) != len || (dns::Load16(packet + 6) & 0x3fff)) {
+    return 0;
+  }
+  const uint8_t *segment = packet + header_len;
+  if (dns::Load16(segment + 4) != len - header_len) {
+    return 0;
+  }
+  uint16_t port = response ? ip::UDPSrcPort(packet, len)
+                           : ip::UDPDstPort(packet, len);
+  if (port != htons(kDNSPort)) {
+    return 0;
+  }
+  return header_len + kUDPHeaderSize;
+}
+
+}  // namespace
+
+DNSInterceptor::DNSInterceptor(size_t capacity)
+    : cache_(capacity), pending_(65536, false), hits_(0), misses_(0) {}
+
+// Only plain queries of one question are answered, the reply carries the
+// question, the cached records and nothing else. EDNS of the query is
+// dropped, so the reply is kept within 512 bytes.
+size_t DNSInterceptor::Answer(uint8_t *packet, size_t len, size_t size) {
+  size_t offset = DNSOffset(packet, len, false);
+  if (offset == 0) {
+    return 0;
+  }
+  uint8_t *message = packet + offset;
+  size_t message_len = len - offset;
+  dns::Reader reader(message, message_len);
+  dns::Question question;
+  if (!reader.ReadHeader() || reader.IsResponse() ||
+      (dns::Load16(message + 2) & 0x7800) ||
+      reader.Count(dns::kQuestion) != 1 || reader.Count(dns::kAnswer) != 0 ||
+      reader.Count(dns::kAuthority) != 0) {
+    return 0;
+  }
+  auto next = reader.NextQuestion(&question);
+  if (!next || !*next || question.cls != dns::kClassIN ||
+      (question.type != dns::kTypeA && question.type != dns::kTypeAAAA)) {
+    return 0;
+  }
+  char name[dns::kMaxNameText];
+  if (!dns::ReadName(message, message_len, question.name, name,
+                     sizeof(name))) {
+    return 0;
+  }
+  DNSAnswer answer;
+  bool refresh;
+  bool hit = cache_.Lookup(name, question.type, DNSCache::Clock::now(),
+                           &answer, &refresh);
+  // Answers go right after the question
+  size_t question_end =
+      *dns::SkipName(message, message_len, question.name) + 4;
+  int family = question.type == dns::kTypeA ? AF_INET : AF_INET6;
+  uint16_t data_len = question.type == dns::kTypeA ? 4 : 16;
+  size_t reply_len =
+      question_end + answer.records.size() * (kRecordHeaderSize + data_len);
+  if (!hit || refresh || reply_len > kMaxReplySize ||
+      offset + reply_len > size) {
+    pending_[reader.Id()] = true;
+    ++misses_;
+    return 0;
+  }
+  uint8_t *record = message + question_end;
+  uint16_t count = 0;
+  for (const auto &addr : answer.records) {
+    if (::inet_pton(family, addr.c_str(), record + kRecordHeaderSize) != 1) {
+      continue;
+    }
+    dns::Store16(record, 0xc000 | question.name);
+    dns::Store16(record + 2, question.type);
+    dns::Store16(record + 4, dns::kClassIN);
+    dns::Store32(record + 6, answer.ttl);
+    dns::Store16(record + 10, data_len);
+    record += kRecordHeaderSize + data_len;
+    ++count;
+  }
+  // Response with the opcode and RD of the query, recursion available
+  uint16_t flags = dns::Load16(message + 2);
+  dns::Store16(message + 2,
+               0x8000 | (flags & 0x7900) | 0x0080 | answer.rcode);
+  dns::Store16(message + 6, count);
+  dns::Store16(message + 8, 0);
+  dns::Store16(message + 10, 0);
+  len = record - packet;
+  ip::UDPEcho(packet, len);
+  dns::Store16(packet + 2, len);
+  packet[8] = kReplyTTL;
+  ip::IPFillChecksum(packet, len);
+  uint8_t *segment = message - kUDPHeaderSize;
+  dns::Store16(segment + 4, record - segment);
+  ip::UDPFillChecksum(packet, len);
+  ++hits_;
+  return len;
+}
+
+// Failures other than NXDOMAIN and truncated answers aren't cached.
+void DNSInterceptor::Learn(const uint8_t *packet, size_t len) {
+  size_t offset = DNSOffset(packet, len, true);
+  if (offset == 0) {
+    return;
+  }
+  const uint8_t *message = packet + offset;
+  size_t message_len = len - offset;
+  dns::Reader reader(message, message_len);
+  if (!reader.ReadHeader() || !reader.IsResponse() || reader.Truncated() ||
+      !pending_[reader.Id()]) {
+    return;
+  }
+  pending_[reader.Id()] = false;
+  if (reader.Rcode() != dns::kRcodeNoError &&
+      reader.Rcode() != dns::kRcodeNXDomain) {
+    return;
+  }
+  std::string name;
+  uint16_t type;
+  auto parse = Resolver::ParseResponse(message, message_len, &name, &type);
+  if (!parse || name.empty() ||
+      (type != dns::kTypeA && type != dns::kTypeAAAA)) {
+    return;
+  }
+  cache_.Insert(name, type, parse->second, DNSCache::Clock::now());
+}
+
+}  // namespace kale
@@ -8,18 +8,23 @@
 #include "kl/udp.h"
 
 int main() {
-  const char *server = "8.8.8.8";
-  uint16_t port = 53;
   auto udp = kl::udp::Socket();
   assert(udp);
   kale::Resolver resolver(*udp);
-  auto query = resolver.SendQuery("www.facebook.com", server, port);
-  assert(query);
+  auto set = resolver.SetUpstreams({{"8.8.8.8", 53}, {"1.1.1.1", 53}});
+  assert(set);
+  auto resp = resolver.Lookup("www.facebook.com", 10000);
   KL_DEBUG("local addr %s", resolver.LocalAddr().c_str());
-  auto resp = resolver.WaitForResult(*query, 10000);
   assert(resp);
   for (auto &answer : *resp) {
     KL_DEBUG("%s", answer.c_str());
   }
+  for (size_t i = 0; i < 2; ++i) {
+    auto stats = resolver.Stats(i);
+    KL_DEBUG("upstream %u: sent %u, answered %u, srtt %uus",
+             static_cast<unsigned>(i), static_cast<unsigned>(stats.sent),
+             static_cast<unsigned>(stats.answered),
+             static_cast<unsigned>(stats.srtt));
+  }
   return 0;
 }
@@ -2,17 +2,26 @@
 // Use of this source code is governed by the BSD license that can be found in
 // the LICENSE file.
 
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include <atomic>
 #include <cstdlib>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "kale/aggregation.h"
 #include "kale/arcfour.h"
 #include "kale/coding.h"
+#include "kale/datagram.h"
 #include "kale/demo_coding.h"
+#include "kale/dns_intercept.h"
+#include "kale/fec.h"
+#include "kale/gso.h"
 #include "kale/tun.h"
 #include "kl/env.h"
 #include "kl/epoll.h"
@@ -30,6 +39,10 @@
 
 namespace {
 
+// Datagrams moved per recvmmsg/sendmmsg
+const size_t kBatchSize = 32;
+const size_t kMaxDatagramSize = 65536;
+
 void DumpErrorPacket(const char *packet_type, const uint8_t *packet,
                      size_t len) {
   std::string packet_dump;
@@ -38,168 +51,159 @@ void DumpErrorPacket(const char *packet_type, const uint8_t *packet,
   KL_ERROR("%s packet dump: %s", packet_type, packet_dump.c_str());
 }
 
-void StatTCP(const uint8_t *packet, size_t len) {
-  std::vector<uint8_t> duplex(packet, packet + len);
-  kale::ipv4::PacketEditor editor(duplex.data(), duplex.size());
-  auto tcp_editor = editor.CreateTCPSegmentEditor();
-  if (!tcp_editor) {
-    KL_ERROR("Packet doesn't contain tcp segment...");
-    DumpErrorPacket("ip", packet, len);
+void StatIPPacket(const uint8_t *packet, size_t len) {
+  kale::ipv4::Verdict verdict =
+      kale::ipv4::Validate(kale::ipv4::PacketRef(packet, len));
+  if (verdict.ok()) {
     return;
   }
-  uint16_t actual_checksum = tcp_editor->ref().rep->checksum;
-  tcp_editor->FillChecksum();
-  uint16_t calc_checksum = tcp_editor->ref().rep->checksum;
-  if (actual_checksum != calc_checksum) {
-    KL_ERROR("tcp actual_checksum: %u, calc_checksum: %u", actual_checksum,
-             calc_checksum);
-    DumpErrorPacket("tcp", packet, len);
-  }
-  // KL_DEBUG("tcp segment, src addr %s, dst addr %s, data length: %u",
-  //          kale::ip::TCPSrcAddr(packet, len).c_str(),
-  //          kale::ip::TCPDstAddr(packet, len).c_str(),
-  //          kale::ip::TCPDataLength(packet, len));
+  KL_ERROR("%s, protocol: %u, actual checksum: %u, expected checksum: %u",
+           kale::ipv4::ValidateStatusString(verdict.status), verdict.protocol,
+           verdict.actual_checksum, verdict.expected_checksum);
+  DumpErrorPacket("ip", packet, len);
 }
 
-void StatUDP(const uint8_t *packet, size_t len) {
-  std::vector<uint8_t> duplex(packet, packet + len);
-  kale::ipv4::PacketEditor editor(duplex.data(), duplex.size());
-  auto udp_editor = editor.CreateUDPSegmentEditor();
-  if (!udp_editor) {
-    KL_ERROR("Packet doesn't contain udp segment...");
-    DumpErrorPacket("ip", packet, len);
-    return;
-  }
-  uint16_t actual_checksum = udp_editor->ref().rep->checksum;
-  udp_editor->FillChecksum();
-  uint16_t calc_checksum = udp_editor->ref().rep->checksum;
-  if (actual_checksum != calc_checksum) {
-    KL_ERROR("udp actual_checksum: %u, calc_checksum: %u", actual_checksum,
-             calc_checksum);
-    DumpErrorPacket("udp", packet, len);
-  }
-  // KL_DEBUG("udp segment, src addr %s, dst addr %s, data length: %u",
-  //          kale::ip::UDPSrcAddr(packet, len).c_str(),
-  //          kale::ip::UDPDstAddr(packet, len).c_str(),
-  //          kale::ip::UDPDataLength(packet, len));
-}
+// Validates one packet out of every @interval, 0 turns validation off.
+class StatSampler {
+ public:
+  explicit StatSampler(uint32_t interval) : interval_(interval), count_(0) {}
 
-void StatIPPacket(const uint8_t *packet, size_t len) {
-  std::vector<uint8_t> duplex(packet, packet + len);
-  kale::ipv4::PacketEditor editor(duplex.data(), duplex.size());
-  if (editor.ref().rep->version != 4) {
-    KL_ERROR("IP version %u not supported yet", editor.ref().rep->version);
-    DumpErrorPacket("ip", packet, len);
-    return;
-  }
-  uint16_t actual_checksum = editor.ref().rep->checksum;
-  editor.FillChecksum();
-  uint16_t calculated_checksum = editor.ref().rep->checksum;
-  if (actual_checksum != calculated_checksum) {
-    KL_ERROR("actual checksum: %u, calculated checksum: %u", actual_checksum,
-             calculated_checksum);
-    DumpErrorPacket("ip", packet, len);
-    return;
-  }
-  if (editor.ref().IsTCP()) {
-    StatTCP(packet, len);
-  }
-  if (editor.ref().IsUDP()) {
-    StatUDP(packet, len);
+  void operator()(const uint8_t *packet, size_t len) {
+    if (interval_ == 0 || ++count_ < interval_) {
+      return;
+    }
+    count_ = 0;
+    StatIPPacket(packet, len);
   }
-}
 
-class RawTunProxy {
- public:
-  RawTunProxy(const char *inet_ifname, const char *inet_gateway,
-              const char *ifname, const char *addr, const char *mask,
-              uint16_t mtu, const char *remote_host, uint16_t remote_port,
-              const char *key, size_t key_len);
+ private:
+  uint32_t interval_, count_;
+};
 
-  int Run();
-  ~RawTunProxy() {
+// One tun queue together with the UDP socket and coding state serving it.
+// Queues share nothing, so each can be driven by its own thread.
+class TunQueue {
+ public:
+  // @offload if @tun_fd was opened with IFF_VNET_HDR.
+  // @aggregate_limit: most bytes of packets sent in one datagram, 0 sends
+  // each packet on its own. A datagram not full yet is held for at most
+  // @flush_deadline_us, or until tun is drained if 0.
+  // @fec_data: datagrams of a group followed by @fec_parity parity
+  // datagrams, 0 sends no parity. A group not full yet is ended the same
+  // way as a datagram.
+  // @dns_cache: most names whose answers are cached to answer DNS queries
+  // without the tunnel, 0 sends them all to remote.
+  TunQueue(int tun_fd, const struct sockaddr_in &remote_addr,
+           const char *key, size_t key_len, uint32_t stat_interval,
+           bool offload, size_t aggregate_limit, uint32_t flush_deadline_us,
+           size_t fec_data, size_t fec_parity, size_t dns_cache);
+  ~TunQueue() {
     if (tun_fd_ >= 0) {
       ::close(tun_fd_);
     }
     if (udp_fd_ >= 0) {
       ::close(udp_fd_);
     }
+    if (timer_fd_ >= 0) {
+      ::close(timer_fd_);
+    }
   }
 
+  // Returns 0 once @stop_fd, if given, turns readable.
+  int Run(int stop_fd = -1);
+
  private:
   int EpollLoop();
   kl::Result<void> HandleTUN();
+  kl::Result<void> HandleOffloadTUN();
   kl::Result<void> HandleUDP();
-  std::string ifname_, addr_, mask_;
-  uint16_t mtu_;
-  std::string remote_host_;
-  uint16_t remote_port_;
-  int tun_fd_, udp_fd_;
+  // Where the next packet read from tun goes, with @room bytes for it.
+  uint8_t *NextPacket(size_t *room);
+  // Writes the reply to @packet back to tun if it's a DNS query answered
+  // from the cache. The reply is built in place, within @room bytes.
+  // RETURNS: whether it's answered
+  kl::Result<bool> AnswerDNS(uint8_t *packet, size_t len, size_t room);
+  // @packet is the last NextPacket()
+  kl::Result<void> CommitUDP(uint8_t *packet, size_t len);
+  kl::Result<void> CommitDatagram(uint8_t *datagram, size_t len);
+  kl::Result<void> CommitAggregate();
+  kl::Result<void> CommitParity();
+  // Sends what is held back for the deadline
+  kl::Result<void> CommitPending();
+  void ArmFlushTimer();
+  kl::Result<void> HandleFlushTimer();
+  kl::Result<void> FlushUDP();
+  kl::Result<void> WriteTUN(const uint8_t *frame, size_t len);
+  kl::Result<void> FlushCoalescer();
+  // Resolved once, used for every datagram sent to remote
+  struct sockaddr_in remote_addr_;
+  int tun_fd_, udp_fd_, timer_fd_;
+  // Not owned, shared by the queues of a proxy
+  int stop_fd_;
+  kale::DatagramBatch send_batch_, recv_batch_;
   kl::Epoll epoll_;
-  kale::Coding coding_;
+  kale::InplaceCoding coding_;
+  // Null without FEC
+  std::unique_ptr<kale::fec::Encoder> fec_;
+  // Null without a DNS cache
+  std::unique_ptr<kale::DNSInterceptor> dns_;
+  StatSampler stat_;
+  bool offload_;
+  // Frames read from tun with offload, up to a whole super packet
+  std::vector<uint8_t> frame_;
+  kale::gso::TCPCoalescer coalescer_;
+  // Datagram being filled in send_batch_.NextBuffer()
+  kale::aggregation::Aggregator aggregator_;
+  uint32_t flush_deadline_us_;
+  // Packet which didn't fit the datagram being filled, on its way to the
+  // next one
+  std::vector<uint8_t> carry_;
   uint64_t write_tun_dropped_;
   uint64_t write_udp_dropped_;
 };
 
-RawTunProxy::RawTunProxy(const char *inet_ifname, const char *inet_gateway,
-                         const char *ifname, const char *addr, const char *mask,
-                         uint16_t mtu, const char *remote_host,
-                         uint16_t remote_port, const char *key, size_t key_len)
-    : ifname_(ifname),
-      addr_(addr),
-      mask_(mask),
-      mtu_(mtu),
-      remote_host_(remote_host),
-      remote_port_(remote_port),
-      tun_fd_(-1),
+TunQueue::TunQueue(int tun_fd, const struct sockaddr_in &remote_addr,
+                   const char *key, size_t key_len, uint32_t stat_interval,
+                   bool offload, size_t aggregate_limit,
+                   uint32_t flush_deadline_us, size_t fec_data,
+                   size_t fec_parity, size_t dns_cache)
+    : remote_addr_(remote_addr),
+      tun_fd_(tun_fd),
       udp_fd_(-1),
-      coding_(
-          kale::DemoCoding(reinterpret_cast<const uint8_t *>(key), key_len)),
+      timer_fd_(-1),
+      stop_fd_(-1),
+      send_batch_(kBatchSize, kMaxDatagramSize),
+      recv_batch_(kBatchSize, kMaxDatagramSize),
+      coding_(kale::DemoInplaceCoding(reinterpret_cast<const uint8_t *>(key),
+                                      key_len)),
+      fec_(fec_data > 0 ? new kale::fec::Encoder(fec_data, fec_parity)
+                        : nullptr),
+      dns_(dns_cache > 0 ? new kale::DNSInterceptor(dns_cache) : nullptr),
+      stat_(stat_interval),
+      offload_(offload),
+      frame_(offload ? kale::gso::kVirtioNetHdrSize + kale::gso::kMaxPacketSize
+                     : 0),
+      aggregator_(aggregate_limit),
+      flush_deadline_us_(flush_deadline_us),
       write_tun_dropped_(0),
       write_udp_dropped_(0) {
-  auto alloc_tun = kale::AllocateTun(ifname);
-  if (!alloc_tun) {
-    throw std::runtime_error(alloc_tun.Err().ToCString());
-  }
-  tun_fd_ = *alloc_tun;
   assert(tun_fd_ >= 0);
-  auto set_addr = kl::netdev::SetAddr(ifname, addr);
-  if (!set_addr) {
-    throw std::runtime_error(set_addr.Err().ToCString());
-  }
-  auto set_mask = kl::netdev::SetNetMask(ifname, mask);
-  if (!set_mask) {
-    throw std::runtime_error(set_mask.Err().ToCString());
-  }
-  auto set_mtu = kl::netdev::SetMTU(ifname, mtu);
-  if (!set_mtu) {
-    throw std::runtime_error(set_mtu.Err().ToCString());
-  }
-  auto if_up = kl::netdev::InterfaceUp(ifname);
-  if (!if_up) {
-    throw std::runtime_error(if_up.Err().ToCString());
-  }
-  auto add_route = kl::netdev::AddRoute(remote_host, inet_gateway, inet_ifname);
-  if (!add_route && add_route.Err().Code() != EEXIST) {
-    throw std::runtime_error(kl::string::FormatString(
-        "%s:%d: failed to add route entry, %s\n", __FILE__, __LINE__,
-        add_route.Err().ToCString()));
-  }
-  add_route = kl::netdev::AddDefaultGateway(addr);
-  if (!add_route && add_route.Err().Code() != EEXIST) {
-    throw std::runtime_error(kl::string::FormatString(
-        "%s:%d: failed to add route entry, %s\n", __FILE__, __LINE__,
-        add_route.Err().ToCString()));
-  }
   auto udp = kl::udp::Socket();
   if (!udp) {
     throw std::runtime_error(udp.Err().ToCString());
   }
   udp_fd_ = *udp;
   assert(udp_fd_ >= 0);
+  if ((aggregator_.Limit() > 0 || fec_) && flush_deadline_us_ > 0) {
+    timer_fd_ = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd_ < 0) {
+      throw std::runtime_error(std::strerror(errno));
+    }
+    carry_.reserve(kMaxDatagramSize);
+  }
 }
 
-int RawTunProxy::Run() {
+int TunQueue::Run(int stop_fd) {
   auto set_nb = kl::env::SetNonBlocking(udp_fd_);
   if (!set_nb) {
     KL_ERROR("set udp_fd_ failed, %s", set_nb.Err().ToCString());
@@ -220,78 +224,388 @@ int RawTunProxy::Run() {
     KL_ERROR(add_tun.Err().ToCString());
     return 1;
   }
+  if (timer_fd_ >= 0) {
+    auto add_timer = epoll_.AddFd(timer_fd_, EPOLLIN);
+    if (!add_timer) {
+      KL_ERROR(add_timer.Err().ToCString());
+      return 1;
+    }
+  }
+  if (stop_fd >= 0) {
+    auto add_stop = epoll_.AddFd(stop_fd, EPOLLIN);
+    if (!add_stop) {
+      KL_ERROR(add_stop.Err().ToCString());
+      return 1;
+    }
+    stop_fd_ = stop_fd;
+  }
   int err = EpollLoop();
   return err;
 }
 
-kl::Result<void> RawTunProxy::HandleTUN() {
-  char buf[65536];
+// Packets read from tun are encoded straight into send_batch_ and go out
+// kBatchSize at a time.
+kl::Result<void> TunQueue::HandleTUN() {
+  if (offload_) {
+    return HandleOffloadTUN();
+  }
   while (true) {
-    int nread = ::read(tun_fd_, buf, sizeof(buf));
+    size_t room;
+    uint8_t *packet = NextPacket(&room);
+    int nread = ::read(tun_fd_, packet, room);
     if (nread < 0) {
       if (errno != EAGAIN && errno != EWOULDBLOCK) {
         return kl::Err(errno, std::strerror(errno));
       }
       break;
     }
-    const uint8_t *packet = reinterpret_cast<const uint8_t *>(buf);
-    size_t len = nread;
-    StatIPPacket(packet, len);
-    std::vector<uint8_t> data;
-    coding_.Encode(packet, len, &data);
-    auto send = kl::inet::Sendto(udp_fd_, data.data(), data.size(), 0,
-                                 remote_host_.c_str(), remote_port_);
-    // record number of packets dropped
-    if (!send &&
-        (send.Err().Code() == EAGAIN || send.Err().Code() == EWOULDBLOCK)) {
-      uint64_t tmp = ++write_udp_dropped_;
-      KL_ERROR("current write_udp_dropped_: %u", tmp);
+    auto answer = AnswerDNS(packet, nread, room);
+    if (!answer) {
+      return kl::Err(answer.MoveErr());
     }
-    if (!send && send.Err().Code() != EAGAIN &&
-        send.Err().Code() != EWOULDBLOCK) {
-      return kl::Err(send.MoveErr());
+    if (*answer) {
+      continue;
+    }
+    auto commit = CommitUDP(packet, nread);
+    if (!commit) {
+      return commit;
     }
   }
-  return kl::Ok();
+  if (flush_deadline_us_ == 0) {
+    auto commit = CommitPending();
+    if (!commit) {
+      return commit;
+    }
+  }
+  return FlushUDP();
 }
 
-kl::Result<void> RawTunProxy::HandleUDP() {
-  char buf[65536];
+// A frame may carry a super packet of many MTUs, its segments are built
+// directly into send_batch_.
+kl::Result<void> TunQueue::HandleOffloadTUN() {
   while (true) {
-    int nread = ::read(udp_fd_, buf, sizeof(buf));
+    int nread = ::read(tun_fd_, frame_.data(), frame_.size());
     if (nread < 0) {
       if (errno != EAGAIN && errno != EWOULDBLOCK) {
         return kl::Err(errno, std::strerror(errno));
       }
       break;
     }
-    std::vector<uint8_t> data;
-    auto ok =
-        coding_.Decode(reinterpret_cast<const uint8_t *>(buf), nread, &data);
-    if (!ok) {
-      KL_ERROR(ok.Err().ToCString());
-      // just ignore it
+    if (static_cast<size_t>(nread) < kale::gso::kVirtioNetHdrSize) {
       continue;
     }
-    const uint8_t *packet = data.data();
-    size_t len = data.size();
-    StatIPPacket(packet, len);
-    int nwrite = ::write(tun_fd_, packet, len);
-    // record number of packets dropped
-    if (nwrite < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-      uint64_t tmp = ++write_tun_dropped_;
-      KL_ERROR("current write_tun_dropped_: %u", tmp);
+    kale::gso::VirtioNetHdr hdr;
+    const uint8_t *super;
+    size_t super_len;
+    kale::gso::ParseFrame(frame_.data(), nread, &hdr, &super, &super_len);
+    size_t count = kale::gso::SegmentCount(hdr, super, super_len);
+    if (count == 0) {
+      DumpErrorPacket("gso", super, super_len);
+      continue;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      size_t room;
+      uint8_t *packet = NextPacket(&room);
+      auto build =
+          kale::gso::BuildSegment(hdr, super, super_len, i, packet, room);
+      if (!build) {
+        KL_ERROR(build.Err().ToCString());
+        break;
+      }
+      auto answer = AnswerDNS(packet, *build, room);
+      if (!answer) {
+        return kl::Err(answer.MoveErr());
+      }
+      if (*answer) {
+        continue;
+      }
+      auto commit = CommitUDP(packet, *build);
+      if (!commit) {
+        return commit;
+      }
+    }
+  }
+  if (flush_deadline_us_ == 0) {
+    auto commit = CommitPending();
+    if (!commit) {
+      return commit;
+    }
+  }
+  return FlushUDP();
+}
+
+// Room is left for the FEC header, the length parity carries and the
+// coding to grow the datagram in place.
+uint8_t *TunQueue::NextPacket(size_t *room) {
+  size_t capacity = send_batch_.BufferSize() - coding_.max_overhead -
+                    (fec_ ? kale::fec::kOverhead : 0);
+  if (aggregator_.Limit() == 0) {
+    *room = capacity;
+    return send_batch_.NextBuffer();
+  }
+  if (aggregator_.Empty()) {
+    aggregator_.Start(send_batch_.NextBuffer());
+  }
+  *room = capacity - aggregator_.Used();
+  return aggregator_.Tail();
+}
+
+// @packet isn't committed, so the space after it is free to grow into.
+kl::Result<bool> TunQueue::AnswerDNS(uint8_t *packet, size_t len,
+                                     size_t room) {
+  if (!dns_) {
+    return kl::Ok(false);
+  }
+  size_t reply = dns_->Answer(packet, len, room);
+  if (reply == 0) {
+    return kl::Ok(false);
+  }
+  if (offload_) {
+    // For its virtio header. The coalescer is empty between batches from
+    // remote, should a packet be pending it goes first.
+    if (!coalescer_.Add(packet, reply)) {
+      auto flush = FlushCoalescer();
+      if (!flush) {
+        return kl::Err(flush.MoveErr());
+      }
+      coalescer_.Add(packet, reply);
+    }
+    auto flush = FlushCoalescer();
+    if (!flush) {
+      return kl::Err(flush.MoveErr());
+    }
+    return kl::Ok(true);
+  }
+  auto write = WriteTUN(packet, reply);
+  if (!write) {
+    return kl::Err(write.MoveErr());
+  }
+  return kl::Ok(true);
+}
+
+kl::Result<void> TunQueue::CommitUDP(uint8_t *packet, size_t len) {
+  stat_(packet, len);
+  if (aggregator_.Limit() == 0) {
+    return CommitDatagram(packet, len);
+  }
+  if (aggregator_.Add(len)) {
+    if (aggregator_.Count() == 1) {
+      ArmFlushTimer();
+    }
+    return kl::Ok();
+  }
+  // The packet starts the next datagram, it's saved first since encoding
+  // may grow the current one over it.
+  carry_.assign(packet, packet + len);
+  auto commit = CommitAggregate();
+  if (!commit) {
+    return commit;
+  }
+  aggregator_.Start(send_batch_.NextBuffer());
+  ::memcpy(aggregator_.Tail(), carry_.data(), len);
+  aggregator_.Add(len);
+  ArmFlushTimer();
+  return kl::Ok();
+}
+
+// @datagram is send_batch_.NextBuffer()
+kl::Result<void> TunQueue::CommitDatagram(uint8_t *datagram, size_t len) {
+  if (fec_) {
+    auto protect = fec_->Protect(
+        datagram, len, send_batch_.BufferSize() - coding_.max_overhead);
+    if (!protect) {
+      KL_ERROR(protect.Err().ToCString());
+      return kl::Ok();
+    }
+    len = *protect;
+    ArmFlushTimer();
+  }
+  auto encode = coding_.Encode(datagram, len, send_batch_.BufferSize());
+  if (!encode) {
+    KL_ERROR(encode.Err().ToCString());
+    return kl::Ok();
+  }
+  send_batch_.Commit(*encode, remote_addr_);
+  if (send_batch_.Full()) {
+    auto flush = FlushUDP();
+    if (!flush) {
+      return flush;
     }
-    if (nwrite < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-      return kl::Err(errno, std::strerror(errno));
+  }
+  return CommitParity();
+}
+
+// Parity of a group goes right after its last datagram.
+kl::Result<void> TunQueue::CommitParity() {
+  while (fec_ && fec_->PendingParity() > 0) {
+    uint8_t *datagram = send_batch_.NextBuffer();
+    auto parity = fec_->NextParity(
+        datagram, send_batch_.BufferSize() - coding_.max_overhead);
+    if (!parity) {
+      // The group goes unprotected
+      KL_ERROR(parity.Err().ToCString());
+      return kl::Ok();
+    }
+    auto encode = coding_.Encode(datagram, *parity, send_batch_.BufferSize());
+    if (!encode) {
+      KL_ERROR(encode.Err().ToCString());
+      continue;
+    }
+    send_batch_.Commit(*encode, remote_addr_);
+    if (send_batch_.Full()) {
+      auto flush = FlushUDP();
+      if (!flush) {
+        return flush;
+      }
     }
   }
   return kl::Ok();
 }
 
-int RawTunProxy::EpollLoop() {
+kl::Result<void> TunQueue::CommitPending() {
+  auto commit = CommitAggregate();
+  if (!commit || !fec_) {
+    return commit;
+  }
+  fec_->Flush();
+  return CommitParity();
+}
+
+kl::Result<void> TunQueue::CommitAggregate() {
+  if (aggregator_.Empty()) {
+    return kl::Ok();
+  }
+  uint8_t *datagram = aggregator_.Buffer();
+  size_t len = aggregator_.Used();
+  aggregator_.Clear();
+  return CommitDatagram(datagram, len);
+}
+
+// One shot, restarted by every new datagram and every datagram added to an
+// FEC group. Firing after the datagram it was armed for has been sent
+// flushes at most the next one early.
+void TunQueue::ArmFlushTimer() {
+  if (timer_fd_ < 0) {
+    return;
+  }
+  struct itimerspec spec;
+  ::memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = flush_deadline_us_ / 1000000;
+  spec.it_value.tv_nsec = (flush_deadline_us_ % 1000000) * 1000;
+  if (::timerfd_settime(timer_fd_, 0, &spec, nullptr) < 0) {
+    KL_ERROR(std::strerror(errno));
+  }
+}
+
+kl::Result<void> TunQueue::HandleFlushTimer() {
+  uint64_t expirations;
+  if (::read(timer_fd_, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN && errno != EWOULDBLOCK) {
+    return kl::Err(errno, std::strerror(errno));
+  }
+  auto commit = CommitPending();
+  if (!commit) {
+    return commit;
+  }
+  return FlushUDP();
+}
+
+// A datagram still being filled stays out of the batch, it's moved to the
+// first buffer once the batch is sent.
+kl::Result<void> TunQueue::FlushUDP() {
+  size_t count = send_batch_.Count();
+  if (count == 0) {
+    return kl::Ok();
+  }
+  auto send = send_batch_.Send(udp_fd_);
+  if (!aggregator_.Empty()) {
+    aggregator_.MoveTo(send_batch_.NextBuffer());
+  }
+  if (!send) {
+    return kl::Err(send.MoveErr());
+  }
+  // record number of packets dropped
+  if (*send < count) {
+    write_udp_dropped_ += count - *send;
+    uint64_t tmp = write_udp_dropped_;
+    KL_ERROR("current write_udp_dropped_: %u", tmp);
+  }
+  return kl::Ok();
+}
+
+kl::Result<void> TunQueue::HandleUDP() {
+  while (true) {
+    auto recv = recv_batch_.Recv(udp_fd_);
+    if (!recv) {
+      return kl::Err(recv.MoveErr());
+    }
+    if (*recv == 0) {
+      break;
+    }
+    for (size_t i = 0; i < recv_batch_.Count(); ++i) {
+      uint8_t *packet = recv_batch_.Data(i);
+      auto decode = coding_.Decode(packet, recv_batch_.Length(i),
+                                   recv_batch_.BufferSize());
+      if (!decode) {
+        KL_ERROR(decode.Err().ToCString());
+        // just ignore it
+        continue;
+      }
+      size_t len = *decode;
+      stat_(packet, len);
+      if (dns_) {
+        dns_->Learn(packet, len);
+      }
+      if (!offload_) {
+        auto write = WriteTUN(packet, len);
+        if (!write) {
+          return write;
+        }
+        continue;
+      }
+      if (!coalescer_.Add(packet, len)) {
+        auto flush = FlushCoalescer();
+        if (!flush) {
+          return flush;
+        }
+        coalescer_.Add(packet, len);
+      }
+    }
+    // Don't hold packets back across batches
+    if (offload_) {
+      auto flush = FlushCoalescer();
+      if (!flush) {
+        return flush;
+      }
+    }
+  }
+  return kl::Ok();
+}
+
+kl::Result<void> TunQueue::WriteTUN(const uint8_t *frame, size_t len) {
+  int nwrite = ::write(tun_fd_, frame, len);
+  // record number of packets dropped
+  if (nwrite < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    uint64_t tmp = ++write_tun_dropped_;
+    KL_ERROR("current write_tun_dropped_: %u", tmp);
+  }
+  if (nwrite < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    return kl::Err(errno, std::strerror(errno));
+  }
+  return kl::Ok();
+}
+
+kl::Result<void> TunQueue::FlushCoalescer() {
+  if (coalescer_.Empty()) {
+    return kl::Ok();
+  }
+  size_t len = coalescer_.Flush();
+  return WriteTUN(coalescer_.Frame(), len);
+}
+
+int TunQueue::EpollLoop() {
   while (true) {
-    auto wait = epoll_.Wait(2, -1);
+    auto wait = epoll_.Wait(4, -1);
     if (!wait) {
       KL_ERROR(wait.Err().ToCString());
       return 1;
@@ -310,6 +624,9 @@ int RawTunProxy::EpollLoop() {
         return 1;
       }
       assert(events & EPOLLIN);
+      if (fd == stop_fd_) {
+        return 0;
+      }
       if (fd == udp_fd_) {
         auto ok = HandleUDP();
         if (!ok) {
@@ -322,8 +639,145 @@ int RawTunProxy::EpollLoop() {
           KL_ERROR(ok.Err().ToCString());
         }
       }
+      if (fd == timer_fd_) {
+        auto ok = HandleFlushTimer();
+        if (!ok) {
+          KL_ERROR(ok.Err().ToCString());
+        }
+      }
+    }
+  }
+}
+
+class RawTunProxy {
+ public:
+  RawTunProxy(const char *inet_ifname, const char *inet_gateway,
+              const char *ifname, const char *addr, const char *mask,
+              uint16_t mtu, const char *remote_host, uint16_t remote_port,
+              const char *key, size_t key_len, uint32_t stat_interval,
+              int nqueues, bool offload, size_t aggregate_limit,
+              uint32_t flush_deadline_us, size_t fec_data, size_t fec_parity,
+              size_t dns_cache);
+
+  // Serves a single queue on the calling thread, otherwise one thread per
+  // queue. The first queue failing stops the others.
+  int Run();
+
+ private:
+  std::string ifname_, addr_, mask_;
+  uint16_t mtu_;
+  std::string remote_host_;
+  uint16_t remote_port_;
+  std::vector<std::unique_ptr<TunQueue>> queues_;
+};
+
+RawTunProxy::RawTunProxy(const char *inet_ifname, const char *inet_gateway,
+                         const char *ifname, const char *addr, const char *mask,
+                         uint16_t mtu, const char *remote_host,
+                         uint16_t remote_port, const char *key, size_t key_len,
+                         uint32_t stat_interval, int nqueues, bool offload,
+                         size_t aggregate_limit, uint32_t flush_deadline_us,
+                         size_t fec_data, size_t fec_parity, size_t dns_cache)
+    : ifname_(ifname),
+      addr_(addr),
+      mask_(mask),
+      mtu_(mtu),
+      remote_host_(remote_host),
+      remote_port_(remote_port) {
+  auto remote_addr = kl::inet::InetSockAddr(remote_host, remote_port);
+  if (!remote_addr) {
+    throw std::runtime_error(remote_addr.Err().ToCString());
+  }
+  std::vector<int> tun_fds;
+  if (nqueues > 1) {
+    auto alloc_tun = kale::AllocateMultiQueueTun(ifname, nqueues, offload);
+    if (!alloc_tun) {
+      throw std::runtime_error(alloc_tun.Err().ToCString());
+    }
+    tun_fds = std::move(*alloc_tun);
+  } else {
+    auto alloc_tun = kale::AllocateTun(ifname, offload);
+    if (!alloc_tun) {
+      throw std::runtime_error(alloc_tun.Err().ToCString());
+    }
+    tun_fds.push_back(*alloc_tun);
+  }
+  // Queues own their fds from here on
+  for (size_t i = 0; i < tun_fds.size(); ++i) {
+    try {
+      queues_.emplace_back(new TunQueue(
+          tun_fds[i], *remote_addr, key, key_len, stat_interval, offload,
+          aggregate_limit, flush_deadline_us, fec_data, fec_parity,
+          dns_cache));
+    } catch (...) {
+      for (size_t j = i; j < tun_fds.size(); ++j) {
+        ::close(tun_fds[j]);
+      }
+      throw;
+    }
+  }
+  auto set_addr = kl::netdev::SetAddr(ifname, addr);
+  if (!set_addr) {
+    throw std::runtime_error(set_addr.Err().ToCString());
+  }
+  auto set_mask = kl::netdev::SetNetMask(ifname, mask);
+  if (!set_mask) {
+    throw std::runtime_error(set_mask.Err().ToCString());
+  }
+  auto set_mtu = kl::netdev::SetMTU(ifname, mtu);
+  if (!set_mtu) {
+    throw std::runtime_error(set_mtu.Err().ToCString());
+  }
+  auto if_up = kl::netdev::InterfaceUp(ifname);
+  if (!if_up) {
+    throw std::runtime_error(if_up.Err().ToCString());
+  }
+  auto add_route = kl::netdev::AddRoute(remote_host, inet_gateway, inet_ifname);
+  if (!add_route && add_route.Err().Code() != EEXIST) {
+    throw std::runtime_error(kl::string::FormatString(
+        "%s:%d: failed to add route entry, %s\n", __FILE__, __LINE__,
+        add_route.Err().ToCString()));
+  }
+  add_route = kl::netdev::AddDefaultGateway(addr);
+  if (!add_route && add_route.Err().Code() != EEXIST) {
+    throw std::runtime_error(kl::string::FormatString(
+        "%s:%d: failed to add route entry, %s\n", __FILE__, __LINE__,
+        add_route.Err().ToCString()));
+  }
+}
+
+int RawTunProxy::Run() {
+  if (queues_.size() == 1) {
+    return queues_[0]->Run();
+  }
+  int stop_fd = ::eventfd(0, EFD_CLOEXEC);
+  if (stop_fd < 0) {
+    KL_ERROR(std::strerror(errno));
+    return 1;
+  }
+  std::vector<int> errs(queues_.size(), 0);
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < queues_.size(); ++i) {
+    workers.emplace_back([this, i, stop_fd, &errs] {
+      errs[i] = queues_[i]->Run(stop_fd);
+      if (errs[i]) {
+        uint64_t one = 1;
+        if (::write(stop_fd, &one, sizeof(one)) < 0) {
+          KL_ERROR(std::strerror(errno));
+        }
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  ::close(stop_fd);
+  for (int err : errs) {
+    if (err) {
+      return err;
     }
   }
+  return 0;
 }
 
 }  // namespace (anonymous)
@@ -340,7 +794,18 @@ static void PrintUsage(int argc, char *argv[]) {
                "    -d daemonize\n"
                "    -u <mtu> mtu\n"
                "    -o <logfile> logfile\n"
-               "    -p <passwd> password\n",
+               "    -p <passwd> password\n"
+               "    -v <n> validate every n-th packet, 0 to disable\n"
+               "    -q <n> number of tun queues, one thread each\n"
+               "    -G enable tun checksum/TSO offload\n"
+               "    -A <bytes> pack packets into datagrams of up to bytes, "
+               "0 to disable\n"
+               "    -D <us> most microseconds a datagram not full yet is "
+               "held\n"
+               "    -F <k:m> send m parity datagrams after every k, so "
+               "losses are rebuilt by remote\n"
+               "    -C <n> answer DNS queries from a cache of n names per "
+               "queue, 0 to disable\n",
                argv[0]);
 }
 
@@ -356,9 +821,17 @@ int main(int argc, char *argv[]) {
   std::string log_file;                    // -o
   bool daemonize = false;                  // -d
   std::string passwd("\xc0\xde\xba\xbe");  // -p
+  uint32_t stat_interval = 1;              // -v
+  int nqueues = 1;                         // -q
+  bool offload = false;                    // -G
+  size_t aggregate_limit = 0;              // -A
+  uint32_t flush_deadline_us = 200;        // -D
+  size_t fec_data = 0, fec_parity = 0;     // -F
+  size_t dns_cache = 0;                    // -C
   kl::env::Defer defer;                    // for some clean work
   int opt = 0;
-  while ((opt = ::getopt(argc, argv, "n:g:r:t:a:i:m:hdo:u:p:")) != -1) {
+  while ((opt = ::getopt(argc, argv, "n:g:r:t:a:i:m:hdo:u:p:v:q:GA:D:F:C:")) !=
+         -1) {
     switch (opt) {
       case 'o':
         log_file = optarg;
@@ -403,6 +876,40 @@ int main(int argc, char *argv[]) {
         passwd = optarg;
         break;
       }
+      case 'v': {
+        stat_interval = atoi(optarg);
+        break;
+      }
+      case 'q': {
+        nqueues = atoi(optarg);
+        break;
+      }
+      case 'G': {
+        offload = true;
+        break;
+      }
+      case 'A': {
+        aggregate_limit = atoi(optarg);
+        break;
+      }
+      case 'D': {
+        flush_deadline_us = atoi(optarg);
+        break;
+      }
+      case 'F': {
+        auto split = kl::string::SplitString(optarg, ":");
+        if (split.size() != 2) {
+          PrintUsage(argc, argv);
+          ::exit(1);
+        }
+        fec_data = atoi(split[0].c_str());
+        fec_parity = atoi(split[1].c_str());
+        break;
+      }
+      case 'C': {
+        dns_cache = atoi(optarg);
+        break;
+      }
       case 'h':
       default:
         PrintUsage(argc, argv);
@@ -424,6 +931,20 @@ int main(int argc, char *argv[]) {
     PrintUsage(argc, argv);
     ::exit(1);
   }
+  if (nqueues < 1) {
+    std::fprintf(stderr, "%s: invalid number of queues %d\n", argv[0],
+                 nqueues);
+    PrintUsage(argc, argv);
+    ::exit(1);
+  }
+  if (fec_data > kale::fec::kMaxShards ||
+      (fec_data > 0 &&
+       (fec_parity < 1 || fec_parity > kale::fec::kMaxShards))) {
+    std::fprintf(stderr, "%s: invalid fec group %zu:%zu\n", argv[0], fec_data,
+                 fec_parity);
+    PrintUsage(argc, argv);
+    ::exit(1);
+  }
   if (inet_ifname.empty()) {
     std::fprintf(stderr, "%s: inet interface must be specified.", argv[0]);
     PrintUsage(argc, argv);
@@ -452,6 +973,8 @@ int main(int argc, char *argv[]) {
   RawTunProxy proxy(inet_ifname.c_str(), inet_gateway.c_str(), tun_name.c_str(),
                     tun_addr.c_str(), tun_mask.c_str(), tun_mtu,
                     remote_host.c_str(), remote_port, passwd.c_str(),
-                    passwd.size());
+                    passwd.size(), stat_interval, nqueues, offload,
+                    aggregate_limit, flush_deadline_us, fec_data, fec_parity,
+                    dns_cache);
   return proxy.Run();
 }
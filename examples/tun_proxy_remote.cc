@@ -2,20 +2,31 @@
 // Use of this source code is governed by the BSD license that can be found in
 // the LICENSE file.
 
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cstdlib>
 #include <map>
-#include <set>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
+#include "kale/aggregation.h"
 #include "kale/arcfour.h"
 #include "kale/coding.h"
+#include "kale/conntrack.h"
+#include "kale/datagram.h"
 #include "kale/demo_coding.h"
-#include "kale/lru.h"
-#include "kale/sniffer.h"
+#include "kale/fec.h"
+#include "kale/nat.h"
+#include "kale/port_reservation.h"
+#include "kale/ring_sniffer.h"
 #include "kale/tun.h"
 #include "kl/env.h"
 #include "kl/slice.h"
@@ -29,45 +40,20 @@
 #include "kl/random.h"
 #include "kl/rwlock.h"
 #include "kl/string.h"
-#include "kl/tcp.h"
 #include "kl/udp.h"
 #include "kl/wait_group.h"
 
 namespace {
 
-kl::Status InsertIptablesRules(uint16_t port_min, uint16_t port_max) {
-  static const char *kCheckRule =
-      "iptables -C INPUT -s 0.0.0.0/0.0.0.0 -p %s "
-      "--dport %u -j DROP 2> /dev/null";
-  static const char *kInsertCommand =
-      "iptables -A INPUT -s 0.0.0.0/0.0.0.0 -p "
-      "%s --dport %u -j DROP 2> /dev/null";
-  for (uint16_t i = port_min; i <= port_max; ++i) {
-    auto check = kl::string::FormatString(kCheckRule, "udp", i);
-    int ok = ::system(check.c_str());
-    if (ok == 0) {
-      continue;
-    }
-    auto insert = kl::string::FormatString(kInsertCommand, "udp", i);
-    ok = ::system(insert.c_str());
-    if (ok != 0) {
-      return kl::Err("failed insert udp rule --dport %u DROP", i);
-    }
-  }
-  for (uint16_t i = port_min; i <= port_max; ++i) {
-    auto check = kl::string::FormatString(kCheckRule, "tcp", i);
-    int ok = ::system(check.c_str());
-    if (ok == 0) {
-      continue;
-    }
-    auto command = kl::string::FormatString(kInsertCommand, "tcp", i);
-    ok = ::system(command.c_str());
-    if (ok != 0) {
-      return kl::Err("failed insert tcp rule --dport %u DROP", i);
-    }
-  }
-  return kl::Ok();
-}
+// Datagrams moved per recvmmsg/sendmmsg
+const size_t kBatchSize = 32;
+const size_t kMaxDatagramSize = 65536;
+// Lets the sniffer thread notice stop_
+const int kSnifferPollTimeout = 1000;
+// Idle mappings are looked for at least this often
+const int kExpireInterval = 1000;
+// Seconds FEC state of a silent peer is kept
+const uint64_t kFECPeerTimeout = 60;
 
 void DumpErrorPacket(const char *packet_type, const uint8_t *packet,
                      size_t len) {
@@ -77,201 +63,186 @@ void DumpErrorPacket(const char *packet_type, const uint8_t *packet,
   KL_ERROR("%s packet dump: %s", packet_type, packet_dump.c_str());
 }
 
-void StatTCP(const uint8_t *packet, size_t len) {
-  std::vector<uint8_t> duplex(packet, packet + len);
-  kale::ipv4::PacketEditor editor(duplex.data(), duplex.size());
-  auto tcp_editor = editor.CreateTCPSegmentEditor();
-  if (!tcp_editor) {
-    KL_ERROR("Packet doesn't contain tcp segment...");
-    DumpErrorPacket("ip", packet, len);
-    return;
-  }
-  uint16_t actual_checksum = tcp_editor->ref().rep->checksum;
-  tcp_editor->FillChecksum();
-  uint16_t calc_checksum = tcp_editor->ref().rep->checksum;
-  if (actual_checksum != calc_checksum) {
-    KL_ERROR("tcp actual_checksum: %u, calc_checksum: %u", actual_checksum,
-             calc_checksum);
-    DumpErrorPacket("tcp", packet, len);
-  }
-  // KL_DEBUG("tcp segment, src addr %s, dst addr %s, data length: %u",
-  //          kale::ip::TCPSrcAddr(packet, len).c_str(),
-  //          kale::ip::TCPDstAddr(packet, len).c_str(),
-  //          kale::ip::TCPDataLength(packet, len));
-}
-
-void StatUDP(const uint8_t *packet, size_t len) {
-  std::vector<uint8_t> duplex(packet, packet + len);
-  kale::ipv4::PacketEditor editor(duplex.data(), duplex.size());
-  auto udp_editor = editor.CreateUDPSegmentEditor();
-  if (!udp_editor) {
-    KL_ERROR("Packet doesn't contain udp segment...");
-    DumpErrorPacket("ip", packet, len);
-    return;
-  }
-  uint16_t actual_checksum = udp_editor->ref().rep->checksum;
-  udp_editor->FillChecksum();
-  uint16_t calc_checksum = udp_editor->ref().rep->checksum;
-  if (actual_checksum != calc_checksum) {
-    KL_ERROR("udp actual_checksum: %u, calc_checksum: %u", actual_checksum,
-             calc_checksum);
-    DumpErrorPacket("udp", packet, len);
-  }
-  // KL_DEBUG("udp segment, src addr %s, dst addr %s, data length: %u",
-  //          kale::ip::UDPSrcAddr(packet, len).c_str(),
-  //          kale::ip::UDPDstAddr(packet, len).c_str(),
-  //          kale::ip::UDPDataLength(packet, len));
-}
-
 void StatIPPacket(const uint8_t *packet, size_t len) {
-  std::vector<uint8_t> duplex(packet, packet + len);
-  kale::ipv4::PacketEditor editor(duplex.data(), duplex.size());
-  if (editor.ref().rep->version != 4) {
-    KL_ERROR("IP version %u not supported yet", editor.ref().rep->version);
-    DumpErrorPacket("ip", packet, len);
-    return;
-  }
-  uint16_t actual_checksum = editor.ref().rep->checksum;
-  editor.FillChecksum();
-  uint16_t calculated_checksum = editor.ref().rep->checksum;
-  if (actual_checksum != calculated_checksum) {
-    KL_ERROR("actual checksum: %u, calculated checksum: %u", actual_checksum,
-             calculated_checksum);
-    DumpErrorPacket("ip", packet, len);
+  kale::ipv4::Verdict verdict =
+      kale::ipv4::Validate(kale::ipv4::PacketRef(packet, len));
+  if (verdict.ok()) {
     return;
   }
-  if (editor.ref().IsTCP()) {
-    StatTCP(packet, len);
-  }
-  if (editor.ref().IsUDP()) {
-    StatUDP(packet, len);
-  }
+  KL_ERROR("%s, protocol: %u, actual checksum: %u, expected checksum: %u",
+           kale::ipv4::ValidateStatusString(verdict.status), verdict.protocol,
+           verdict.actual_checksum, verdict.expected_checksum);
+  DumpErrorPacket("ip", packet, len);
 }
 
-class FdManager {
+// Validates one packet out of every @interval, 0 turns validation off.
+class StatSampler {
  public:
-  void AddFd(int fd) {
-    assert(fd >= 0);
-    set_.insert(fd);
-  }
+  explicit StatSampler(uint32_t interval) : interval_(interval), count_(0) {}
 
-  ~FdManager() {
-    for (auto fd : set_) {
-      ::close(fd);
+  void operator()(const uint8_t *packet, size_t len) {
+    if (interval_ == 0 || ++count_ < interval_) {
+      return;
     }
+    count_ = 0;
+    StatIPPacket(packet, len);
   }
 
  private:
-  std::set<int> set_;
+  uint32_t interval_, count_;
 };
 
-const char *kHostAddrFormat = "%s:%u:%s:%u";
-
-// Tow Level NAT
-// <peer_addr>:<subnet_addr> -> local_port
-// local_port -> <peer_addr>:<subnet_addr>
+// Two level NAT
+// <peer_addr>:<subnet_addr> -> local_addr:local_port
+// local_addr:local_port -> <peer_addr>:<subnet_addr>
+// Shared by every peer and sniffer worker, the lock is only held
+// for the lookup itself. Time is in seconds.
 class NAT {
  public:
-  NAT(uint16_t port_min, uint16_t port_max)
-      : port_min_(port_min),
-        port_max_(port_max),
-        lru_(port_max - port_min + 1) {}
-
-  // RETURNS: local port allocated
-  kl::Result<uint16_t> AddEntry(const char *peer_addr, uint16_t peer_port,
-                                const char *subnet_addr, uint16_t subnet_port) {
-    int local_port = AllocatePort();
-    if (local_port < 0) {
-      return kl::Err("failed to allocate port");
-    }
-    uint16_t port = local_port;
-    std::string host(kl::string::FormatString(
-        kHostAddrFormat, peer_addr, peer_port, subnet_addr, subnet_port));
-    host_to_port_[host] = port;
-    port_to_host_[port] = std::move(host);
-    return kl::Ok(port);
-  }
-
-  kl::Result<uint16_t> QueryPort(const char *peer_addr, uint16_t peer_port,
-                                 const char *subnet_addr,
-                                 uint16_t subnet_port) {
-    std::string host(kl::string::FormatString(
-        kHostAddrFormat, peer_addr, peer_port, subnet_addr, subnet_port));
-    auto iter = host_to_port_.find(host);
-    if (iter == host_to_port_.end()) {
-      return kl::Err("failed to find port");
+  NAT(const std::vector<uint32_t> &addrs, uint16_t port_min,
+      uint16_t port_max, uint32_t idle_timeout)
+      : nat_(addrs, port_min, port_max, idle_timeout),
+        timeouts_(kale::conntrack::DefaultTimeouts(idle_timeout)) {}
+
+  // RETURNS: local endpoint of the flow, allocated if it's new
+  kl::Result<kale::Endpoint> Map(const kale::FlowKey &key) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return nat_.Map(key);
+  }
+
+  bool QueryFlow(const kale::Endpoint &local, kale::FlowKey *key) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return nat_.QueryFlow(local, key);
+  }
+
+  // Same as above, tracking the TCP state of the mapping with @segment so
+  // ports of closed connections are released early.
+  kl::Result<kale::Endpoint> Map(
+      const kale::FlowKey &key,
+      const kale::ipv4::SegmentRef<kale::ipv4::tcp::TCPRep> &segment) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto map = nat_.Map(key);
+    if (map) {
+      Track(*map, kale::conntrack::kOriginal, segment);
     }
-    return kl::Ok(iter->second);
+    return map;
   }
 
-  kl::Result<std::tuple<std::string, uint16_t>> QueryPeer(uint16_t port) {
-    auto iter = port_to_host_.find(port);
-    if (iter == port_to_host_.end()) {
-      return kl::Err("no such entry");
+  bool QueryFlow(
+      const kale::Endpoint &local, kale::FlowKey *key,
+      const kale::ipv4::SegmentRef<kale::ipv4::tcp::TCPRep> &segment) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!nat_.QueryFlow(local, key)) {
+      return false;
     }
-    lru_.Use(port);
-    auto split = kl::string::SplitString(iter->second.c_str(), ":");
-    assert(split.size() == 4);
-    return kl::Ok(std::make_tuple(
-        std::move(split[0]), static_cast<uint16_t>(atoi(split[1].c_str()))));
+    Track(local, kale::conntrack::kReply, segment);
+    return true;
   }
 
-  kl::Result<std::tuple<std::string, uint16_t>> QuerySubnet(uint16_t port) {
-    auto iter = port_to_host_.find(port);
-    if (iter == port_to_host_.end()) {
-      return kl::Err("no such entry");
-    }
-    lru_.Use(port);
-    auto split = kl::string::SplitString(iter->second.c_str(), ":");
-    assert(split.size() == 4);
-    return kl::Ok(std::make_tuple(
-        std::move(split[2]), static_cast<uint16_t>(atoi(split[3].c_str()))));
-  }
-
-  kl::Result<std::tuple<std::string, uint16_t, std::string, uint16_t>>
-  QueryHost(uint16_t port) {
-    auto iter = port_to_host_.find(port);
-    if (iter == port_to_host_.end()) {
-      return kl::Err("no such entry");
-    }
-    lru_.Use(port);
-    auto split = kl::string::SplitString(iter->second.c_str(), ":");
-    assert(split.size() == 4);
-    return kl::Ok(std::make_tuple(
-        std::move(split[0]), static_cast<uint16_t>(atoi(split[1].c_str())),
-        std::move(split[2]), static_cast<uint16_t>(atoi(split[3].c_str()))));
+  // RETURNS: number of mappings released
+  size_t Advance(uint64_t now) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return nat_.Advance(now);
   }
 
  private:
-  int AllocatePort() {
-    int n = port_min_ + lru_.GetLRU();
-    assert(n >= port_min_ && n <= port_max_);
-    return n;
+  // Called with mutex_ held.
+  void Track(const kale::Endpoint &local,
+             kale::conntrack::Direction direction,
+             const kale::ipv4::SegmentRef<kale::ipv4::tcp::TCPRep> &segment) {
+    uint8_t current = kale::conntrack::kNone;
+    nat_.GetState(local, &current);
+    auto state = static_cast<kale::conntrack::State>(current);
+    auto next =
+        kale::conntrack::Track(&nat_, local, direction, segment, timeouts_);
+    if (next != state && kale::conntrack::IsClosed(next)) {
+      KL_DEBUG("port %u %s, released in %u seconds", local.port,
+               kale::conntrack::StateName(next),
+               kale::conntrack::Timeout(timeouts_, next));
+    }
   }
-  uint16_t port_min_, port_max_;
-  kale::LRU lru_;
-  std::map<uint16_t, std::string> port_to_host_;
-  std::map<std::string, uint16_t> host_to_port_;
+
+  std::mutex mutex_;
+  kale::Nat nat_;
+  kale::conntrack::Timeouts timeouts_;
+};
+
+// Return traffic handled by one sniffer thread. With several workers their
+// rings join one PACKET_FANOUT group and each sees a share of the flows.
+struct SnifferWorker {
+  SnifferWorker(const char *ifname, uint32_t stat_interval)
+      : sniffer(ifname),
+        udp_fd(-1),
+        back_batch(kBatchSize, 0),
+        stat(stat_interval),
+        write_udp_fd_dropped(0) {}
+
+  kale::RingSniffer sniffer;
+  // Packets of the ring block being handled
+  std::vector<kale::PacketView> sniffed;
+  // Socket of a PeerWorker replies are sent from
+  int udp_fd;
+  // Packets sniffed and encoded in the ring, queued for udp_fd
+  kale::DatagramBatch back_batch;
+  StatSampler stat;
+  uint64_t write_udp_fd_dropped;
+};
+
+struct FECPeer {
+  FECPeer() : last_active(0) {}
+
+  kale::fec::Decoder decoder;
+  // Seconds on the NAT clock
+  uint64_t last_active;
+};
+
+// Upstream traffic of the peers handled by one epoll thread. With several
+// workers each binds its own SO_REUSEPORT socket to the listen address and
+// the kernel spreads the peers over them.
+struct PeerWorker {
+  PeerWorker()
+      : udp_fd(-1),
+        recv_batch(kBatchSize, kMaxDatagramSize),
+        raw_batch(kBatchSize, 0),
+        write_raw_fd_dropped(0),
+        fec_expired_at(0) {}
+
+  kl::Epoll epoll;
+  int udp_fd;
+  // Datagrams from peers and the decoded packets queued for raw_fd_
+  kale::DatagramBatch recv_batch, raw_batch;
+  uint64_t write_raw_fd_dropped;
+  // Peers sending FEC protected datagrams, by address << 16 | port
+  std::map<uint64_t, FECPeer> fec_peers;
+  // Second fec_peers was last scanned in
+  uint64_t fec_expired_at;
 };
 
 class Proxy {
  public:
   Proxy(const char *ifname, const char *local_addr, uint16_t local_port,
-        uint16_t port_min, uint16_t port_max, const char *key, size_t key_len)
+        uint16_t port_min, uint16_t port_max, const char *key, size_t key_len,
+        uint32_t stat_interval, int sniffer_workers, uint32_t tcp_timeout,
+        uint32_t udp_timeout, const std::vector<uint32_t> &nat_addrs,
+        int peer_workers)
       : stop_(false),
         ifname_(ifname),
         addr_(local_addr),
         port_min_(port_min),
         port_max_(port_max),
         port_(local_port),
-        udp_nat_(port_min, port_max),
-        tcp_nat_(port_min, port_max),
-        sniffer_(ifname),
-        coding_(
-            kale::DemoCoding(reinterpret_cast<const uint8_t *>(key), key_len)),
-        write_raw_fd_dropped_(0),
-        write_udp_fd_dropped_(0) {
-    inet_aton(addr_.c_str(), &in_addr_);
+        nat_addrs_(nat_addrs),
+        udp_nat_(nat_addrs, port_min, port_max, udp_timeout),
+        tcp_nat_(nat_addrs, port_min, port_max, tcp_timeout),
+        start_(std::chrono::steady_clock::now()),
+        coding_(kale::DemoInplaceCoding(
+            reinterpret_cast<const uint8_t *>(key), key_len)) {
+    for (int i = 0; i < sniffer_workers; ++i) {
+      workers_.emplace_back(new SnifferWorker(ifname, stat_interval));
+    }
+    for (int i = 0; i < peer_workers; ++i) {
+      peers_.emplace_back(new PeerWorker());
+    }
   }
 
   kl::Result<void> Run() {
@@ -280,8 +251,16 @@ class Proxy {
       return create;
     }
     kl::env::Defer defer([this] { DestroySocket(); });
-    LaunchSnifferThread();
-    LaunchEpollThread();
+    // Peer sockets share the listen address, replies may leave from any
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      workers_[i]->udp_fd = peers_[i % peers_.size()]->udp_fd;
+    }
+    for (auto &worker : workers_) {
+      LaunchSnifferThread(worker.get());
+    }
+    for (auto &peer : peers_) {
+      LaunchEpollThread(peer.get());
+    }
     sync_.Wait();
     if (!exit_reason_.empty()) {
       return kl::Err(std::move(exit_reason_));
@@ -289,53 +268,71 @@ class Proxy {
     return kl::Ok();
   }
 
+  // Makes Run return, from any thread.
+  void Stop() { stop_.store(true); }
+
  private:
-  void EpollWaitAndHandle();
-  void SnifferWaitAndHandle();
-  void SnifferSendBack(const char *addr, uint16_t port, const char *buf,
-                       size_t len);
-
-  static void FindIPPacket(int datalink, struct pcap_pkthdr *header,
-                           uint8_t *packet, uint8_t **ip, size_t *len) {
-    switch (datalink) {
-      case DLT_LINUX_SLL:
-        *ip = packet + 16;
-        *len = header->len - 16;
-        return;
-      case DLT_EN10MB:
-        *ip = packet + 14;
-        *len = header->len - 14;
-        return;
-      case DLT_SLIP:
-      case DLT_PPP:
-        *ip = packet + 24;
-        *len = header->len - 24;
-        return;
-      case DLT_NULL:
-        *ip = packet + 4;
-        *len = header->len - 4;
-        return;
-      default:
-        KL_ERROR("unrecognized datalink type: %d", datalink);
+  void EpollWaitAndHandle(PeerWorker *worker);
+  // Packets to every port of every NAT address
+  std::string SnifferFilter() const;
+  // Endpoint of the NAT a sniffed packet is sent to
+  kale::Endpoint LocalEndpoint(uint32_t dest_addr, uint16_t dest_port) const;
+  // Seconds since start_
+  uint64_t Now() const;
+  // Releases the NAT mappings which have been idle for their timeout.
+  void ExpireIdle();
+  // Drops FEC state of the worker's peers silent for kFECPeerTimeout, at
+  // most once a second.
+  void ExpireFECPeers(PeerWorker *worker);
+  void SnifferWaitAndHandle(SnifferWorker *worker);
+  // @capacity: writable bytes from @packet on, used to encode in place.
+  // @packet is sent from the ring, it must stay valid until FlushSendBack.
+  void SnifferSendBack(SnifferWorker *worker, const struct sockaddr_in &peer,
+                       uint8_t *packet, size_t len, size_t capacity);
+  void FlushSendBack(SnifferWorker *worker);
+
+  kl::Result<void> CreateSocket() {
+    for (auto &peer : peers_) {
+      auto create = CreatePeerSocket(peer.get());
+      if (!create) {
+        DestroySocket();
+        return create;
+      }
     }
+    raw_fd_ = *kale::RawIPv4Socket();
+    kl::env::SetNonBlocking(raw_fd_);
+    return kl::Ok();
   }
 
-  kl::Result<void> CreateSocket() {
-    udp_fd_ = *kl::udp::Socket();
-    kl::env::SetNonBlocking(udp_fd_);
-    auto bind = kl::inet::Bind(udp_fd_, addr_.c_str(), port_);
+  kl::Result<void> CreatePeerSocket(PeerWorker *worker) {
+    int fd = *kl::udp::Socket();
+    kl::env::SetNonBlocking(fd);
+    if (peers_.size() > 1) {
+      int on = 1;
+      if (::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        ::close(fd);
+        return kl::Err(errno, std::strerror(errno));
+      }
+    }
+    auto bind = kl::inet::Bind(fd, addr_.c_str(), port_);
     if (!bind) {
-      ::close(udp_fd_);
+      ::close(fd);
       return bind;
     }
-    raw_fd_ = *kale::RawIPv4Socket();
-    kl::env::SetNonBlocking(raw_fd_);
+    worker->udp_fd = fd;
     return kl::Ok();
   }
 
   void DestroySocket() {
-    ::close(raw_fd_);
-    ::close(udp_fd_);
+    if (raw_fd_ >= 0) {
+      ::close(raw_fd_);
+    }
+    for (auto &peer : peers_) {
+      if (peer->udp_fd >= 0) {
+        ::close(peer->udp_fd);
+        peer->udp_fd = -1;
+      }
+    }
   }
 
   void SetExitReason(const char *reason) {
@@ -344,25 +341,32 @@ class Proxy {
     mutex_.unlock();
   }
 
-  void LaunchSnifferThread() {
+  void LaunchSnifferThread(SnifferWorker *worker) {
     sync_.Add();
-    std::thread([this] {
+    std::thread([this, worker] {
       kl::env::Defer defer([this] {
         stop_.store(true);
         sync_.Done();
       });
-      char filter_expr[1024];
-      std::snprintf(filter_expr, sizeof(filter_expr),
-                    "(udp or tcp) and host %s and dst portrange %u-%u",
-                    addr_.c_str(), port_min_, port_max_);
-      auto compile = sniffer_.CompileAndInstall(filter_expr);
+      std::string filter_expr = SnifferFilter();
+      auto compile = worker->sniffer.CompileAndInstall(filter_expr.c_str());
       if (!compile) {
         KL_ERROR(compile.Err().ToCString());
         Stop(compile.Err().ToCString());
         return;
       }
+      if (workers_.size() > 1) {
+        // One group per proxy process
+        auto join = worker->sniffer.JoinFanout(::getpid() & 0xffff,
+                                               kale::kFanoutHash);
+        if (!join) {
+          KL_ERROR(join.Err().ToCString());
+          Stop(join.Err().ToCString());
+          return;
+        }
+      }
       while (!stop_) {
-        SnifferWaitAndHandle();
+        SnifferWaitAndHandle(worker);
       }
     }).detach();
   }
@@ -372,36 +376,42 @@ class Proxy {
     SetExitReason(err);
   }
 
-  void LaunchEpollThread() {
+  void LaunchEpollThread(PeerWorker *worker) {
     sync_.Add();
-    std::thread([this] {
+    std::thread([this, worker] {
       kl::env::Defer defer([this] {
         stop_.store(true);
         sync_.Done();
       });
-      auto init_epoll = InitEpoll();
+      auto init_epoll = InitEpoll(worker);
       if (!init_epoll) {
         SetExitReason(init_epoll.Err().ToCString());
         return;
       }
       while (!stop_) {
-        EpollWaitAndHandle();
+        EpollWaitAndHandle(worker);
       }
     }).detach();
   }
 
-  void SnifferHandleTCP(uint8_t *packet, size_t len);
-  void SnifferHandleUDP(uint8_t *packet, size_t len);
-  void EpollHandleTCP(const char *peer_addr, uint16_t peer_port,
+  void SnifferHandleTCP(SnifferWorker *worker, uint8_t *packet, size_t len,
+                        size_t capacity);
+  void SnifferHandleUDP(SnifferWorker *worker, uint8_t *packet, size_t len,
+                        size_t capacity);
+  void EpollHandleTCP(PeerWorker *worker, const struct sockaddr_in &peer,
                       uint8_t *packet, size_t len);
-  void EpollHandleUDP(const char *peer_addr, uint16_t peer_port,
+  void EpollHandleUDP(PeerWorker *worker, const struct sockaddr_in &peer,
                       uint8_t *packet, size_t len);
-  void OnUDPRecvFromPeer();
-
-  void Stop() { stop_.store(true); }
-
-  kl::Result<void> InitEpoll() {
-    auto add_udp = epoll_.AddFd(udp_fd_, EPOLLET | EPOLLIN);
+  void OnUDPRecvFromPeer(PeerWorker *worker);
+  // @datagram is decoded and without FEC header
+  void HandlePeerDatagram(PeerWorker *worker, const struct sockaddr_in &peer,
+                          uint8_t *datagram, size_t len);
+  void QueueRaw(PeerWorker *worker, const uint8_t *packet, size_t len,
+                uint32_t dest_addr);
+  void FlushRaw(PeerWorker *worker);
+
+  kl::Result<void> InitEpoll(PeerWorker *worker) {
+    auto add_udp = worker->epoll.AddFd(worker->udp_fd, EPOLLET | EPOLLIN);
     if (!add_udp) {
       return add_udp;
     }
@@ -412,184 +422,194 @@ class Proxy {
   std::atomic<bool> stop_;
   std::string ifname_, addr_, exit_reason_;
   uint16_t port_min_, port_max_;
-  struct in_addr in_addr_;
   uint16_t port_;
+  // Network byte order. INADDR_ANY comes only alone, it leaves the source
+  // address to the kernel.
+  std::vector<uint32_t> nat_addrs_;
   NAT udp_nat_, tcp_nat_;
-  kale::Sniffer sniffer_;
+  // NAT clock starts at 0 here
+  std::chrono::steady_clock::time_point start_;
+  std::vector<std::unique_ptr<SnifferWorker>> workers_;
+  // Used to communicate with peers
+  std::vector<std::unique_ptr<PeerWorker>> peers_;
   kl::WaitGroup sync_;
-  kl::Epoll epoll_;
-  // Used to communicate with peer
-  int udp_fd_;
   // Used to send IPv4 packets to inet host
-  int raw_fd_;
+  int raw_fd_ = -1;
   // kale::arcfour::Cipher cipher_;
-  kale::Coding coding_;
-  uint64_t write_raw_fd_dropped_;
-  uint64_t write_udp_fd_dropped_;
+  kale::InplaceCoding coding_;
 };
 
-void Proxy::EpollHandleTCP(const char *peer_addr, uint16_t peer_port,
-                           uint8_t *packet, size_t len) {
+void Proxy::EpollHandleTCP(PeerWorker *worker,
+                           const struct sockaddr_in &peer, uint8_t *packet,
+                           size_t len) {
   kale::ipv4::PacketEditor editor(packet, len);
-  std::string subnet_addr(inet_ntoa(in_addr{
-      // .s_addr = kale::ip::SrcAddr(packet, len),
-      .s_addr = editor.ref().rep->source_addr,
-  }));
   auto tcp_editor = editor.CreateTCPSegmentEditor();
   assert(tcp_editor);
-  // uint16_t subnet_port = ntohs(kale::ip::TCPSrcPort(packet, len));
-  uint16_t subnet_port = ntohs(tcp_editor->ref().rep->source_port);
-  auto query = tcp_nat_.QueryPort(peer_addr, peer_port, subnet_addr.c_str(),
-                                  subnet_port);
-  uint16_t port = 0;
-  if (!query) {
-    auto add = tcp_nat_.AddEntry(peer_addr, peer_port, subnet_addr.c_str(),
-                                 subnet_port);
-    if (!add) {
-      return;
-    }
-    port = *add;
-  } else {
-    port = *query;
-  }
-  assert(port > 0);
-  // kale::ip::ChangeSrcAddr(packet, len, in_addr_.s_addr);
-  editor.ChangeSourceAddr(in_addr_.s_addr);
-  // kale::ip::ChangeTCPSrcPort(packet, len, htons(port));
-  tcp_editor->ChangeSourcePort(htons(port));
-  // kale::ip::TCPFillChecksum(packet, len);
-  tcp_editor->FillChecksum();
-  // kale::ip::IPFillChecksum(packet, len);
-  editor.FillChecksum();
-  std::string dst_addr(inet_ntoa(in_addr{
-      // .s_addr = kale::ip::DstAddr(packet, len),
-      .s_addr = editor.ref().rep->dest_addr,
-  }));
-  // uint16_t dst_port = ntohs(kale::ip::TCPDstPort(packet, len));
-  uint16_t dst_port = ntohs(tcp_editor->ref().rep->dest_port);
-  KL_DEBUG(
-      "tcp segment from host %s:%u's subnet  %s:%u -> %s:%u now is %s:%u "
-      "-> %s:%u",
-      peer_addr, peer_port, subnet_addr.c_str(), subnet_port, dst_addr.c_str(),
-      dst_port, addr_.c_str(), port, dst_addr.c_str(), dst_port);
-  auto send =
-      kl::inet::Sendto(raw_fd_, packet, len, 0, dst_addr.c_str(), dst_port);
-  // record number of packets dropped
-  if (!send &&
-      (send.Err().Code() == EAGAIN || send.Err().Code() == EWOULDBLOCK)) {
-    uint64_t tmp = ++write_raw_fd_dropped_;
-    KL_ERROR("current write_raw_fd_dropped_: %u", tmp);
-  }
-  if (!send && send.Err().Code() != EAGAIN &&
-      send.Err().Code() != EWOULDBLOCK) {
-    KL_ERROR(send.Err().ToCString());
+  kale::FlowKey key;
+  key.peer_addr = peer.sin_addr.s_addr;
+  key.peer_port = peer.sin_port;
+  key.subnet_addr = editor.ref().rep->source_addr;
+  key.subnet_port = tcp_editor->ref().rep->source_port;
+  auto map = tcp_nat_.Map(key, tcp_editor->ref());
+  if (!map) {
+    KL_ERROR(map.Err().ToCString());
+    return;
   }
+  const kale::Endpoint &local = *map;
+  editor.ChangeSourceAddr(local.addr, kale::ipv4::kIncrementalChecksum);
+  tcp_editor->ChangeSourcePort(htons(local.port),
+                              kale::ipv4::kIncrementalChecksum);
+  KL_DEBUG("tcp segment from subnet port %u now is from port %u",
+           ntohs(key.subnet_port), local.port);
+  QueueRaw(worker, packet, len, editor.ref().rep->dest_addr);
 }
 
-void Proxy::EpollHandleUDP(const char *peer_addr, uint16_t peer_port,
-                           uint8_t *packet, size_t len) {
+void Proxy::EpollHandleUDP(PeerWorker *worker,
+                           const struct sockaddr_in &peer, uint8_t *packet,
+                           size_t len) {
   kale::ipv4::PacketEditor editor(packet, len);
   auto udp_editor = editor.CreateUDPSegmentEditor();
   assert(udp_editor);
-  std::string subnet_addr(inet_ntoa(in_addr{
-      // .s_addr = kale::ip::SrcAddr(packet, len),
-      .s_addr = editor.ref().rep->source_addr,
-  }));
-  // uint16_t subnet_port = ntohs(kale::ip::UDPSrcPort(packet, len));
-  uint16_t subnet_port = ntohs(udp_editor->ref().rep->source_port);
-  auto query = udp_nat_.QueryPort(peer_addr, peer_port, subnet_addr.c_str(),
-                                  subnet_port);
-  uint16_t port = 0;
-  if (!query) {
-    auto add = udp_nat_.AddEntry(peer_addr, peer_port, subnet_addr.c_str(),
-                                 subnet_port);
-    if (!add) {
-      return;
-    }
-    port = *add;
-  } else {
-    port = *query;
-  }
-  assert(port > 0);
-  // kale::ip::ChangeSrcAddr(packet, len, in_addr_.s_addr);
-  editor.ChangeSourceAddr(in_addr_.s_addr);
-  // kale::ip::ChangeUDPSrcPort(packet, len, htons(port));
-  udp_editor->ChangeSourcePort(htons(port));
-  // kale::ip::UDPFillChecksum(packet, len);
-  udp_editor->FillChecksum();
-  // kale::ip::IPFillChecksum(packet, len);
-  editor.FillChecksum();
-  std::string dst_addr(inet_ntoa(in_addr{
-      // .s_addr = kale::ip::DstAddr(packet, len),
-      .s_addr = editor.ref().rep->dest_addr,
-  }));
-  // uint16_t dst_port = ntohs(kale::ip::UDPDstPort(packet, len));
-  uint16_t dst_port = ntohs(udp_editor->ref().rep->dest_port);
-  KL_DEBUG(
-      "udp segment from host %s:%u's subnet  %s:%u -> %s:%u now is %s:%u "
-      "-> %s:%u",
-      peer_addr, peer_port, subnet_addr.c_str(), subnet_port, dst_addr.c_str(),
-      dst_port, addr_.c_str(), port, dst_addr.c_str(), dst_port);
-  auto send =
-      kl::inet::Sendto(raw_fd_, packet, len, 0, dst_addr.c_str(), dst_port);
-  if (!send && send.Err().Code() != EAGAIN &&
-      send.Err().Code() != EWOULDBLOCK) {
+  kale::FlowKey key;
+  key.peer_addr = peer.sin_addr.s_addr;
+  key.peer_port = peer.sin_port;
+  key.subnet_addr = editor.ref().rep->source_addr;
+  key.subnet_port = udp_editor->ref().rep->source_port;
+  auto map = udp_nat_.Map(key);
+  if (!map) {
+    KL_ERROR(map.Err().ToCString());
+    return;
+  }
+  const kale::Endpoint &local = *map;
+  editor.ChangeSourceAddr(local.addr, kale::ipv4::kIncrementalChecksum);
+  udp_editor->ChangeSourcePort(htons(local.port),
+                              kale::ipv4::kIncrementalChecksum);
+  KL_DEBUG("udp segment from subnet port %u now is from port %u",
+           ntohs(key.subnet_port), local.port);
+  QueueRaw(worker, packet, len, editor.ref().rep->dest_addr);
+}
+
+// Packets stay in recv_batch until raw_batch is flushed.
+void Proxy::QueueRaw(PeerWorker *worker, const uint8_t *packet, size_t len,
+                     uint32_t dest_addr) {
+  struct sockaddr_in addr;
+  ::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = dest_addr;
+  worker->raw_batch.Add(packet, len, addr);
+  if (worker->raw_batch.Full()) {
+    FlushRaw(worker);
+  }
+}
+
+void Proxy::FlushRaw(PeerWorker *worker) {
+  size_t count = worker->raw_batch.Count();
+  if (count == 0) {
+    return;
+  }
+  auto send = worker->raw_batch.Send(raw_fd_);
+  if (!send) {
     KL_ERROR(send.Err().ToCString());
+    return;
+  }
+  // record number of packets dropped
+  if (*send < count) {
+    worker->write_raw_fd_dropped += count - *send;
+    uint64_t tmp = worker->write_raw_fd_dropped;
+    KL_ERROR("current write_raw_fd_dropped: %u", tmp);
   }
 }
 
-void Proxy::OnUDPRecvFromPeer() {
+void Proxy::OnUDPRecvFromPeer(PeerWorker *worker) {
+  kale::DatagramBatch &recv_batch = worker->recv_batch;
   // read until EAGAIN or EWOULDBLOCK
-  char buf[65536];
   while (true) {
-    auto recv = kl::inet::RecvFrom(udp_fd_, buf, sizeof(buf), 0);
+    auto recv = recv_batch.Recv(worker->udp_fd);
     if (!recv) {
-      if (recv.Err().Code() == EAGAIN || recv.Err().Code() == EWOULDBLOCK) {
-        break;
-      }
       KL_ERROR(recv.Err().ToCString());
       Stop(recv.Err().ToCString());
       return;
     }
-    int nread = std::get<0>(*recv);
-    assert(nread >= 0);
-    std::string &peer_addr = std::get<1>(*recv);
-    uint32_t peer_port = std::get<2>(*recv);
-    std::vector<uint8_t> data;
-    auto ok =
-        coding_.Decode(reinterpret_cast<const uint8_t *>(buf), nread, &data);
-    if (!ok) {
-      KL_ERROR(ok.Err().ToCString());
+    if (*recv == 0) {
       break;
     }
-    assert(data.size() <= sizeof(buf));
-    ::memcpy(buf, data.data(), data.size());
-    uint8_t *packet = reinterpret_cast<uint8_t *>(buf);
-    const size_t len = data.size();
-    kale::ipv4::PacketRef packet_ref(packet, len);
-    if (packet_ref.IsTCP()) {
-      EpollHandleTCP(peer_addr.c_str(), peer_port, packet, len);
-    } else if (packet_ref.IsUDP()) {
-      EpollHandleUDP(peer_addr.c_str(), peer_port, packet, len);
+    for (size_t i = 0; i < recv_batch.Count(); ++i) {
+      const struct sockaddr_in &peer = recv_batch.Addr(i);
+      uint8_t *packet = recv_batch.Data(i);
+      auto decode = coding_.Decode(packet, recv_batch.Length(i),
+                                   recv_batch.BufferSize());
+      if (!decode) {
+        KL_ERROR(decode.Err().ToCString());
+        continue;
+      }
+      if (!kale::fec::IsProtected(packet, *decode)) {
+        HandlePeerDatagram(worker, peer, packet, *decode);
+        continue;
+      }
+      uint64_t key = static_cast<uint64_t>(peer.sin_addr.s_addr) << 16 |
+                     peer.sin_port;
+      FECPeer &fec_peer = worker->fec_peers[key];
+      fec_peer.last_active = Now();
+      bool recovered = false;
+      auto receive = fec_peer.decoder.Receive(
+          packet, *decode,
+          [this, worker, &peer, &recovered](uint8_t *payload, size_t len,
+                                            bool rebuilt) {
+            HandlePeerDatagram(worker, peer, payload, len);
+            recovered |= rebuilt;
+          });
+      if (!receive) {
+        KL_ERROR(receive.Err().ToCString());
+      }
+      // Recovered packets live in the decoder only until the next datagram
+      if (recovered) {
+        FlushRaw(worker);
+      }
     }
+    FlushRaw(worker);
   }
 }
 
-void Proxy::EpollWaitAndHandle() {
-  // wait for only udp_fd_
-  auto wait = epoll_.Wait(1, -1);
+// Clients may pack several packets into a datagram
+void Proxy::HandlePeerDatagram(PeerWorker *worker,
+                               const struct sockaddr_in &peer,
+                               uint8_t *datagram, size_t len) {
+  auto split = kale::aggregation::Split(
+      datagram, len, [this, worker, &peer](uint8_t *packet, size_t len) {
+        kale::ipv4::PacketRef packet_ref(packet, len);
+        if (packet_ref.IsTCP()) {
+          EpollHandleTCP(worker, peer, packet, len);
+        } else if (packet_ref.IsUDP()) {
+          EpollHandleUDP(worker, peer, packet, len);
+        }
+      });
+  if (!split) {
+    KL_ERROR(split.Err().ToCString());
+  }
+}
+
+void Proxy::EpollWaitAndHandle(PeerWorker *worker) {
+  // wait for only the worker's udp_fd
+  auto wait = worker->epoll.Wait(1, kExpireInterval);
+  if (worker == peers_[0].get()) {
+    ExpireIdle();
+  }
+  ExpireFECPeers(worker);
   if (!wait) {
     KL_ERROR(wait.Err().ToCString());
     Stop(wait.Err().ToCString());
     return;
   }
+  if ((*wait).empty()) {
+    return;
+  }
   assert((*wait).size() == 1);
   auto &event = (*wait)[0];
   int fd = event.data.fd;
-  assert(fd == udp_fd_);
+  assert(fd == worker->udp_fd);
   uint32_t events = event.events;
   if (events & EPOLLIN) {
-    OnUDPRecvFromPeer();
+    OnUDPRecvFromPeer(worker);
   }
   if (events & EPOLLERR) {
     int error = 0;
@@ -602,155 +622,175 @@ void Proxy::EpollWaitAndHandle() {
   }
 }
 
-void Proxy::SnifferWaitAndHandle() {
-  struct pcap_pkthdr header;
-  char buf[65536];
-  const uint8_t *raw_packet = sniffer_.NextPacket(&header);
-  if (raw_packet == nullptr) {
-    // KL_ERROR("recv NULL packet");
-    // stop or continue
+std::string Proxy::SnifferFilter() const {
+  std::string hosts;
+  for (uint32_t addr : nat_addrs_) {
+    if (addr == INADDR_ANY) {
+      break;
+    }
+    struct in_addr in;
+    in.s_addr = addr;
+    hosts += hosts.empty() ? "host " : " or host ";
+    hosts += inet_ntoa(in);
+  }
+  std::string filter("(udp or tcp)");
+  if (!hosts.empty()) {
+    filter += " and (" + hosts + ")";
+  }
+  filter += kl::string::FormatString(" and dst portrange %u-%u", port_min_,
+                                     port_max_);
+  return filter;
+}
+
+kale::Endpoint Proxy::LocalEndpoint(uint32_t dest_addr,
+                                    uint16_t dest_port) const {
+  kale::Endpoint local;
+  local.addr = nat_addrs_[0] == INADDR_ANY ? INADDR_ANY : dest_addr;
+  local.port = dest_port;
+  return local;
+}
+
+uint64_t Proxy::Now() const {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::steady_clock::now() - start_)
+      .count();
+}
+
+void Proxy::ExpireIdle() {
+  uint64_t now = Now();
+  size_t tcp = tcp_nat_.Advance(now);
+  size_t udp = udp_nat_.Advance(now);
+  if (tcp + udp > 0) {
+    KL_DEBUG("released %u tcp and %u udp idle mappings",
+             static_cast<unsigned>(tcp), static_cast<unsigned>(udp));
+  }
+}
+
+void Proxy::ExpireFECPeers(PeerWorker *worker) {
+  uint64_t now = Now();
+  if (now == worker->fec_expired_at) {
     return;
   }
-  // ignore truncated packet
-  if (header.len != header.caplen) {
-    KL_ERROR("truncated packet, header.len %d, header.caplen %d", header.len,
-             header.caplen);
+  worker->fec_expired_at = now;
+  for (auto it = worker->fec_peers.begin(); it != worker->fec_peers.end();) {
+    if (now - it->second.last_active >= kFECPeerTimeout) {
+      it = worker->fec_peers.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+// Packets are rewritten and encoded right in the ring block, which goes back
+// to the kernel once they are sent.
+void Proxy::SnifferWaitAndHandle(SnifferWorker *worker) {
+  auto next = worker->sniffer.NextBlock(kSnifferPollTimeout, &worker->sniffed);
+  if (!next) {
+    KL_ERROR(next.Err().ToCString());
+    Stop(next.Err().ToCString());
     return;
   }
-  // ignore too long packet
-  if (header.len > sizeof(buf)) {
-    KL_ERROR("too long packet: %d", header.len);
+  for (const auto &view : worker->sniffed) {
+    kale::ipv4::PacketRef packet_ref(view.data, view.len);
+    if (packet_ref.IsTCP()) {
+      SnifferHandleTCP(worker, view.data, view.len, view.capacity);
+    } else if (packet_ref.IsUDP()) {
+      SnifferHandleUDP(worker, view.data, view.len, view.capacity);
+    }
+  }
+  FlushSendBack(worker);
+  worker->sniffer.ReleaseBlock();
+}
+
+void Proxy::SnifferSendBack(SnifferWorker *worker,
+                            const struct sockaddr_in &peer, uint8_t *packet,
+                            size_t len, size_t capacity) {
+  if (len + coding_.max_overhead > capacity) {
+    KL_ERROR("no room to encode packet of length %u",
+             static_cast<unsigned>(len));
     return;
   }
-  ::memcpy(buf, raw_packet, header.len);
-  uint8_t *packet = nullptr;
-  size_t len;
-  FindIPPacket(sniffer_.DataLink(), &header, reinterpret_cast<uint8_t *>(buf),
-               &packet, &len);
-  // ignore unrecognized datalink
-  if (packet == nullptr) {
+  auto encode = coding_.Encode(packet, len, capacity);
+  if (!encode) {
+    KL_ERROR(encode.Err().ToCString());
     return;
   }
-  kale::ipv4::PacketRef packet_ref(packet, len);
-  if (packet_ref.IsTCP()) {
-    SnifferHandleTCP(packet, len);
-  } else if (packet_ref.IsUDP()) {
-    SnifferHandleUDP(packet, len);
+  worker->back_batch.Add(packet, *encode, peer);
+  if (worker->back_batch.Full()) {
+    FlushSendBack(worker);
   }
 }
 
-void Proxy::SnifferSendBack(const char *addr, uint16_t port, const char *buf,
-                            size_t len) {
-  std::vector<uint8_t> data;
-  coding_.Encode(reinterpret_cast<const uint8_t *>(buf), len, &data);
-  auto send =
-      kl::inet::Sendto(udp_fd_, data.data(), data.size(), 0, addr, port);
-  // record number of packets dropped
-  if (!send &&
-      (send.Err().Code() == EAGAIN || send.Err().Code() == EWOULDBLOCK)) {
-    uint64_t tmp = ++write_udp_fd_dropped_;
-    KL_ERROR("current write_udp_fd_dropped_: %u", tmp);
+void Proxy::FlushSendBack(SnifferWorker *worker) {
+  size_t count = worker->back_batch.Count();
+  if (count == 0) {
+    return;
   }
-  if (!send && send.Err().Code() != EAGAIN &&
-      send.Err().Code() != EWOULDBLOCK) {
+  auto send = worker->back_batch.Send(worker->udp_fd);
+  if (!send) {
     KL_ERROR(send.Err().ToCString());
+    return;
+  }
+  // record number of packets dropped
+  if (*send < count) {
+    worker->write_udp_fd_dropped += count - *send;
+    uint64_t tmp = worker->write_udp_fd_dropped;
+    KL_ERROR("current write_udp_fd_dropped: %u", tmp);
   }
 }
 
-void Proxy::SnifferHandleTCP(uint8_t *packet, size_t len) {
+void Proxy::SnifferHandleTCP(SnifferWorker *worker, uint8_t *packet,
+                             size_t len, size_t capacity) {
   kale::ipv4::PacketEditor editor(packet, len);
   auto tcp_editor = editor.CreateTCPSegmentEditor();
   assert(tcp_editor);
-  // uint16_t port = ntohs(kale::ip::TCPDstPort(packet, len));
-  uint16_t port = ntohs(tcp_editor->ref().rep->dest_port);
-  auto query = tcp_nat_.QueryHost(port);
-  if (!query) {
+  kale::Endpoint local =
+      LocalEndpoint(editor.ref().rep->dest_addr,
+                    ntohs(tcp_editor->ref().rep->dest_port));
+  kale::FlowKey key;
+  if (!tcp_nat_.QueryFlow(local, &key, tcp_editor->ref())) {
     return;
   }
-  auto &host = *query;
-  // peer for sending across inet
-  std::string &peer_addr = std::get<0>(host);
-  uint16_t peer_port = std::get<1>(host);
-  // subnet for client to send packet to right tun user
-  std::string &subnet_addr = std::get<2>(host);
-  uint16_t subnet_port = std::get<3>(host);
-  // Modify essential tcp info
-  struct sockaddr_in addr =
-      *kl::inet::InetSockAddr(subnet_addr.c_str(), subnet_port);
-  // kale::ip::ChangeDstAddr(packet, len, addr.sin_addr.s_addr);
-  editor.ChangeDestAddr(addr.sin_addr.s_addr);
-  // kale::ip::ChangeTCPDstPort(packet, len, htons(subnet_port));
-  tcp_editor->ChangeDestPort(htons(subnet_port));
-  // kale::ip::TCPFillChecksum(packet, len);
-  tcp_editor->FillChecksum();
-  // kale::ip::IPFillChecksum(packet, len);
-  editor.FillChecksum();
+  // Modify essential tcp info for the subnet host
+  editor.ChangeDestAddr(key.subnet_addr, kale::ipv4::kIncrementalChecksum);
+  tcp_editor->ChangeDestPort(key.subnet_port,
+                             kale::ipv4::kIncrementalChecksum);
   // Sending back to client
-  StatIPPacket(packet, len);
-  SnifferSendBack(peer_addr.c_str(), peer_port,
-                  reinterpret_cast<const char *>(packet), len);
+  worker->stat(packet, len);
+  struct sockaddr_in peer;
+  ::memset(&peer, 0, sizeof(peer));
+  peer.sin_family = AF_INET;
+  peer.sin_addr.s_addr = key.peer_addr;
+  peer.sin_port = key.peer_port;
+  SnifferSendBack(worker, peer, packet, len, capacity);
 }
 
-void Proxy::SnifferHandleUDP(uint8_t *packet, size_t len) {
+void Proxy::SnifferHandleUDP(SnifferWorker *worker, uint8_t *packet,
+                             size_t len, size_t capacity) {
   kale::ipv4::PacketEditor editor(packet, len);
   auto udp_editor = editor.CreateUDPSegmentEditor();
   assert(udp_editor);
-  // uint16_t port = ntohs(kale::ip::UDPDstPort(packet, len));
-  uint16_t port = ntohs(udp_editor->ref().rep->dest_port);
-  auto query = udp_nat_.QueryHost(port);
-  if (!query) {
+  kale::Endpoint local =
+      LocalEndpoint(editor.ref().rep->dest_addr,
+                    ntohs(udp_editor->ref().rep->dest_port));
+  kale::FlowKey key;
+  if (!udp_nat_.QueryFlow(local, &key)) {
     return;
   }
-  auto &host = *query;
-  // peer for sending across inet
-  std::string &peer_addr = std::get<0>(host);
-  uint16_t peer_port = std::get<1>(host);
-  // subnet for client to send packet to right tun user
-  std::string &subnet_addr = std::get<2>(host);
-  uint16_t subnet_port = std::get<3>(host);
-  // Modify essential udp info
-  struct sockaddr_in addr =
-      *kl::inet::InetSockAddr(subnet_addr.c_str(), subnet_port);
-  // kale::ip::ChangeDstAddr(packet, len, addr.sin_addr.s_addr);
-  editor.ChangeDestAddr(addr.sin_addr.s_addr);
-  // kale::ip::ChangeUDPDstPort(packet, len, htons(subnet_port));
-  udp_editor->ChangeDestPort(htons(subnet_port));
-  // kale::ip::UDPFillChecksum(packet, len);
-  udp_editor->FillChecksum();
-  // kale::ip::IPFillChecksum(packet, len);
-  editor.FillChecksum();
+  // Modify essential udp info for the subnet host
+  editor.ChangeDestAddr(key.subnet_addr, kale::ipv4::kIncrementalChecksum);
+  udp_editor->ChangeDestPort(key.subnet_port,
+                             kale::ipv4::kIncrementalChecksum);
   // Sending back to client
-  StatIPPacket(packet, len);
-  SnifferSendBack(peer_addr.c_str(), peer_port,
-                  reinterpret_cast<const char *>(packet), len);
+  worker->stat(packet, len);
+  struct sockaddr_in peer;
+  ::memset(&peer, 0, sizeof(peer));
+  peer.sin_family = AF_INET;
+  peer.sin_addr.s_addr = key.peer_addr;
+  peer.sin_port = key.peer_port;
+  SnifferSendBack(worker, peer, packet, len, capacity);
 }
 
-kl::Result<void> BindPortRange(FdManager *fd_manager, const char *host,
-                               uint16_t port_min, uint16_t port_max) {
-  for (uint16_t port = port_min; port <= port_max; ++port) {
-    // tcp port
-    auto tcp_sock = kl::tcp::Socket();
-    if (!tcp_sock) {
-      return kl::Err(tcp_sock.MoveErr());
-    }
-    auto tcp_bind = kl::inet::Bind(*tcp_sock, host, port);
-    if (!tcp_bind) {
-      return kl::Err(tcp_bind.MoveErr());
-    }
-    fd_manager->AddFd(*tcp_sock);
-    // udp port
-    auto udp_sock = kl::udp::Socket();
-    if (!udp_sock) {
-      return kl::Err(udp_sock.MoveErr());
-    }
-    auto udp_bind = kl::inet::Bind(*udp_sock, host, port);
-    if (!udp_bind) {
-      return kl::Err(udp_bind.MoveErr());
-    }
-    fd_manager->AddFd(*udp_sock);
-  }
-  return kl::Ok();
-}
 }  // namespace (anonymous)
 
 static void PrintUsage(int argc, char *argv[]) {
@@ -761,7 +801,16 @@ static void PrintUsage(int argc, char *argv[]) {
                "    -r <port_start-port_end> port range to be reserved\n"
                "    -d daemon\n"
                "    -o <logfile> logfile\n"
-               "    -p <passwd> password\n",
+               "    -p <passwd> password\n"
+               "    -v <n> validate every n-th packet, 0 to disable\n"
+               "    -w <n> number of sniffer workers\n"
+               "    -u <n> number of SO_REUSEPORT sockets receiving from "
+               "peers\n"
+               "    -T <seconds> idle timeout of tcp mappings\n"
+               "    -U <seconds> idle timeout of udp mappings\n"
+               "    -N drop packets to reserved ports with nftables\n"
+               "    -s <addr[,addr...]> source addresses of the NAT pool, the "
+               "listen address by default, 0.0.0.0 only on its own\n",
                argv[0]);
 }
 
@@ -773,9 +822,16 @@ int main(int argc, char *argv[]) {
   std::string log_file;                         // -o
   bool daemonize = false;                       // -d
   std::string passwd("\xc0\xde\xba\xbe");       // -p
+  uint32_t stat_interval = 1;                   // -v
+  int sniffer_workers = 1;                      // -w
+  int peer_workers = 1;                         // -u
+  uint32_t tcp_timeout = 7440;                  // -T, RFC 5382
+  uint32_t udp_timeout = 300;                   // -U, RFC 4787
+  auto firewall = kale::ports::kIptables;       // -N
+  std::vector<uint32_t> nat_addrs;              // -s
   kl::env::Defer defer;                         // for some clean work
   int opt = 0;
-  while ((opt = ::getopt(argc, argv, "i:l:r:o:hdp:")) != -1) {
+  while ((opt = ::getopt(argc, argv, "i:l:r:o:hdp:v:w:u:T:U:Ns:")) != -1) {
     switch (opt) {
       case 'o':
         log_file = optarg;
@@ -805,12 +861,69 @@ int main(int argc, char *argv[]) {
         passwd = optarg;
         break;
       }
+      case 'v': {
+        stat_interval = atoi(optarg);
+        break;
+      }
+      case 'w': {
+        sniffer_workers = atoi(optarg);
+        if (sniffer_workers < 1) {
+          PrintUsage(argc, argv);
+          ::exit(1);
+        }
+        break;
+      }
+      case 'u': {
+        peer_workers = atoi(optarg);
+        if (peer_workers < 1) {
+          PrintUsage(argc, argv);
+          ::exit(1);
+        }
+        break;
+      }
+      case 'T': {
+        tcp_timeout = atoi(optarg);
+        if (tcp_timeout == 0) {
+          PrintUsage(argc, argv);
+          ::exit(1);
+        }
+        break;
+      }
+      case 'U': {
+        udp_timeout = atoi(optarg);
+        if (udp_timeout == 0) {
+          PrintUsage(argc, argv);
+          ::exit(1);
+        }
+        break;
+      }
+      case 'N': {
+        firewall = kale::ports::kNftables;
+        break;
+      }
+      case 's': {
+        for (const auto &addr : kl::string::SplitString(optarg, ",")) {
+          struct in_addr in;
+          if (inet_aton(addr.c_str(), &in) == 0) {
+            PrintUsage(argc, argv);
+            ::exit(1);
+          }
+          nat_addrs.push_back(in.s_addr);
+        }
+        break;
+      }
       case 'h':
       default:
         PrintUsage(argc, argv);
         ::exit(1);
     }
   }
+  // Any address can't share the pool with others
+  if (nat_addrs.size() > 1 &&
+      std::count(nat_addrs.begin(), nat_addrs.end(), INADDR_ANY) > 0) {
+    PrintUsage(argc, argv);
+    ::exit(1);
+  }
   // daemonize
   if (daemonize) {
     int err = ::daemon(1, 1);
@@ -819,23 +932,36 @@ int main(int argc, char *argv[]) {
       ::exit(1);
     }
   }
-  // Bind ports so that OS won't use these ports
-  FdManager fd_manager;
-  auto bind_range =
-      BindPortRange(&fd_manager, host.c_str(), port_min, port_max);
-  if (!bind_range) {
-    KL_ERROR(bind_range.Err().ToCString());
+  // So that OS won't use these ports, undone on the way out
+  auto reserve = kale::ports::ReserveLocalPorts(port_min, port_max);
+  if (!reserve) {
+    KL_ERROR(reserve.Err().ToCString());
+  } else {
+    // Only the ports added here, others may have reserved the rest
+    kale::ports::PortSet added = std::move(*reserve);
+    defer([added] {
+      auto release = kale::ports::ReleaseLocalPorts(added);
+      if (!release) {
+        KL_ERROR(release.Err().ToCString());
+      }
+    });
   }
-  auto insert = InsertIptablesRules(port_min, port_max);
+  auto insert = kale::ports::InstallDropRules(firewall, port_min, port_max);
   if (!insert) {
     KL_ERROR(insert.Err().ToCString());
-    ::exit(1);
+    return 1;
   }
+  defer([firewall, port_min, port_max] {
+    auto remove = kale::ports::RemoveDropRules(firewall, port_min, port_max);
+    if (!remove) {
+      KL_ERROR(remove.Err().ToCString());
+    }
+  });
   if (!log_file.empty()) {
     int fd = ::open(log_file.c_str(), O_CREAT | O_WRONLY, 0644);
     if (fd < 0) {
       KL_ERROR(std::strerror(errno));
-      ::exit(1);
+      return 1;
     }
     defer([fd] { ::close(fd); });
     kl::logging::Logger::SetDefaultLogger(kl::logging::Logger(
@@ -844,12 +970,32 @@ int main(int argc, char *argv[]) {
           (void)nwrite;
         }));
   }
+  if (nat_addrs.empty()) {
+    nat_addrs.push_back(inet_addr(host.c_str()));
+  }
+  // SIGINT and SIGTERM stop the proxy so main returns and the ports and
+  // rules are released. They're blocked in every thread and taken by one.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  ::pthread_sigmask(SIG_BLOCK, &signals, nullptr);
   Proxy proxy(ifname.c_str(), host.c_str(), port, port_min, port_max,
-              passwd.c_str(), passwd.size());
+              passwd.c_str(), passwd.size(), stat_interval, sniffer_workers,
+              tcp_timeout, udp_timeout, nat_addrs, peer_workers);
+  std::thread waiter([&proxy, signals] {
+    int signo;
+    if (::sigwait(&signals, &signo) == 0) {
+      proxy.Stop();
+    }
+  });
   auto run = proxy.Run();
+  // Lets the waiter go if no signal came
+  ::pthread_kill(waiter.native_handle(), SIGTERM);
+  waiter.join();
   if (!run) {
     KL_ERROR(run.Err().ToCString());
-    ::exit(1);
+    return 1;
   }
   return 0;
 }
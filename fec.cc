@@ -0,0 +1,420 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <utility>
+
+#include "kale/fec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KALE_FEC_SSSE3 1
+#endif
+
+namespace kale {
+namespace fec {
+
+namespace {
+
+// GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1
+struct Tables {
+  uint8_t exp[512];
+  uint8_t log[256];
+
+  Tables() {
+    unsigned x = 1;
+    for (int i = 0; i < 255; ++i) {
+      exp[i] = x;
+      log[x] = i;
+      x <<= 1;
+      if (x & 0x100) {
+        x ^= 0x11d;
+      }
+    }
+    for (int i = 255; i < 512; ++i) {
+      exp[i] = exp[i - 255];
+    }
+    log[0] = 0;
+  }
+};
+
+const Tables &GF() {
+  static const Tables tables;
+  return tables;
+}
+
+void WriteHeader(uint8_t *buffer, uint8_t index, uint8_t data_count,
+                 uint8_t parity_count, uint32_t group) {
+  buffer[0] = kMagic;
+  buffer[1] = index;
+  buffer[2] = data_count;
+  buffer[3] = parity_count;
+  buffer[4] = group >> 24;
+  buffer[5] = group >> 16;
+  buffer[6] = group >> 8;
+  buffer[7] = group;
+}
+
+// Data shards are protected with their length, so rebuilt ones can be cut
+// out of the zero padding.
+void AddShard(std::vector<uint8_t> *parity, const uint8_t *payload,
+              size_t len, uint8_t c) {
+  if (parity->size() < len + 2) {
+    parity->resize(len + 2, 0);
+  }
+  uint8_t length[2] = {static_cast<uint8_t>(len >> 8),
+                       static_cast<uint8_t>(len)};
+  MulAddRegion(parity->data(), length, c, 2);
+  MulAddRegion(parity->data() + 2, payload, c, len);
+}
+
+#ifdef KALE_FEC_SSSE3
+// Looks up the products of the low and high nibbles of 16 bytes at once.
+// RETURNS: number of bytes done, a multiple of 16
+__attribute__((target("ssse3"))) size_t MulAddSSSE3(uint8_t *dst,
+                                                     const uint8_t *src,
+                                                     const uint8_t *low,
+                                                     const uint8_t *high,
+                                                     size_t len) {
+  const __m128i low_table =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(low));
+  const __m128i high_table =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(high));
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+    __m128i lo = _mm_shuffle_epi8(low_table, _mm_and_si128(s, mask));
+    __m128i hi = _mm_shuffle_epi8(high_table,
+                                  _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+    d = _mm_xor_si128(d, _mm_xor_si128(lo, hi));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), d);
+  }
+  return i;
+}
+
+bool HasSSSE3() {
+  static const bool has = __builtin_cpu_supports("ssse3");
+  return has;
+}
+#endif
+
+}  // namespace
+
+void XorRegion(uint8_t *dst, const uint8_t *src, size_t len) {
+  size_t i = 0;
+  // Word at a time, which the compiler widens to vectors
+  for (; i + 8 <= len; i += 8) {
+    uint64_t a, b;
+    std::memcpy(&a, dst + i, 8);
+    std::memcpy(&b, src + i, 8);
+    a ^= b;
+    std::memcpy(dst + i, &a, 8);
+  }
+  for (; i < len; ++i) {
+    dst[i] ^= src[i];
+  }
+}
+
+uint8_t Mul(uint8_t a, uint8_t b) {
+  if (a == 0 || b == 0) {
+    return 0;
+  }
+  const Tables &gf = GF();
+  return gf.exp[gf.log[a] + gf.log[b]];
+}
+
+uint8_t Inverse(uint8_t a) {
+  assert(a != 0);
+  const Tables &gf = GF();
+  return gf.exp[255 - gf.log[a]];
+}
+
+void MulAddRegion(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  if (c == 0) {
+    return;
+  }
+  if (c == 1) {
+    XorRegion(dst, src, len);
+    return;
+  }
+  size_t i = 0;
+#ifdef KALE_FEC_SSSE3
+  if (len >= 16 && HasSSSE3()) {
+    uint8_t low[16], high[16];
+    for (int n = 0; n < 16; ++n) {
+      low[n] = Mul(c, n);
+      high[n] = Mul(c, n << 4);
+    }
+    i = MulAddSSSE3(dst, src, low, high, len);
+  }
+#endif
+  const Tables &gf = GF();
+  unsigned log_c = gf.log[c];
+  for (; i < len; ++i) {
+    if (src[i]) {
+      dst[i] ^= gf.exp[log_c + gf.log[src[i]]];
+    }
+  }
+}
+
+// Cauchy matrix 1 / (x_parity + y_data) with x_parity = parity and
+// y_data = kMaxShards + data, every column divided by its first entry.
+// Every square submatrix of it stays invertible.
+uint8_t Coefficient(size_t parity, size_t data) {
+  assert(parity < kMaxShards && data < kMaxShards);
+  uint8_t y = kMaxShards + data;
+  return Mul(Inverse(parity ^ y), y);
+}
+
+bool IsProtected(const uint8_t *datagram, size_t len) {
+  return len >= kHeaderSize && datagram[0] == kMagic;
+}
+
+Encoder::Encoder(size_t k, size_t m)
+    : k_(k),
+      m_(m),
+      group_(0),
+      count_(0),
+      pending_(0),
+      finished_count_(0),
+      parity_(m),
+      finished_(m),
+      shard_size_(0),
+      finished_size_(0) {
+  assert(k >= 1 && k <= kMaxShards);
+  assert(m >= 1 && m <= kMaxShards);
+}
+
+kl::Result<size_t> Encoder::Protect(uint8_t *buffer, size_t len,
+                                    size_t capacity) {
+  if (len > kMaxPayload || len + kOverhead > capacity) {
+    return kl::Err("no room to protect datagram of length %u",
+                   static_cast<unsigned>(len));
+  }
+  ::memmove(buffer + kHeaderSize, buffer, len);
+  WriteHeader(buffer, count_, 0, m_, group_);
+  for (size_t j = 0; j < m_; ++j) {
+    AddShard(&parity_[j], buffer + kHeaderSize, len, Coefficient(j, count_));
+  }
+  if (len + 2 > shard_size_) {
+    shard_size_ = len + 2;
+  }
+  if (++count_ == k_) {
+    Finish();
+  }
+  return kl::Ok(len + kHeaderSize);
+}
+
+void Encoder::Flush() {
+  if (count_ > 0) {
+    Finish();
+  }
+}
+
+void Encoder::Finish() {
+  parity_.swap(finished_);
+  for (auto &parity : parity_) {
+    parity.clear();
+  }
+  finished_count_ = count_;
+  finished_size_ = shard_size_;
+  pending_ = m_;
+  ++group_;
+  count_ = 0;
+  shard_size_ = 0;
+}
+
+size_t Encoder::ParitySize() const { return kHeaderSize + finished_size_; }
+
+kl::Result<size_t> Encoder::NextParity(uint8_t *buffer, size_t capacity) {
+  assert(pending_ > 0);
+  if (ParitySize() > capacity) {
+    pending_ = 0;
+    return kl::Err("no room for parity of length %u",
+                   static_cast<unsigned>(ParitySize()));
+  }
+  size_t j = m_ - pending_;
+  --pending_;
+  WriteHeader(buffer, finished_count_ + j, finished_count_, m_, group_ - 1);
+  const std::vector<uint8_t> &parity = finished_[j];
+  assert(parity.size() == finished_size_);
+  std::memcpy(buffer + kHeaderSize, parity.data(), finished_size_);
+  return kl::Ok(ParitySize());
+}
+
+Decoder::Decoder(size_t window) : groups_(window), recovered_total_(0) {
+  assert(window > 0);
+  for (auto &group : groups_) {
+    group.live = false;
+    group.have.assign(2 * kMaxShards, false);
+    group.shards.resize(2 * kMaxShards);
+  }
+}
+
+kl::Result<uint8_t *> Decoder::Accept(uint8_t *datagram, size_t len,
+                                      size_t *payload_len) {
+  recovered_.clear();
+  if (!IsProtected(datagram, len)) {
+    return kl::Err("not a protected datagram");
+  }
+  size_t index = datagram[1], data_count = datagram[2],
+         parity_count = datagram[3];
+  uint32_t id = (static_cast<uint32_t>(datagram[4]) << 24) |
+                (static_cast<uint32_t>(datagram[5]) << 16) |
+                (static_cast<uint32_t>(datagram[6]) << 8) | datagram[7];
+  uint8_t *payload = datagram + kHeaderSize;
+  size_t size = len - kHeaderSize;
+  bool is_data = data_count == 0;
+  if (parity_count == 0 || parity_count > kMaxShards ||
+      data_count > kMaxShards ||
+      (is_data ? index >= kMaxShards
+               : index < data_count || index >= data_count + parity_count ||
+                     size < 2)) {
+    return kl::Err("bad header, index %u, data %u, parity %u",
+                   static_cast<unsigned>(index),
+                   static_cast<unsigned>(data_count),
+                   static_cast<unsigned>(parity_count));
+  }
+  *payload_len = size;
+  uint8_t *none = nullptr;
+  Group &group = groups_[id % groups_.size()];
+  if (!group.live || group.id != id) {
+    if (group.live && static_cast<int32_t>(id - group.id) < 0) {
+      // Too late to be rebuilt from, still worth handing out
+      return kl::Ok(is_data ? payload : none);
+    }
+    group.id = id;
+    group.live = true;
+    group.data_count = 0;
+    group.parity_count = parity_count;
+    group.done = false;
+    group.have.assign(group.have.size(), false);
+    group.parity_size = 0;
+  }
+  if (is_data) {
+    if (group.have[index]) {
+      return kl::Ok(none);
+    }
+    std::vector<uint8_t> &shard = group.shards[index];
+    shard.resize(size + 2);
+    shard[0] = size >> 8;
+    shard[1] = size;
+    std::memcpy(shard.data() + 2, payload, size);
+    group.have[index] = true;
+  } else {
+    if (group.data_count == 0) {
+      group.data_count = data_count;
+      group.parity_size = size;
+    } else if (group.data_count != data_count || group.parity_size != size) {
+      return kl::Err("parity of group %u doesn't match", id);
+    }
+    size_t slot = kMaxShards + index - data_count;
+    if (group.have[slot]) {
+      return kl::Ok(none);
+    }
+    group.shards[slot].assign(payload, payload + size);
+    group.have[slot] = true;
+    payload = nullptr;
+  }
+  if (!group.done && group.data_count > 0) {
+    Rebuild(&group);
+  }
+  return kl::Ok(payload);
+}
+
+// Solves for the missing data shards D_E from e parity shards P:
+// P_r - sum C[r][i] D_i over the data received = sum C[r][c] D_c over E.
+void Decoder::Rebuild(Group *group) {
+  std::vector<size_t> missing, parities;
+  for (size_t i = 0; i < group->data_count; ++i) {
+    if (!group->have[i]) {
+      missing.push_back(i);
+    }
+  }
+  if (missing.empty()) {
+    group->done = true;
+    return;
+  }
+  for (size_t j = 0; j < group->parity_count; ++j) {
+    if (group->have[kMaxShards + j] && parities.size() < missing.size()) {
+      parities.push_back(j);
+    }
+  }
+  if (parities.size() < missing.size()) {
+    return;
+  }
+  const size_t e = missing.size(), size = group->parity_size;
+  // Gauss-Jordan on [A | I]
+  matrix_.assign(e * e, 0);
+  inverse_.assign(e * e, 0);
+  for (size_t r = 0; r < e; ++r) {
+    for (size_t c = 0; c < e; ++c) {
+      matrix_[r * e + c] = Coefficient(parities[r], missing[c]);
+    }
+    inverse_[r * e + r] = 1;
+  }
+  for (size_t c = 0; c < e; ++c) {
+    size_t pivot = c;
+    while (pivot < e && matrix_[pivot * e + c] == 0) {
+      ++pivot;
+    }
+    if (pivot == e) {
+      return;
+    }
+    for (size_t n = 0; n < e; ++n) {
+      std::swap(matrix_[c * e + n], matrix_[pivot * e + n]);
+      std::swap(inverse_[c * e + n], inverse_[pivot * e + n]);
+    }
+    uint8_t scale = Inverse(matrix_[c * e + c]);
+    for (size_t n = 0; n < e; ++n) {
+      matrix_[c * e + n] = Mul(matrix_[c * e + n], scale);
+      inverse_[c * e + n] = Mul(inverse_[c * e + n], scale);
+    }
+    for (size_t r = 0; r < e; ++r) {
+      uint8_t factor = matrix_[r * e + c];
+      if (r == c || factor == 0) {
+        continue;
+      }
+      for (size_t n = 0; n < e; ++n) {
+        matrix_[r * e + n] ^= Mul(factor, matrix_[c * e + n]);
+        inverse_[r * e + n] ^= Mul(factor, inverse_[c * e + n]);
+      }
+    }
+  }
+  // Parity shards become P_r less the data received, in place
+  for (size_t r = 0; r < e; ++r) {
+    std::vector<uint8_t> &parity = group->shards[kMaxShards + parities[r]];
+    for (size_t i = 0; i < group->data_count; ++i) {
+      if (!group->have[i]) {
+        continue;
+      }
+      const std::vector<uint8_t> &data = group->shards[i];
+      MulAddRegion(parity.data(), data.data(), Coefficient(parities[r], i),
+                   std::min(data.size(), size));
+    }
+  }
+  for (size_t c = 0; c < e; ++c) {
+    std::vector<uint8_t> &shard = group->shards[missing[c]];
+    shard.assign(size, 0);
+    for (size_t r = 0; r < e; ++r) {
+      MulAddRegion(shard.data(), group->shards[kMaxShards + parities[r]].data(),
+                   inverse_[c * e + r], size);
+    }
+    group->have[missing[c]] = true;
+    size_t len = (static_cast<size_t>(shard[0]) << 8) | shard[1];
+    if (len + 2 > size) {
+      continue;
+    }
+    recovered_.push_back(std::make_pair(shard.data() + 2, len));
+    ++recovered_total_;
+  }
+  group->done = true;
+}
+
+}  // namespace fec
+}  // namespace kale
@@ -0,0 +1,293 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+
+#include "kale/gso.h"
+#include "kale/ipv4.h"
+#include "kale/ipv4_tcp.h"
+
+namespace kale {
+namespace gso {
+
+namespace {
+
+using ipv4::tcp::TCPRep;
+
+// Header lengths of a well formed, unfragmented TCP/IPv4 packet.
+bool ParseTCP(const uint8_t *packet, size_t len, size_t *ip_hlen,
+              size_t *tcp_hlen) {
+  if (len < offsetof(ipv4::Rep, data)) {
+    return false;
+  }
+  const ipv4::Rep *ip = reinterpret_cast<const ipv4::Rep *>(packet);
+  ipv4::PacketRef ref(packet, len);
+  if (ip->version != 4 || !ref.IsTCP() || ntohs(ip->total_length) != len) {
+    return false;
+  }
+  if (ip->fragment_offset_high || ip->fragment_offset_low ||
+      (ip->flags & 0x1)) {
+    return false;
+  }
+  *ip_hlen = ref.HeaderLength();
+  if (*ip_hlen < offsetof(ipv4::Rep, data) ||
+      len < *ip_hlen + offsetof(TCPRep, data)) {
+    return false;
+  }
+  const TCPRep *tcp = reinterpret_cast<const TCPRep *>(packet + *ip_hlen);
+  *tcp_hlen = tcp->data_offset << 2;
+  return *tcp_hlen >= offsetof(TCPRep, data) && *ip_hlen + *tcp_hlen <= len;
+}
+
+uint32_t PseudoHeaderSum(const ipv4::Rep *ip, size_t segment_len) {
+  uint32_t sum = 0;
+  sum += ipv4::InternetChecksum(
+      reinterpret_cast<const uint8_t *>(&ip->source_addr),
+      sizeof(ip->source_addr));
+  sum += ipv4::InternetChecksum(
+      reinterpret_cast<const uint8_t *>(&ip->dest_addr),
+      sizeof(ip->dest_addr));
+  sum += htons(static_cast<uint16_t>(ip->protocol));
+  sum += htons(static_cast<uint16_t>(segment_len));
+  return sum;
+}
+
+// With kNeedsChecksum the kernel leaves the pseudo header sum in
+// the checksum field, summing from csum_start on finishes it.
+kl::Result<void> CompleteChecksum(const VirtioNetHdr &hdr,
+                                  uint8_t *packet, size_t len) {
+  if (!(hdr.flags & kNeedsChecksum)) {
+    return kl::Ok();
+  }
+  size_t start = hdr.csum_start, offset = start + hdr.csum_offset;
+  if (offset + sizeof(uint16_t) > len) {
+    return kl::Err("partial checksum at %zu out of packet of %zu bytes",
+                   offset, len);
+  }
+  uint16_t checksum = static_cast<uint16_t>(~ipv4::ChecksumCarry(
+      ipv4::InternetChecksum(packet + start, len - start)));
+  ipv4::PacketRef ref(packet, len);
+  // Zero means no checksum for UDP
+  if (ref.IsUDP() && checksum == 0) {
+    checksum = 0xffff;
+  }
+  ::memcpy(packet + offset, &checksum, sizeof(checksum));
+  return kl::Ok();
+}
+
+bool IsTCPv4(const VirtioNetHdr &hdr) {
+  return (hdr.gso_type & ~kGSOECN) == kGSOTCPv4;
+}
+
+// Only pure ACKs carrying data, with or without PSH, are merged.
+bool PlainData(const TCPRep *tcp) {
+  return tcp->ack && !tcp->syn && !tcp->fin && !tcp->rst && !tcp->urg;
+}
+
+}  // namespace
+
+void ParseFrame(const uint8_t *frame, size_t len, VirtioNetHdr *hdr,
+                const uint8_t **packet, size_t *packet_len) {
+  assert(len >= kVirtioNetHdrSize);
+  ::memcpy(hdr, frame, kVirtioNetHdrSize);
+  *packet = frame + kVirtioNetHdrSize;
+  *packet_len = len - kVirtioNetHdrSize;
+}
+
+size_t SegmentCount(const VirtioNetHdr &hdr, const uint8_t *packet,
+                    size_t len) {
+  if (hdr.gso_type == kGSONone) {
+    return 1;
+  }
+  size_t ip_hlen, tcp_hlen;
+  if (!IsTCPv4(hdr) || hdr.gso_size == 0 ||
+      !ParseTCP(packet, len, &ip_hlen, &tcp_hlen)) {
+    return 0;
+  }
+  size_t payload = len - ip_hlen - tcp_hlen;
+  if (payload == 0) {
+    return 1;
+  }
+  return (payload + hdr.gso_size - 1) / hdr.gso_size;
+}
+
+kl::Result<size_t> BuildSegment(const VirtioNetHdr &hdr,
+                                const uint8_t *packet, size_t len,
+                                size_t index, uint8_t *out, size_t capacity) {
+  if (hdr.gso_type == kGSONone) {
+    assert(index == 0);
+    if (len > capacity) {
+      return kl::Err(ENOBUFS,
+                     "packet of %zu bytes exceeds buffer of %zu bytes", len,
+                     capacity);
+    }
+    ::memcpy(out, packet, len);
+    auto complete = CompleteChecksum(hdr, out, len);
+    if (!complete) {
+      return kl::Err(complete.MoveErr());
+    }
+    return kl::Ok(len);
+  }
+  size_t ip_hlen, tcp_hlen;
+  if (!IsTCPv4(hdr) || !ParseTCP(packet, len, &ip_hlen, &tcp_hlen)) {
+    return kl::Err(EINVAL, "unsupported gso type %u", hdr.gso_type);
+  }
+  size_t header_len = ip_hlen + tcp_hlen;
+  size_t payload = len - header_len;
+  size_t offset = index * hdr.gso_size;
+  assert(offset < payload || (offset == 0 && payload == 0));
+  size_t segment_payload = std::min<size_t>(hdr.gso_size, payload - offset);
+  bool last = offset + segment_payload == payload;
+  size_t segment_len = header_len + segment_payload;
+  if (segment_len > capacity) {
+    return kl::Err(ENOBUFS,
+                   "segment of %zu bytes exceeds buffer of %zu bytes",
+                   segment_len, capacity);
+  }
+  ::memcpy(out, packet, header_len);
+  ::memcpy(out + header_len, packet + header_len + offset, segment_payload);
+  ipv4::Rep *ip = reinterpret_cast<ipv4::Rep *>(out);
+  ip->total_length = htons(static_cast<uint16_t>(segment_len));
+  ip->identification =
+      htons(static_cast<uint16_t>(ntohs(ip->identification) + index));
+  TCPRep *tcp = reinterpret_cast<TCPRep *>(out + ip_hlen);
+  tcp->sequence_number = htonl(ntohl(tcp->sequence_number) + offset);
+  if (index > 0) {
+    tcp->cwr = 0;
+  }
+  if (!last) {
+    tcp->fin = 0;
+    tcp->psh = 0;
+  }
+  ipv4::PacketEditor editor(out, segment_len);
+  editor.FillChecksum();
+  ipv4::tcp::TCPSegmentEditor tcp_editor(editor.ref(), out + ip_hlen,
+                                         segment_len - ip_hlen);
+  tcp_editor.FillChecksum();
+  return kl::Ok(segment_len);
+}
+
+TCPCoalescer::TCPCoalescer(size_t capacity)
+    : capacity_(capacity),
+      count_(0),
+      len_(0),
+      segment_size_(0),
+      closed_(false),
+      buffer_(kVirtioNetHdrSize + capacity) {
+  assert(capacity <= kMaxPacketSize);
+}
+
+bool TCPCoalescer::Mergeable(const uint8_t *packet, size_t len) const {
+  size_t ip_hlen, tcp_hlen;
+  if (closed_ || !ParseTCP(packet, len, &ip_hlen, &tcp_hlen)) {
+    return false;
+  }
+  const uint8_t *pending = buffer_.data() + kVirtioNetHdrSize;
+  const ipv4::Rep *pending_ip = reinterpret_cast<const ipv4::Rep *>(pending);
+  const ipv4::Rep *ip = reinterpret_cast<const ipv4::Rep *>(packet);
+  size_t pending_ip_hlen = ipv4::PacketRef(pending, len_).HeaderLength();
+  const TCPRep *pending_tcp =
+      reinterpret_cast<const TCPRep *>(pending + pending_ip_hlen);
+  const TCPRep *tcp = reinterpret_cast<const TCPRep *>(packet + ip_hlen);
+  size_t payload = len - ip_hlen - tcp_hlen;
+  size_t pending_payload =
+      len_ - pending_ip_hlen - (pending_tcp->data_offset << 2);
+  if (ip_hlen != pending_ip_hlen ||
+      tcp_hlen != static_cast<size_t>(pending_tcp->data_offset << 2)) {
+    return false;
+  }
+  if (ip->source_addr != pending_ip->source_addr ||
+      ip->dest_addr != pending_ip->dest_addr || ip->ttl != pending_ip->ttl ||
+      ip->dscp != pending_ip->dscp || ip->ecn != pending_ip->ecn ||
+      ip->flags != pending_ip->flags) {
+    return false;
+  }
+  if (tcp->source_port != pending_tcp->source_port ||
+      tcp->dest_port != pending_tcp->dest_port ||
+      tcp->ack_number != pending_tcp->ack_number ||
+      tcp->window_size != pending_tcp->window_size || !PlainData(tcp) ||
+      tcp->cwr || tcp->ece != pending_tcp->ece) {
+    return false;
+  }
+  // Options, e.g. timestamps, must be the same for the kernel to resegment
+  if (::memcmp(&tcp->data, &pending_tcp->data,
+               tcp_hlen - offsetof(TCPRep, data)) != 0) {
+    return false;
+  }
+  return payload > 0 && payload <= segment_size_ &&
+         ntohl(tcp->sequence_number) ==
+             ntohl(pending_tcp->sequence_number) + pending_payload &&
+         len_ + payload <= capacity_;
+}
+
+bool TCPCoalescer::Add(const uint8_t *packet, size_t len) {
+  uint8_t *pending = buffer_.data() + kVirtioNetHdrSize;
+  size_t ip_hlen, tcp_hlen;
+  if (count_ == 0) {
+    assert(len <= capacity_);
+    ::memcpy(pending, packet, len);
+    count_ = 1;
+    len_ = len;
+    closed_ = true;
+    if (ParseTCP(packet, len, &ip_hlen, &tcp_hlen)) {
+      const TCPRep *tcp = reinterpret_cast<const TCPRep *>(packet + ip_hlen);
+      segment_size_ = len - ip_hlen - tcp_hlen;
+      closed_ = !PlainData(tcp) || tcp->psh || segment_size_ == 0;
+    }
+    return true;
+  }
+  if (!Mergeable(packet, len)) {
+    return false;
+  }
+  ParseTCP(packet, len, &ip_hlen, &tcp_hlen);
+  const TCPRep *tcp = reinterpret_cast<const TCPRep *>(packet + ip_hlen);
+  size_t payload = len - ip_hlen - tcp_hlen;
+  ::memcpy(pending + len_, packet + ip_hlen + tcp_hlen, payload);
+  len_ += payload;
+  ++count_;
+  // A short segment or PSH ends the run
+  if (tcp->psh) {
+    reinterpret_cast<TCPRep *>(pending + ip_hlen)->psh = 1;
+    closed_ = true;
+  }
+  if (payload < segment_size_) {
+    closed_ = true;
+  }
+  return true;
+}
+
+size_t TCPCoalescer::Flush() {
+  assert(count_ > 0);
+  uint8_t *pending = buffer_.data() + kVirtioNetHdrSize;
+  VirtioNetHdr hdr;
+  ::memset(&hdr, 0, sizeof(hdr));
+  if (count_ > 1) {
+    size_t ip_hlen = ipv4::PacketRef(pending, len_).HeaderLength();
+    ipv4::Rep *ip = reinterpret_cast<ipv4::Rep *>(pending);
+    TCPRep *tcp = reinterpret_cast<TCPRep *>(pending + ip_hlen);
+    ip->total_length = htons(static_cast<uint16_t>(len_));
+    ipv4::PacketEditor(pending, len_).FillChecksum();
+    // Leave the TCP checksum partial, the kernel finishes it per segment.
+    tcp->checksum =
+        ipv4::ChecksumCarry(PseudoHeaderSum(ip, len_ - ip_hlen));
+    hdr.flags = kNeedsChecksum;
+    hdr.csum_start = ip_hlen;
+    hdr.csum_offset = offsetof(TCPRep, checksum);
+    hdr.gso_type = kGSOTCPv4;
+    hdr.gso_size = segment_size_;
+    hdr.hdr_len = ip_hlen + (tcp->data_offset << 2);
+  }
+  ::memcpy(buffer_.data(), &hdr, sizeof(hdr));
+  count_ = 0;
+  closed_ = false;
+  return kVirtioNetHdrSize + len_;
+}
+
+}  // namespace gso
+}  // namespace kale
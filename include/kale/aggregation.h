@@ -0,0 +1,87 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// Several IP packets carried by one datagram, put back to back before the
+// datagram is encoded. Each packet is delimited by its own IPv4 total
+// length, so there is no framing overhead and a datagram of one packet is
+// the same as without aggregation.
+
+#ifndef KALE_AGGREGATION_H_
+#define KALE_AGGREGATION_H_
+#include <cstddef>
+#include <cstdint>
+
+#include "kl/error.h"
+
+namespace kale {
+namespace aggregation {
+
+// Length of the IPv4 packet at the start of @data.
+// RETURNS: 0 if the first @len bytes don't hold a whole packet.
+size_t PacketLength(const uint8_t *data, size_t len);
+
+// Calls @on_packet(uint8_t *packet, size_t len) for every packet of the
+// decoded @datagram, in order.
+// RETURNS: number of packets, an error if bytes are left which don't form
+// a packet. Packets before them have been handled.
+template <typename OnPacket>
+kl::Result<size_t> Split(uint8_t *datagram, size_t len, OnPacket on_packet) {
+  size_t count = 0, offset = 0;
+  while (offset < len) {
+    size_t packet_len = PacketLength(datagram + offset, len - offset);
+    if (packet_len == 0) {
+      return kl::Err("bad packet at offset %u of datagram of length %u",
+                     static_cast<unsigned>(offset),
+                     static_cast<unsigned>(len));
+    }
+    on_packet(datagram + offset, packet_len);
+    offset += packet_len;
+    ++count;
+  }
+  return kl::Ok(count);
+}
+
+// Packs packets into a datagram buffer as they are read, e.g. from tun,
+// right where they belong. Not thread safe.
+class Aggregator {
+public:
+  // @limit: most bytes of packets in one datagram, e.g. the path MTU less
+  // the IP and UDP headers and the coding overhead.
+  explicit Aggregator(size_t limit)
+      : limit_(limit), buffer_(nullptr), used_(0), count_(0) {}
+
+  // Begins a new datagram at @buffer.
+  void Start(uint8_t *buffer) {
+    buffer_ = buffer;
+    used_ = 0;
+    count_ = 0;
+  }
+  // Drops the datagram, e.g. once it's been sent.
+  void Clear() { Start(nullptr); }
+  // Keeps the packets added so far, moving them to @buffer.
+  void MoveTo(uint8_t *buffer);
+
+  // Where the next packet is to be written.
+  uint8_t *Tail() const { return buffer_ + used_; }
+  // Takes the @len bytes written at Tail() as the next packet.
+  // RETURNS: false if they would take the datagram past the limit, they are
+  // left out then. The first packet of a datagram is taken whatever its
+  // length.
+  bool Add(size_t len);
+
+  uint8_t *Buffer() const { return buffer_; }
+  size_t Used() const { return used_; }
+  size_t Count() const { return count_; }
+  bool Empty() const { return count_ == 0; }
+  size_t Limit() const { return limit_; }
+
+private:
+  size_t limit_;
+  uint8_t *buffer_;
+  size_t used_, count_;
+};
+
+}  // namespace aggregation
+}  // namespace kale
+#endif
@@ -16,6 +16,8 @@ public:
   Cipher(const uint8_t *key, size_t len);
   std::vector<uint8_t> Encrypt(const uint8_t *buffer, size_t len);
   std::vector<uint8_t> Decrypt(const uint8_t *buffer, size_t len);
+  void EncryptInPlace(uint8_t *buffer, size_t len);
+  void DecryptInPlace(uint8_t *buffer, size_t len);
 
 private:
   uint8_t state_[256];
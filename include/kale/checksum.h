@@ -0,0 +1,37 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// One's complement sum used by IPv4/TCP/UDP checksums, with SIMD kernels
+// selected at runtime.
+#ifndef KALE_CHECKSUM_H_
+#define KALE_CHECKSUM_H_
+#include <cstddef>
+#include <cstdint>
+
+namespace kale {
+namespace checksum {
+
+enum Kernel {
+  kScalar,
+  kSSE2,
+  kAVX2,
+};
+
+// @return: true if @kernel can run on this cpu.
+bool Supports(Kernel kernel);
+// Best kernel supported by this cpu, picked once on first use.
+Kernel ActiveKernel();
+const char *KernelName(Kernel kernel);
+
+// Sum of @buffer as 16-bit words in memory order, folded to 16 bits. An odd
+// trailing byte is padded with zero. @buffer needn't be aligned.
+// The result is never greater than 0xffff, so callers can keep adding such
+// sums into a uint32_t and finish with ipv4::ChecksumCarry.
+uint32_t Sum(const uint8_t *buffer, size_t len);
+// REQUIRES: Supports(kernel)
+uint32_t Sum(Kernel kernel, const uint8_t *buffer, size_t len);
+
+}  // namespace checksum
+}  // namespace kale
+#endif  // KALE_CHECKSUM_H_
@@ -21,6 +21,21 @@ struct Coding {
       Decode;
 };
 
+// Transforms the @len bytes at @buffer in place, @capacity is the size of the
+// writable region starting at @buffer.
+// RETURNS: length of the result
+using InplaceTransform = std::function<kl::Result<size_t>(
+    uint8_t *buffer, size_t len, size_t capacity)>;
+
+// Allocation-free counterpart of Coding.
+struct InplaceCoding {
+  // Encode never grows its input by more than this many bytes, callers leave
+  // room for it in @capacity.
+  size_t max_overhead;
+  InplaceTransform Encode;
+  InplaceTransform Decode;
+};
+
 }  // namespace kale
 
 #endif
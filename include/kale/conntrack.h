@@ -0,0 +1,73 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// TCP connection tracking of NAT mappings, enough to give ports of closed
+// connections back early. Only flags are looked at, sequence numbers aren't
+// checked.
+
+#ifndef KALE_CONNTRACK_H_
+#define KALE_CONNTRACK_H_
+#include <cstdint>
+
+#include "kale/ipv4.h"
+#include "kale/ipv4_tcp.h"
+#include "kale/nat.h"
+
+namespace kale {
+namespace conntrack {
+
+enum State : uint8_t {
+  // Nothing seen yet
+  kNone = 0,
+  kSynSent,
+  kSynReceived,
+  kEstablished,
+  // FIN seen from the subnet side only, or from the inet side only
+  kFinWait,
+  kCloseWait,
+  // FIN seen both ways
+  kTimeWait,
+  // RST seen
+  kClosed,
+};
+
+enum Direction {
+  // From the subnet host to inet
+  kOriginal,
+  kReply,
+};
+
+// Idle timeouts of each state, in NAT ticks.
+struct Timeouts {
+  uint32_t syn_sent;
+  uint32_t syn_received;
+  uint32_t established;
+  uint32_t closing;
+  uint32_t time_wait;
+  uint32_t closed;
+};
+// In ticks of a second: closing connections keep their port for 2 minutes,
+// closed ones for 30 seconds after FINs and 10 after a RST.
+Timeouts DefaultTimeouts(uint32_t established);
+
+const char *StateName(State state);
+bool IsClosing(State state);
+bool IsClosed(State state);
+uint32_t Timeout(const Timeouts &timeouts, State state);
+
+// State after @segment went through a connection in @state. A connection
+// picked up in the middle, e.g. after a restart, is taken as established.
+State Next(State state, Direction direction,
+           const ipv4::SegmentRef<ipv4::tcp::TCPRep> &segment);
+
+// Feeds @segment to the mapping at @local of @nat and updates its timeout
+// when the state changes.
+// RETURNS: the new state, kNone if @local isn't mapped.
+State Track(Nat *nat, const Endpoint &local, Direction direction,
+            const ipv4::SegmentRef<ipv4::tcp::TCPRep> &segment,
+            const Timeouts &timeouts);
+
+}  // namespace conntrack
+}  // namespace kale
+#endif
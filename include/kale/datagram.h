@@ -0,0 +1,75 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// Batched datagram I/O over recvmmsg/sendmmsg.
+
+#ifndef KALE_DATAGRAM_H_
+#define KALE_DATAGRAM_H_
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "kl/error.h"
+
+namespace kale {
+
+// A fixed set of datagram slots, each with its own buffer, iovec and peer
+// address, all allocated up front. A batch is either being filled by Recv or
+// by Commit/Add for Send, not both at once.
+class DatagramBatch {
+public:
+  // @buffer_size can be 0 for a batch only fed by Add.
+  // REQUIRES: size >= 1
+  DatagramBatch(size_t size, size_t buffer_size);
+  size_t Capacity() const { return headers_.size(); }
+  size_t BufferSize() const { return buffer_size_; }
+  // Number of datagrams held
+  size_t Count() const { return count_; }
+  bool Full() const { return count_ == headers_.size(); }
+  void Clear() { count_ = 0; }
+
+  // Receives up to Capacity() datagrams from @fd in one syscall, replacing
+  // the contents of the batch. Blocks for the first datagram only if @fd is
+  // blocking.
+  // RETURNS: number of datagrams received, 0 if none is pending.
+  kl::Result<size_t> Recv(int fd);
+  // REQUIRES: i < Count()
+  uint8_t *Data(size_t i) {
+    return reinterpret_cast<uint8_t *>(iovecs_[i].iov_base);
+  }
+  size_t Length(size_t i) const { return headers_[i].msg_len; }
+  // Set if the datagram didn't fit into BufferSize()
+  bool Truncated(size_t i) const {
+    return headers_[i].msg_hdr.msg_flags & MSG_TRUNC;
+  }
+  const struct sockaddr_in &Addr(size_t i) const { return addrs_[i]; }
+
+  // Owned buffer of the next slot, fill at most BufferSize() bytes and
+  // Commit.
+  // REQUIRES: !Full()
+  uint8_t *NextBuffer();
+  void Commit(size_t len, const struct sockaddr_in &addr);
+  // Queues caller-owned memory, which must stay valid until Send.
+  // REQUIRES: !Full()
+  void Add(const uint8_t *data, size_t len, const struct sockaddr_in &addr);
+  // Sends all queued datagrams with as few syscalls as possible and empties
+  // the batch. Datagrams that can't be sent without blocking are dropped.
+  // RETURNS: number of datagrams sent. If some datagram failed for another
+  // reason the rest are still tried and the last error is returned.
+  kl::Result<size_t> Send(int fd);
+
+private:
+  void SetSlot(size_t i, void *data, size_t len);
+  size_t buffer_size_;
+  size_t count_;
+  std::vector<uint8_t> buffers_;
+  std::vector<struct iovec> iovecs_;
+  std::vector<struct sockaddr_in> addrs_;
+  std::vector<struct mmsghdr> headers_;
+};
+
+}  // namespace kale
+#endif
@@ -9,6 +9,8 @@
 namespace kale {
 
 Coding DemoCoding(const uint8_t *key, size_t len);
+// Wire compatible with DemoCoding.
+InplaceCoding DemoInplaceCoding(const uint8_t *key, size_t len);
 
 }  // namespace kale
 
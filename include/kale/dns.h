@@ -0,0 +1,163 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// DNS messages read and written in place, refer to RFC 1035. Nothing is
+// copied or allocated: names and record data are offsets into the packet,
+// and every read is checked against its length. Compression pointers are
+// followed only backwards and names are at most 255 bytes, so a malformed
+// or hostile packet can't loop or read out of bounds.
+
+#ifndef KALE_DNS_H_
+#define KALE_DNS_H_
+#include <cstddef>
+#include <cstdint>
+
+#include "kl/error.h"
+
+namespace kale {
+namespace dns {
+
+const uint16_t kTypeA = 1;
+const uint16_t kTypeNS = 2;
+const uint16_t kTypeCNAME = 5;
+const uint16_t kTypeSOA = 6;
+const uint16_t kTypePTR = 12;
+const uint16_t kTypeMX = 15;
+const uint16_t kTypeTXT = 16;
+const uint16_t kTypeAAAA = 28;
+const uint16_t kTypeSRV = 33;
+const uint16_t kClassIN = 1;
+
+const size_t kHeaderSize = 12;
+// Of a name on the wire
+const size_t kMaxNameLength = 255;
+// Buffer for a name in dotted form, NUL included
+const size_t kMaxNameText = 256;
+// Of a query of one question
+const size_t kMaxQuerySize = kHeaderSize + kMaxNameLength + 4;
+
+const uint8_t kRcodeNoError = 0;
+const uint8_t kRcodeServFail = 2;
+const uint8_t kRcodeNXDomain = 3;
+
+enum Section {
+  kQuestion,
+  kAnswer,
+  kAuthority,
+  kAdditional,
+};
+
+inline uint16_t Load16(const uint8_t *p) {
+  return static_cast<uint16_t>(p[0] << 8 | p[1]);
+}
+
+inline uint32_t Load32(const uint8_t *p) {
+  return static_cast<uint32_t>(p[0]) << 24 |
+         static_cast<uint32_t>(p[1]) << 16 |
+         static_cast<uint32_t>(p[2]) << 8 | p[3];
+}
+
+inline void Store16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+inline void Store32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+// Steps over the name at @offset of @packet without following its pointer,
+// if it ends with one.
+// RETURNS: the offset right after it
+kl::Result<size_t> SkipName(const uint8_t *packet, size_t len, size_t offset);
+// Writes the name at @offset in dotted form to @buf, NUL terminated. The
+// root name is empty.
+// RETURNS: its length
+kl::Result<size_t> ReadName(const uint8_t *packet, size_t len, size_t offset,
+                            char *buf, size_t size);
+// Compares the name at @offset with dotted @name, case insensitive. A
+// trailing dot of @name is ignored.
+bool NameEquals(const uint8_t *packet, size_t len, size_t offset,
+                const char *name);
+// Writes dotted @name to @buf in wire format, uncompressed.
+// RETURNS: bytes written
+kl::Result<size_t> WriteName(const char *name, uint8_t *buf, size_t size);
+// Writes a recursive query of one question to @buf, kMaxQuerySize bytes
+// are always enough.
+// RETURNS: its length
+kl::Result<size_t> BuildQuery(const char *name, uint16_t id, uint16_t type,
+                              uint8_t *buf, size_t size);
+
+struct Question {
+  // Offset of the name
+  size_t name;
+  uint16_t type, cls;
+};
+
+struct Record {
+  Section section;
+  // Offset of the owner name
+  size_t name;
+  uint16_t type, cls;
+  uint32_t ttl;
+  // Offset and length of the data
+  size_t data;
+  uint16_t data_len;
+};
+
+// Walks the sections of a message in order.
+class Reader {
+public:
+  // @packet must outlive the reader.
+  Reader(const uint8_t *packet, size_t len);
+
+  // RETURNS: an error if @packet is shorter than a header
+  kl::Result<void> ReadHeader();
+  uint16_t Id() const { return id_; }
+  bool IsResponse() const { return flags_ & 0x8000; }
+  bool Truncated() const { return flags_ & 0x0200; }
+  uint8_t Rcode() const { return flags_ & 0x0f; }
+  uint16_t Count(Section section) const { return counts_[section]; }
+
+  // RETURNS: false once every question is read
+  kl::Result<bool> NextQuestion(Question *question);
+  // Answers, then authority and additional records. Questions not read
+  // yet are skipped.
+  // RETURNS: false once every record is read
+  kl::Result<bool> NextRecord(Record *record);
+
+  const uint8_t *Packet() const { return packet_; }
+  size_t Length() const { return len_; }
+  const uint8_t *Data(const Record &record) const {
+    return packet_ + record.data;
+  }
+
+private:
+  const uint8_t *packet_;
+  size_t len_;
+  // Of the next question or record
+  size_t offset_;
+  uint16_t id_, flags_;
+  uint16_t counts_[4];
+  // Section being read and its entries read
+  int section_;
+  uint16_t read_;
+};
+
+// Writes the address of an A or AAAA @record in text form to @buf.
+// RETURNS: its length
+kl::Result<size_t> FormatAddress(const Reader &reader, const Record &record,
+                                 char *buf, size_t size);
+// Offset of the name in the data of an NS, CNAME, PTR, MX, SRV or SOA
+// @record, the primary server of SOA.
+kl::Result<size_t> TargetName(const Reader &reader, const Record &record);
+// Minimum TTL of an SOA @record, which bounds negative answers.
+kl::Result<uint32_t> SOAMinimum(const Reader &reader, const Record &record);
+
+}  // namespace dns
+}  // namespace kale
+#endif
@@ -0,0 +1,85 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// Answers of DNS queries kept for their TTL, keyed by (name, type). Failed
+// and empty answers are kept too, for a TTL of their own. A popular entry
+// near its expiry asks to be refreshed while it's still answered from, so
+// names in use keep hitting.
+
+#ifndef KALE_DNS_CACHE_H_
+#define KALE_DNS_CACHE_H_
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "kale/lru.h"
+
+namespace kale {
+
+// Records of a response, e.g. addresses of A records. An answer with a
+// non-zero rcode or without records is negative.
+struct DNSAnswer {
+  DNSAnswer() : rcode(0), ttl(0) {}
+
+  uint8_t rcode;
+  // Least of the TTLs of the records, in seconds
+  uint32_t ttl;
+  std::vector<std::string> records;
+};
+
+// Not thread safe.
+class DNSCache {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // @capacity: most entries kept, the least recently used is evicted first.
+  // @negative_ttl: seconds a negative answer is kept.
+  // REQUIRES: capacity >= 1
+  explicit DNSCache(size_t capacity, uint32_t negative_ttl = 30);
+
+  // Copies the answer cached for (@name, @type) to @answer unless it's
+  // expired at @now. @refresh is set once per entry when a query should
+  // be sent to renew it: it's been hit more than once since it was cached
+  // and less than a tenth of its TTL is left. The TTL of @answer is what's
+  // left of it.
+  // RETURNS: whether @answer is set
+  bool Lookup(const std::string &name, uint16_t type, Clock::time_point now,
+              DNSAnswer *answer, bool *refresh);
+  // Caches @answer from @now on, replacing the entry of (@name, @type).
+  // Positive answers of TTL 0 aren't kept.
+  void Insert(const std::string &name, uint16_t type,
+              const DNSAnswer &answer, Clock::time_point now);
+  void Clear();
+  size_t Size() const { return index_.size(); }
+  size_t Capacity() const { return slots_.size(); }
+
+private:
+  // Names compare case insensitive, they are kept lower case
+  using Key = std::pair<std::string, uint16_t>;
+  struct Slot {
+    bool used;
+    Key key;
+    DNSAnswer answer;
+    Clock::time_point expire;
+    // Left when a refresh is asked for
+    Clock::duration refresh_ahead;
+    uint32_t hits;
+    bool refreshing;
+  };
+  static Key MakeKey(const std::string &name, uint16_t type);
+  // Frees @slot, it's the next to take a new entry.
+  void Release(uint32_t slot);
+  uint32_t negative_ttl_;
+  std::vector<Slot> slots_;
+  std::map<Key, uint32_t> index_;
+  // Slots by recency of use, the least recent one takes a new entry
+  ArenaLRU lru_;
+};
+
+}  // namespace kale
+#endif
@@ -0,0 +1,48 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// DNS answered on the tun side of a tunnel. Queries of A and AAAA records
+// to UDP port 53 are answered from a cache, the query packet rewritten in
+// place into its reply. Misses go through the tunnel as usual and their
+// answers coming back fill the cache.
+
+#ifndef KALE_DNS_INTERCEPT_H_
+#define KALE_DNS_INTERCEPT_H_
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "kale/dns_cache.h"
+
+namespace kale {
+
+// Not thread safe.
+class DNSInterceptor {
+public:
+  // @capacity: most names cached.
+  // REQUIRES: capacity >= 1
+  explicit DNSInterceptor(size_t capacity);
+
+  // If IPv4 @packet is a query whose answer is cached, turns it into the
+  // reply to the querier: addresses and ports swapped, the answer written
+  // after the question and checksums filled. @size bytes are writable at
+  // @packet. A hit close to expiry is left to the tunnel to refresh it.
+  // RETURNS: length of the reply, 0 if @packet is left untouched
+  size_t Answer(uint8_t *packet, size_t len, size_t size);
+  // Caches the answer if IPv4 @packet is the response to a query missed
+  // by Answer.
+  void Learn(const uint8_t *packet, size_t len);
+
+  uint64_t Hits() const { return hits_; }
+  uint64_t Misses() const { return misses_; }
+
+private:
+  DNSCache cache_;
+  // By transaction id, queries missed and not answered yet
+  std::vector<bool> pending_;
+  uint64_t hits_, misses_;
+};
+
+}  // namespace kale
+#endif
@@ -0,0 +1,146 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// Forward error correction over groups of datagrams: after every k data
+// datagrams m parity datagrams are sent, and any k of the k + m rebuild the
+// lost ones without waiting for a retransmit. Parity is a systematic
+// Reed-Solomon code over GF(2^8) with a Cauchy matrix whose first row is all
+// ones, so m = 1 is plain XOR.
+//
+// Every datagram starts with a header whose first byte can't start an IPv4
+// packet, protected and plain datagrams can be told apart.
+
+#ifndef KALE_FEC_H_
+#define KALE_FEC_H_
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "kl/error.h"
+
+namespace kale {
+namespace fec {
+
+const uint8_t kMagic = 0xfe;
+const size_t kHeaderSize = 8;
+// Room a payload needs past its end, for the header and the length its
+// parity carries
+const size_t kOverhead = kHeaderSize + 2;
+// Of each kind in a group
+const size_t kMaxShards = 128;
+const size_t kMaxPayload = 65535;
+
+// dst[i] ^= src[i]
+void XorRegion(uint8_t *dst, const uint8_t *src, size_t len);
+// dst[i] ^= c * src[i] in GF(2^8), with SSSE3 where the CPU has it.
+void MulAddRegion(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+uint8_t Mul(uint8_t a, uint8_t b);
+// REQUIRES: a != 0
+uint8_t Inverse(uint8_t a);
+// Coefficient of data shard @data in parity shard @parity, 1 for parity 0.
+uint8_t Coefficient(size_t parity, size_t data);
+
+bool IsProtected(const uint8_t *datagram, size_t len);
+
+class Encoder {
+public:
+  // REQUIRES: 1 <= k, m <= kMaxShards
+  Encoder(size_t k, size_t m);
+
+  // Puts the header in front of the @len bytes at @buffer, which has
+  // @capacity writable bytes, and adds them to the parity of the group.
+  // Fails unless kOverhead bytes are left past them, so buffers of the
+  // same @capacity hold the parity.
+  // RETURNS: the new length
+  kl::Result<size_t> Protect(uint8_t *buffer, size_t len, size_t capacity);
+  // Ends the group before it has k datagrams, e.g. when the sender goes
+  // idle, so those sent are protected without waiting.
+  void Flush();
+  // Parity datagrams of the last group not taken yet.
+  size_t PendingParity() const { return pending_; }
+  // Length of the next parity datagram.
+  size_t ParitySize() const;
+  // Writes the next parity datagram to @buffer. If it doesn't fit, the
+  // rest of the group's parity is dropped.
+  // RETURNS: its length
+  // REQUIRES: PendingParity() > 0
+  kl::Result<size_t> NextParity(uint8_t *buffer, size_t capacity);
+
+private:
+  void Finish();
+  const size_t k_, m_;
+  uint32_t group_;
+  // Data datagrams of the current group
+  size_t count_;
+  // Of the group being taken, which is group_ - 1
+  size_t pending_, finished_count_;
+  std::vector<std::vector<uint8_t>> parity_;
+  // Parity of the finished group, swapped with parity_
+  std::vector<std::vector<uint8_t>> finished_;
+  size_t shard_size_, finished_size_;
+};
+
+class Decoder {
+public:
+  // Keeps the latest @window groups, older ones are given up.
+  explicit Decoder(size_t window = 8);
+
+  // Calls @on_payload(uint8_t *payload, size_t len, bool recovered) for
+  // the payload of @datagram unless it's been recovered already, then for
+  // each payload @datagram let be recovered. Payloads may be edited in
+  // place, recovered ones are valid until the next call.
+  // RETURNS: an error if @datagram is malformed.
+  template <typename OnPayload>
+  kl::Result<void> Receive(uint8_t *datagram, size_t len,
+                           OnPayload on_payload);
+  uint64_t Recovered() const { return recovered_total_; }
+
+private:
+  struct Group {
+    uint32_t id;
+    bool live;
+    // Known once a parity datagram arrives
+    size_t data_count;
+    size_t parity_count;
+    bool done;
+    // By index, data shards then parity shards
+    std::vector<bool> have;
+    // Data shards are the payload after its 2 byte length, zero padded to
+    // the parity length when rebuilding.
+    std::vector<std::vector<uint8_t>> shards;
+    size_t parity_size;
+  };
+  // RETURNS: the payload of a data datagram to hand out, nullptr if none.
+  kl::Result<uint8_t *> Accept(uint8_t *datagram, size_t len,
+                               size_t *payload_len);
+  void Rebuild(Group *group);
+  std::vector<Group> groups_;
+  // Payloads recovered by the last Accept
+  std::vector<std::pair<uint8_t *, size_t>> recovered_;
+  uint64_t recovered_total_;
+  // Scratch of Rebuild
+  std::vector<uint8_t> matrix_, inverse_;
+};
+
+template <typename OnPayload>
+kl::Result<void> Decoder::Receive(uint8_t *datagram, size_t len,
+                                  OnPayload on_payload) {
+  size_t payload_len;
+  auto accept = Accept(datagram, len, &payload_len);
+  if (!accept) {
+    return kl::Err(accept.MoveErr());
+  }
+  if (*accept) {
+    on_payload(*accept, payload_len, false);
+  }
+  for (const auto &payload : recovered_) {
+    on_payload(payload.first, payload.second, true);
+  }
+  return kl::Ok();
+}
+
+}  // namespace fec
+}  // namespace kale
+#endif
@@ -0,0 +1,107 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// Segmentation and coalescing of TCP/IPv4 GSO super packets exchanged with a
+// tun opened with IFF_VNET_HDR.
+
+#ifndef KALE_GSO_H_
+#define KALE_GSO_H_
+#include <cstdint>
+#include <vector>
+
+#include "kl/error.h"
+
+namespace kale {
+namespace gso {
+
+// Every frame on an IFF_VNET_HDR tun starts with this header, laid out as
+// struct virtio_net_hdr. linux/virtio_net.h itself doesn't compile as C++.
+// Fields are in host byte order.
+struct VirtioNetHdr {
+  uint8_t flags;
+  uint8_t gso_type;
+  uint16_t hdr_len;
+  uint16_t gso_size;
+  uint16_t csum_start;
+  uint16_t csum_offset;
+};
+
+const size_t kVirtioNetHdrSize = sizeof(VirtioNetHdr);
+static_assert(kVirtioNetHdrSize == 10, "virtio_net_hdr is 10 bytes");
+
+enum VirtioNetHdrFlags {
+  // Checksum at csum_start + csum_offset only covers the pseudo header
+  kNeedsChecksum = 1,
+};
+
+enum GSOType {
+  kGSONone = 0,
+  kGSOTCPv4 = 1,
+  // Or'ed in when the packet had CWR set
+  kGSOECN = 0x80,
+};
+
+// Largest IPv4 packet, and so the largest super packet
+const size_t kMaxPacketSize = 65535;
+
+// Splits a frame read from tun into its header and packet.
+// REQUIRES: len >= kVirtioNetHdrSize
+void ParseFrame(const uint8_t *frame, size_t len, VirtioNetHdr *hdr,
+                const uint8_t **packet, size_t *packet_len);
+
+// Number of packets @packet is split into, 1 unless it's a TCPv4 super
+// packet. 0 if @packet is malformed.
+size_t SegmentCount(const VirtioNetHdr &hdr, const uint8_t *packet,
+                    size_t len);
+
+// Builds the @index-th packet of @packet into @out. Total length,
+// identification and IP checksum are fixed for every segment, as are the
+// sequence number, flags and checksum of TCP. A packet which isn't a super
+// packet is copied as is, with its checksum completed if the kernel left it
+// partial.
+// REQUIRES: index < SegmentCount(hdr, packet, len)
+// RETURNS: length of the segment.
+kl::Result<size_t> BuildSegment(const VirtioNetHdr &hdr,
+                                const uint8_t *packet, size_t len,
+                                size_t index, uint8_t *out, size_t capacity);
+
+// Merges consecutive in-order TCP/IPv4 segments of one flow into a super
+// packet so the kernel receives them with a single write.
+class TCPCoalescer {
+public:
+  // @capacity bounds the merged packet.
+  // REQUIRES: capacity <= kMaxPacketSize
+  explicit TCPCoalescer(size_t capacity = kMaxPacketSize);
+
+  bool Empty() const { return count_ == 0; }
+  // Number of packets merged so far
+  size_t Count() const { return count_; }
+
+  // Appends @packet to the pending one. Packets which aren't plain TCP data
+  // are taken only when nothing is pending and are never merged.
+  // RETURNS: false if @packet doesn't continue the pending packet, nothing
+  // is changed then. Flush and Add again.
+  bool Add(const uint8_t *packet, size_t len);
+
+  // Completes the pending packet and empties the coalescer.
+  // RETURNS: length of the frame, VirtioNetHdr included, to write to tun.
+  // The frame stays valid until the next Add.
+  size_t Flush();
+  const uint8_t *Frame() const { return buffer_.data(); }
+
+private:
+  bool Mergeable(const uint8_t *packet, size_t len) const;
+  size_t capacity_;
+  size_t count_;
+  size_t len_;
+  // Payload size of the first segment, all but the last must match it.
+  size_t segment_size_;
+  bool closed_;
+  // VirtioNetHdr followed by the packet
+  std::vector<uint8_t> buffer_;
+};
+
+}  // namespace gso
+}  // namespace kale
+#endif
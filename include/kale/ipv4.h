@@ -30,7 +30,7 @@ enum Protocol {
   kUDP = 0x11,
 };
 
-#pragma pack(1)
+#pragma pack(push, 1)
 struct Rep {
   uint8_t ihl : 4, version : 4;
   uint8_t ecn : 4, dscp : 4;
@@ -45,6 +45,7 @@ struct Rep {
   uint32_t dest_addr;
   uint8_t data;
 };
+#pragma pack(pop)
 
 template <typename Rep>
 struct SegmentRef {
@@ -93,13 +94,75 @@ inline uint16_t ChecksumCarry(uint32_t x) {
   return x;
 }
 
+// Patch @checksum after a 16-bit field of the checksummed data changes from
+// @old_value to @new_value, RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m').
+// All values in network byte order.
+inline uint16_t ChecksumAdjust(uint16_t checksum, uint16_t old_value,
+                               uint16_t new_value) {
+  uint32_t sum = static_cast<uint16_t>(~checksum);
+  sum += static_cast<uint16_t>(~old_value);
+  sum += new_value;
+  return static_cast<uint16_t>(~ChecksumCarry(sum));
+}
+
+// Same as above for a 32-bit field, e.g. an address.
+inline uint16_t ChecksumAdjust32(uint16_t checksum, uint32_t old_value,
+                                 uint32_t new_value) {
+  uint32_t sum = static_cast<uint16_t>(~checksum);
+  sum += static_cast<uint16_t>(~old_value);
+  sum += static_cast<uint16_t>(~(old_value >> 16));
+  sum += static_cast<uint16_t>(new_value);
+  sum += static_cast<uint16_t>(new_value >> 16);
+  return static_cast<uint16_t>(~ChecksumCarry(sum));
+}
+
+// How editors treat checksums when they rewrite a field.
+enum ChecksumUpdate {
+  // Leave checksums untouched, callers are expected to FillChecksum later.
+  kLeaveChecksum,
+  // Patch affected checksums in O(1) from the old and new values. Requires
+  // checksums to be valid before the change.
+  kIncrementalChecksum,
+};
+
+// Folded one's complement sum of @packet, see kale/checksum.h.
 uint32_t InternetChecksum(const uint8_t *packet, size_t len);
 
+// Outcome of Validate.
+enum ValidateStatus {
+  kValid,
+  // Shorter than its headers claim
+  kTruncated,
+  kNotIPv4,
+  kBadHeaderChecksum,
+  kBadSegmentChecksum,
+};
+
+struct Verdict {
+  ValidateStatus status;
+  // Valid once the IP header has been read
+  uint8_t protocol;
+  // Checksum field carried by the failing layer and the value it should have,
+  // in network byte order.
+  uint16_t actual_checksum;
+  uint16_t expected_checksum;
+  bool ok() const { return status == kValid; }
+};
+
+// Verifies the IP header checksum and, for unfragmented TCP/UDP, the segment
+// checksum. Reads @packet only and never allocates.
+Verdict Validate(PacketRef packet);
+const char *ValidateStatusString(ValidateStatus status);
+
 class PacketEditor {
  public:
   PacketEditor(uint8_t *buffer, size_t len);
-  void ChangeSourceAddr(uint32_t new_source_addr);
-  void ChangeDestAddr(uint32_t new_dest_addr);
+  // With kIncrementalChecksum both the header checksum and the TCP/UDP
+  // checksum covering the pseudo header are patched.
+  void ChangeSourceAddr(uint32_t new_source_addr,
+                        ChecksumUpdate update = kLeaveChecksum);
+  void ChangeDestAddr(uint32_t new_dest_addr,
+                      ChecksumUpdate update = kLeaveChecksum);
   void FillChecksum();
   bool ValidateChecksum() const;
   void SwapAddr();
@@ -112,6 +175,7 @@ class PacketEditor {
   std::unique_ptr<udp::UDPSegmentEditor> CreateUDPSegmentEditor();
 
  private:
+  void AdjustChecksum(uint32_t old_addr, uint32_t new_addr);
   Rep *rep_;
   size_t len_;
 };
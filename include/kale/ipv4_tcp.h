@@ -11,7 +11,7 @@ namespace kale {
 namespace ipv4 {
 namespace tcp {
 
-#pragma pack(1)
+#pragma pack(push, 1)
 struct TCPRep {
   uint16_t source_port;
   uint16_t dest_port;
@@ -25,12 +25,15 @@ struct TCPRep {
   uint16_t urgent_pointer;
   uint8_t data;
 };
+#pragma pack(pop)
 
 class TCPSegmentEditor {
  public:
   TCPSegmentEditor(PacketRef packet, uint8_t* segment, size_t len);
-  void ChangeSourcePort(uint16_t new_port);
-  void ChangeDestPort(uint16_t new_port);
+  void ChangeSourcePort(uint16_t new_port,
+                        ChecksumUpdate update = kLeaveChecksum);
+  void ChangeDestPort(uint16_t new_port,
+                      ChecksumUpdate update = kLeaveChecksum);
   void SwapPort();
   SegmentRef<TCPRep> ref() const { return SegmentRef<TCPRep>(rep_, len_); }
   void FillChecksum();
@@ -11,7 +11,7 @@ namespace kale {
 namespace ipv4 {
 namespace udp {
 
-#pragma pack(1)
+#pragma pack(push, 1)
 struct UDPRep {
   uint16_t source_port;
   uint16_t dest_port;
@@ -19,18 +19,22 @@ struct UDPRep {
   uint16_t checksum;
   uint8_t data;
 };
+#pragma pack(pop)
 
 class UDPSegmentEditor {
  public:
   UDPSegmentEditor(PacketRef packet, uint8_t* segment, size_t len);
-  void ChangeSourcePort(uint16_t new_port);
-  void ChangeDestPort(uint16_t new_port);
+  void ChangeSourcePort(uint16_t new_port,
+                        ChecksumUpdate update = kLeaveChecksum);
+  void ChangeDestPort(uint16_t new_port,
+                      ChecksumUpdate update = kLeaveChecksum);
   void SwapPort();
   SegmentRef<UDPRep> ref() const { return SegmentRef<UDPRep>(rep_, len_); }
   void FillChecksum();
   bool ValidateChecksum() const;
 
  private:
+  void AdjustChecksum(uint16_t old_port, uint16_t new_port);
   PacketRef packet_;
   UDPRep* rep_;
   size_t len_;
@@ -6,8 +6,10 @@
 #ifndef KALE_LRU_H_
 #define KALE_LRU_H_
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <map>
+#include <vector>
 
 namespace kale {
 
@@ -144,5 +146,106 @@ inline void LRU::Remove(Node *n) {
   }
 }
 
+// Same as LRU with its nodes in one array indexed by id, linked by 32-bit
+// indices. Use and GetLRU are O(1) and never allocate.
+class ArenaLRU {
+public:
+  // REQUIRES: size >= 1
+  explicit ArenaLRU(size_t size);
+  bool Use(uint32_t v);
+  // Makes @v the least recently used, the next GetLRU takes it.
+  bool Drop(uint32_t v);
+  uint32_t GetLRU();
+  uint32_t Head() const { return head_; }
+  uint32_t Tail() const { return tail_; }
+  size_t Size() const { return nodes_.size(); }
+
+protected:
+  static const uint32_t kNil = UINT32_MAX;
+  struct Node {
+    uint32_t prev, next;
+  };
+  void Remove(uint32_t v);
+  void PushFront(uint32_t v);
+  void PushBack(uint32_t v);
+  uint32_t head_, tail_;
+  std::vector<Node> nodes_;
+};
+
+inline ArenaLRU::ArenaLRU(size_t size)
+    : head_(kNil), tail_(kNil), nodes_(size) {
+  assert(size >= 1);
+  // Ordered as LRU, the last id at head
+  for (size_t i = 0; i < size; ++i) {
+    PushFront(i);
+  }
+}
+
+inline bool ArenaLRU::Use(uint32_t v) {
+  if (v >= nodes_.size()) {
+    return false;
+  }
+  if (v != head_) {
+    Remove(v);
+    PushFront(v);
+  }
+  return true;
+}
+
+inline bool ArenaLRU::Drop(uint32_t v) {
+  if (v >= nodes_.size()) {
+    return false;
+  }
+  if (v != tail_) {
+    Remove(v);
+    PushBack(v);
+  }
+  return true;
+}
+
+inline uint32_t ArenaLRU::GetLRU() {
+  uint32_t v = tail_;
+  Use(v);
+  return v;
+}
+
+inline void ArenaLRU::Remove(uint32_t v) {
+  Node &n = nodes_[v];
+  if (n.prev != kNil) {
+    nodes_[n.prev].next = n.next;
+  } else {
+    head_ = n.next;
+  }
+  if (n.next != kNil) {
+    nodes_[n.next].prev = n.prev;
+  } else {
+    tail_ = n.prev;
+  }
+}
+
+inline void ArenaLRU::PushFront(uint32_t v) {
+  Node &n = nodes_[v];
+  n.prev = kNil;
+  n.next = head_;
+  if (head_ != kNil) {
+    nodes_[head_].prev = v;
+  } else {
+    tail_ = v;
+  }
+  head_ = v;
+}
+
+inline void ArenaLRU::PushBack(uint32_t v) {
+  Node &n = nodes_[v];
+  n.next = kNil;
+  n.prev = tail_;
+  if (tail_ != kNil) {
+    nodes_[tail_].next = v;
+  } else {
+    head_ = v;
+  }
+  tail_ = v;
+}
+
 }  // namespace kale
 #endif
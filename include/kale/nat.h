@@ -0,0 +1,136 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// Port mapping of the remote proxy. A flow, a subnet host behind some peer,
+// is given a local port out of a fixed range until it has been idle for a
+// while.
+
+#ifndef KALE_NAT_H_
+#define KALE_NAT_H_
+#include <cstdint>
+#include <vector>
+
+#include "kale/timing_wheel.h"
+#include "kl/error.h"
+
+namespace kale {
+
+// Addresses and ports in network byte order, as they are in packets and
+// sockaddr_in.
+struct FlowKey {
+  uint32_t peer_addr;
+  uint32_t subnet_addr;
+  uint16_t peer_port;
+  uint16_t subnet_port;
+};
+
+inline bool operator==(const FlowKey &a, const FlowKey &b) {
+  return a.peer_addr == b.peer_addr && a.subnet_addr == b.subnet_addr &&
+         a.peer_port == b.peer_port && a.subnet_port == b.subnet_port;
+}
+
+// A local address and port a flow is mapped to, the address in network byte
+// order and the port in host byte order.
+struct Endpoint {
+  uint32_t addr;
+  uint16_t port;
+};
+
+// Flow to endpoint is an open addressing hash table, endpoint to flow a flat
+// array indexed by address and port. Neither direction allocates after
+// construction. Not thread safe.
+//
+// With several local addresses a new flow takes a port of the address its
+// subnet host hashes to, so all flows of a host share one address as long
+// as that address has free ports (paired pooling of RFC 4787).
+//
+// Time is counted in ticks, seconds for the proxy, and only moves with
+// Advance. Every lookup marks the mapping as seen now. A mapping is released
+// once it has been idle for the timeout; the timer wheel isn't touched per
+// packet, an expired timer whose mapping was seen since is pushed back.
+class Nat {
+public:
+  // REQUIRES: !addrs.empty(), port_min <= port_max, idle_timeout > 0
+  Nat(const std::vector<uint32_t> &addrs, uint16_t port_min,
+      uint16_t port_max, uint32_t idle_timeout);
+  const std::vector<uint32_t> &Addrs() const { return addrs_; }
+  uint16_t PortMin() const { return port_min_; }
+  uint16_t PortMax() const { return port_max_; }
+  uint32_t IdleTimeout() const { return idle_timeout_; }
+  uint64_t Now() const { return now_; }
+  // Number of flows mapped
+  size_t Size() const { return size_; }
+
+  // Endpoint of @key, mapping it first if it's new. Ports of an address are
+  // handed out least recently released first.
+  // RETURNS: error if @key is new and every endpoint is in use.
+  kl::Result<Endpoint> Map(const FlowKey &key);
+  // RETURNS: false if @key isn't mapped.
+  bool QueryEndpoint(const FlowKey &key, Endpoint *local);
+  // Copies the flow mapped to @local into @key.
+  // RETURNS: false if @local isn't mapped.
+  bool QueryFlow(const Endpoint &local, FlowKey *key);
+  // RETURNS: false if @local isn't mapped.
+  bool Remove(const Endpoint &local);
+  // A byte of state the caller keeps per mapping, 0 for a new one.
+  // RETURNS: false if @local isn't mapped.
+  bool GetState(const Endpoint &local, uint8_t *state) const;
+  // Sets the state of the mapping at @local along with its idle timeout,
+  // which counts from when it was last seen.
+  // REQUIRES: idle_timeout > 0
+  // RETURNS: false if @local isn't mapped.
+  bool SetState(const Endpoint &local, uint8_t state, uint32_t idle_timeout);
+  // Moves the clock to @now and releases the mappings idle for their
+  // timeout, IdleTimeout() unless SetState changed it.
+  // RETURNS: number of mappings released.
+  size_t Advance(uint64_t now);
+
+private:
+  struct Slot {
+    FlowKey key;
+    // Index of the endpoint, kEmpty if the slot is free
+    uint32_t index;
+  };
+  struct Binding {
+    FlowKey key;
+    uint64_t last_seen;
+    uint32_t timeout;
+    uint8_t state;
+    bool used;
+  };
+  // Free ports of an address, a ring in its part of free_
+  struct FreeList {
+    size_t head, count;
+  };
+  static const uint32_t kEmpty = UINT32_MAX;
+  static size_t Hash(const FlowKey &key);
+  // Slot holding @key, or the free slot ending its probe sequence
+  size_t Probe(const FlowKey &key) const;
+  void Erase(size_t slot);
+  // Index of @local if it's mapped, kEmpty otherwise. Addresses are few,
+  // they are searched linearly.
+  uint32_t IndexOf(const Endpoint &local) const;
+  Endpoint EndpointOf(uint32_t index) const;
+  void Release(uint32_t index);
+  std::vector<uint32_t> addrs_;
+  uint16_t port_min_, port_max_;
+  // Ports per address
+  uint32_t ports_;
+  uint32_t idle_timeout_;
+  uint64_t now_;
+  size_t size_;
+  // Capacity - 1, the table is a power of two at least twice the endpoints
+  size_t mask_;
+  std::vector<Slot> table_;
+  // Indexed by address * ports_ + port offset
+  std::vector<Binding> bindings_;
+  // Port offsets, released ones go to the back of their address' ring
+  std::vector<uint32_t> free_;
+  std::vector<FreeList> free_lists_;
+  // One timer per endpoint in use
+  TimingWheel wheel_;
+};
+
+}  // namespace kale
+#endif
@@ -0,0 +1,170 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// Preallocated packet buffers with room before and after the packet, so
+// coding headers and trailers are added in place instead of copying the
+// packet into a bigger buffer. Buffers are reference counted, a packet
+// handed to several stages is freed by the last one.
+
+#ifndef KALE_PACKET_POOL_H_
+#define KALE_PACKET_POOL_H_
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "kale/ipv4.h"
+#include "kale/ring.h"
+
+namespace kale {
+
+const size_t kPacketHeadroom = 64;
+const size_t kPacketTailroom = 64;
+
+class PacketPool;
+
+// Handle to a pool buffer and the bytes of it holding the packet. Copies
+// share the buffer, which goes back to the pool with the last of them.
+class PacketBuffer {
+public:
+  PacketBuffer() : pool_(nullptr), index_(0), offset_(0), length_(0) {}
+  PacketBuffer(const PacketBuffer &other);
+  PacketBuffer(PacketBuffer &&other);
+  PacketBuffer &operator=(PacketBuffer other);
+  ~PacketBuffer() { Reset(); }
+
+  bool Valid() const { return pool_ != nullptr; }
+  // Drops the reference.
+  void Reset();
+  // More than one handle refers to the buffer, it shouldn't be edited.
+  bool Shared() const;
+
+  uint8_t *Data() const;
+  size_t Length() const { return length_; }
+  size_t Headroom() const { return offset_; }
+  size_t Tailroom() const;
+  // Writable bytes from Data(), as taken by InplaceTransform
+  size_t Capacity() const { return length_ + Tailroom(); }
+
+  // Grows the packet at the front, e.g. for a coding header.
+  // RETURNS: the new Data()
+  // REQUIRES: n <= Headroom()
+  uint8_t *Prepend(size_t n);
+  // Strips @n bytes from the front.
+  // REQUIRES: n <= Length()
+  void Consume(size_t n);
+  // REQUIRES: len <= Capacity()
+  void SetLength(size_t len);
+
+  ipv4::PacketRef ref() const { return ipv4::PacketRef(Data(), length_); }
+  ipv4::PacketEditor Editor() const {
+    return ipv4::PacketEditor(Data(), length_);
+  }
+
+private:
+  friend class PacketPool;
+  PacketBuffer(PacketPool *pool, uint32_t index, uint32_t offset)
+      : pool_(pool), index_(index), offset_(offset), length_(0) {}
+  PacketPool *pool_;
+  uint32_t index_;
+  uint32_t offset_;
+  uint32_t length_;
+};
+
+// The buffers of a BufferPool, handed out by reference. Get locks the
+// pool, threads getting and freeing many buffers do it through their own
+// Cache.
+class PacketPool {
+public:
+  // Every buffer holds @headroom + @data_room + @tailroom bytes, a new
+  // packet starts after @headroom.
+  // REQUIRES: count is a power of 2
+  PacketPool(size_t count, size_t data_room,
+             size_t headroom = kPacketHeadroom,
+             size_t tailroom = kPacketTailroom);
+  PacketPool(const PacketPool &) = delete;
+  PacketPool &operator=(const PacketPool &) = delete;
+  // REQUIRES: all buffers are back, caches included
+  ~PacketPool();
+
+  // RETURNS: false if all buffers are out.
+  bool Get(PacketBuffer *packet);
+  size_t Available();
+  size_t Count() const { return count_; }
+  size_t DataRoom() const { return data_room_; }
+
+  // Buffers kept by one thread, taken from and given back to the pool in
+  // batches so the lock is held once per batch. Not thread safe.
+  class Cache {
+  public:
+    // REQUIRES: size >= 2
+    explicit Cache(PacketPool *pool, size_t size = 64);
+    Cache(const Cache &) = delete;
+    Cache &operator=(const Cache &) = delete;
+    // Gives the kept buffers back.
+    ~Cache();
+    bool Get(PacketBuffer *packet);
+    // Drops the reference of @packet, keeping the buffer if it was the last.
+    void Recycle(PacketBuffer *packet);
+    size_t Size() const { return free_.size(); }
+
+  private:
+    PacketPool *pool_;
+    const size_t size_;
+    std::vector<uint32_t> free_;
+  };
+
+private:
+  friend class PacketBuffer;
+  uint8_t *Buffer(uint32_t index) { return buffers_.Data(index); }
+  // Drops the reference of @packet to buffer @index.
+  // RETURNS: true if it was the last, the caller then owns the buffer.
+  bool Detach(PacketBuffer *packet, uint32_t *index);
+  void Free(uint32_t index);
+  PacketBuffer Wrap(uint32_t index);
+  // Moves up to @n free buffers to @out.
+  size_t Take(size_t n, std::vector<uint32_t> *out);
+  // Frees the last @n buffers of @in.
+  void Give(size_t n, std::vector<uint32_t> *in);
+
+  const size_t count_, headroom_, data_room_, stride_;
+  BufferPool buffers_;
+  std::unique_ptr<std::atomic<uint32_t>[]> refs_;
+  // Taken by those getting from buffers_, it has a single consumer
+  std::mutex mutex_;
+};
+
+inline uint8_t *PacketBuffer::Data() const {
+  assert(Valid());
+  return pool_->Buffer(index_) + offset_;
+}
+
+inline size_t PacketBuffer::Tailroom() const {
+  assert(Valid());
+  return pool_->stride_ - offset_ - length_;
+}
+
+inline uint8_t *PacketBuffer::Prepend(size_t n) {
+  assert(n <= offset_);
+  offset_ -= n;
+  length_ += n;
+  return Data();
+}
+
+inline void PacketBuffer::Consume(size_t n) {
+  assert(n <= length_);
+  offset_ += n;
+  length_ -= n;
+}
+
+inline void PacketBuffer::SetLength(size_t len) {
+  assert(len <= Capacity());
+  length_ = len;
+}
+
+}  // namespace kale
+#endif
@@ -0,0 +1,71 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// Keeps a range of local ports to the NAT of the remote proxy: the kernel
+// must neither hand them out to local sockets nor answer packets sent to
+// them, which are only sniffed. Both are done for the whole range at once,
+// without a socket or a process per port.
+
+#ifndef KALE_PORT_RESERVATION_H_
+#define KALE_PORT_RESERVATION_H_
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "kl/error.h"
+
+namespace kale {
+namespace ports {
+
+extern const char *kLocalReservedPorts;
+
+// Whether each of the 65536 ports is in
+using PortSet = std::vector<bool>;
+
+// The comma separated list of ports and ranges the kernel reads and prints
+// the set as, adjacent ports merged into ranges.
+kl::Result<PortSet> ParsePorts(const std::string &list);
+std::string FormatPorts(const PortSet &ports);
+
+// Adds [port_min, port_max] to the ports the kernel never binds implicitly,
+// the list in @path.
+// RETURNS: the ports of the range which weren't listed yet, the ones added
+kl::Result<PortSet> ReserveLocalPorts(uint16_t port_min, uint16_t port_max,
+                                      const char *path = kLocalReservedPorts);
+// Takes @ports, as added by ReserveLocalPorts, off the list again. Ports
+// listed by others are left, even within the same range.
+kl::Result<void> ReleaseLocalPorts(const PortSet &ports,
+                                   const char *path = kLocalReservedPorts);
+
+enum Firewall {
+  kIptables,
+  kNftables,
+};
+
+// Name of the chain or table holding the rules of the range, so proxies
+// with different ranges don't step on each other.
+std::string RuleSetName(uint16_t port_min, uint16_t port_max);
+
+// Input fed to iptables-restore or nft to drop TCP and UDP packets to the
+// range. Loading it again replaces the rules rather than adding duplicates.
+// The iptables chain is jumped to from INPUT only with @hook, the jump
+// being the one rule which would be duplicated.
+std::string DropRules(Firewall firewall, uint16_t port_min, uint16_t port_max,
+                      bool hook = true);
+
+// Loads DropRules in one atomic batch.
+kl::Result<void> InstallDropRules(Firewall firewall, uint16_t port_min,
+                                  uint16_t port_max);
+
+// Input deleting what DropRules loads, the jump from INPUT included.
+std::string DeleteRules(Firewall firewall, uint16_t port_min,
+                        uint16_t port_max);
+
+// Loads DeleteRules in one atomic batch.
+kl::Result<void> RemoveDropRules(Firewall firewall, uint16_t port_min,
+                                 uint16_t port_max);
+
+}  // namespace ports
+}  // namespace kale
+#endif
@@ -2,18 +2,28 @@
 // Use of this source code is governed by the BSD license that can be found in
 // the LICENSE file.
 
-// An simple implementation of DNS query.
+// An simple implementation of DNS query, answers are cached for their TTL.
+// Queries don't block: each waits in the slot of its transaction id until
+// its answer or timeout completes it. Queries may be hedged across a set of
+// upstream servers, the first answer wins.
 
 #ifndef KALE_RESOLVER_H_
 #define KALE_RESOLVER_H_
+#include <netinet/in.h>
+
 #include <atomic>
-#include <condition_variable>
-#include <map>
+#include <chrono>
+#include <functional>
+#include <future>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <vector>
 
+#include "kale/dns.h"
+#include "kale/dns_cache.h"
+#include "kale/timing_wheel.h"
 #include "kl/error.h"
 #include "kl/rwlock.h"
 
@@ -21,19 +31,54 @@ namespace kale {
 
 class Resolver {
 public:
+  // Called once with the records, or an error
+  using Callback = std::function<void(kl::Result<std::vector<std::string>>)>;
+  // One per transaction id
+  static const size_t kMaxPending = 65536;
+  static const size_t kMaxUpstreams = 32;
+  // Hedge delay of SetUpstreams following the latency of each upstream
+  static const int kAdaptiveHedge = -1;
+
+  struct Upstream {
+    std::string addr;
+    uint16_t port;
+  };
+
+  // Of an upstream, the RTT is estimated as in RFC 6298.
+  struct UpstreamStats {
+    // Queries sent, hedges and retries included
+    uint64_t sent;
+    // Queries it answered first
+    uint64_t answered;
+    // Queries it didn't answer before they timed out or another upstream
+    // answered
+    uint64_t unanswered;
+    // Smoothed round trip time and its variation in microseconds, 0 until
+    // the first answer
+    uint64_t srtt, rttvar;
+    // Moving average of the queries unanswered
+    double loss;
+  };
+
+  // Query of an A record, see dns::BuildQuery to build one in place.
   static std::vector<uint8_t> BuildQuery(const char *name,
                                          uint16_t transaction_id);
+  // Empty if @name isn't valid.
   static std::string DNSName(const char *name);
+  // Of an uncompressed name, empty if it isn't valid.
   static std::string FromDNSName(const uint8_t *base);
-  // RETURNS: number of bytes skipped
+  // RETURNS: number of bytes skipped, -1 if the name isn't valid
   static int SkipDNSName(const uint8_t *base);
-  // RETURNS: number of bytes skipped
-  static kl::Result<int> RetrieveRecord(const uint8_t *base,
-                                        std::string *record);
-  // RETURNS: (transaction_id, query_result_list)
-  static kl::Result<std::pair<uint16_t, std::vector<std::string>>>
-  ParseResponse(const uint8_t *packet, size_t len);
-  explicit Resolver(int fd);
+  // Records of the answer of the type asked, addresses of A and AAAA, the
+  // name of CNAME, NS and PTR. The name and type of the question are put
+  // to @name and @type if given.
+  // RETURNS: (transaction_id, answer)
+  static kl::Result<std::pair<uint16_t, DNSAnswer>>
+  ParseResponse(const uint8_t *packet, size_t len, std::string *name = nullptr,
+                uint16_t *type = nullptr);
+  // @cache_capacity: most names whose answers are cached.
+  explicit Resolver(int fd, size_t cache_capacity = 4096);
+  // Its answer is kept for WaitForResult for up to a minute.
   // RETURNS: <transaction id>
   kl::Result<uint16_t> SendQuery(const char *name, const char *server,
                                  uint16_t port);
@@ -42,23 +87,137 @@ public:
   // RETURNS: <list of resource records>
   kl::Result<std::vector<std::string>> WaitForResult(uint16_t transaction_id,
                                                      int timeout);
+  // Answers from the cache, otherwise queries @server without blocking.
+  // @callback gets the records, or an error with the rcode of a failed
+  // answer. It's called right away on a hit or if the query can't be sent,
+  // otherwise on the listen thread once the answer comes or @timeout
+  // milliseconds have passed, and mustn't block. Should the listen thread
+  // quit on an error, it's called with that. A hit close to expiry is
+  // refreshed in the background.
+  void Resolve(const char *name, const char *server, uint16_t port,
+               int timeout, Callback callback);
+  std::future<kl::Result<std::vector<std::string>>>
+  Resolve(const char *name, const char *server, uint16_t port, int timeout);
+  // Resolve and wait.
+  kl::Result<std::vector<std::string>> Lookup(const char *name,
+                                              const char *server,
+                                              uint16_t port, int timeout);
+  // Queries of Resolve and Lookup without a server go to @upstreams, first
+  // to the one expected to answer soonest given its RTT and loss. Unless
+  // answered, the query is sent to the next one after @hedge_delay
+  // milliseconds, or to every one at once if it's 0. kAdaptiveHedge waits
+  // for the retransmission timeout of the upstream queried last. Once each
+  // has been tried the query is retried on the best one, the delay doubled
+  // every time.
+  // REQUIRES: no query is pending
+  kl::Result<void> SetUpstreams(const std::vector<Upstream> &upstreams,
+                                int hedge_delay = kAdaptiveHedge);
+  // REQUIRES: @upstream < number of upstreams set
+  UpstreamStats Stats(size_t upstream);
+  void Resolve(const char *name, int timeout, Callback callback);
+  std::future<kl::Result<std::vector<std::string>>> Resolve(const char *name,
+                                                            int timeout);
+  kl::Result<std::vector<std::string>> Lookup(const char *name, int timeout);
+  // Queries waiting for an answer
+  size_t Pending();
   std::string LocalAddr();
   ~Resolver();
 
 private:
+  struct Slot {
+    bool busy;
+    // The question, which the answer must echo
+    std::string name;
+    Callback callback;
+    // Of SendQuery, taken by WaitForResult
+    std::future<kl::Result<std::vector<std::string>>> result;
+    // Of a query to one server, otherwise upstreams_ are queried
+    bool direct;
+    // The server a direct answer must come from
+    struct sockaddr_in server;
+    // Masks of upstreams_ queried, and queried more than once
+    uint32_t sent, resent;
+    // Microseconds of the first query to each of upstreams_
+    std::vector<uint64_t> sent_at;
+    // Milliseconds until the next hedge
+    uint64_t hedge_delay;
+  };
+  struct UpstreamState {
+    struct sockaddr_in addr;
+    UpstreamStats stats;
+  };
+  // A hedge built while locked and sent after
+  struct Outgoing {
+    struct sockaddr_in addr;
+    uint8_t query[dns::kMaxQuerySize];
+    size_t len;
+  };
   void LaunchListenThread();
   void StopListenThread();
   void SetExitReason(const char *func, int line, const char *reason);
+  // Fails every pending query when the listen thread quits on an error,
+  // nothing would complete them, and those submitted after.
+  void FailPending();
+  // Takes a free slot for @name and sends its query to @server, to
+  // upstreams_ if it's null. @callback isn't called if it fails. @result
+  // is kept in the slot for WaitForResult.
+  // RETURNS: <transaction id>
+  kl::Result<uint16_t> Submit(
+      const char *name, const struct sockaddr_in *server, int timeout,
+      Callback callback,
+      std::future<kl::Result<std::vector<std::string>>> result =
+          std::future<kl::Result<std::vector<std::string>>>());
+  // Answers from the cache, otherwise submits the query.
+  void Dispatch(const char *name, const struct sockaddr_in *server,
+                int timeout, Callback callback);
+  void HandleResponse(const uint8_t *packet, size_t len,
+                      const struct sockaddr_in &from);
+  // Sends hedges that are due and fails the queries whose timeout has
+  // passed.
+  void ReapExpired();
+  // Milliseconds since start_, the ticks of wheel_
+  uint64_t Now() const;
+  uint64_t Micros() const;
+  // The rest are called with mutex_ held.
+  // RETURNS: tick by which a hedge or a timeout is due, UINT64_MAX if none
+  uint64_t NextDeadline() const;
+  bool QueriedAll(const Slot &slot) const;
+  // Index in upstreams_ of the best one @slot hasn't queried yet, of the
+  // best one if it has queried all.
+  size_t NextUpstream(const Slot &slot) const;
+  void MarkSent(Slot *slot, size_t upstream, uint64_t now);
+  // Milliseconds to wait for @upstream before hedging
+  uint64_t HedgeDelay(size_t upstream) const;
+  // Updates the stats of the upstreams @slot queried once it completes,
+  // answered by @winner or timed out if it's -1.
+  void Account(const Slot &slot, int winner, uint64_t now);
   int fd_;
   std::string addr_;
   uint16_t port_;
-  std::atomic<uint16_t> transaction_id_;
-  std::map<uint16_t, std::vector<std::string>> response_;
   std::atomic<bool> stop_listen_;
   std::unique_ptr<std::thread> listen_thread_;
   std::string exit_reason_;
-  std::condition_variable cv_;
+  // Guards slots_, wheel_, hedge_wheel_, next_id_, upstreams_ and
+  // listening_
   std::mutex mutex_;
+  // Cleared once the listen thread has quit
+  bool listening_;
+  // By transaction id, the timers of a busy one in wheel_ and hedge_wheel_
+  // have the same id
+  std::vector<Slot> slots_;
+  TimingWheel wheel_;
+  TimingWheel hedge_wheel_;
+  uint16_t next_id_;
+  std::vector<UpstreamState> upstreams_;
+  int hedge_delay_;
+  // Of the listen thread
+  std::vector<Outgoing> outgoing_;
+  std::chrono::steady_clock::time_point start_;
+  // Wakes the listen thread up to time the first query out
+  int wake_fd_;
+  // Filled by the listen thread with the answers to queries
+  DNSCache cache_;
+  std::mutex cache_mutex_;
 };
 
 }  // namespace kale
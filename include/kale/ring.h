@@ -0,0 +1,258 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// Bounded lock-free queues handing packets from one pipeline stage to the
+// next, e.g. sniffing, NAT and sending on their own cores. Packets stay in a
+// BufferPool, only their descriptors go through the rings.
+
+#ifndef KALE_RING_H_
+#define KALE_RING_H_
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace kale {
+
+const size_t kCacheLineSize = 64;
+
+// Index of a buffer of a BufferPool and the bytes used in it.
+struct PacketDesc {
+  uint32_t buffer;
+  uint32_t length;
+};
+
+// An index written by one side of a ring, alone in its cache line so the
+// other side polling its own index doesn't bounce it. What follows it in a
+// ring starts on the next line.
+struct alignas(kCacheLineSize) PaddedIndex {
+  std::atomic<size_t> value;
+
+  PaddedIndex() : value(0) {}
+};
+static_assert(sizeof(PaddedIndex) == kCacheLineSize,
+              "PaddedIndex takes one cache line");
+
+// One producer thread and one consumer thread.
+template <typename T>
+class SPSCRing {
+public:
+  // REQUIRES: capacity is a power of 2
+  explicit SPSCRing(size_t capacity);
+  bool Push(const T &v);
+  bool Pop(T *v);
+  // RETURNS: number of elements pushed or popped, up to @n, the indices are
+  // published once per batch.
+  size_t PushBatch(const T *v, size_t n);
+  size_t PopBatch(T *v, size_t n);
+  size_t Size() const;
+  size_t Capacity() const { return mask_ + 1; }
+
+private:
+  const size_t mask_;
+  std::unique_ptr<T[]> slots_;
+  PaddedIndex head_;
+  // Copy of head_ kept by the producer, refreshed only when the ring looks
+  // full.
+  size_t cached_head_;
+  PaddedIndex tail_;
+  // Copy of tail_ kept by the consumer.
+  size_t cached_tail_;
+};
+
+// Any number of producer threads and one consumer thread. Every slot has a
+// sequence number telling whether it's been written in the current lap, so
+// producers only contend on the tail.
+template <typename T>
+class MPSCRing {
+public:
+  // REQUIRES: capacity is a power of 2
+  explicit MPSCRing(size_t capacity);
+  bool Push(const T &v);
+  bool Pop(T *v);
+  // Reserves up to @n slots at once.
+  size_t PushBatch(const T *v, size_t n);
+  size_t PopBatch(T *v, size_t n);
+  size_t Size() const;
+  size_t Capacity() const { return mask_ + 1; }
+
+private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+  const size_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+  PaddedIndex head_;
+  PaddedIndex tail_;
+};
+
+// Fixed count of fixed size buffers in one allocation, each starting on a
+// cache line. Get is called by one thread at a time, e.g. the stage reading
+// packets in, Put by any.
+class BufferPool {
+public:
+  // REQUIRES: count is a power of 2
+  BufferPool(size_t count, size_t buffer_size);
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+  ~BufferPool();
+  // RETURNS: false if all buffers are out.
+  bool Get(uint32_t *buffer);
+  void Put(uint32_t buffer);
+  uint8_t *Data(uint32_t buffer) {
+    assert(buffer < count_);
+    return storage_ + buffer * stride_;
+  }
+  uint8_t *Data(const PacketDesc &desc) { return Data(desc.buffer); }
+  size_t BufferSize() const { return buffer_size_; }
+  size_t Available() const { return free_.Size(); }
+
+private:
+  const size_t count_, buffer_size_;
+  // buffer_size_ rounded up to whole cache lines
+  const size_t stride_;
+  uint8_t *storage_;
+  MPSCRing<uint32_t> free_;
+};
+
+template <typename T>
+SPSCRing<T>::SPSCRing(size_t capacity)
+    : mask_(capacity - 1),
+      slots_(new T[capacity]),
+      cached_head_(0),
+      cached_tail_(0) {
+  assert(capacity > 0 && (capacity & mask_) == 0);
+}
+
+template <typename T>
+bool SPSCRing<T>::Push(const T &v) {
+  return PushBatch(&v, 1) == 1;
+}
+
+template <typename T>
+bool SPSCRing<T>::Pop(T *v) {
+  return PopBatch(v, 1) == 1;
+}
+
+template <typename T>
+size_t SPSCRing<T>::PushBatch(const T *v, size_t n) {
+  size_t tail = tail_.value.load(std::memory_order_relaxed);
+  if (tail - cached_head_ + n > Capacity()) {
+    cached_head_ = head_.value.load(std::memory_order_acquire);
+  }
+  size_t room = Capacity() - (tail - cached_head_);
+  if (n > room) {
+    n = room;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    slots_[(tail + i) & mask_] = v[i];
+  }
+  tail_.value.store(tail + n, std::memory_order_release);
+  return n;
+}
+
+template <typename T>
+size_t SPSCRing<T>::PopBatch(T *v, size_t n) {
+  size_t head = head_.value.load(std::memory_order_relaxed);
+  if (cached_tail_ - head < n) {
+    cached_tail_ = tail_.value.load(std::memory_order_acquire);
+  }
+  size_t ready = cached_tail_ - head;
+  if (n > ready) {
+    n = ready;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    v[i] = slots_[(head + i) & mask_];
+  }
+  head_.value.store(head + n, std::memory_order_release);
+  return n;
+}
+
+template <typename T>
+size_t SPSCRing<T>::Size() const {
+  size_t head = head_.value.load(std::memory_order_acquire);
+  return tail_.value.load(std::memory_order_acquire) - head;
+}
+
+template <typename T>
+MPSCRing<T>::MPSCRing(size_t capacity)
+    : mask_(capacity - 1), slots_(new Slot[capacity]) {
+  assert(capacity > 0 && (capacity & mask_) == 0);
+  for (size_t i = 0; i < capacity; ++i) {
+    slots_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+template <typename T>
+bool MPSCRing<T>::Push(const T &v) {
+  return PushBatch(&v, 1) == 1;
+}
+
+template <typename T>
+bool MPSCRing<T>::Pop(T *v) {
+  return PopBatch(v, 1) == 1;
+}
+
+template <typename T>
+size_t MPSCRing<T>::PushBatch(const T *v, size_t n) {
+  size_t tail = tail_.value.load(std::memory_order_relaxed);
+  size_t reserved;
+  do {
+    // Slots after tail which are free in this lap
+    reserved = 0;
+    while (reserved < n) {
+      const Slot &slot = slots_[(tail + reserved) & mask_];
+      if (slot.sequence.load(std::memory_order_acquire) != tail + reserved) {
+        break;
+      }
+      ++reserved;
+    }
+    if (reserved == 0) {
+      size_t current = tail_.value.load(std::memory_order_relaxed);
+      if (current == tail) {
+        return 0;
+      }
+      tail = current;
+      continue;
+    }
+  } while (reserved == 0 ||
+           !tail_.value.compare_exchange_weak(tail, tail + reserved,
+                                              std::memory_order_relaxed));
+  for (size_t i = 0; i < reserved; ++i) {
+    Slot &slot = slots_[(tail + i) & mask_];
+    slot.value = v[i];
+    slot.sequence.store(tail + i + 1, std::memory_order_release);
+  }
+  return reserved;
+}
+
+template <typename T>
+size_t MPSCRing<T>::PopBatch(T *v, size_t n) {
+  size_t head = head_.value.load(std::memory_order_relaxed);
+  size_t i = 0;
+  for (; i < n; ++i) {
+    Slot &slot = slots_[(head + i) & mask_];
+    // A producer further ahead may have finished first, the order of the
+    // ring is kept by stopping at the first unwritten slot.
+    if (slot.sequence.load(std::memory_order_acquire) != head + i + 1) {
+      break;
+    }
+    v[i] = slot.value;
+    slot.sequence.store(head + i + Capacity(), std::memory_order_release);
+  }
+  head_.value.store(head + i, std::memory_order_relaxed);
+  return i;
+}
+
+template <typename T>
+size_t MPSCRing<T>::Size() const {
+  size_t head = head_.value.load(std::memory_order_acquire);
+  size_t tail = tail_.value.load(std::memory_order_acquire);
+  return tail > head ? tail - head : 0;
+}
+
+}  // namespace kale
+#endif
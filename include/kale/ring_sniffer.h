@@ -0,0 +1,79 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// Sniffer backend reading IPv4 packets off an AF_PACKET TPACKET_V3 ring
+// mapped into user space, a block of packets at a time and without copying.
+
+#ifndef KALE_RING_SNIFFER_H_
+#define KALE_RING_SNIFFER_H_
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "kl/error.h"
+
+namespace kale {
+
+// An IPv4 packet inside the ring.
+struct PacketView {
+  uint8_t *data;
+  size_t len;
+  // Writable bytes from data on, at least len
+  size_t capacity;
+};
+
+// How PACKET_FANOUT spreads packets over the sockets of a group.
+enum FanoutMode {
+  // By flow hash, every packet of a flow reaches the same socket
+  kFanoutHash,
+  // By the CPU the packet arrived on
+  kFanoutCPU,
+  // Round robin
+  kFanoutLoadBalance,
+};
+
+class RingSniffer {
+public:
+  struct Options {
+    // Must be a multiple of the page size
+    size_t block_size;
+    size_t block_count;
+    // The kernel retires a block which isn't full after this long
+    int block_timeout_ms;
+  };
+  // 64 blocks of 1MB retired every 8ms.
+  static Options DefaultOptions();
+
+  // Captures incoming packets of @ifname, network header first.
+  explicit RingSniffer(const char *ifname);
+  RingSniffer(const char *ifname, const Options &options);
+  kl::Result<void> CompileAndInstall(const char *filter_expr);
+  // Joins the PACKET_FANOUT group @group_id of the device, creating it if
+  // needed. Every socket of a group must use the same @mode.
+  kl::Result<void> JoinFanout(uint16_t group_id, FanoutMode mode);
+  // Waits up to @timeout_ms for a retired block and replaces @packets with
+  // its packets. They stay valid until ReleaseBlock, which must follow every
+  // NextBlock. Blocks without an incoming whole packet are skipped.
+  // RETURNS: number of packets, 0 on timeout.
+  kl::Result<size_t> NextBlock(int timeout_ms,
+                               std::vector<PacketView> *packets);
+  // Hands the current block back to the kernel.
+  void ReleaseBlock();
+  int fd() const { return fd_; }
+  void Close();
+  ~RingSniffer();
+
+private:
+  std::string ifname_;
+  Options options_;
+  int fd_;
+  uint8_t *ring_;
+  size_t ring_size_;
+  // Block handed out next, and whether it's held by the caller
+  size_t current_;
+  bool holding_;
+};
+
+}  // namespace kale
+#endif
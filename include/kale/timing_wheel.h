@@ -0,0 +1,88 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+// Hierarchical timing wheel for timers identified by dense ids.
+
+#ifndef KALE_TIMING_WHEEL_H_
+#define KALE_TIMING_WHEEL_H_
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace kale {
+
+// Timers 0..capacity-1 live in intrusive lists of four wheels of 64 slots,
+// each slot of a wheel spanning a whole turn of the wheel below. Scheduling
+// and cancelling are O(1), a timer is moved down at most three times before
+// it fires. Time is counted in ticks of the caller's choosing, a timer
+// further than 2^24 ticks away fires after 2^24 - 1 ticks.
+class TimingWheel {
+public:
+  explicit TimingWheel(size_t capacity);
+  size_t Capacity() const { return next_.size(); }
+  // Number of timers pending
+  size_t Size() const { return size_; }
+  uint64_t Now() const { return now_; }
+  bool Scheduled(uint32_t id) const { return slot_[id] != kNil; }
+  // Tick of the first timer due, or a tick no later than it for timers on
+  // the upper wheels. UINT64_MAX if none is pending.
+  uint64_t NextExpiry() const;
+
+  // (Re)schedules @id to fire at tick @expires, right at the next tick if
+  // it's already due.
+  // REQUIRES: id < Capacity()
+  void Schedule(uint32_t id, uint64_t expires);
+  void Cancel(uint32_t id);
+
+  // Moves the wheel to @now and calls @on_expire(id) for every timer due,
+  // the timer no longer pending. @on_expire may schedule timers.
+  template <typename F>
+  void Advance(uint64_t now, F &&on_expire);
+
+private:
+  static const uint32_t kNil = UINT32_MAX;
+  static const int kLevelBits = 6;
+  static const int kLevels = 4;
+  static const uint32_t kSlots = 1 << kLevelBits;
+  static const uint32_t kSlotMask = kSlots - 1;
+  uint32_t SlotOf(uint64_t expires) const;
+  void Link(uint32_t id, uint32_t slot);
+  void Unlink(uint32_t id);
+  // Spreads slot @index of wheel @level over the wheels below.
+  // RETURNS: @index
+  uint32_t Cascade(int level, uint32_t index);
+  // Moves the timers of @slot to kDue, where callbacks can't add to them.
+  void TakeDue(uint32_t slot);
+  // Extra list after the wheels holding timers being fired
+  static const uint32_t kDue = kLevels * kSlots;
+  uint64_t now_;
+  size_t size_;
+  std::vector<uint32_t> heads_;
+  std::vector<uint32_t> next_, prev_, slot_;
+  std::vector<uint64_t> expires_;
+};
+
+template <typename F>
+void TimingWheel::Advance(uint64_t now, F &&on_expire) {
+  while (now_ <= now) {
+    if (size_ == 0) {
+      now_ = now + 1;
+      return;
+    }
+    uint32_t index = now_ & kSlotMask;
+    for (int level = 1; index == 0 && level < kLevels; ++level) {
+      index = Cascade(level, (now_ >> (level * kLevelBits)) & kSlotMask);
+    }
+    TakeDue(now_ & kSlotMask);
+    ++now_;
+    uint32_t id;
+    while ((id = heads_[kDue]) != kNil) {
+      Unlink(id);
+      on_expire(id);
+    }
+  }
+}
+
+}  // namespace kale
+#endif
@@ -8,6 +8,7 @@
 #define KALE_TUN_H_
 #include <string>
 #include <tuple>
+#include <vector>
 
 #include "kl/epoll.h"
 #include "kl/error.h"
@@ -16,8 +17,18 @@ namespace kale {
 
 extern const char *kTunDevRoot;
 
+// With @vnet_hdr the device is opened with IFF_VNET_HDR and checksum/TSO
+// offload, every frame read or written is then prefixed by a
+// virtio_net_hdr and TCP may come as GSO super packets, see kale/gso.h.
 // RETURN: fd
-kl::Result<int> AllocateTun(const char *ifname);
+kl::Result<int> AllocateTun(const char *ifname, bool vnet_hdr = false);
+// Opens @nqueues queues of the same device with IFF_MULTI_QUEUE, the kernel
+// spreads flows over them so each can be served by its own thread.
+// REQUIRES: nqueues >= 1
+// RETURN: one fd per queue
+kl::Result<std::vector<int>> AllocateMultiQueueTun(const char *ifname,
+                                                   int nqueues,
+                                                   bool vnet_hdr = false);
 std::string RandomTunName();
 
 kl::Result<int> RawIPv4Socket();
@@ -2,10 +2,14 @@
 // Use of this source code is governed by the BSD license that can be found in
 // the LICENSE file.
 
+#include <arpa/inet.h>
+
+#include "kale/checksum.h"
 #include "kale/ipv4.h"
 #include "kale/ipv4_tcp.h"
 #include "kale/ipv4_udp.h"
 
+#include <cstddef>
 #include <iostream>
 
 namespace kale {
@@ -34,14 +38,120 @@ bool PacketRef::GetUDPSegmentRef(SegmentRef<udp::UDPRep> *udp) const {
 }
 
 uint32_t InternetChecksum(const uint8_t *packet, size_t len) {
+  return checksum::Sum(packet, len);
+}
+
+namespace {
+
+uint32_t PseudoHeaderSum(PacketRef packet, Protocol protocol,
+                         size_t segment_len) {
   uint32_t sum = 0;
-  for (size_t i = 0; i < len - 1; i += 2) {
-    sum += *reinterpret_cast<const uint16_t *>(packet + i);
+  sum += InternetChecksum(
+      reinterpret_cast<const uint8_t *>(&packet.rep->source_addr),
+      sizeof(packet.rep->source_addr));
+  sum += InternetChecksum(
+      reinterpret_cast<const uint8_t *>(&packet.rep->dest_addr),
+      sizeof(packet.rep->dest_addr));
+  sum += htons(static_cast<uint16_t>(protocol));
+  sum += htons(static_cast<uint16_t>(segment_len));
+  return sum;
+}
+
+// @sum covers the checksum field itself, take it out again.
+uint16_t ExpectedChecksum(uint32_t sum, uint16_t actual) {
+  return static_cast<uint16_t>(
+      ~ChecksumCarry(sum + static_cast<uint16_t>(~actual)));
+}
+
+Verdict MakeVerdict(ValidateStatus status, uint8_t protocol) {
+  Verdict verdict;
+  verdict.status = status;
+  verdict.protocol = protocol;
+  verdict.actual_checksum = 0;
+  verdict.expected_checksum = 0;
+  return verdict;
+}
+
+}  // namespace
+
+Verdict Validate(PacketRef packet) {
+  const uint8_t *base = reinterpret_cast<const uint8_t *>(packet.rep);
+  if (packet.len < offsetof(Rep, data)) {
+    return MakeVerdict(kTruncated, 0);
   }
-  if (len & 1) {
-    sum += *(packet + len - 1);
+  if (packet.rep->version != 4) {
+    return MakeVerdict(kNotIPv4, 0);
   }
-  return sum;
+  Verdict verdict = MakeVerdict(kValid, packet.rep->protocol);
+  size_t header_len = packet.HeaderLength();
+  // Link layers may pad short frames, trust total_length over @packet.len
+  size_t total_len = ntohs(packet.rep->total_length);
+  if (header_len < offsetof(Rep, data) || total_len < header_len ||
+      total_len > packet.len) {
+    verdict.status = kTruncated;
+    return verdict;
+  }
+  uint32_t sum = InternetChecksum(base, header_len);
+  if (ChecksumCarry(sum) != 0xffff) {
+    verdict.status = kBadHeaderChecksum;
+    verdict.actual_checksum = packet.rep->checksum;
+    verdict.expected_checksum = ExpectedChecksum(sum, packet.rep->checksum);
+    return verdict;
+  }
+  // Segment checksum of a fragmented datagram covers all its fragments
+  bool more_fragments = packet.rep->flags & 0x1;
+  if (more_fragments || packet.rep->fragment_offset_low != 0 ||
+      packet.rep->fragment_offset_high != 0) {
+    return verdict;
+  }
+  PacketRef datagram(base, total_len);
+  const uint8_t *segment = base + header_len;
+  size_t segment_len = total_len - header_len;
+  uint16_t actual = 0;
+  if (datagram.IsTCP()) {
+    if (segment_len < offsetof(tcp::TCPRep, data)) {
+      verdict.status = kTruncated;
+      return verdict;
+    }
+    actual = reinterpret_cast<const tcp::TCPRep *>(segment)->checksum;
+    sum = PseudoHeaderSum(datagram, kTCP, segment_len);
+  } else if (datagram.IsUDP()) {
+    if (segment_len < offsetof(udp::UDPRep, data)) {
+      verdict.status = kTruncated;
+      return verdict;
+    }
+    actual = reinterpret_cast<const udp::UDPRep *>(segment)->checksum;
+    // Sender didn't compute a checksum
+    if (actual == 0) {
+      return verdict;
+    }
+    sum = PseudoHeaderSum(datagram, kUDP, segment_len);
+  } else {
+    return verdict;
+  }
+  sum += InternetChecksum(segment, segment_len);
+  if (ChecksumCarry(sum) != 0xffff) {
+    verdict.status = kBadSegmentChecksum;
+    verdict.actual_checksum = actual;
+    verdict.expected_checksum = ExpectedChecksum(sum, actual);
+  }
+  return verdict;
+}
+
+const char *ValidateStatusString(ValidateStatus status) {
+  switch (status) {
+    case kValid:
+      return "valid";
+    case kTruncated:
+      return "truncated";
+    case kNotIPv4:
+      return "not ipv4";
+    case kBadHeaderChecksum:
+      return "bad header checksum";
+    case kBadSegmentChecksum:
+      return "bad segment checksum";
+  }
+  return "unknown";
 }
 
 PacketEditor::PacketEditor(uint8_t *buffer, size_t len) {
@@ -49,14 +159,54 @@ PacketEditor::PacketEditor(uint8_t *buffer, size_t len) {
   len_ = len;
 }
 
-void PacketEditor::ChangeSourceAddr(uint32_t new_source_addr) {
+void PacketEditor::ChangeSourceAddr(uint32_t new_source_addr,
+                                    ChecksumUpdate update) {
+  if (update == kIncrementalChecksum) {
+    AdjustChecksum(rep_->source_addr, new_source_addr);
+  }
   rep_->source_addr = new_source_addr;
 }
 
-void PacketEditor::ChangeDestAddr(uint32_t new_dest_addr) {
+void PacketEditor::ChangeDestAddr(uint32_t new_dest_addr,
+                                  ChecksumUpdate update) {
+  if (update == kIncrementalChecksum) {
+    AdjustChecksum(rep_->dest_addr, new_dest_addr);
+  }
   rep_->dest_addr = new_dest_addr;
 }
 
+// http://www.rfc-archive.org/getrfc.php?rfc=1624
+// Addresses are covered by the header checksum and by the pseudo header of
+// TCP/UDP checksums.
+void PacketEditor::AdjustChecksum(uint32_t old_addr, uint32_t new_addr) {
+  rep_->checksum = ChecksumAdjust32(rep_->checksum, old_addr, new_addr);
+  // Only the first fragment carries the segment header
+  if (rep_->fragment_offset_low != 0 || rep_->fragment_offset_high != 0) {
+    return;
+  }
+  PacketRef packet_ref = ref();
+  SegmentRef<tcp::TCPRep> tcp;
+  if (packet_ref.GetTCPSegmentRef(&tcp) &&
+      tcp.segment_len >= offsetof(tcp::TCPRep, urgent_pointer)) {
+    tcp::TCPRep *rep = const_cast<tcp::TCPRep *>(tcp.rep);
+    rep->checksum = ChecksumAdjust32(rep->checksum, old_addr, new_addr);
+    return;
+  }
+  SegmentRef<udp::UDPRep> udp;
+  if (packet_ref.GetUDPSegmentRef(&udp) &&
+      udp.segment_len >= offsetof(udp::UDPRep, data)) {
+    udp::UDPRep *rep = const_cast<udp::UDPRep *>(udp.rep);
+    // Zero means the sender didn't compute a checksum
+    if (rep->checksum == 0) {
+      return;
+    }
+    rep->checksum = ChecksumAdjust32(rep->checksum, old_addr, new_addr);
+    if (rep->checksum == 0) {
+      rep->checksum = 0xffff;
+    }
+  }
+}
+
 void PacketEditor::SwapAddr() { std::swap(rep_->source_addr, rep_->dest_addr); }
 
 bool PacketEditor::ValidateChecksum() const {
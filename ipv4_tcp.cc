@@ -16,11 +16,20 @@ TCPSegmentEditor::TCPSegmentEditor(PacketRef packet, uint8_t *segment,
                                    size_t len)
     : packet_(packet), rep_(reinterpret_cast<TCPRep *>(segment)), len_(len) {}
 
-void TCPSegmentEditor::ChangeSourcePort(uint16_t new_port) {
+void TCPSegmentEditor::ChangeSourcePort(uint16_t new_port,
+                                        ChecksumUpdate update) {
+  if (update == kIncrementalChecksum) {
+    rep_->checksum =
+        ChecksumAdjust(rep_->checksum, rep_->source_port, new_port);
+  }
   rep_->source_port = new_port;
 }
 
-void TCPSegmentEditor::ChangeDestPort(uint16_t new_port) {
+void TCPSegmentEditor::ChangeDestPort(uint16_t new_port,
+                                      ChecksumUpdate update) {
+  if (update == kIncrementalChecksum) {
+    rep_->checksum = ChecksumAdjust(rep_->checksum, rep_->dest_port, new_port);
+  }
   rep_->dest_port = new_port;
 }
 
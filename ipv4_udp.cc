@@ -14,14 +14,34 @@ UDPSegmentEditor::UDPSegmentEditor(PacketRef packet, uint8_t *segment,
                                    size_t len)
     : packet_(packet), rep_(reinterpret_cast<UDPRep *>(segment)), len_(len) {}
 
-void UDPSegmentEditor::ChangeSourcePort(uint16_t new_port) {
+void UDPSegmentEditor::ChangeSourcePort(uint16_t new_port,
+                                        ChecksumUpdate update) {
+  if (update == kIncrementalChecksum) {
+    AdjustChecksum(rep_->source_port, new_port);
+  }
   rep_->source_port = new_port;
 }
 
-void UDPSegmentEditor::ChangeDestPort(uint16_t new_port) {
+void UDPSegmentEditor::ChangeDestPort(uint16_t new_port,
+                                      ChecksumUpdate update) {
+  if (update == kIncrementalChecksum) {
+    AdjustChecksum(rep_->dest_port, new_port);
+  }
   rep_->dest_port = new_port;
 }
 
+void UDPSegmentEditor::AdjustChecksum(uint16_t old_port, uint16_t new_port) {
+  // Zero means the sender didn't compute a checksum
+  if (rep_->checksum == 0) {
+    return;
+  }
+  rep_->checksum = ChecksumAdjust(rep_->checksum, old_port, new_port);
+  // A computed zero is transmitted as all ones, RFC 768
+  if (rep_->checksum == 0) {
+    rep_->checksum = 0xffff;
+  }
+}
+
 void UDPSegmentEditor::SwapPort() {
   std::swap(rep_->source_port, rep_->dest_port);
 }
@@ -0,0 +1,238 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <cassert>
+
+#include "kale/nat.h"
+
+namespace kale {
+
+const uint32_t Nat::kEmpty;
+
+namespace {
+
+size_t TableSize(size_t ports) {
+  size_t n = 1;
+  while (n < 2 * ports) {
+    n <<= 1;
+  }
+  return n;
+}
+
+// Hash of the subnet host of a flow, its port left out
+size_t HostHash(const FlowKey &key) {
+  uint64_t h = (static_cast<uint64_t>(key.peer_addr) << 32) | key.subnet_addr;
+  h = (h ^ key.peer_port) * 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 29);
+}
+
+}  // namespace
+
+Nat::Nat(const std::vector<uint32_t> &addrs, uint16_t port_min,
+         uint16_t port_max, uint32_t idle_timeout)
+    : addrs_(addrs),
+      port_min_(port_min),
+      port_max_(port_max),
+      ports_(port_max - port_min + 1),
+      idle_timeout_(idle_timeout),
+      now_(0),
+      size_(0),
+      mask_(TableSize(addrs.size() * ports_) - 1),
+      table_(mask_ + 1),
+      bindings_(addrs.size() * ports_),
+      free_(bindings_.size()),
+      free_lists_(addrs.size()),
+      wheel_(bindings_.size()) {
+  assert(!addrs.empty());
+  assert(port_min <= port_max);
+  assert(idle_timeout > 0);
+  for (auto &slot : table_) {
+    slot.index = kEmpty;
+  }
+  for (size_t i = 0; i < bindings_.size(); ++i) {
+    bindings_[i].used = false;
+    free_[i] = i % ports_;
+  }
+  for (auto &list : free_lists_) {
+    list.head = 0;
+    list.count = ports_;
+  }
+}
+
+size_t Nat::Hash(const FlowKey &key) {
+  uint64_t a = (static_cast<uint64_t>(key.peer_addr) << 32) | key.subnet_addr;
+  uint64_t b = (static_cast<uint64_t>(key.peer_port) << 16) | key.subnet_port;
+  uint64_t h = (a ^ (b * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+  return h ^ (h >> 32);
+}
+
+size_t Nat::Probe(const FlowKey &key) const {
+  size_t i = Hash(key) & mask_;
+  while (table_[i].index != kEmpty && !(table_[i].key == key)) {
+    i = (i + 1) & mask_;
+  }
+  return i;
+}
+
+Endpoint Nat::EndpointOf(uint32_t index) const {
+  Endpoint local;
+  local.addr = addrs_[index / ports_];
+  local.port = port_min_ + index % ports_;
+  return local;
+}
+
+uint32_t Nat::IndexOf(const Endpoint &local) const {
+  if (local.port < port_min_ || local.port > port_max_) {
+    return kEmpty;
+  }
+  for (size_t i = 0; i < addrs_.size(); ++i) {
+    if (addrs_[i] != local.addr) {
+      continue;
+    }
+    uint32_t index = i * ports_ + local.port - port_min_;
+    return bindings_[index].used ? index : kEmpty;
+  }
+  return kEmpty;
+}
+
+kl::Result<Endpoint> Nat::Map(const FlowKey &key) {
+  size_t slot = Probe(key);
+  if (table_[slot].index != kEmpty) {
+    uint32_t index = table_[slot].index;
+    bindings_[index].last_seen = now_;
+    return kl::Ok(EndpointOf(index));
+  }
+  // The host's address first, then whichever has a free port
+  size_t first = HostHash(key) % addrs_.size();
+  size_t addr = first;
+  while (free_lists_[addr].count == 0) {
+    addr = (addr + 1) % addrs_.size();
+    if (addr == first) {
+      return kl::Err("all %u ports from %u of %u addresses are in use",
+                     ports_, port_min_, static_cast<unsigned>(addrs_.size()));
+    }
+  }
+  FreeList &list = free_lists_[addr];
+  uint32_t index = addr * ports_ + free_[addr * ports_ + list.head];
+  list.head = (list.head + 1) % ports_;
+  --list.count;
+  Binding &binding = bindings_[index];
+  binding.key = key;
+  binding.last_seen = now_;
+  binding.timeout = idle_timeout_;
+  binding.state = 0;
+  binding.used = true;
+  table_[slot].key = key;
+  table_[slot].index = index;
+  wheel_.Schedule(index, now_ + idle_timeout_);
+  ++size_;
+  return kl::Ok(EndpointOf(index));
+}
+
+bool Nat::QueryEndpoint(const FlowKey &key, Endpoint *local) {
+  size_t slot = Probe(key);
+  if (table_[slot].index == kEmpty) {
+    return false;
+  }
+  bindings_[table_[slot].index].last_seen = now_;
+  *local = EndpointOf(table_[slot].index);
+  return true;
+}
+
+bool Nat::QueryFlow(const Endpoint &local, FlowKey *key) {
+  uint32_t index = IndexOf(local);
+  if (index == kEmpty) {
+    return false;
+  }
+  bindings_[index].last_seen = now_;
+  *key = bindings_[index].key;
+  return true;
+}
+
+bool Nat::Remove(const Endpoint &local) {
+  uint32_t index = IndexOf(local);
+  if (index == kEmpty) {
+    return false;
+  }
+  wheel_.Cancel(index);
+  Release(index);
+  return true;
+}
+
+bool Nat::GetState(const Endpoint &local, uint8_t *state) const {
+  uint32_t index = IndexOf(local);
+  if (index == kEmpty) {
+    return false;
+  }
+  *state = bindings_[index].state;
+  return true;
+}
+
+bool Nat::SetState(const Endpoint &local, uint8_t state,
+                   uint32_t idle_timeout) {
+  assert(idle_timeout > 0);
+  uint32_t index = IndexOf(local);
+  if (index == kEmpty) {
+    return false;
+  }
+  Binding &binding = bindings_[index];
+  binding.state = state;
+  if (binding.timeout != idle_timeout) {
+    binding.timeout = idle_timeout;
+    // A shorter timeout must not wait for the pending timer
+    wheel_.Schedule(index, binding.last_seen + idle_timeout);
+  }
+  return true;
+}
+
+size_t Nat::Advance(uint64_t now) {
+  if (now < now_) {
+    return 0;
+  }
+  now_ = now;
+  size_t released = 0;
+  wheel_.Advance(now, [this, &released](uint32_t index) {
+    uint64_t expires = bindings_[index].last_seen + bindings_[index].timeout;
+    if (expires > now_) {
+      // Seen while the timer was pending
+      wheel_.Schedule(index, expires);
+      return;
+    }
+    Release(index);
+    ++released;
+  });
+  return released;
+}
+
+void Nat::Release(uint32_t index) {
+  Binding &binding = bindings_[index];
+  assert(binding.used);
+  Erase(Probe(binding.key));
+  binding.used = false;
+  --size_;
+  uint32_t addr = index / ports_;
+  FreeList &list = free_lists_[addr];
+  free_[addr * ports_ + (list.head + list.count) % ports_] = index % ports_;
+  ++list.count;
+}
+
+// Backward shift deletion, no tombstones are left behind so probe sequences
+// never grow with churn.
+void Nat::Erase(size_t slot) {
+  assert(table_[slot].index != kEmpty);
+  size_t hole = slot;
+  size_t i = (hole + 1) & mask_;
+  while (table_[i].index != kEmpty) {
+    size_t home = Hash(table_[i].key) & mask_;
+    // Move the entry into the hole unless its home lies in (hole, i]
+    if (((i - home) & mask_) >= ((i - hole) & mask_)) {
+      table_[hole] = table_[i];
+      hole = i;
+    }
+    i = (i + 1) & mask_;
+  }
+  table_[hole].index = kEmpty;
+}
+
+}  // namespace kale
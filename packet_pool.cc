@@ -0,0 +1,161 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <utility>
+
+#include "kale/packet_pool.h"
+
+namespace kale {
+
+namespace {
+
+size_t RoundUp(size_t n, size_t align) {
+  return (n + align - 1) / align * align;
+}
+
+}  // namespace
+
+PacketBuffer::PacketBuffer(const PacketBuffer &other)
+    : pool_(other.pool_),
+      index_(other.index_),
+      offset_(other.offset_),
+      length_(other.length_) {
+  if (pool_) {
+    pool_->refs_[index_].fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+PacketBuffer::PacketBuffer(PacketBuffer &&other)
+    : pool_(other.pool_),
+      index_(other.index_),
+      offset_(other.offset_),
+      length_(other.length_) {
+  other.pool_ = nullptr;
+}
+
+PacketBuffer &PacketBuffer::operator=(PacketBuffer other) {
+  std::swap(pool_, other.pool_);
+  std::swap(index_, other.index_);
+  std::swap(offset_, other.offset_);
+  std::swap(length_, other.length_);
+  return *this;
+}
+
+void PacketBuffer::Reset() {
+  if (!pool_) {
+    return;
+  }
+  PacketPool *pool = pool_;
+  uint32_t index;
+  if (pool->Detach(this, &index)) {
+    pool->Free(index);
+  }
+}
+
+bool PacketBuffer::Shared() const {
+  return pool_ && pool_->refs_[index_].load(std::memory_order_acquire) > 1;
+}
+
+// Buffers are whole cache lines, which BufferPool starts them on, so
+// packets of different threads never share one. The tailroom takes up the
+// rounding.
+PacketPool::PacketPool(size_t count, size_t data_room, size_t headroom,
+                       size_t tailroom)
+    : count_(count),
+      headroom_(headroom),
+      data_room_(data_room),
+      stride_(RoundUp(headroom + data_room + tailroom, kCacheLineSize)),
+      buffers_(count, stride_),
+      refs_(new std::atomic<uint32_t>[count]) {
+  for (size_t i = 0; i < count_; ++i) {
+    refs_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+PacketPool::~PacketPool() { assert(buffers_.Available() == count_); }
+
+bool PacketPool::Get(PacketBuffer *packet) {
+  uint32_t index;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!buffers_.Get(&index)) {
+      return false;
+    }
+  }
+  *packet = Wrap(index);
+  return true;
+}
+
+size_t PacketPool::Available() { return buffers_.Available(); }
+
+bool PacketPool::Detach(PacketBuffer *packet, uint32_t *index) {
+  assert(packet->pool_ == this);
+  *index = packet->index_;
+  packet->pool_ = nullptr;
+  uint32_t refs = refs_[*index].fetch_sub(1, std::memory_order_acq_rel);
+  assert(refs > 0);
+  return refs == 1;
+}
+
+void PacketPool::Free(uint32_t index) { buffers_.Put(index); }
+
+PacketBuffer PacketPool::Wrap(uint32_t index) {
+  assert(refs_[index].load(std::memory_order_relaxed) == 0);
+  refs_[index].store(1, std::memory_order_relaxed);
+  return PacketBuffer(this, index, headroom_);
+}
+
+size_t PacketPool::Take(size_t n, std::vector<uint32_t> *out) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  size_t i = 0;
+  uint32_t index;
+  for (; i < n && buffers_.Get(&index); ++i) {
+    out->push_back(index);
+  }
+  return i;
+}
+
+void PacketPool::Give(size_t n, std::vector<uint32_t> *in) {
+  assert(n <= in->size());
+  for (size_t i = in->size() - n; i < in->size(); ++i) {
+    buffers_.Put((*in)[i]);
+  }
+  in->resize(in->size() - n);
+}
+
+PacketPool::Cache::Cache(PacketPool *pool, size_t size)
+    : pool_(pool), size_(size) {
+  assert(size >= 2);
+  free_.reserve(size_);
+}
+
+PacketPool::Cache::~Cache() { pool_->Give(free_.size(), &free_); }
+
+// Refilled and drained by half its size, a thread getting and recycling
+// one buffer at a time around a boundary doesn't hit the pool on each call.
+bool PacketPool::Cache::Get(PacketBuffer *packet) {
+  if (free_.empty() && pool_->Take(size_ / 2, &free_) == 0) {
+    return false;
+  }
+  uint32_t index = free_.back();
+  free_.pop_back();
+  *packet = pool_->Wrap(index);
+  return true;
+}
+
+void PacketPool::Cache::Recycle(PacketBuffer *packet) {
+  if (!packet->Valid()) {
+    return;
+  }
+  uint32_t index;
+  if (!pool_->Detach(packet, &index)) {
+    return;
+  }
+  if (free_.size() == size_) {
+    pool_->Give(size_ / 2, &free_);
+  }
+  free_.push_back(index);
+}
+
+}  // namespace kale
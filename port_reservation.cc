@@ -0,0 +1,240 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <sys/wait.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "kale/port_reservation.h"
+#include "kl/string.h"
+
+namespace kale {
+namespace ports {
+
+const char *kLocalReservedPorts = "/proc/sys/net/ipv4/ip_local_reserved_ports";
+
+namespace {
+
+bool Succeeded(int status) {
+  return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Runs @command with @input on its stdin.
+kl::Result<void> Feed(const char *command, const std::string &input) {
+  FILE *pipe = ::popen(command, "w");
+  if (pipe == nullptr) {
+    return kl::Err(errno, "%s: %s", command, std::strerror(errno));
+  }
+  size_t written = std::fwrite(input.data(), 1, input.size(), pipe);
+  int status = ::pclose(pipe);
+  if (written != input.size() || !Succeeded(status)) {
+    return kl::Err("%s failed to load:\n%s", command, input.c_str());
+  }
+  return kl::Ok();
+}
+
+const size_t kNumPorts = 65536;
+
+kl::Result<std::string> ReadList(const char *path) {
+  std::ifstream in(path);
+  if (!in) {
+    return kl::Err("can't read %s", path);
+  }
+  std::string list;
+  std::getline(in, list);
+  return kl::Ok(list);
+}
+
+// The kernel replaces the whole list on write.
+kl::Result<void> WriteList(const char *path, const std::string &list) {
+  std::ofstream out(path);
+  out << list << "\n";
+  out.flush();
+  if (!out) {
+    return kl::Err("can't write %s to %s", list.c_str(), path);
+  }
+  return kl::Ok();
+}
+
+kl::Result<PortSet> ReadPorts(const char *path) {
+  auto list = ReadList(path);
+  if (!list) {
+    return kl::Err(list.MoveErr());
+  }
+  return ParsePorts(*list);
+}
+
+}  // namespace
+
+kl::Result<PortSet> ParsePorts(const std::string &list) {
+  PortSet ports(kNumPorts, false);
+  std::istringstream items(list);
+  std::string item;
+  while (std::getline(items, item, ',')) {
+    if (item.empty()) {
+      continue;
+    }
+    unsigned low, high;
+    char extra;
+    int n = std::sscanf(item.c_str(), "%u-%u%c", &low, &high, &extra);
+    if (n == 1) {
+      high = low;
+    }
+    if (n < 1 || n > 2 || low > high || high >= kNumPorts) {
+      return kl::Err("bad port range %s", item.c_str());
+    }
+    for (unsigned port = low; port <= high; ++port) {
+      ports[port] = true;
+    }
+  }
+  return kl::Ok(std::move(ports));
+}
+
+std::string FormatPorts(const PortSet &ports) {
+  std::string list;
+  size_t port = 0;
+  while (port < ports.size()) {
+    if (!ports[port]) {
+      ++port;
+      continue;
+    }
+    size_t low = port;
+    while (port + 1 < ports.size() && ports[port + 1]) {
+      ++port;
+    }
+    if (!list.empty()) {
+      list += ",";
+    }
+    list += low == port
+                ? kl::string::FormatString("%zu", low)
+                : kl::string::FormatString("%zu-%zu", low, port);
+    ++port;
+  }
+  return list;
+}
+
+kl::Result<PortSet> ReserveLocalPorts(uint16_t port_min, uint16_t port_max,
+                                      const char *path) {
+  auto listed = ReadPorts(path);
+  if (!listed) {
+    return kl::Err(listed.MoveErr());
+  }
+  PortSet added(kNumPorts, false);
+  bool changed = false;
+  for (unsigned port = port_min; port <= port_max; ++port) {
+    if (!(*listed)[port]) {
+      (*listed)[port] = true;
+      added[port] = true;
+      changed = true;
+    }
+  }
+  if (changed) {
+    auto write = WriteList(path, FormatPorts(*listed));
+    if (!write) {
+      return kl::Err(write.MoveErr());
+    }
+  }
+  return kl::Ok(std::move(added));
+}
+
+kl::Result<void> ReleaseLocalPorts(const PortSet &ports, const char *path) {
+  auto listed = ReadPorts(path);
+  if (!listed) {
+    return kl::Err(listed.MoveErr());
+  }
+  bool changed = false;
+  for (size_t port = 0; port < ports.size() && port < kNumPorts; ++port) {
+    if (ports[port] && (*listed)[port]) {
+      (*listed)[port] = false;
+      changed = true;
+    }
+  }
+  if (!changed) {
+    return kl::Ok();
+  }
+  return WriteList(path, FormatPorts(*listed));
+}
+
+std::string RuleSetName(uint16_t port_min, uint16_t port_max) {
+  return kl::string::FormatString("KALE_%u_%u", port_min, port_max);
+}
+
+std::string DropRules(Firewall firewall, uint16_t port_min, uint16_t port_max,
+                      bool hook) {
+  std::string name = RuleSetName(port_min, port_max);
+  if (firewall == kNftables) {
+    // Declaring the table first lets the delete succeed on the first load
+    const char *kFormat =
+        "table ip %s\n"
+        "delete table ip %s\n"
+        "table ip %s {\n"
+        "  chain input {\n"
+        "    type filter hook input priority 0; policy accept;\n"
+        "    tcp dport %u-%u drop\n"
+        "    udp dport %u-%u drop\n"
+        "  }\n"
+        "}\n";
+    return kl::string::FormatString(kFormat, name.c_str(), name.c_str(),
+                                    name.c_str(), port_min, port_max, port_min,
+                                    port_max);
+  }
+  // With --noflush a declared chain is flushed, other chains are kept
+  const char *kFormat =
+      "*filter\n"
+      ":%s - [0:0]\n"
+      "-A %s -p tcp -m tcp --dport %u:%u -j DROP\n"
+      "-A %s -p udp -m udp --dport %u:%u -j DROP\n";
+  std::string rules = kl::string::FormatString(
+      kFormat, name.c_str(), name.c_str(), port_min, port_max, name.c_str(),
+      port_min, port_max);
+  if (hook) {
+    rules += kl::string::FormatString("-I INPUT -j %s\n", name.c_str());
+  }
+  rules += "COMMIT\n";
+  return rules;
+}
+
+kl::Result<void> InstallDropRules(Firewall firewall, uint16_t port_min,
+                                  uint16_t port_max) {
+  if (firewall == kNftables) {
+    return Feed("nft -f -", DropRules(firewall, port_min, port_max));
+  }
+  std::string check = kl::string::FormatString(
+      "iptables -C INPUT -j %s 2> /dev/null",
+      RuleSetName(port_min, port_max).c_str());
+  bool hooked = Succeeded(::system(check.c_str()));
+  return Feed("iptables-restore --noflush",
+              DropRules(firewall, port_min, port_max, !hooked));
+}
+
+std::string DeleteRules(Firewall firewall, uint16_t port_min,
+                        uint16_t port_max) {
+  std::string name = RuleSetName(port_min, port_max);
+  if (firewall == kNftables) {
+    return kl::string::FormatString("delete table ip %s\n", name.c_str());
+  }
+  // A chain is deleted once nothing jumps to it and it's empty
+  const char *kFormat =
+      "*filter\n"
+      "-D INPUT -j %s\n"
+      "-F %s\n"
+      "-X %s\n"
+      "COMMIT\n";
+  return kl::string::FormatString(kFormat, name.c_str(), name.c_str(),
+                                  name.c_str());
+}
+
+kl::Result<void> RemoveDropRules(Firewall firewall, uint16_t port_min,
+                                 uint16_t port_max) {
+  return Feed(firewall == kNftables ? "nft -f -" : "iptables-restore --noflush",
+              DeleteRules(firewall, port_min, port_max));
+}
+
+}  // namespace ports
+}  // namespace kale
@@ -3,10 +3,13 @@
 // the LICENSE file.
 
 #include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <stdexcept>
 #include <thread>
 #include <unistd.h>
 
-#include "kale/ip.h"
+#include "kale/dns.h"
 #include "kale/resolver.h"
 #include "kl/env.h"
 #include "kl/epoll.h"
@@ -15,8 +18,111 @@
 
 namespace kale {
 
-Resolver::Resolver(int fd) : fd_(fd), transaction_id_(0), stop_listen_(false) {
+namespace {
+
+// Milliseconds a query of SendQuery waits for WaitForResult
+const int kSendQueryTimeout = 60000;
+// Most milliseconds the listen thread waits, so it notices it's stopped
+const uint64_t kMaxWait = 1000;
+// Retransmission timeout in microseconds of an upstream without RTT
+// samples
+const uint64_t kInitialRTO = 100000;
+
+using UpstreamStats = Resolver::UpstreamStats;
+
+// Microseconds
+uint64_t RetransmitTimeout(const UpstreamStats &stats) {
+  if (stats.srtt == 0) {
+    return kInitialRTO;
+  }
+  return stats.srtt + 4 * stats.rttvar;
+}
+
+// Of the answer of an upstream, lost queries cost a retransmission each.
+double ExpectedLatency(const UpstreamStats &stats) {
+  return RetransmitTimeout(stats) / (1 - std::min(stats.loss, 0.9));
+}
+
+// Refer to RFC 6298.
+void AddRTTSample(UpstreamStats *stats, uint64_t rtt) {
+  rtt = std::max<uint64_t>(rtt, 1);
+  if (stats->srtt == 0) {
+    stats->srtt = rtt;
+    stats->rttvar = rtt / 2;
+    return;
+  }
+  uint64_t delta = stats->srtt > rtt ? stats->srtt - rtt : rtt - stats->srtt;
+  stats->rttvar = (3 * stats->rttvar + delta) / 4;
+  stats->srtt = (7 * stats->srtt + rtt) / 8;
+}
+
+void AddLossSample(UpstreamStats *stats, bool lost) {
+  stats->loss += ((lost ? 1.0 : 0.0) - stats->loss) / 8;
+}
+
+bool SameAddr(const struct sockaddr_in &a, const struct sockaddr_in &b) {
+  return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+int SendTo(int fd, const uint8_t *query, size_t len,
+           const struct sockaddr_in &addr) {
+  return ::sendto(fd, query, len, 0,
+                  reinterpret_cast<const struct sockaddr *>(&addr),
+                  sizeof(addr));
+}
+
+Resolver::Callback
+Fulfill(std::shared_ptr<std::promise<kl::Result<std::vector<std::string>>>>
+            promise) {
+  return [promise](kl::Result<std::vector<std::string>> result) {
+    promise->set_value(std::move(result));
+  };
+}
+
+kl::Result<std::vector<std::string>> ToResult(DNSAnswer *answer) {
+  if (answer->rcode != 0) {
+    return kl::Err(answer->rcode, "failed to fectch records, error code %u",
+                   answer->rcode);
+  }
+  return kl::Ok(std::move(answer->records));
+}
+
+// Text of the address of A and AAAA records, of the name of others.
+kl::Result<size_t> FormatRecord(const dns::Reader &reader,
+                                const dns::Record &record, char *buf,
+                                size_t size) {
+  if (record.type == dns::kTypeA || record.type == dns::kTypeAAAA) {
+    return dns::FormatAddress(reader, record, buf, size);
+  }
+  auto target = dns::TargetName(reader, record);
+  if (!target) {
+    return target;
+  }
+  return dns::ReadName(reader.Packet(), reader.Length(), *target, buf, size);
+}
+
+}  // namespace
+
+Resolver::Resolver(int fd, size_t cache_capacity)
+    : fd_(fd),
+      stop_listen_(false),
+      listening_(true),
+      slots_(kMaxPending),
+      wheel_(kMaxPending),
+      hedge_wheel_(kMaxPending),
+      next_id_(0),
+      hedge_delay_(kAdaptiveHedge),
+      start_(std::chrono::steady_clock::now()),
+      wake_fd_(-1),
+      cache_(cache_capacity) {
   assert(fd_ >= 0);
+  for (auto &slot : slots_) {
+    slot.busy = false;
+  }
+  wake_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd_ < 0) {
+    throw std::runtime_error(std::strerror(errno));
+  }
   // Launch a thread to receive response
   LaunchListenThread();
 }
@@ -26,90 +132,64 @@ void Resolver::SetExitReason(const char *func, int line, const char *reason) {
   exit_reason_ = reason;
 }
 
-kl::Result<std::pair<uint16_t, std::vector<std::string>>>
-Resolver::ParseResponse(const uint8_t *packet, size_t len) {
-  if (len < 12) {
-    return kl::Err("insufficient header length");
-  }
-  // refer to https://www.ietf.org/rfc/rfc1035.txt
-  uint8_t response_code = *(packet + 3) & 0x0f;
-  if (response_code != 0) {
-    return kl::Err(response_code, "failed to fectch records, error code %u",
-                   response_code);
-  }
-  std::vector<std::string> result;
-  uint16_t transaction_id = ntohs(*reinterpret_cast<const uint16_t *>(packet));
-  uint16_t question_count =
-      ntohs(*reinterpret_cast<const uint16_t *>(packet + 4));
-  // KL_DEBUG("number of questions: %u", question_count);
-  uint16_t answer_count =
-      ntohs(*reinterpret_cast<const uint16_t *>(packet + 6));
-  // KL_DEBUG("number of answers: %u", answer_count);
-  uint16_t nameserver_count =
-      ntohs(*reinterpret_cast<const uint16_t *>(packet + 8));
-  uint16_t additional_count =
-      ntohs(*reinterpret_cast<const uint16_t *>(packet + 10));
-  const uint8_t *ptr = packet + 12;
-  for (uint16_t i = 0; i < question_count; ++i) {
-    int count = SkipDNSName(ptr);
-    ptr += count + 4;
-  }
-  std::string record;
-  for (uint16_t i = 0; i < answer_count; ++i) {
-    auto count = RetrieveRecord(ptr, &record);
-    if (!count) {
-      continue;
+// A failed answer is parsed as well, so it can be cached. The TTL is the
+// least of the answer section, CNAME records leading to the answer
+// included.
+kl::Result<std::pair<uint16_t, DNSAnswer>>
+Resolver::ParseResponse(const uint8_t *packet, size_t len, std::string *name,
+                        uint16_t *type) {
+  dns::Reader reader(packet, len);
+  auto header = reader.ReadHeader();
+  if (!header) {
+    return kl::Err(header.MoveErr());
+  }
+  DNSAnswer result;
+  result.rcode = reader.Rcode();
+  dns::Question question;
+  auto next = reader.NextQuestion(&question);
+  if (!next) {
+    return kl::Err(next.MoveErr());
+  }
+  uint16_t asked = *next ? question.type : dns::kTypeA;
+  char text[dns::kMaxNameText];
+  if (*next && name) {
+    auto read = dns::ReadName(packet, len, question.name, text, sizeof(text));
+    if (!read) {
+      return kl::Err(read.MoveErr());
     }
-    ptr += *count;
-    result.push_back(std::move(record));
+    name->assign(text, *read);
+  }
+  if (type) {
+    *type = asked;
   }
-  for (uint16_t i = 0; i < nameserver_count; ++i) {
-    auto count = RetrieveRecord(ptr, &record);
-    if (!count) {
+  dns::Record record;
+  while (result.rcode == dns::kRcodeNoError) {
+    auto next = reader.NextRecord(&record);
+    if (!next) {
+      return kl::Err(next.MoveErr());
+    }
+    if (!*next || record.section != dns::kAnswer) {
+      break;
+    }
+    if (record.cls != dns::kClassIN) {
       continue;
     }
-    ptr += *count;
-    result.push_back(std::move(record));
-  }
-  for (uint16_t i = 0; i < additional_count; ++i) {
-    auto count = RetrieveRecord(ptr, &record);
-    if (!count) {
+    if (record.type == asked) {
+      auto format = FormatRecord(reader, record, text, sizeof(text));
+      if (format) {
+        result.records.emplace_back(text, *format);
+      }
+    } else if (record.type != dns::kTypeCNAME) {
       continue;
     }
-    ptr += *count;
-    result.push_back(std::move(record));
+    if (result.ttl == 0 || record.ttl < result.ttl) {
+      result.ttl = record.ttl;
+    }
   }
-  return kl::Ok(std::make_pair(transaction_id, std::move(result)));
-}
-
-// TODO(Kai Luo): support more type
-// Support only IN class at present
-kl::Result<int> Resolver::RetrieveRecord(const uint8_t *base,
-                                         std::string *record) {
-  const uint8_t *ptr = base;
-  // is a pointer
-  if ((*ptr & 0xc0) == 0xc0) {
-    ptr += 2;
-  } else {
-    ptr += SkipDNSName(ptr);
-  }
-  uint16_t type = ntohs(*reinterpret_cast<const uint16_t *>(ptr));
-  ptr += 2;
-  uint16_t cls = ntohs(*reinterpret_cast<const uint16_t *>(ptr));
-  if (type != 0x0001 || cls != 0x0001) {
-    return kl::Err("unimplemented type or class");
-  }
-  ptr += 2;
-  // skip ttl
-  ptr += 4;
-  uint16_t length = ntohs(*reinterpret_cast<const uint16_t *>(ptr));
-  ptr += 2;
-  assert(length == 4);
-  *record = inet_ntoa(in_addr{
-      .s_addr = *reinterpret_cast<const uint32_t *>(ptr),
-  });
-  ptr += 4;
-  return kl::Ok(static_cast<int>(ptr - base));
+  if (result.records.empty()) {
+    result.ttl = 0;
+  }
+  return kl::Ok(std::make_pair(reader.Id(), std::move(result)));
 }
 
 void Resolver::LaunchListenThread() {
@@ -117,144 +197,552 @@ void Resolver::LaunchListenThread() {
     kl::env::SetNonBlocking(fd_);
     kl::Epoll epoll;
     epoll.AddFd(fd_, EPOLLET | EPOLLIN);
+    epoll.AddFd(wake_fd_, EPOLLIN);
     while (!stop_listen_) {
-      auto wait = epoll.Wait(1, 1000);
+      // Until the first hedge or timeout due, Submit wakes it up for an
+      // earlier one
+      int timeout;
+      {
+        std::unique_lock<std::mutex> _(mutex_);
+        uint64_t now = Now();
+        uint64_t next = NextDeadline();
+        timeout = next <= now ? 0 : std::min(next - now, kMaxWait);
+      }
+      auto wait = epoll.Wait(2, timeout);
       if (!wait) {
         SetExitReason(__FUNCTION__, __LINE__, wait.Err().ToCString());
+        FailPending();
         return;
       }
-      auto &event_list = *wait;
-      if (event_list.size() == 0) {
-        continue;
-      }
-      auto &event = event_list[0];
-      int fd = event.data.fd;
-      uint32_t events = event.events;
-      if (events & EPOLLIN) {
-        char buf[65536];
-        while (true) {
-          int nread = ::read(fd, buf, sizeof(buf));
-          if (nread < 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-              SetExitReason(__FUNCTION__, __LINE__, std::strerror(errno));
-              return;
-            } else {
-              break;
-            }
+      for (auto &event : *wait) {
+        if (event.data.fd == wake_fd_) {
+          uint64_t count;
+          if (::read(wake_fd_, &count, sizeof(count)) < 0) {
+            KL_ERROR(std::strerror(errno));
           }
-          assert(nread >= 0);
-          auto parse =
-              ParseResponse(reinterpret_cast<const uint8_t *>(buf), nread);
-          if (!parse) {
-            KL_ERROR(parse.Err().ToCString());
-            continue;
+          continue;
+        }
+        int fd = event.data.fd;
+        uint32_t events = event.events;
+        if (events & EPOLLIN) {
+          char buf[65536];
+          while (true) {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            int nread = ::recvfrom(fd, buf, sizeof(buf), 0,
+                                   reinterpret_cast<struct sockaddr *>(&from),
+                                   &from_len);
+            if (nread < 0) {
+              if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                SetExitReason(__FUNCTION__, __LINE__,
+                              std::strerror(errno));
+                FailPending();
+                return;
+              } else {
+                break;
+              }
+            }
+            assert(nread >= 0);
+            HandleResponse(reinterpret_cast<const uint8_t *>(buf), nread,
+                           from);
           }
-          // Due to incremental transaction id, lock might be not needed
-          std::unique_lock<std::mutex> _(mutex_);
-          response_.insert(std::move(*parse));
-          cv_.notify_all();
         }
-      }
-      if (events & EPOLLERR) {
-        int err = kl::inet::SocketError(fd);
-        if (err != 0) {
-          SetExitReason(__FUNCTION__, __LINE__, std::strerror(err));
-        } else {
-          SetExitReason(__FUNCTION__, __LINE__, "EPOLLERR");
+        if (events & EPOLLERR) {
+          int err = kl::inet::SocketError(fd);
+          if (err != 0) {
+            SetExitReason(__FUNCTION__, __LINE__, std::strerror(err));
+          } else {
+            SetExitReason(__FUNCTION__, __LINE__, "EPOLLERR");
+          }
         }
       }
+      ReapExpired();
     }
   });
 }
 
+// Only answers to waiting queries from a server they were sent to are
+// taken, and cached, so a forged one has to guess the id and the name.
+// Others are dropped before anything is copied.
+void Resolver::HandleResponse(const uint8_t *packet, size_t len,
+                              const struct sockaddr_in &from) {
+  dns::Reader reader(packet, len);
+  dns::Question question;
+  auto header = reader.ReadHeader();
+  if (!header) {
+    KL_ERROR(header.Err().ToCString());
+    return;
+  }
+  auto next = reader.NextQuestion(&question);
+  if (!next || !*next || !reader.IsResponse()) {
+    KL_ERROR("response %u without question", reader.Id());
+    return;
+  }
+  uint16_t id = reader.Id();
+  Callback callback;
+  std::string name;
+  {
+    std::unique_lock<std::mutex> _(mutex_);
+    Slot &slot = slots_[id];
+    if (!slot.busy || question.type != dns::kTypeA ||
+        !dns::NameEquals(packet, len, question.name, slot.name.c_str())) {
+      KL_DEBUG("unexpected answer %u", id);
+      return;
+    }
+    if (slot.direct) {
+      if (!SameAddr(from, slot.server)) {
+        KL_DEBUG("answer %u from unexpected server", id);
+        return;
+      }
+    } else {
+      size_t i = 0;
+      while (i < upstreams_.size() && !SameAddr(from, upstreams_[i].addr)) {
+        ++i;
+      }
+      if (i == upstreams_.size() || !(slot.sent & 1u << i)) {
+        KL_DEBUG("answer %u from unexpected server", id);
+        return;
+      }
+      Account(slot, i, Micros());
+    }
+    callback = std::move(slot.callback);
+    name.swap(slot.name);
+    slot.busy = false;
+    wheel_.Cancel(id);
+    hedge_wheel_.Cancel(id);
+  }
+  auto parse = ParseResponse(packet, len);
+  if (!parse) {
+    callback(kl::Err(parse.MoveErr()));
+    return;
+  }
+  DNSAnswer &answer = parse->second;
+  {
+    std::unique_lock<std::mutex> _(cache_mutex_);
+    cache_.Insert(name, question.type, answer, DNSCache::Clock::now());
+  }
+  callback(ToResult(&answer));
+}
+
+void Resolver::ReapExpired() {
+  std::vector<Callback> expired;
+  {
+    std::unique_lock<std::mutex> _(mutex_);
+    uint64_t now = Now();
+    uint64_t micros = Micros();
+    wheel_.Advance(now, [this, &expired, micros](uint32_t id) {
+      Slot &slot = slots_[id];
+      if (!slot.direct) {
+        Account(slot, -1, micros);
+      }
+      expired.push_back(std::move(slot.callback));
+      slot.busy = false;
+      hedge_wheel_.Cancel(id);
+    });
+    hedge_wheel_.Advance(now, [this, now, micros](uint32_t id) {
+      Slot &slot = slots_[id];
+      bool retry = QueriedAll(slot);
+      size_t i = NextUpstream(slot);
+      outgoing_.emplace_back();
+      Outgoing &out = outgoing_.back();
+      auto build = dns::BuildQuery(slot.name.c_str(), id, dns::kTypeA,
+                                   out.query, sizeof(out.query));
+      if (!build) {
+        outgoing_.pop_back();
+        return;
+      }
+      out.addr = upstreams_[i].addr;
+      out.len = *build;
+      MarkSent(&slot, i, micros);
+      slot.hedge_delay = retry ? slot.hedge_delay * 2 : HedgeDelay(i);
+      hedge_wheel_.Schedule(id, now + slot.hedge_delay);
+    });
+  }
+  for (auto &out : outgoing_) {
+    if (SendTo(fd_, out.query, out.len, out.addr) < 0) {
+      KL_ERROR(std::strerror(errno));
+    }
+  }
+  outgoing_.clear();
+  for (auto &callback : expired) {
+    callback(kl::Err("timeout"));
+  }
+}
+
+void Resolver::FailPending() {
+  std::vector<Callback> failed;
+  {
+    std::unique_lock<std::mutex> _(mutex_);
+    listening_ = false;
+    for (size_t id = 0; id < slots_.size(); ++id) {
+      Slot &slot = slots_[id];
+      if (!slot.busy) {
+        continue;
+      }
+      failed.push_back(std::move(slot.callback));
+      slot.busy = false;
+      wheel_.Cancel(id);
+      hedge_wheel_.Cancel(id);
+    }
+  }
+  for (auto &callback : failed) {
+    callback(kl::Err("listen thread has quit"));
+  }
+}
+
+uint64_t Resolver::NextDeadline() const {
+  return std::min(wheel_.NextExpiry(), hedge_wheel_.NextExpiry());
+}
+
+// In 64 bits, as every bit of sent is set with kMaxUpstreams upstreams.
+bool Resolver::QueriedAll(const Slot &slot) const {
+  return uint64_t{slot.sent} + 1 == uint64_t{1} << upstreams_.size();
+}
+
+size_t Resolver::NextUpstream(const Slot &slot) const {
+  bool all = QueriedAll(slot);
+  size_t best = upstreams_.size();
+  for (size_t i = 0; i < upstreams_.size(); ++i) {
+    if (!all && (slot.sent & 1u << i)) {
+      continue;
+    }
+    if (best == upstreams_.size() ||
+        ExpectedLatency(upstreams_[i].stats) <
+            ExpectedLatency(upstreams_[best].stats)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+void Resolver::MarkSent(Slot *slot, size_t upstream, uint64_t now) {
+  uint32_t bit = 1u << upstream;
+  if (slot->sent & bit) {
+    slot->resent |= bit;
+  } else {
+    slot->sent |= bit;
+    slot->sent_at[upstream] = now;
+  }
+  ++upstreams_[upstream].stats.sent;
+}
+
+uint64_t Resolver::HedgeDelay(size_t upstream) const {
+  if (hedge_delay_ > 0) {
+    return hedge_delay_;
+  }
+  return std::max<uint64_t>(
+      1, (RetransmitTimeout(upstreams_[upstream].stats) + 999) / 1000);
+}
+
+// The RTT isn't sampled from an upstream queried more than once, as its
+// answer may be to either query. One beaten by a hedge counts as a loss,
+// slow and lost look the same to the caller.
+void Resolver::Account(const Slot &slot, int winner, uint64_t now) {
+  for (size_t i = 0; i < upstreams_.size(); ++i) {
+    uint32_t bit = 1u << i;
+    if (!(slot.sent & bit)) {
+      continue;
+    }
+    UpstreamStats &stats = upstreams_[i].stats;
+    if (static_cast<int>(i) == winner) {
+      ++stats.answered;
+      AddLossSample(&stats, false);
+      if (!(slot.resent & bit)) {
+        AddRTTSample(&stats, now - slot.sent_at[i]);
+      }
+    } else {
+      ++stats.unanswered;
+      AddLossSample(&stats, true);
+    }
+  }
+}
+
+uint64_t Resolver::Now() const {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start_)
+      .count();
+}
+
+uint64_t Resolver::Micros() const {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start_)
+      .count();
+}
+
+kl::Result<void> Resolver::SetUpstreams(const std::vector<Upstream> &upstreams,
+                                        int hedge_delay) {
+  if (upstreams.size() > kMaxUpstreams) {
+    return kl::Err("more than %u upstreams",
+                   static_cast<unsigned>(kMaxUpstreams));
+  }
+  std::vector<UpstreamState> states(upstreams.size());
+  for (size_t i = 0; i < upstreams.size(); ++i) {
+    auto addr =
+        kl::inet::InetSockAddr(upstreams[i].addr.c_str(), upstreams[i].port);
+    if (!addr) {
+      return kl::Err(addr.MoveErr());
+    }
+    states[i].addr = *addr;
+    states[i].stats = UpstreamStats{0, 0, 0, 0, 0, 0};
+  }
+  std::unique_lock<std::mutex> _(mutex_);
+  if (wheel_.Size() > 0) {
+    return kl::Err("queries pending");
+  }
+  upstreams_ = std::move(states);
+  hedge_delay_ = hedge_delay;
+  return kl::Ok();
+}
+
+Resolver::UpstreamStats Resolver::Stats(size_t upstream) {
+  std::unique_lock<std::mutex> _(mutex_);
+  return upstreams_[upstream].stats;
+}
+
+size_t Resolver::Pending() {
+  std::unique_lock<std::mutex> _(mutex_);
+  return wheel_.Size();
+}
+
 void Resolver::StopListenThread() {
   stop_listen_.store(true);
   listen_thread_->join();
 }
 
+// Queries still waiting fail rather than leave their futures hanging.
 Resolver::~Resolver() {
   StopListenThread();
+  for (auto &slot : slots_) {
+    if (slot.busy) {
+      slot.busy = false;
+      slot.callback(kl::Err("resolver stopped"));
+    }
+  }
+  ::close(wake_fd_);
   if (fd_ >= 0) {
     ::close(fd_);
   }
 }
 
 std::string Resolver::FromDNSName(const uint8_t *base) {
-  std::vector<char> tmp;
-  uint8_t count = *base;
-  while (count != 0) {
-    while (count-- > 0) {
-      tmp.push_back(*(++base));
-    }
-    count = *(++base);
-    if (count) {
-      tmp.push_back('.');
-    }
+  char text[dns::kMaxNameText];
+  auto read = dns::ReadName(base, dns::kMaxNameLength, 0, text, sizeof(text));
+  if (!read) {
+    return std::string();
   }
-  return std::string(tmp.data(), tmp.size());
+  return std::string(text, *read);
 }
 
 int Resolver::SkipDNSName(const uint8_t *ptr) {
-  const uint8_t *base = ptr;
-  uint8_t count = *base;
-  while (count != 0) {
-    ptr += (count + 1);
-    count = *ptr;
+  auto skip = dns::SkipName(ptr, dns::kMaxNameLength, 0);
+  if (!skip) {
+    return -1;
   }
-  return ptr - base + 1;
+  return *skip;
 }
 
 std::string Resolver::DNSName(const char *name) {
-  const char *ptr = name;
-  while (*ptr != 0) {
-    ++ptr;
-  }
-  std::string result;
-  result.resize(ptr - name + 2);
-  int i = result.size() - 1;
-  uint8_t count = 0xff;
-  while (ptr >= name) {
-    assert(i >= 0);
-    if (*ptr == '.') {
-      result[i--] = static_cast<char>(count);
-      count = 0;
-    } else {
-      result[i--] = *ptr;
-      ++count;
-    }
-    --ptr;
+  uint8_t buf[dns::kMaxNameLength];
+  auto write = dns::WriteName(name, buf, sizeof(buf));
+  if (!write) {
+    return std::string();
   }
-  assert(i == 0);
-  result[i] = static_cast<char>(count);
-  return result;
+  return std::string(reinterpret_cast<const char *>(buf), *write);
 }
 
+// The slot of the query holds the future its answer is delivered to.
 kl::Result<uint16_t> Resolver::SendQuery(const char *name, const char *server,
                                          uint16_t port) {
-  uint16_t id = transaction_id_++;
-  auto query = BuildQuery(name, id);
-  auto send =
-      kl::inet::Sendto(fd_, query.data(), query.size(), 0, server, port);
-  if (!send) {
-    return kl::Err(send.MoveErr());
+  auto addr = kl::inet::InetSockAddr(server, port);
+  if (!addr) {
+    return kl::Err(addr.MoveErr());
   }
-  return kl::Ok(id);
+  auto promise =
+      std::make_shared<std::promise<kl::Result<std::vector<std::string>>>>();
+  auto result = promise->get_future();
+  // Stored along with the slot, an answer may free it before we return
+  return Submit(name, &*addr, kSendQueryTimeout, Fulfill(promise),
+                std::move(result));
 }
 
 kl::Result<std::vector<std::string>>
 Resolver::WaitForResult(uint16_t transaction_id, int timeout) {
-  std::unique_lock<std::mutex> l(mutex_);
-  decltype(response_.begin()) iter;
-  if (cv_.wait_for(l, std::chrono::milliseconds(timeout),
-                   [&iter, this, transaction_id] {
-                     iter = response_.find(transaction_id);
-                     return iter != response_.end();
-                   })) {
-    auto result = std::move(iter->second);
-    response_.erase(iter);
-    return kl::Ok(std::move(result));
+  std::future<kl::Result<std::vector<std::string>>> result;
+  {
+    std::unique_lock<std::mutex> _(mutex_);
+    result = std::move(slots_[transaction_id].result);
   }
-  return kl::Err("timeout");
+  if (!result.valid()) {
+    return kl::Err("no query %u to wait for", transaction_id);
+  }
+  if (result.wait_for(std::chrono::milliseconds(timeout)) !=
+      std::future_status::ready) {
+    return kl::Err("timeout");
+  }
+  return result.get();
+}
+
+kl::Result<uint16_t> Resolver::Submit(
+    const char *name, const struct sockaddr_in *server, int timeout,
+    Callback callback,
+    std::future<kl::Result<std::vector<std::string>>> result) {
+  // Its id is set once a slot is taken
+  uint8_t query[dns::kMaxQuerySize];
+  auto build = dns::BuildQuery(name, 0, dns::kTypeA, query, sizeof(query));
+  if (!build) {
+    return kl::Err(build.MoveErr());
+  }
+  struct sockaddr_in targets[kMaxUpstreams];
+  size_t count = 0;
+  uint16_t id;
+  bool wake;
+  {
+    std::unique_lock<std::mutex> _(mutex_);
+    if (!listening_) {
+      return kl::Err("listen thread has quit");
+    }
+    if (!server && upstreams_.empty()) {
+      return kl::Err("no upstream to query");
+    }
+    if (wheel_.Size() == kMaxPending) {
+      return kl::Err("too many pending queries");
+    }
+    while (slots_[next_id_].busy) {
+      ++next_id_;
+    }
+    id = next_id_++;
+    Slot &slot = slots_[id];
+    slot.busy = true;
+    slot.name = name;
+    slot.callback = std::move(callback);
+    slot.result = std::move(result);
+    slot.direct = server != nullptr;
+    slot.sent = 0;
+    slot.resent = 0;
+    uint64_t next = NextDeadline();
+    uint64_t now = Now();
+    wheel_.Schedule(id, now + timeout);
+    if (server) {
+      slot.server = *server;
+      targets[count++] = *server;
+    } else {
+      slot.sent_at.assign(upstreams_.size(), 0);
+      uint64_t micros = Micros();
+      size_t i;
+      // All at once when racing
+      do {
+        i = NextUpstream(slot);
+        MarkSent(&slot, i, micros);
+        targets[count++] = upstreams_[i].addr;
+      } while (hedge_delay_ == 0 && count < upstreams_.size());
+      if (hedge_delay_ != 0) {
+        slot.hedge_delay = HedgeDelay(i);
+        hedge_wheel_.Schedule(id, now + slot.hedge_delay);
+      }
+    }
+    // The listen thread sleeps till the old first deadline
+    wake = NextDeadline() < next;
+  }
+  if (wake) {
+    uint64_t one = 1;
+    if (::write(wake_fd_, &one, sizeof(one)) < 0) {
+      KL_ERROR(std::strerror(errno));
+    }
+  }
+  dns::Store16(query, id);
+  size_t failed = 0;
+  int err = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (SendTo(fd_, query, *build, targets[i]) < 0) {
+      ++failed;
+      err = errno;
+    }
+  }
+  if (failed == count) {
+    std::unique_lock<std::mutex> _(mutex_);
+    slots_[id].busy = false;
+    slots_[id].callback = nullptr;
+    wheel_.Cancel(id);
+    hedge_wheel_.Cancel(id);
+    return kl::Err(err, std::strerror(err));
+  }
+  return kl::Ok(id);
+}
+
+void Resolver::Dispatch(const char *name, const struct sockaddr_in *server,
+                        int timeout, Callback callback) {
+  DNSAnswer answer;
+  bool hit, refresh;
+  {
+    std::unique_lock<std::mutex> _(cache_mutex_);
+    hit = cache_.Lookup(name, dns::kTypeA, DNSCache::Clock::now(), &answer,
+                        &refresh);
+  }
+  if (hit) {
+    if (refresh) {
+      // Its answer renews the entry, nobody else waits for it
+      auto submit = Submit(name, server, timeout,
+                           [](kl::Result<std::vector<std::string>>) {});
+      if (!submit) {
+        KL_ERROR(submit.Err().ToCString());
+      }
+    }
+    callback(ToResult(&answer));
+    return;
+  }
+  // Kept here in case Submit fails
+  auto shared = std::make_shared<Callback>(std::move(callback));
+  auto submit = Submit(name, server, timeout,
+                       [shared](kl::Result<std::vector<std::string>> result) {
+                         (*shared)(std::move(result));
+                       });
+  if (!submit) {
+    (*shared)(kl::Err(submit.MoveErr()));
+  }
+}
+
+void Resolver::Resolve(const char *name, const char *server, uint16_t port,
+                       int timeout, Callback callback) {
+  auto addr = kl::inet::InetSockAddr(server, port);
+  if (!addr) {
+    callback(kl::Err(addr.MoveErr()));
+    return;
+  }
+  Dispatch(name, &*addr, timeout, std::move(callback));
+}
+
+void Resolver::Resolve(const char *name, int timeout, Callback callback) {
+  Dispatch(name, nullptr, timeout, std::move(callback));
+}
+
+std::future<kl::Result<std::vector<std::string>>>
+Resolver::Resolve(const char *name, const char *server, uint16_t port,
+                  int timeout) {
+  auto promise =
+      std::make_shared<std::promise<kl::Result<std::vector<std::string>>>>();
+  auto result = promise->get_future();
+  Resolve(name, server, port, timeout, Fulfill(promise));
+  return result;
+}
+
+std::future<kl::Result<std::vector<std::string>>>
+Resolver::Resolve(const char *name, int timeout) {
+  auto promise =
+      std::make_shared<std::promise<kl::Result<std::vector<std::string>>>>();
+  auto result = promise->get_future();
+  Resolve(name, timeout, Fulfill(promise));
+  return result;
+}
+
+kl::Result<std::vector<std::string>>
+Resolver::Lookup(const char *name, const char *server, uint16_t port,
+                 int timeout) {
+  return Resolve(name, server, port, timeout).get();
+}
+
+kl::Result<std::vector<std::string>> Resolver::Lookup(const char *name,
+                                                      int timeout) {
+  return Resolve(name, timeout).get();
 }
 
 std::string Resolver::LocalAddr() {
@@ -270,19 +758,10 @@ std::string Resolver::LocalAddr() {
 
 std::vector<uint8_t> Resolver::BuildQuery(const char *name,
                                           uint16_t transaction_id) {
-  std::vector<uint8_t> result;
-  uint8_t header[12];
-  int len = ip::BuildNetworkBuffer(header, sizeof(header), "wbbwwww",
-                                          htons(transaction_id), 0x01, 0x00,
-                                          htons(1), 0, 0, 0);
-  assert(len == 12);
-  result.insert(result.end(), header, header + len);
-  std::string domain = DNSName(name);
-  result.insert(result.end(), domain.data(), domain.data() + domain.size());
-  result.insert(result.end(), 0x00);
-  result.insert(result.end(), 0x01);
-  result.insert(result.end(), 0x00);
-  result.insert(result.end(), 0x01);
+  std::vector<uint8_t> result(dns::kMaxQuerySize);
+  auto build = dns::BuildQuery(name, transaction_id, dns::kTypeA,
+                               result.data(), result.size());
+  result.resize(build ? *build : 0);
   return result;
 }
 
@@ -0,0 +1,43 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <cstdlib>
+#include <new>
+
+#include "kale/ring.h"
+
+namespace kale {
+
+BufferPool::BufferPool(size_t count, size_t buffer_size)
+    : count_(count),
+      buffer_size_(buffer_size),
+      stride_((buffer_size + kCacheLineSize - 1) / kCacheLineSize *
+              kCacheLineSize),
+      storage_(nullptr),
+      free_(count) {
+  void *storage;
+  if (::posix_memalign(&storage, kCacheLineSize, count_ * stride_) != 0) {
+    throw std::bad_alloc();
+  }
+  storage_ = static_cast<uint8_t *>(storage);
+  for (uint32_t i = 0; i < count_; ++i) {
+    bool ok = free_.Push(i);
+    assert(ok);
+    (void)ok;
+  }
+}
+
+BufferPool::~BufferPool() { ::free(storage_); }
+
+bool BufferPool::Get(uint32_t *buffer) { return free_.Pop(buffer); }
+
+void BufferPool::Put(uint32_t buffer) {
+  assert(buffer < count_);
+  // Never full, there are only count_ buffers
+  bool ok = free_.Push(buffer);
+  assert(ok);
+  (void)ok;
+}
+
+}  // namespace kale
@@ -0,0 +1,257 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include "kale/ring_sniffer.h"
+#include "pcap/pcap.h"
+
+namespace kale {
+
+namespace {
+
+// TPACKET_V3 frames are variable sized, the frame size only has to pass the
+// kernel's sanity checks.
+const unsigned kFrameSize = 2048;
+
+struct tpacket_block_desc *Block(uint8_t *ring, size_t block_size,
+                                 size_t index) {
+  return reinterpret_cast<struct tpacket_block_desc *>(ring +
+                                                       index * block_size);
+}
+
+}  // namespace
+
+RingSniffer::Options RingSniffer::DefaultOptions() {
+  Options options;
+  options.block_size = 1 << 20;
+  options.block_count = 64;
+  options.block_timeout_ms = 8;
+  return options;
+}
+
+RingSniffer::RingSniffer(const char *ifname)
+    : RingSniffer(ifname, DefaultOptions()) {}
+
+RingSniffer::RingSniffer(const char *ifname, const Options &options)
+    : ifname_(ifname),
+      options_(options),
+      fd_(-1),
+      ring_(nullptr),
+      ring_size_(options.block_size * options.block_count),
+      current_(0),
+      holding_(false) {
+  assert(options_.block_count > 0);
+  assert(options_.block_size % kFrameSize == 0);
+  unsigned ifindex = ::if_nametoindex(ifname);
+  if (ifindex == 0) {
+    throw std::runtime_error(std::strerror(errno));
+  }
+  fd_ = ::socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP));
+  if (fd_ < 0) {
+    throw std::runtime_error(std::strerror(errno));
+  }
+  int version = TPACKET_V3;
+  if (::setsockopt(fd_, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version)) < 0) {
+    int err = errno;
+    Close();
+    throw std::runtime_error(std::strerror(err));
+  }
+  struct tpacket_req3 req;
+  ::memset(&req, 0, sizeof(req));
+  req.tp_block_size = options_.block_size;
+  req.tp_block_nr = options_.block_count;
+  req.tp_frame_size = kFrameSize;
+  req.tp_frame_nr = options_.block_size / kFrameSize * options_.block_count;
+  req.tp_retire_blk_tov = options_.block_timeout_ms;
+  if (::setsockopt(fd_, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+    int err = errno;
+    Close();
+    throw std::runtime_error(std::strerror(err));
+  }
+  void *ring = ::mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, 0);
+  if (ring == MAP_FAILED) {
+    int err = errno;
+    Close();
+    throw std::runtime_error(std::strerror(err));
+  }
+  ring_ = reinterpret_cast<uint8_t *>(ring);
+  struct sockaddr_ll addr;
+  ::memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_IP);
+  addr.sll_ifindex = ifindex;
+  if (::bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) <
+      0) {
+    int err = errno;
+    Close();
+    throw std::runtime_error(std::strerror(err));
+  }
+}
+
+// Packets of a SOCK_DGRAM packet socket start at the network header, so the
+// filter is compiled for raw IP.
+kl::Result<void> RingSniffer::CompileAndInstall(const char *filter_expr) {
+  pcap_t *dead = pcap_open_dead(DLT_RAW, 65535);
+  if (dead == nullptr) {
+    return kl::Err("%s: pcap_open_dead failed", ifname_.c_str());
+  }
+  struct bpf_program program;
+  if (pcap_compile(dead, &program, filter_expr, 1, PCAP_NETMASK_UNKNOWN) <
+      0) {
+    auto err = kl::Err("%s: Couldn't parse filter %s: %s\n", ifname_.c_str(),
+                       filter_expr, pcap_geterr(dead));
+    pcap_close(dead);
+    return err;
+  }
+  struct sock_fprog fprog;
+  fprog.len = program.bf_len;
+  fprog.filter = reinterpret_cast<struct sock_filter *>(program.bf_insns);
+  int ret =
+      ::setsockopt(fd_, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+  int err = errno;
+  pcap_freecode(&program);
+  pcap_close(dead);
+  if (ret < 0) {
+    return kl::Err(err, "%s: Couldn't install filter %s: %s\n",
+                   ifname_.c_str(), filter_expr, std::strerror(err));
+  }
+  return kl::Ok();
+}
+
+kl::Result<void> RingSniffer::JoinFanout(uint16_t group_id, FanoutMode mode) {
+  int type = PACKET_FANOUT_HASH;
+  switch (mode) {
+    case kFanoutHash:
+      // Hash reassembled packets, fragments of a flow then stay together
+      type = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
+      break;
+    case kFanoutCPU:
+      type = PACKET_FANOUT_CPU;
+      break;
+    case kFanoutLoadBalance:
+      type = PACKET_FANOUT_LB;
+      break;
+  }
+  int arg = group_id | (type << 16);
+  if (::setsockopt(fd_, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+    return kl::Err(errno, "%s: Couldn't join fanout group %u: %s\n",
+                   ifname_.c_str(), group_id, std::strerror(errno));
+  }
+  return kl::Ok();
+}
+
+// Blocks of nothing but outgoing or truncated packets go straight back to
+// the kernel and the wait goes on, for what's left of @timeout_ms.
+kl::Result<size_t> RingSniffer::NextBlock(int timeout_ms,
+                                          std::vector<PacketView> *packets) {
+  assert(!holding_);
+  packets->clear();
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(timeout_ms);
+  while (packets->empty()) {
+    struct tpacket_block_desc *block =
+        Block(ring_, options_.block_size, current_);
+    if (!(block->hdr.bh1.block_status & TP_STATUS_USER)) {
+      int left = timeout_ms;
+      if (timeout_ms > 0) {
+        left = std::max<int64_t>(
+            0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                   deadline - std::chrono::steady_clock::now())
+                   .count());
+      }
+      struct pollfd pfd;
+      pfd.fd = fd_;
+      pfd.events = POLLIN | POLLERR;
+      pfd.revents = 0;
+      int n = ::poll(&pfd, 1, left);
+      if (n < 0) {
+        if (errno == EINTR) {
+          return kl::Ok(static_cast<size_t>(0));
+        }
+        return kl::Err(errno, std::strerror(errno));
+      }
+      if (!(block->hdr.bh1.block_status & TP_STATUS_USER)) {
+        return kl::Ok(static_cast<size_t>(0));
+      }
+    }
+    // Read the block only after seeing its status
+    __sync_synchronize();
+    holding_ = true;
+    uint8_t *base = reinterpret_cast<uint8_t *>(block);
+    uint8_t *end = base + options_.block_size;
+    uint32_t num_packets = block->hdr.bh1.num_pkts;
+    uint8_t *next = base + block->hdr.bh1.offset_to_first_pkt;
+    for (uint32_t i = 0; i < num_packets; ++i) {
+      struct tpacket3_hdr *header =
+          reinterpret_cast<struct tpacket3_hdr *>(next);
+      uint8_t *frame_end =
+          header->tp_next_offset ? next + header->tp_next_offset : end;
+      next = frame_end;
+      const struct sockaddr_ll *ll =
+          reinterpret_cast<const struct sockaddr_ll *>(
+              reinterpret_cast<uint8_t *>(header) +
+              TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+      // Only traffic coming in is of interest, and only whole packets
+      if (ll->sll_pkttype == PACKET_OUTGOING ||
+          header->tp_snaplen != header->tp_len) {
+        continue;
+      }
+      PacketView view;
+      view.data = reinterpret_cast<uint8_t *>(header) + header->tp_net;
+      view.len = header->tp_snaplen;
+      view.capacity = frame_end - view.data;
+      packets->push_back(view);
+    }
+    if (packets->empty()) {
+      ReleaseBlock();
+    }
+  }
+  return kl::Ok(packets->size());
+}
+
+void RingSniffer::ReleaseBlock() {
+  if (!holding_) {
+    return;
+  }
+  struct tpacket_block_desc *block =
+      Block(ring_, options_.block_size, current_);
+  // Done with the packets before the kernel may reuse the block
+  __sync_synchronize();
+  block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+  current_ = (current_ + 1) % options_.block_count;
+  holding_ = false;
+}
+
+void RingSniffer::Close() {
+  if (ring_) {
+    ::munmap(ring_, ring_size_);
+    ring_ = nullptr;
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+RingSniffer::~RingSniffer() { Close(); }
+
+}  // namespace kale
@@ -0,0 +1,120 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <cassert>
+
+#include "kale/timing_wheel.h"
+
+namespace kale {
+
+const uint32_t TimingWheel::kNil;
+const uint32_t TimingWheel::kDue;
+
+TimingWheel::TimingWheel(size_t capacity)
+    : now_(0),
+      size_(0),
+      heads_(kDue + 1, kNil),
+      next_(capacity, kNil),
+      prev_(capacity, kNil),
+      slot_(capacity, kNil),
+      expires_(capacity, 0) {}
+
+// Wheel l holds the timers less than 64^(l+1) ticks away, in the slot of
+// their expiry's l-th group of bits.
+uint32_t TimingWheel::SlotOf(uint64_t expires) const {
+  if (expires < now_) {
+    expires = now_;
+  }
+  uint64_t delta = expires - now_;
+  int level = 0;
+  while (level < kLevels - 1 && delta >= (1ULL << ((level + 1) * kLevelBits))) {
+    ++level;
+  }
+  return level * kSlots + ((expires >> (level * kLevelBits)) & kSlotMask);
+}
+
+void TimingWheel::Link(uint32_t id, uint32_t slot) {
+  uint32_t head = heads_[slot];
+  next_[id] = head;
+  prev_[id] = kNil;
+  if (head != kNil) {
+    prev_[head] = id;
+  }
+  heads_[slot] = id;
+  slot_[id] = slot;
+  ++size_;
+}
+
+void TimingWheel::Unlink(uint32_t id) {
+  uint32_t prev = prev_[id], next = next_[id];
+  if (prev != kNil) {
+    next_[prev] = next;
+  } else {
+    heads_[slot_[id]] = next;
+  }
+  if (next != kNil) {
+    prev_[next] = prev;
+  }
+  slot_[id] = kNil;
+  --size_;
+}
+
+// The lowest wheel is exact. A timer on an upper wheel expires past the
+// current turn of the lowest one, it hasn't been cascaded yet.
+uint64_t TimingWheel::NextExpiry() const {
+  if (size_ == 0) {
+    return UINT64_MAX;
+  }
+  for (uint64_t tick = now_; tick < now_ + kSlots; ++tick) {
+    if (heads_[tick & kSlotMask] != kNil) {
+      return tick;
+    }
+  }
+  return (now_ | kSlotMask) + 1;
+}
+
+void TimingWheel::Schedule(uint32_t id, uint64_t expires) {
+  assert(id < Capacity());
+  if (Scheduled(id)) {
+    Unlink(id);
+  }
+  // Beyond the top wheel the timer fires early rather than wrap around
+  const uint64_t kMaxDelta = (1ULL << (kLevels * kLevelBits)) - 1;
+  if (expires > now_ + kMaxDelta) {
+    expires = now_ + kMaxDelta;
+  }
+  expires_[id] = expires;
+  Link(id, SlotOf(expires));
+}
+
+void TimingWheel::Cancel(uint32_t id) {
+  assert(id < Capacity());
+  if (Scheduled(id)) {
+    Unlink(id);
+  }
+}
+
+// The timers of the slot are all less than 64^level ticks away now, so they
+// move to lower wheels.
+uint32_t TimingWheel::Cascade(int level, uint32_t index) {
+  uint32_t slot = level * kSlots + index;
+  uint32_t id;
+  while ((id = heads_[slot]) != kNil) {
+    Unlink(id);
+    Link(id, SlotOf(expires_[id]));
+  }
+  return index;
+}
+
+void TimingWheel::TakeDue(uint32_t slot) {
+  assert(heads_[kDue] == kNil);
+  uint32_t head = heads_[slot];
+  heads_[slot] = kNil;
+  heads_[kDue] = head;
+  for (uint32_t id = head; id != kNil; id = next_[id]) {
+    slot_[id] = kDue;
+  }
+}
+
+}  // namespace kale
@@ -9,6 +9,7 @@
 
 #include <linux/if_tun.h>
 
+#include <cassert>
 #include <cerrno>
 #include <cstring>
 #include <cstring>
@@ -22,25 +23,83 @@ namespace kale {
 
 const char *kTunDevRoot = "/dev/net/tun";
 
-kl::Result<int> AllocateTun(const char *ifname) {
+namespace {
+
+// Attaches @fd to the device named in @ifr and turns on the offloads that
+// come with IFF_VNET_HDR.
+kl::Result<void> AttachTun(int fd, struct ifreq *ifr, bool vnet_hdr) {
+  if (::ioctl(fd, TUNSETIFF, static_cast<void *>(ifr)) < 0) {
+    return kl::Err(errno, std::strerror(errno));
+  }
+  if (vnet_hdr) {
+    unsigned offload = TUN_F_CSUM | TUN_F_TSO4;
+    if (::ioctl(fd, TUNSETOFFLOAD, offload) < 0) {
+      return kl::Err(errno, std::strerror(errno));
+    }
+  }
+  return kl::Ok();
+}
+
+void FillTunRequest(const char *ifname, short flags, bool vnet_hdr,
+                    struct ifreq *ifr) {
+  ::memset(ifr, 0, sizeof(*ifr));
+  ifr->ifr_flags = IFF_TUN | IFF_NO_PI | flags;
+  if (vnet_hdr) {
+    ifr->ifr_flags |= IFF_VNET_HDR;
+  }
+  if (ifname) {
+    ::strncpy(ifr->ifr_name, ifname, IFNAMSIZ - 1);
+  }
+}
+
+}  // namespace
+
+kl::Result<int> AllocateTun(const char *ifname, bool vnet_hdr) {
   struct ifreq ifr;
   int fd = ::open(kTunDevRoot, O_RDWR);
   if (fd < 0) {
     return kl::Err(errno, std::strerror(errno));
   }
-  ::memset(&ifr, 0, sizeof(ifr));
-  ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
-  if (ifname) {
-    ::strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
-  }
-  int err = ::ioctl(fd, TUNSETIFF, static_cast<void *>(&ifr));
-  if (err < 0) {
+  FillTunRequest(ifname, 0, vnet_hdr, &ifr);
+  auto attach = AttachTun(fd, &ifr, vnet_hdr);
+  if (!attach) {
     ::close(fd);
-    return kl::Err(errno, std::strerror(errno));
+    return kl::Err(attach.MoveErr());
   }
   return kl::Ok(fd);
 }
 
+kl::Result<std::vector<int>> AllocateMultiQueueTun(const char *ifname,
+                                                   int nqueues,
+                                                   bool vnet_hdr) {
+  assert(nqueues >= 1);
+  std::vector<int> fds;
+  struct ifreq ifr;
+  FillTunRequest(ifname, IFF_MULTI_QUEUE, vnet_hdr, &ifr);
+  for (int i = 0; i < nqueues; ++i) {
+    int fd = ::open(kTunDevRoot, O_RDWR);
+    if (fd < 0) {
+      int err = errno;
+      for (int opened : fds) {
+        ::close(opened);
+      }
+      return kl::Err(err, std::strerror(err));
+    }
+    // The kernel fills in the name picked for the first queue, later queues
+    // attach to it.
+    auto attach = AttachTun(fd, &ifr, vnet_hdr);
+    if (!attach) {
+      ::close(fd);
+      for (int opened : fds) {
+        ::close(opened);
+      }
+      return kl::Err(attach.MoveErr());
+    }
+    fds.push_back(fd);
+  }
+  return kl::Ok(std::move(fds));
+}
+
 std::string RandomTunName() {
   static const int kMaxTunNum = 1024;
   int num = kMaxTunNum * kl::random::UniformSampleFloat();
@@ -0,0 +1,102 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <arpa/inet.h>
+
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "kale/aggregation.h"
+#include "kale/ipv4.h"
+#include "kl/logger.h"
+#include "kl/testkit.h"
+
+namespace {
+
+class T {};
+
+// IPv4 header followed by @payload bytes of @fill
+std::vector<uint8_t> MakePacket(size_t payload, uint8_t fill) {
+  std::vector<uint8_t> packet(20 + payload, fill);
+  kale::ipv4::Rep *rep = reinterpret_cast<kale::ipv4::Rep *>(packet.data());
+  std::memset(rep, 0, 20);
+  rep->version = 4;
+  rep->ihl = 5;
+  rep->total_length = htons(packet.size());
+  rep->protocol = kale::ipv4::kUDP;
+  return packet;
+}
+
+std::vector<std::pair<size_t, uint8_t>> SplitAll(uint8_t *datagram,
+                                                 size_t len, bool *ok) {
+  std::vector<std::pair<size_t, uint8_t>> packets;
+  auto split = kale::aggregation::Split(
+      datagram, len, [&packets](uint8_t *packet, size_t len) {
+        packets.push_back(std::make_pair(len, packet[len - 1]));
+      });
+  *ok = static_cast<bool>(split);
+  return packets;
+}
+
+TEST(T, PacketLength) {
+  auto packet = MakePacket(10, 1);
+  ASSERT(kale::aggregation::PacketLength(packet.data(), packet.size()) == 30);
+  ASSERT(kale::aggregation::PacketLength(packet.data(), 29) == 0);
+  ASSERT(kale::aggregation::PacketLength(packet.data(), 19) == 0);
+  packet[0] = 0x65;
+  ASSERT(kale::aggregation::PacketLength(packet.data(), packet.size()) == 0);
+}
+
+TEST(T, AggregateAndSplit) {
+  std::vector<uint8_t> buffer(4096);
+  kale::aggregation::Aggregator aggregator(130);
+  aggregator.Start(buffer.data());
+  ASSERT(aggregator.Empty());
+  const size_t kPayloads[] = {20, 30, 15};
+  for (size_t i = 0; i < 3; ++i) {
+    auto packet = MakePacket(kPayloads[i], i + 1);
+    std::memcpy(aggregator.Tail(), packet.data(), packet.size());
+    ASSERT(aggregator.Add(packet.size()));
+  }
+  ASSERT(aggregator.Count() == 3 && aggregator.Used() == 125);
+  // 125 + 40 > 130
+  auto big = MakePacket(20, 4);
+  std::memcpy(aggregator.Tail(), big.data(), big.size());
+  ASSERT(!aggregator.Add(big.size()));
+  ASSERT(aggregator.Count() == 3);
+  bool ok;
+  auto packets = SplitAll(aggregator.Buffer(), aggregator.Used(), &ok);
+  ASSERT(ok);
+  ASSERT(packets.size() == 3);
+  for (size_t i = 0; i < 3; ++i) {
+    ASSERT(packets[i].first == 20 + kPayloads[i]);
+    ASSERT(packets[i].second == i + 1);
+  }
+  // Moved to another buffer as is
+  aggregator.MoveTo(buffer.data() + 2048);
+  packets = SplitAll(aggregator.Buffer(), aggregator.Used(), &ok);
+  ASSERT(ok && packets.size() == 3);
+  // The first packet is taken whatever its length
+  aggregator.Start(buffer.data());
+  auto jumbo = MakePacket(200, 5);
+  std::memcpy(aggregator.Tail(), jumbo.data(), jumbo.size());
+  ASSERT(aggregator.Add(jumbo.size()));
+  aggregator.Clear();
+  ASSERT(aggregator.Empty());
+}
+
+TEST(T, SplitGarbage) {
+  auto packet = MakePacket(10, 7);
+  packet.push_back(0x45);
+  packet.push_back(0);
+  bool ok;
+  auto packets = SplitAll(packet.data(), packet.size(), &ok);
+  ASSERT(!ok);
+  ASSERT(packets.size() == 1 && packets[0].first == 30);
+  packets = SplitAll(packet.data(), 30, &ok);
+  ASSERT(ok && packets.size() == 1);
+}
+
+}  // namespace
@@ -27,4 +27,15 @@ TEST(kale::arcfour::Cipher, Encryption, kKey, sizeof(kKey)) {
   ASSERT(check == message);
   ASSERT(check1 == message1);
 }
+
+TEST(kale::arcfour::Cipher, EncryptInPlace, kKey, sizeof(kKey)) {
+  const std::string message("Linear in the distance between first and last ");
+  auto enc = Encrypt(reinterpret_cast<const uint8_t *>(message.data()),
+                     message.size());
+  std::vector<uint8_t> buffer(message.begin(), message.end());
+  EncryptInPlace(buffer.data(), buffer.size());
+  ASSERT(buffer == enc);
+  DecryptInPlace(buffer.data(), buffer.size());
+  ASSERT(std::string(buffer.begin(), buffer.end()) == message);
+}
 }  // namespace
@@ -0,0 +1,109 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <random>
+#include <vector>
+
+#include "kale/checksum.h"
+#include "kale/ipv4.h"
+#include "kl/logger.h"
+#include "kl/testkit.h"
+
+namespace {
+
+class T {};
+
+// The word-at-a-time loop InternetChecksum used before the SIMD kernels.
+uint32_t ReferenceSum(const uint8_t *packet, size_t len) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i + 1 < len; i += 2) {
+    sum += *reinterpret_cast<const uint16_t *>(packet + i);
+  }
+  if (len & 1) {
+    sum += *(packet + len - 1);
+  }
+  return sum;
+}
+
+const kale::checksum::Kernel kKernels[] = {
+    kale::checksum::kScalar, kale::checksum::kSSE2, kale::checksum::kAVX2,
+};
+
+TEST(T, ActiveKernel) {
+  auto kernel = kale::checksum::ActiveKernel();
+  ASSERT(kale::checksum::Supports(kernel));
+  KL_DEBUG("active checksum kernel: %s", kale::checksum::KernelName(kernel));
+}
+
+TEST(T, Empty) {
+  uint8_t buf[1] = {0xff};
+  for (auto kernel : kKernels) {
+    if (!kale::checksum::Supports(kernel)) {
+      continue;
+    }
+    ASSERT(kale::checksum::Sum(kernel, buf, 0) == 0);
+  }
+}
+
+TEST(T, AllOnes) {
+  std::vector<uint8_t> buf(1500, 0xff);
+  for (auto kernel : kKernels) {
+    if (!kale::checksum::Supports(kernel)) {
+      continue;
+    }
+    ASSERT(kale::checksum::Sum(kernel, buf.data(), buf.size()) == 0xffff);
+  }
+}
+
+// Every kernel must agree bit-exactly with the reference once carried, for
+// all lengths and misalignments.
+TEST(T, MatchReference) {
+  std::mt19937 rng(0x6b616c65);
+  std::uniform_int_distribution<int> byte(0, 255);
+  std::vector<uint8_t> buf(2048 + 64);
+  for (auto &b : buf) {
+    b = byte(rng);
+  }
+  for (auto kernel : kKernels) {
+    if (!kale::checksum::Supports(kernel)) {
+      continue;
+    }
+    for (size_t offset = 0; offset < 64; ++offset) {
+      for (size_t len = 0; len <= 2048; len += (len < 256 ? 1 : 61)) {
+        const uint8_t *p = buf.data() + offset;
+        uint32_t sum = kale::checksum::Sum(kernel, p, len);
+        ASSERT(sum <= 0xffff);
+        ASSERT(kale::ipv4::ChecksumCarry(sum) ==
+               kale::ipv4::ChecksumCarry(ReferenceSum(p, len)));
+      }
+    }
+  }
+}
+
+TEST(T, MatchReferenceRandom) {
+  std::mt19937 rng(1624);
+  std::uniform_int_distribution<int> byte(0, 255);
+  std::uniform_int_distribution<size_t> length(0, 65535);
+  std::vector<uint8_t> buf(65536 + 32);
+  for (int round = 0; round < 256; ++round) {
+    size_t len = length(rng);
+    size_t offset = round & 31;
+    for (size_t i = 0; i < len; ++i) {
+      buf[offset + i] = byte(rng);
+    }
+    const uint8_t *p = buf.data() + offset;
+    uint16_t expect = kale::ipv4::ChecksumCarry(ReferenceSum(p, len));
+    ASSERT(kale::ipv4::ChecksumCarry(kale::ipv4::InternetChecksum(p, len)) ==
+           expect);
+    for (auto kernel : kKernels) {
+      if (!kale::checksum::Supports(kernel)) {
+        continue;
+      }
+      ASSERT(kale::ipv4::ChecksumCarry(
+                 kale::checksum::Sum(kernel, p, len)) == expect);
+    }
+  }
+}
+
+}  // namespace
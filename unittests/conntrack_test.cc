@@ -0,0 +1,124 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <arpa/inet.h>
+
+#include <cstring>
+#include <vector>
+
+#include "kale/conntrack.h"
+#include "kale/ipv4_tcp.h"
+#include "kale/nat.h"
+#include "kl/logger.h"
+#include "kl/testkit.h"
+
+namespace {
+
+class T {};
+using namespace kale::conntrack;
+using kale::ipv4::SegmentRef;
+using kale::ipv4::tcp::TCPRep;
+
+enum Flags {
+  kFIN = 1,
+  kSYN = 2,
+  kRST = 4,
+  kACK = 8,
+};
+
+// A bare TCP header with @flags
+struct Segment {
+  explicit Segment(int flags) {
+    ::memset(&rep, 0, sizeof(rep));
+    rep.data_offset = 5;
+    rep.fin = (flags & kFIN) != 0;
+    rep.syn = (flags & kSYN) != 0;
+    rep.rst = (flags & kRST) != 0;
+    rep.ack = (flags & kACK) != 0;
+  }
+  SegmentRef<TCPRep> ref() const { return SegmentRef<TCPRep>(&rep, 20); }
+  TCPRep rep;
+};
+
+State Feed(State state, Direction direction, int flags) {
+  return Next(state, direction, Segment(flags).ref());
+}
+
+TEST(T, Handshake) {
+  State state = Feed(kNone, kOriginal, kSYN);
+  ASSERT(state == kSynSent);
+  state = Feed(state, kReply, kSYN | kACK);
+  ASSERT(state == kSynReceived);
+  state = Feed(state, kOriginal, kACK);
+  ASSERT(state == kEstablished);
+  ASSERT(Feed(state, kReply, kACK) == kEstablished);
+}
+
+TEST(T, Close) {
+  State state = Feed(kEstablished, kOriginal, kFIN | kACK);
+  ASSERT(state == kFinWait);
+  ASSERT(IsClosing(state));
+  // Half closed, data still flows back
+  state = Feed(state, kReply, kACK);
+  ASSERT(state == kFinWait);
+  state = Feed(state, kReply, kFIN | kACK);
+  ASSERT(state == kTimeWait);
+  ASSERT(IsClosed(state));
+  ASSERT(Feed(kEstablished, kReply, kFIN) == kCloseWait);
+  ASSERT(Feed(kCloseWait, kOriginal, kFIN) == kTimeWait);
+}
+
+TEST(T, Reset) {
+  ASSERT(Feed(kSynSent, kReply, kRST | kACK) == kClosed);
+  ASSERT(Feed(kEstablished, kOriginal, kRST) == kClosed);
+  // The tuple is reused by a new connection
+  ASSERT(Feed(kClosed, kOriginal, kSYN) == kSynSent);
+  ASSERT(Feed(kTimeWait, kOriginal, kSYN) == kSynSent);
+}
+
+TEST(T, StateName) {
+  ASSERT(::strcmp(StateName(kNone), "NONE") == 0);
+  ASSERT(::strcmp(StateName(kSynReceived), "SYN_RECV") == 0);
+  ASSERT(::strcmp(StateName(kTimeWait), "TIME_WAIT") == 0);
+  ASSERT(::strcmp(StateName(kClosed), "CLOSED") == 0);
+  ASSERT(::strcmp(StateName(static_cast<State>(100)), "UNKNOWN") == 0);
+}
+
+TEST(T, PickUp) {
+  ASSERT(Feed(kNone, kOriginal, kACK) == kEstablished);
+  ASSERT(Feed(kNone, kReply, kACK) == kEstablished);
+}
+
+// A closed connection gives its port back well before the idle timeout.
+TEST(T, Reclaim) {
+  const uint32_t kIdle = 7440;
+  Timeouts timeouts = DefaultTimeouts(kIdle);
+  kale::Nat nat(std::vector<uint32_t>(1, 0), 1000, 1000, kIdle);
+  kale::FlowKey key;
+  ::memset(&key, 0, sizeof(key));
+  key.subnet_port = htons(80);
+  auto map = nat.Map(key);
+  ASSERT(map);
+  kale::Endpoint local = *map;
+  ASSERT(Track(&nat, local, kOriginal, Segment(kSYN).ref(), timeouts) ==
+         kSynSent);
+  ASSERT(Track(&nat, local, kReply, Segment(kSYN | kACK).ref(), timeouts) ==
+         kSynReceived);
+  ASSERT(Track(&nat, local, kOriginal, Segment(kACK).ref(), timeouts) ==
+         kEstablished);
+  ASSERT(nat.Advance(100) == 0);
+  // Segments are tracked right after the lookup which marks them seen
+  ASSERT(nat.Map(key));
+  ASSERT(Track(&nat, local, kOriginal, Segment(kRST).ref(), timeouts) ==
+         kClosed);
+  ASSERT(nat.Advance(100 + timeouts.closed - 1) == 0);
+  ASSERT(nat.Advance(100 + timeouts.closed) == 1);
+  ASSERT(Track(&nat, local, kOriginal, Segment(kACK).ref(), timeouts) ==
+         kNone);
+  // The only port is free again
+  key.subnet_port = htons(81);
+  ASSERT(nat.Map(key));
+}
+
+}  // namespace
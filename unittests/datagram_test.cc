@@ -0,0 +1,105 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "kale/datagram.h"
+#include "kl/env.h"
+#include "kl/inet.h"
+#include "kl/logger.h"
+#include "kl/testkit.h"
+#include "kl/udp.h"
+
+namespace {
+
+class T {};
+
+TEST(T, SendRecv) {
+  const uint16_t port = 4001;
+  const size_t kNumOfPackets = 100;
+  auto recv_sock = kl::udp::Socket();
+  ASSERT(recv_sock);
+  kl::env::Defer defer([fd = *recv_sock] { ::close(fd); });
+  ASSERT(kl::inet::Bind(*recv_sock, "127.0.0.1", port));
+  ASSERT(kl::env::SetNonBlocking(*recv_sock));
+  auto send_sock = kl::udp::Socket();
+  ASSERT(send_sock);
+  defer([fd = *send_sock] { ::close(fd); });
+  auto addr = kl::inet::InetSockAddr("127.0.0.1", port);
+  ASSERT(addr);
+  // Add only borrows memory, messages must outlive Send
+  std::vector<std::string> messages;
+  for (size_t i = 0; i < kNumOfPackets; ++i) {
+    messages.push_back(std::to_string(i));
+  }
+  kale::DatagramBatch send_batch(32, 64);
+  size_t sent = 0;
+  for (size_t i = 0; i < kNumOfPackets; ++i) {
+    const std::string &message = messages[i];
+    if (i & 1) {
+      ::memcpy(send_batch.NextBuffer(), message.data(), message.size());
+      send_batch.Commit(message.size(), *addr);
+    } else {
+      send_batch.Add(reinterpret_cast<const uint8_t *>(message.data()),
+                     message.size(), *addr);
+    }
+    if (send_batch.Full() || i + 1 == kNumOfPackets) {
+      size_t count = send_batch.Count();
+      auto send = send_batch.Send(*send_sock);
+      ASSERT(send);
+      ASSERT(*send == count);
+      ASSERT(send_batch.Count() == 0);
+      sent += *send;
+    }
+  }
+  ASSERT(sent == kNumOfPackets);
+  kale::DatagramBatch recv_batch(32, 64);
+  size_t received = 0;
+  while (received < kNumOfPackets) {
+    auto recv = recv_batch.Recv(*recv_sock);
+    ASSERT(recv);
+    ASSERT(*recv > 0);
+    ASSERT(recv_batch.Count() == *recv);
+    for (size_t i = 0; i < recv_batch.Count(); ++i) {
+      std::string message(
+          reinterpret_cast<const char *>(recv_batch.Data(i)),
+          recv_batch.Length(i));
+      ASSERT(message == std::to_string(received));
+      ASSERT(!recv_batch.Truncated(i));
+      ASSERT(recv_batch.Addr(i).sin_family == AF_INET);
+      ++received;
+    }
+  }
+  auto recv = recv_batch.Recv(*recv_sock);
+  ASSERT(recv);
+  ASSERT(*recv == 0);
+}
+
+TEST(T, Truncated) {
+  const uint16_t port = 4002;
+  auto recv_sock = kl::udp::Socket();
+  ASSERT(recv_sock);
+  kl::env::Defer defer([fd = *recv_sock] { ::close(fd); });
+  ASSERT(kl::inet::Bind(*recv_sock, "127.0.0.1", port));
+  auto send_sock = kl::udp::Socket();
+  ASSERT(send_sock);
+  defer([fd = *send_sock] { ::close(fd); });
+  auto addr = kl::inet::InetSockAddr("127.0.0.1", port);
+  ASSERT(addr);
+  kale::DatagramBatch send_batch(1, 64);
+  ::memset(send_batch.NextBuffer(), 'k', 64);
+  send_batch.Commit(64, *addr);
+  ASSERT(send_batch.Send(*send_sock));
+  kale::DatagramBatch recv_batch(4, 16);
+  auto recv = recv_batch.Recv(*recv_sock);
+  ASSERT(recv);
+  ASSERT(*recv == 1);
+  ASSERT(recv_batch.Truncated(0));
+}
+
+}  // namespace
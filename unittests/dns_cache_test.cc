@@ -0,0 +1,126 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include "kale/dns_cache.h"
+#include "kl/testkit.h"
+
+namespace {
+
+class T {};
+
+using Clock = kale::DNSCache::Clock;
+
+kale::DNSAnswer Answer(uint32_t ttl, const char *addr) {
+  kale::DNSAnswer answer;
+  answer.ttl = ttl;
+  answer.records.push_back(addr);
+  return answer;
+}
+
+TEST(T, HonorsTTL) {
+  kale::DNSCache cache(16);
+  Clock::time_point now = Clock::now();
+  kale::DNSAnswer answer;
+  bool refresh;
+  ASSERT(!cache.Lookup("example.com", 1, now, &answer, &refresh));
+  cache.Insert("example.com", 1, Answer(60, "1.2.3.4"), now);
+  ASSERT(cache.Lookup("Example.COM", 1, now + std::chrono::seconds(10),
+                      &answer, &refresh));
+  ASSERT(answer.records.size() == 1 && answer.records[0] == "1.2.3.4");
+  ASSERT(answer.ttl == 50);
+  ASSERT(!cache.Lookup("example.com", 28, now, &answer, &refresh));
+  ASSERT(!cache.Lookup("example.com", 1, now + std::chrono::seconds(60),
+                       &answer, &refresh));
+  ASSERT(cache.Size() == 0);
+  // Not worth keeping
+  cache.Insert("example.com", 1, Answer(0, "1.2.3.4"), now);
+  ASSERT(cache.Size() == 0);
+}
+
+TEST(T, Negative) {
+  kale::DNSCache cache(16, 5);
+  Clock::time_point now = Clock::now();
+  kale::DNSAnswer nxdomain, answer;
+  nxdomain.rcode = 3;
+  nxdomain.ttl = 3600;
+  cache.Insert("nowhere.example", 1, nxdomain, now);
+  bool refresh;
+  ASSERT(cache.Lookup("nowhere.example", 1, now + std::chrono::seconds(4),
+                      &answer, &refresh));
+  ASSERT(answer.rcode == 3 && answer.records.empty());
+  ASSERT(!cache.Lookup("nowhere.example", 1, now + std::chrono::seconds(5),
+                       &answer, &refresh));
+}
+
+TEST(T, RefreshAhead) {
+  kale::DNSCache cache(16);
+  Clock::time_point now = Clock::now();
+  cache.Insert("popular.example", 1, Answer(100, "1.2.3.4"), now);
+  kale::DNSAnswer answer;
+  bool refresh;
+  ASSERT(cache.Lookup("popular.example", 1, now, &answer, &refresh));
+  ASSERT(!refresh);
+  ASSERT(cache.Lookup("popular.example", 1, now + std::chrono::seconds(95),
+                      &answer, &refresh));
+  ASSERT(refresh);
+  // Asked once until renewed
+  ASSERT(cache.Lookup("popular.example", 1, now + std::chrono::seconds(96),
+                      &answer, &refresh));
+  ASSERT(!refresh);
+  cache.Insert("popular.example", 1, Answer(100, "5.6.7.8"),
+               now + std::chrono::seconds(96));
+  ASSERT(cache.Lookup("popular.example", 1, now + std::chrono::seconds(150),
+                      &answer, &refresh));
+  ASSERT(!refresh && answer.records[0] == "5.6.7.8");
+  // Shorter than 10s
+  cache.Insert("short.example", 1, Answer(5, "1.2.3.4"), now);
+  ASSERT(cache.Lookup("short.example", 1, now, &answer, &refresh));
+  ASSERT(cache.Lookup("short.example", 1, now + std::chrono::seconds(4),
+                      &answer, &refresh));
+  ASSERT(refresh);
+  // Hit once only, it's left to expire
+  cache.Insert("rare.example", 1, Answer(100, "1.2.3.4"), now);
+  ASSERT(cache.Lookup("rare.example", 1, now + std::chrono::seconds(95),
+                      &answer, &refresh));
+  ASSERT(!refresh);
+}
+
+TEST(T, EvictsLeastRecentlyUsed) {
+  kale::DNSCache cache(2);
+  Clock::time_point now = Clock::now();
+  cache.Insert("a.example", 1, Answer(60, "1.1.1.1"), now);
+  cache.Insert("b.example", 1, Answer(60, "2.2.2.2"), now);
+  kale::DNSAnswer answer;
+  bool refresh;
+  ASSERT(cache.Lookup("a.example", 1, now, &answer, &refresh));
+  cache.Insert("c.example", 1, Answer(60, "3.3.3.3"), now);
+  ASSERT(cache.Size() == 2);
+  ASSERT(!cache.Lookup("b.example", 1, now, &answer, &refresh));
+  ASSERT(cache.Lookup("a.example", 1, now, &answer, &refresh));
+  ASSERT(cache.Lookup("c.example", 1, now, &answer, &refresh));
+  cache.Clear();
+  ASSERT(cache.Size() == 0);
+  ASSERT(!cache.Lookup("a.example", 1, now, &answer, &refresh));
+}
+
+// The slot of an expired entry takes the next one, the live entries stay.
+TEST(T, ReusesExpiredSlot) {
+  kale::DNSCache cache(2);
+  Clock::time_point now = Clock::now();
+  cache.Insert("a.example", 1, Answer(10, "1.1.1.1"), now);
+  cache.Insert("b.example", 1, Answer(60, "2.2.2.2"), now);
+  kale::DNSAnswer answer;
+  bool refresh;
+  // a is the most recent when it expires
+  ASSERT(cache.Lookup("a.example", 1, now, &answer, &refresh));
+  now += std::chrono::seconds(20);
+  ASSERT(!cache.Lookup("a.example", 1, now, &answer, &refresh));
+  ASSERT(cache.Size() == 1);
+  cache.Insert("c.example", 1, Answer(60, "3.3.3.3"), now);
+  ASSERT(cache.Size() == 2);
+  ASSERT(cache.Lookup("b.example", 1, now, &answer, &refresh));
+  ASSERT(cache.Lookup("c.example", 1, now, &answer, &refresh));
+}
+
+}  // namespace
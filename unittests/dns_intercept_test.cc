@@ -0,0 +1,179 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <arpa/inet.h>
+
+#include <cstring>
+#include <vector>
+
+#include "kale/dns.h"
+#include "kale/dns_intercept.h"
+#include "kale/ip.h"
+#include "kale/ipv4.h"
+#include "kale/resolver.h"
+#include "kl/testkit.h"
+
+namespace {
+
+class T {};
+
+const char *kClient = "10.0.0.2";
+const char *kServer = "8.8.8.8";
+const uint16_t kClientPort = 40000;
+
+// UDP/IPv4 packet carrying @payload, with room to grow.
+std::vector<uint8_t> BuildPacket(const char *src, uint16_t src_port,
+                                 const char *dst, uint16_t dst_port,
+                                 const uint8_t *payload, size_t len) {
+  std::vector<uint8_t> packet(2048);
+  size_t total = 28 + len;
+  uint8_t *p = packet.data();
+  p[0] = 0x45;
+  kale::dns::Store16(p + 2, total);
+  p[8] = 64;
+  p[9] = 0x11;
+  ::inet_pton(AF_INET, src, p + 12);
+  ::inet_pton(AF_INET, dst, p + 16);
+  kale::dns::Store16(p + 20, src_port);
+  kale::dns::Store16(p + 22, dst_port);
+  kale::dns::Store16(p + 24, 8 + len);
+  std::memcpy(p + 28, payload, len);
+  kale::ip::IPFillChecksum(p, total);
+  kale::ip::UDPFillChecksum(p, total);
+  return packet;
+}
+
+std::vector<uint8_t> BuildQueryPacket(const char *name, uint16_t id,
+                                      uint16_t type = kale::dns::kTypeA) {
+  uint8_t query[kale::dns::kMaxQuerySize];
+  auto build = kale::dns::BuildQuery(name, id, type, query, sizeof(query));
+  ASSERT(build);
+  return BuildPacket(kClient, kClientPort, kServer, 53, query, *build);
+}
+
+// Response to BuildQueryPacket(@name, @id) with an A record of @addr, or
+// @rcode.
+std::vector<uint8_t> BuildResponsePacket(const char *name, uint16_t id,
+                                         const char *addr,
+                                         uint8_t rcode = 0) {
+  uint8_t message[1024];
+  auto build = kale::dns::BuildQuery(name, id, kale::dns::kTypeA, message,
+                                     sizeof(message));
+  ASSERT(build);
+  size_t len = *build;
+  message[2] = 0x81;
+  message[3] = 0x80 | rcode;
+  if (addr) {
+    message[7] = 1;
+    const uint8_t record[] = {0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 1, 0x2c, 0, 4};
+    std::memcpy(message + len, record, sizeof(record));
+    ::inet_pton(AF_INET, addr, message + len + sizeof(record));
+    len += sizeof(record) + 4;
+  }
+  return BuildPacket(kServer, 53, kClient, kClientPort, message, len);
+}
+
+size_t Length(const std::vector<uint8_t> &packet) {
+  return kale::dns::Load16(packet.data() + 2);
+}
+
+TEST(T, AnswerFromCache) {
+  kale::DNSInterceptor interceptor(16);
+  auto query = BuildQueryPacket("www.example.com", 1);
+  ASSERT(interceptor.Answer(query.data(), Length(query), query.size()) == 0);
+  ASSERT(interceptor.Misses() == 1);
+  auto response = BuildResponsePacket("www.example.com", 1, "10.1.2.3");
+  interceptor.Learn(response.data(), Length(response));
+  query = BuildQueryPacket("WWW.example.com", 2);
+  size_t len = interceptor.Answer(query.data(), Length(query), query.size());
+  ASSERT(len > 0);
+  ASSERT(interceptor.Hits() == 1);
+  const uint8_t *reply = query.data();
+  ASSERT(kale::ipv4::Validate(kale::ipv4::PacketRef(reply, len)).ok());
+  ASSERT(kale::ip::UDPSrcAddr(reply, len) == "8.8.8.8:53");
+  ASSERT(kale::ip::UDPDstAddr(reply, len) == "10.0.0.2:40000");
+  std::string name;
+  auto parse = kale::Resolver::ParseResponse(reply + 28, len - 28, &name);
+  ASSERT(parse);
+  ASSERT(parse->first == 2 && name == "WWW.example.com");
+  ASSERT(parse->second.records.size() == 1);
+  ASSERT(parse->second.records[0] == "10.1.2.3");
+  ASSERT(parse->second.ttl > 0 && parse->second.ttl <= 300);
+  // Not cached for AAAA
+  query = BuildQueryPacket("www.example.com", 3, kale::dns::kTypeAAAA);
+  ASSERT(interceptor.Answer(query.data(), Length(query), query.size()) == 0);
+}
+
+TEST(T, AnswerNegative) {
+  kale::DNSInterceptor interceptor(16);
+  auto query = BuildQueryPacket("nowhere.example", 7);
+  ASSERT(interceptor.Answer(query.data(), Length(query), query.size()) == 0);
+  auto response = BuildResponsePacket("nowhere.example", 7, nullptr, 3);
+  interceptor.Learn(response.data(), Length(response));
+  query = BuildQueryPacket("nowhere.example", 8);
+  size_t len = interceptor.Answer(query.data(), Length(query), query.size());
+  ASSERT(len > 0);
+  kale::dns::Reader reader(query.data() + 28, len - 28);
+  ASSERT(reader.ReadHeader());
+  ASSERT(reader.IsResponse() && reader.Rcode() == kale::dns::kRcodeNXDomain);
+  ASSERT(reader.Count(kale::dns::kAnswer) == 0);
+}
+
+// Responses nobody asked for through the tunnel are ignored, so are
+// failures other than NXDOMAIN.
+TEST(T, LearnOnlyMissed) {
+  kale::DNSInterceptor interceptor(16);
+  auto response = BuildResponsePacket("www.example.com", 1, "10.1.2.3");
+  interceptor.Learn(response.data(), Length(response));
+  auto query = BuildQueryPacket("www.example.com", 2);
+  ASSERT(interceptor.Answer(query.data(), Length(query), query.size()) == 0);
+  response = BuildResponsePacket("www.example.com", 2, nullptr, 2);
+  interceptor.Learn(response.data(), Length(response));
+  query = BuildQueryPacket("www.example.com", 3);
+  ASSERT(interceptor.Answer(query.data(), Length(query), query.size()) == 0);
+  ASSERT(interceptor.Hits() == 0 && interceptor.Misses() == 2);
+}
+
+// Packets other than DNS queries are left untouched.
+TEST(T, PassThrough) {
+  kale::DNSInterceptor interceptor(16);
+  auto query = BuildQueryPacket("www.example.com", 1);
+  auto response = BuildResponsePacket("www.example.com", 1, "10.1.2.3");
+  interceptor.Learn(response.data(), Length(response));
+  interceptor.Answer(query.data(), Length(query), query.size());
+  interceptor.Learn(response.data(), Length(response));
+  std::vector<std::vector<uint8_t>> packets;
+  // Another port
+  uint8_t message[kale::dns::kMaxQuerySize];
+  auto build = kale::dns::BuildQuery("www.example.com", 4, kale::dns::kTypeA,
+                                     message, sizeof(message));
+  packets.push_back(
+      BuildPacket(kClient, kClientPort, kServer, 5353, message, *build));
+  // A fragment
+  packets.push_back(BuildQueryPacket("www.example.com", 5));
+  packets.back()[6] = 0x20;
+  // TCP
+  packets.push_back(BuildQueryPacket("www.example.com", 6));
+  packets.back()[9] = 0x06;
+  // A response
+  packets.push_back(BuildResponsePacket("www.example.com", 7, "10.1.2.3"));
+  for (auto &packet : packets) {
+    std::vector<uint8_t> copy = packet;
+    ASSERT(interceptor.Answer(packet.data(), Length(packet), packet.size()) ==
+           0);
+    ASSERT(packet == copy);
+  }
+  // Truncated
+  auto query2 = BuildQueryPacket("www.example.com", 8);
+  for (size_t len = 0; len < Length(query2); ++len) {
+    ASSERT(interceptor.Answer(query2.data(), len, query2.size()) == 0);
+  }
+  // No room for the reply
+  ASSERT(interceptor.Answer(query2.data(), Length(query2), Length(query2)) ==
+         0);
+  ASSERT(interceptor.Answer(query2.data(), Length(query2), query2.size()) >
+         0);
+}
+
+}  // namespace
@@ -0,0 +1,198 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "kale/dns.h"
+#include "kl/testkit.h"
+
+namespace {
+
+class T {};
+
+// www.example.com CNAME example.com, example.com A 10.0.0.1 and
+// AAAA 2001:db8::1, example.com SOA in authority with minimum 300.
+const uint8_t kResponse[] = {
+    0x12, 0x34, 0x81, 0x80, 0, 1, 0, 3, 0, 1, 0, 0,
+    // Question at 12, example.com at 16
+    3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm',
+    0, 0, 1, 0, 1,
+    // CNAME
+    0xc0, 0x0c, 0, 5, 0, 1, 0, 0, 0x0e, 0x10, 0, 2, 0xc0, 0x10,
+    // A
+    0xc0, 0x10, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 10, 0, 0, 1,
+    // AAAA
+    0xc0, 0x10, 0, 28, 0, 1, 0, 0, 0, 60, 0, 16, 0x20, 0x01, 0x0d, 0xb8, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+    // SOA, ns.example.com, hostmaster.example.com
+    0xc0, 0x10, 0, 6, 0, 1, 0, 0, 0, 60, 0, 38, 2, 'n', 's', 0xc0, 0x10, 10,
+    'h', 'o', 's', 't', 'm', 'a', 's', 't', 'e', 'r', 0xc0, 0x10, 0, 0, 0, 1,
+    0, 0, 0x0e, 0x10, 0, 0, 0x07, 0x08, 0, 0x09, 0x3a, 0x80, 0, 0, 1, 0x2c};
+
+TEST(T, WriteQuery) {
+  const char *expected = "\x2c\x13\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00"
+                         "\x03www\x06google\x03"
+                         "com\x00\x00\x01\x00\x01";
+  uint8_t buf[kale::dns::kMaxQuerySize];
+  auto build = kale::dns::BuildQuery("www.google.com", 0x2c13,
+                                     kale::dns::kTypeA, buf, sizeof(buf));
+  ASSERT(build);
+  ASSERT(*build == 32);
+  ASSERT(std::memcmp(buf, expected, *build) == 0);
+  // A trailing dot is the same name
+  auto dotted = kale::dns::BuildQuery("www.google.com.", 0x2c13,
+                                      kale::dns::kTypeA, buf, sizeof(buf));
+  ASSERT(dotted && *dotted == 32);
+  ASSERT(!kale::dns::BuildQuery("www.google.com", 0, kale::dns::kTypeA, buf,
+                                20));
+  ASSERT(!kale::dns::BuildQuery("www..com", 0, kale::dns::kTypeA, buf,
+                                sizeof(buf)));
+  std::string label(64, 'a');
+  ASSERT(!kale::dns::BuildQuery(label.c_str(), 0, kale::dns::kTypeA, buf,
+                                sizeof(buf)));
+  std::string name;
+  for (int i = 0; i < 64; ++i) {
+    name += "abc.";
+  }
+  ASSERT(!kale::dns::BuildQuery(name.c_str(), 0, kale::dns::kTypeA, buf,
+                                sizeof(buf)));
+}
+
+TEST(T, ReadName) {
+  char text[kale::dns::kMaxNameText];
+  auto read = kale::dns::ReadName(kResponse, sizeof(kResponse), 12, text,
+                                  sizeof(text));
+  ASSERT(read && *read == 15);
+  ASSERT(std::strcmp(text, "www.example.com") == 0);
+  // Compressed, the owner of the A record
+  read = kale::dns::ReadName(kResponse, sizeof(kResponse), 47, text,
+                             sizeof(text));
+  ASSERT(read && std::strcmp(text, "example.com") == 0);
+  ASSERT(!kale::dns::ReadName(kResponse, sizeof(kResponse), 12, text, 8));
+  ASSERT(kale::dns::NameEquals(kResponse, sizeof(kResponse), 12,
+                               "WWW.Example.com"));
+  ASSERT(kale::dns::NameEquals(kResponse, sizeof(kResponse), 47,
+                               "example.com."));
+  ASSERT(!kale::dns::NameEquals(kResponse, sizeof(kResponse), 47,
+                                "example.co"));
+  ASSERT(!kale::dns::NameEquals(kResponse, sizeof(kResponse), 47,
+                                "example.com.cn"));
+  ASSERT(!kale::dns::NameEquals(kResponse, sizeof(kResponse), 47,
+                                "www.example.com"));
+  auto skip = kale::dns::SkipName(kResponse, sizeof(kResponse), 47);
+  ASSERT(skip && *skip == 49);
+}
+
+TEST(T, MalformedName) {
+  char text[kale::dns::kMaxNameText];
+  // Pointers to themselves, in a loop, forwards and past the end
+  const uint8_t self[] = {0xc0, 0};
+  ASSERT(!kale::dns::ReadName(self, sizeof(self), 0, text, sizeof(text)));
+  const uint8_t loop[] = {1, 'a', 0xc0, 0};
+  ASSERT(!kale::dns::ReadName(loop, sizeof(loop), 0, text, sizeof(text)));
+  ASSERT(!kale::dns::NameEquals(loop, sizeof(loop), 0, "a.a.a"));
+  const uint8_t forward[] = {0xc0, 2, 1, 'a', 0};
+  ASSERT(!kale::dns::ReadName(forward, sizeof(forward), 0, text,
+                              sizeof(text)));
+  const uint8_t truncated[] = {3, 'w', 'w'};
+  ASSERT(!kale::dns::ReadName(truncated, sizeof(truncated), 0, text,
+                              sizeof(text)));
+  ASSERT(!kale::dns::SkipName(truncated, sizeof(truncated), 0));
+  const uint8_t reserved[] = {0x40, 0};
+  ASSERT(!kale::dns::ReadName(reserved, sizeof(reserved), 0, text,
+                              sizeof(text)));
+  // Longer than 255 bytes once pointers are followed
+  std::vector<uint8_t> chain;
+  for (int i = 0; i < 20; ++i) {
+    size_t prev = chain.size() - (i > 0 ? 16 : 0);
+    chain.insert(chain.end(), 14, 'a');
+    chain[chain.size() - 14] = 13;
+    if (i == 0) {
+      chain.push_back(0);
+      chain.push_back(0);
+    } else {
+      chain.push_back(0xc0 | prev >> 8);
+      chain.push_back(prev);
+    }
+  }
+  ASSERT(!kale::dns::ReadName(chain.data(), chain.size(), chain.size() - 16,
+                              text, sizeof(text)));
+}
+
+TEST(T, Reader) {
+  kale::dns::Reader reader(kResponse, sizeof(kResponse));
+  ASSERT(reader.ReadHeader());
+  ASSERT(reader.Id() == 0x1234 && reader.IsResponse() &&
+         reader.Rcode() == kale::dns::kRcodeNoError);
+  ASSERT(reader.Count(kale::dns::kAnswer) == 3);
+  kale::dns::Record record;
+  char text[kale::dns::kMaxNameText];
+  // Questions are skipped
+  auto next = reader.NextRecord(&record);
+  ASSERT(next && *next);
+  ASSERT(record.type == kale::dns::kTypeCNAME && record.ttl == 3600);
+  auto target = kale::dns::TargetName(reader, record);
+  ASSERT(target);
+  ASSERT(kale::dns::NameEquals(kResponse, sizeof(kResponse), *target,
+                               "example.com"));
+  next = reader.NextRecord(&record);
+  ASSERT(next && *next && record.type == kale::dns::kTypeA);
+  auto format = kale::dns::FormatAddress(reader, record, text, sizeof(text));
+  ASSERT(format && std::strcmp(text, "10.0.0.1") == 0);
+  next = reader.NextRecord(&record);
+  ASSERT(next && *next && record.type == kale::dns::kTypeAAAA);
+  format = kale::dns::FormatAddress(reader, record, text, sizeof(text));
+  ASSERT(format && std::strcmp(text, "2001:db8::1") == 0);
+  next = reader.NextRecord(&record);
+  ASSERT(next && *next && record.section == kale::dns::kAuthority);
+  auto minimum = kale::dns::SOAMinimum(reader, record);
+  ASSERT(minimum && *minimum == 300);
+  ASSERT(!kale::dns::FormatAddress(reader, record, text, sizeof(text)));
+  next = reader.NextRecord(&record);
+  ASSERT(next && !*next);
+}
+
+// Cut and corrupted packets are rejected without reading past them, which
+// the sanitizers check.
+TEST(T, Truncated) {
+  std::mt19937 rng(5);
+  for (size_t len = 0; len < sizeof(kResponse); ++len) {
+    std::vector<uint8_t> packet(kResponse, kResponse + len);
+    for (int round = 0; round < 16; ++round) {
+      if (round > 0 && len > 0) {
+        packet[rng() % len] = rng();
+      }
+      kale::dns::Reader reader(packet.data(), packet.size());
+      if (!reader.ReadHeader()) {
+        ASSERT(len < kale::dns::kHeaderSize);
+        continue;
+      }
+      kale::dns::Record record;
+      char text[kale::dns::kMaxNameText];
+      size_t count = 0;
+      while (true) {
+        auto next = reader.NextRecord(&record);
+        if (!next || !*next) {
+          break;
+        }
+        ASSERT(record.data + record.data_len <= len);
+        kale::dns::ReadName(packet.data(), len, record.name, text,
+                            sizeof(text));
+        auto target = kale::dns::TargetName(reader, record);
+        if (target) {
+          kale::dns::ReadName(packet.data(), len, *target, text,
+                              sizeof(text));
+        }
+        kale::dns::SOAMinimum(reader, record);
+        ++count;
+      }
+      ASSERT(count <= 4 || round > 0);
+    }
+  }
+}
+
+}  // namespace
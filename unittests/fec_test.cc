@@ -0,0 +1,191 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "kale/fec.h"
+#include "kl/logger.h"
+#include "kl/testkit.h"
+
+namespace {
+
+class T {};
+
+TEST(kale::fec::Encoder, Constructor, 4, 2) {}
+
+TEST(T, Field) {
+  for (int a = 1; a < 256; ++a) {
+    ASSERT(kale::fec::Mul(a, kale::fec::Inverse(a)) == 1);
+    ASSERT(kale::fec::Mul(a, 1) == a);
+  }
+  for (size_t i = 0; i < 8; ++i) {
+    ASSERT(kale::fec::Coefficient(0, i) == 1);
+  }
+}
+
+// Every length, so both the vector and the byte loops are covered.
+TEST(T, MulAddRegion) {
+  std::mt19937 rng(1);
+  for (size_t len = 0; len < 70; ++len) {
+    std::vector<uint8_t> src(len), dst(len), expected;
+    for (size_t i = 0; i < len; ++i) {
+      src[i] = rng();
+      dst[i] = rng();
+    }
+    uint8_t c = rng();
+    expected = dst;
+    for (size_t i = 0; i < len; ++i) {
+      expected[i] ^= kale::fec::Mul(c, src[i]);
+    }
+    kale::fec::MulAddRegion(dst.data(), src.data(), c, len);
+    ASSERT(dst == expected);
+  }
+}
+
+struct Datagram {
+  std::vector<uint8_t> bytes;
+};
+
+// Protects @payloads as one group and returns data then parity datagrams.
+std::vector<Datagram> Protect(kale::fec::Encoder *encoder,
+                              const std::vector<std::string> &payloads) {
+  std::vector<Datagram> datagrams;
+  for (const auto &payload : payloads) {
+    Datagram datagram;
+    datagram.bytes.resize(2048);
+    std::memcpy(datagram.bytes.data(), payload.data(), payload.size());
+    auto protect = encoder->Protect(datagram.bytes.data(), payload.size(),
+                                    datagram.bytes.size());
+    ASSERT(protect);
+    datagram.bytes.resize(*protect);
+    ASSERT(kale::fec::IsProtected(datagram.bytes.data(), *protect));
+    datagrams.push_back(datagram);
+  }
+  encoder->Flush();
+  while (encoder->PendingParity() > 0) {
+    Datagram datagram;
+    datagram.bytes.resize(encoder->ParitySize());
+    auto parity =
+        encoder->NextParity(datagram.bytes.data(), datagram.bytes.size());
+    ASSERT(parity);
+    datagrams.push_back(datagram);
+  }
+  return datagrams;
+}
+
+std::vector<std::string> Payloads(std::mt19937 *rng, size_t n) {
+  std::vector<std::string> payloads;
+  for (size_t i = 0; i < n; ++i) {
+    std::string payload((*rng)() % 1400 + 1, 0);
+    for (auto &c : payload) {
+      c = (*rng)();
+    }
+    payloads.push_back(payload);
+  }
+  return payloads;
+}
+
+// Any m of the k + m datagrams of a group can be lost.
+TEST(T, RebuildAnyLoss) {
+  const size_t kData = 6, kParity = 3;
+  std::mt19937 rng(2);
+  kale::fec::Encoder encoder(kData, kParity);
+  kale::fec::Decoder decoder;
+  uint64_t total = 0;
+  for (int round = 0; round < 200; ++round) {
+    auto payloads = Payloads(&rng, kData);
+    auto datagrams = Protect(&encoder, payloads);
+    ASSERT(datagrams.size() == kData + kParity);
+    std::set<size_t> lost;
+    size_t loss = rng() % (kParity + 1);
+    while (lost.size() < loss) {
+      lost.insert(rng() % datagrams.size());
+    }
+    std::set<std::string> got;
+    size_t recovered = 0, arrived = 0, rebuilt_data = 0;
+    // Parity may arrive before data
+    std::shuffle(datagrams.begin(), datagrams.end(), rng);
+    for (size_t i = 0; i < datagrams.size(); ++i) {
+      if (lost.count(i)) {
+        continue;
+      }
+      // Data not among the first k to arrive is rebuilt from them, data
+      // datagrams have no data count
+      if (arrived++ < kData && datagrams[i].bytes[2] != 0) {
+        ++rebuilt_data;
+      }
+      auto receive = decoder.Receive(
+          datagrams[i].bytes.data(), datagrams[i].bytes.size(),
+          [&](const uint8_t *payload, size_t len, bool rebuilt) {
+            std::string s(reinterpret_cast<const char *>(payload), len);
+            ASSERT(got.insert(s).second);
+            recovered += rebuilt;
+          });
+      ASSERT(receive);
+    }
+    ASSERT(got.size() == kData);
+    for (const auto &payload : payloads) {
+      ASSERT(got.count(payload));
+    }
+    ASSERT(recovered == rebuilt_data);
+    total += recovered;
+  }
+  ASSERT(total > 0 && decoder.Recovered() == total);
+}
+
+// A group ended early by Flush, and XOR parity.
+TEST(T, PartialGroup) {
+  std::mt19937 rng(3);
+  kale::fec::Encoder encoder(8, 1);
+  kale::fec::Decoder decoder;
+  auto payloads = Payloads(&rng, 3);
+  auto datagrams = Protect(&encoder, payloads);
+  ASSERT(datagrams.size() == 4);
+  std::vector<std::string> got;
+  for (size_t i : {0, 2, 3}) {
+    decoder.Receive(datagrams[i].bytes.data(), datagrams[i].bytes.size(),
+                    [&](const uint8_t *payload, size_t len, bool) {
+                      got.emplace_back(
+                          reinterpret_cast<const char *>(payload), len);
+                    });
+  }
+  ASSERT(got.size() == 3);
+  ASSERT(got[0] == payloads[0] && got[1] == payloads[2] &&
+         got[2] == payloads[1]);
+}
+
+// Protected datagrams leave room for the length parity carries, parity
+// that still doesn't fit is dropped with the rest of its group's.
+TEST(T, NoRoom) {
+  kale::fec::Encoder encoder(1, 2);
+  uint8_t buffer[64] = {};
+  ASSERT(!encoder.Protect(buffer, 60, sizeof(buffer)));
+  ASSERT(encoder.PendingParity() == 0);
+  auto protect = encoder.Protect(buffer, 54, sizeof(buffer));
+  ASSERT(protect && *protect == 62);
+  ASSERT(encoder.PendingParity() == 2);
+  ASSERT(encoder.ParitySize() == sizeof(buffer));
+  ASSERT(!encoder.NextParity(buffer, sizeof(buffer) - 1));
+  ASSERT(encoder.PendingParity() == 0);
+  ASSERT(encoder.Protect(buffer, 10, sizeof(buffer)));
+  auto parity = encoder.NextParity(buffer, sizeof(buffer));
+  ASSERT(parity && *parity == kale::fec::kOverhead + 10);
+  ASSERT(encoder.PendingParity() == 1);
+}
+
+TEST(T, Malformed) {
+  kale::fec::Decoder decoder;
+  auto ignore = [](const uint8_t *, size_t, bool) {};
+  uint8_t ip[20] = {0x45};
+  ASSERT(!decoder.Receive(ip, sizeof(ip), ignore));
+  uint8_t bad[kale::fec::kHeaderSize + 4] = {kale::fec::kMagic, 5, 4, 1};
+  ASSERT(!decoder.Receive(bad, sizeof(bad), ignore));
+}
+
+}  // namespace
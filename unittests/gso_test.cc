@@ -0,0 +1,175 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <arpa/inet.h>
+
+#include <cstring>
+#include <vector>
+
+#include "kale/gso.h"
+#include "kale/ipv4.h"
+#include "kale/ipv4_tcp.h"
+#include "kl/logger.h"
+#include "kl/testkit.h"
+
+namespace {
+
+class T {};
+using namespace kale::ipv4;
+
+// TCP/IPv4 headers with timestamp options, 52 bytes.
+const uint8_t kHeaders[] = {
+    0x45, 0x00, 0x00, 0x34, 0x9d, 0x8a, 0x40, 0x00, 0x40, 0x06, 0xe1,
+    0x74, 0x0a, 0x00, 0x00, 0x01, 0x4a, 0x7d, 0x67, 0x47, 0x90, 0x10,
+    0x01, 0xbb, 0x44, 0xc6, 0xc0, 0x30, 0x61, 0x4e, 0x74, 0xcd, 0x80,
+    0x10, 0x58, 0x64, 0xff, 0xff, 0x00, 0x00, 0x01, 0x01, 0x08, 0x0a,
+    0x00, 0x3e, 0x27, 0xdb, 0x96, 0xa5, 0x36, 0xf7,
+};
+const size_t kHeaderLen = sizeof(kHeaders);
+
+std::vector<uint8_t> MakePacket(uint32_t seq, size_t payload, bool psh) {
+  std::vector<uint8_t> packet(kHeaders, kHeaders + kHeaderLen);
+  for (size_t i = 0; i < payload; ++i) {
+    packet.push_back(static_cast<uint8_t>(seq + i));
+  }
+  Rep *ip = reinterpret_cast<Rep *>(packet.data());
+  ip->total_length = htons(packet.size());
+  tcp::TCPRep *tcp = reinterpret_cast<tcp::TCPRep *>(packet.data() + 20);
+  tcp->sequence_number = htonl(seq);
+  tcp->psh = psh;
+  PacketEditor editor(packet.data(), packet.size());
+  editor.FillChecksum();
+  editor.CreateTCPSegmentEditor()->FillChecksum();
+  return packet;
+}
+
+kale::gso::VirtioNetHdr TSOHeader(size_t gso_size) {
+  kale::gso::VirtioNetHdr hdr;
+  ::memset(&hdr, 0, sizeof(hdr));
+  hdr.gso_type = kale::gso::kGSOTCPv4;
+  hdr.gso_size = gso_size;
+  hdr.hdr_len = kHeaderLen;
+  return hdr;
+}
+
+TEST(T, Segment) {
+  const uint32_t kSeq = 0xfffff000;
+  const size_t kPayload = 3000, kMSS = 1400;
+  auto super = MakePacket(kSeq, kPayload, true);
+  auto hdr = TSOHeader(kMSS);
+  ASSERT(kale::gso::SegmentCount(hdr, super.data(), super.size()) == 3);
+  uint8_t out[2048];
+  size_t offset = 0;
+  for (size_t i = 0; i < 3; ++i) {
+    auto build = kale::gso::BuildSegment(hdr, super.data(), super.size(), i,
+                                         out, sizeof(out));
+    ASSERT(build);
+    size_t payload = i < 2 ? kMSS : kPayload - 2 * kMSS;
+    ASSERT(*build == kHeaderLen + payload);
+    ASSERT(Validate(PacketRef(out, *build)).ok());
+    const tcp::TCPRep *tcp =
+        reinterpret_cast<const tcp::TCPRep *>(out + 20);
+    ASSERT(ntohl(tcp->sequence_number) == kSeq + offset);
+    ASSERT(tcp->psh == (i == 2));
+    ASSERT(::memcmp(out + kHeaderLen, super.data() + kHeaderLen + offset,
+                    payload) == 0);
+    offset += payload;
+  }
+}
+
+TEST(T, SegmentTooSmall) {
+  auto super = MakePacket(1, 3000, false);
+  auto hdr = TSOHeader(1400);
+  uint8_t out[1024];
+  ASSERT(!kale::gso::BuildSegment(hdr, super.data(), super.size(), 0, out,
+                                  sizeof(out)));
+}
+
+TEST(T, CompletePartialChecksum) {
+  auto packet = MakePacket(1, 100, false);
+  const uint16_t expected = reinterpret_cast<const tcp::TCPRep *>(
+                                packet.data() + 20)->checksum;
+  // What the kernel hands out with checksum offload
+  kale::gso::VirtioNetHdr hdr;
+  ::memset(&hdr, 0, sizeof(hdr));
+  hdr.flags = kale::gso::kNeedsChecksum;
+  hdr.csum_start = 20;
+  hdr.csum_offset = offsetof(tcp::TCPRep, checksum);
+  uint16_t partial = ChecksumCarry(
+      InternetChecksum(packet.data() + 12, 8) + htons(kTCP) +
+      htons(static_cast<uint16_t>(packet.size() - 20)));
+  ::memcpy(packet.data() + 20 + hdr.csum_offset, &partial, sizeof(partial));
+  ASSERT(kale::gso::SegmentCount(hdr, packet.data(), packet.size()) == 1);
+  uint8_t out[2048];
+  auto build = kale::gso::BuildSegment(hdr, packet.data(), packet.size(), 0,
+                                       out, sizeof(out));
+  ASSERT(build);
+  ASSERT(Validate(PacketRef(out, *build)).ok());
+  ASSERT(reinterpret_cast<const tcp::TCPRep *>(out + 20)->checksum ==
+         expected);
+}
+
+// Segments coalesced back to a super packet resegment to the same packets.
+TEST(T, CoalesceRoundTrip) {
+  const size_t kMSS = 1000;
+  std::vector<std::vector<uint8_t>> packets;
+  for (size_t i = 0; i < 4; ++i) {
+    packets.push_back(
+        MakePacket(100 + i * kMSS, i < 3 ? kMSS : 500, i == 3));
+  }
+  kale::gso::TCPCoalescer coalescer;
+  for (const auto &packet : packets) {
+    ASSERT(coalescer.Add(packet.data(), packet.size()));
+  }
+  ASSERT(coalescer.Count() == 4);
+  size_t len = coalescer.Flush();
+  ASSERT(coalescer.Empty());
+  kale::gso::VirtioNetHdr hdr;
+  const uint8_t *super;
+  size_t super_len;
+  kale::gso::ParseFrame(coalescer.Frame(), len, &hdr, &super, &super_len);
+  ASSERT(super_len == kHeaderLen + 3 * kMSS + 500);
+  ASSERT(hdr.gso_type == kale::gso::kGSOTCPv4);
+  ASSERT(hdr.gso_size == kMSS);
+  ASSERT(hdr.hdr_len == kHeaderLen);
+  ASSERT(hdr.flags & kale::gso::kNeedsChecksum);
+  ASSERT(kale::gso::SegmentCount(hdr, super, super_len) == 4);
+  uint8_t out[2048];
+  for (size_t i = 0; i < 4; ++i) {
+    auto build =
+        kale::gso::BuildSegment(hdr, super, super_len, i, out, sizeof(out));
+    ASSERT(build);
+    ASSERT(*build == packets[i].size());
+    // Identification is renumbered, everything else must match.
+    ASSERT(::memcmp(out + 20, packets[i].data() + 20, *build - 20) == 0);
+    ASSERT(Validate(PacketRef(out, *build)).ok());
+  }
+}
+
+TEST(T, CoalesceRejects) {
+  auto first = MakePacket(100, 1000, false);
+  auto gap = MakePacket(1200, 1000, false);
+  auto longer = MakePacket(1100, 1200, false);
+  auto next = MakePacket(1100, 1000, false);
+  kale::gso::TCPCoalescer coalescer;
+  ASSERT(coalescer.Add(first.data(), first.size()));
+  ASSERT(!coalescer.Add(gap.data(), gap.size()));
+  ASSERT(!coalescer.Add(longer.data(), longer.size()));
+  ASSERT(coalescer.Add(next.data(), next.size()));
+  ASSERT(coalescer.Count() == 2);
+  // A lone packet goes out untouched with an empty header
+  coalescer.Flush();
+  ASSERT(coalescer.Add(gap.data(), gap.size()));
+  size_t len = coalescer.Flush();
+  ASSERT(len == kale::gso::kVirtioNetHdrSize + gap.size());
+  kale::gso::VirtioNetHdr hdr;
+  const uint8_t *packet;
+  size_t packet_len;
+  kale::gso::ParseFrame(coalescer.Frame(), len, &hdr, &packet, &packet_len);
+  ASSERT(hdr.gso_type == kale::gso::kGSONone);
+  ASSERT(hdr.flags == 0);
+  ASSERT(::memcmp(packet, gap.data(), gap.size()) == 0);
+}
+
+}  // namespace
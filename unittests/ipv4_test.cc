@@ -105,4 +105,102 @@ TEST(IPv4Test, IPv4Packet2) {
   ASSERT(edited.rep->checksum == 0);
 }
 
+TEST(IPv4Test, ChecksumAdjust) {
+  // Changing a word to itself keeps the checksum
+  ASSERT(ChecksumAdjust(0x1234, 0xabcd, 0xabcd) == 0x1234);
+  ASSERT(ChecksumAdjust32(0x1234, 0xdeadbeef, 0xdeadbeef) == 0x1234);
+}
+
+TEST(IPv4Test, IncrementalTCP) {
+  const uint8_t packet[] = {
+      0x45, 0x00, 0x00, 0x34, 0x9d, 0x8a, 0x40, 0x00, 0x40, 0x06, 0xe1,
+      0x74, 0x0a, 0x00, 0x00, 0x01, 0x4a, 0x7d, 0x67, 0x47, 0x90, 0x10,
+      0x01, 0xbb, 0x44, 0xc6, 0xc0, 0x30, 0x61, 0x4e, 0x74, 0xcd, 0x80,
+      0x10, 0x58, 0x64, 0xff, 0xff, 0x00, 0x00, 0x01, 0x01, 0x08, 0x0a,
+      0x00, 0x3e, 0x27, 0xdb, 0x96, 0xa5, 0x36, 0xf7,
+  };
+  std::vector<uint8_t> incremental(packet, packet + sizeof(packet));
+  std::vector<uint8_t> full(packet, packet + sizeof(packet));
+  PacketEditor editor(incremental.data(), incremental.size());
+  auto tcp_editor = editor.CreateTCPSegmentEditor();
+  ASSERT(tcp_editor);
+  editor.ChangeSourceAddr(0x0100a8c0, kIncrementalChecksum);
+  editor.ChangeDestAddr(0x08080808, kIncrementalChecksum);
+  tcp_editor->ChangeSourcePort(0x60ea, kIncrementalChecksum);
+  tcp_editor->ChangeDestPort(0x3500, kIncrementalChecksum);
+  ASSERT(editor.ValidateChecksum());
+  ASSERT(tcp_editor->ValidateChecksum());
+  PacketEditor full_editor(full.data(), full.size());
+  auto full_tcp_editor = full_editor.CreateTCPSegmentEditor();
+  full_editor.ChangeSourceAddr(0x0100a8c0);
+  full_editor.ChangeDestAddr(0x08080808);
+  full_tcp_editor->ChangeSourcePort(0x60ea);
+  full_tcp_editor->ChangeDestPort(0x3500);
+  full_editor.FillChecksum();
+  full_tcp_editor->FillChecksum();
+  ASSERT(editor.ref().rep->checksum == full_editor.ref().rep->checksum);
+  ASSERT(tcp_editor->ref().rep->checksum ==
+         full_tcp_editor->ref().rep->checksum);
+}
+
+TEST(IPv4Test, IncrementalUDP) {
+  // 10.0.0.1:4000 -> 8.8.8.8:53, payload "kale!"
+  uint8_t packet[] = {
+      0x45, 0x00, 0x00, 0x21, 0x00, 0x01, 0x40, 0x00, 0x40, 0x11, 0x00,
+      0x00, 0x0a, 0x00, 0x00, 0x01, 0x08, 0x08, 0x08, 0x08, 0x0f, 0xa0,
+      0x00, 0x35, 0x00, 0x0d, 0x00, 0x00, 0x6b, 0x61, 0x6c, 0x65, 0x21,
+  };
+  PacketEditor origin(packet, sizeof(packet));
+  origin.FillChecksum();
+  origin.CreateUDPSegmentEditor()->FillChecksum();
+  std::vector<uint8_t> incremental(packet, packet + sizeof(packet));
+  PacketEditor editor(incremental.data(), incremental.size());
+  auto udp_editor = editor.CreateUDPSegmentEditor();
+  ASSERT(udp_editor);
+  ASSERT(udp_editor->ValidateChecksum());
+  editor.ChangeSourceAddr(0x0100a8c0, kIncrementalChecksum);
+  udp_editor->ChangeSourcePort(0x60ea, kIncrementalChecksum);
+  ASSERT(editor.ValidateChecksum());
+  ASSERT(udp_editor->ValidateChecksum());
+  // Absent checksum stays absent
+  udp_editor->FillChecksum();
+  const_cast<udp::UDPRep *>(udp_editor->ref().rep)->checksum = 0;
+  editor.ChangeDestAddr(0x04040808, kIncrementalChecksum);
+  udp_editor->ChangeDestPort(0x3600, kIncrementalChecksum);
+  ASSERT(udp_editor->ref().rep->checksum == 0);
+  ASSERT(editor.ValidateChecksum());
+}
+
+TEST(IPv4Test, Validate) {
+  const uint8_t packet[] = {
+      0x45, 0x00, 0x00, 0x34, 0x9d, 0x8a, 0x40, 0x00, 0x40, 0x06, 0xe1,
+      0x74, 0x0a, 0x00, 0x00, 0x01, 0x4a, 0x7d, 0x67, 0x47, 0x90, 0x10,
+      0x01, 0xbb, 0x44, 0xc6, 0xc0, 0x30, 0x61, 0x4e, 0x74, 0xcd, 0x80,
+      0x10, 0x58, 0x64, 0xff, 0xff, 0x00, 0x00, 0x01, 0x01, 0x08, 0x0a,
+      0x00, 0x3e, 0x27, 0xdb, 0x96, 0xa5, 0x36, 0xf7,
+  };
+  Verdict verdict = Validate(PacketRef(packet, sizeof(packet)));
+  ASSERT(verdict.ok());
+  ASSERT(verdict.protocol == kTCP);
+  // Trailing link layer padding is ignored
+  std::vector<uint8_t> padded(packet, packet + sizeof(packet));
+  padded.resize(60, 0);
+  ASSERT(Validate(PacketRef(padded.data(), padded.size())).ok());
+  ASSERT(Validate(PacketRef(packet, sizeof(packet) - 1)).status ==
+         kTruncated);
+  ASSERT(Validate(PacketRef(packet, 10)).status == kTruncated);
+  std::vector<uint8_t> corrupt(packet, packet + sizeof(packet));
+  corrupt[8] = 0x3f;  // ttl
+  verdict = Validate(PacketRef(corrupt.data(), corrupt.size()));
+  ASSERT(verdict.status == kBadHeaderChecksum);
+  ASSERT(verdict.actual_checksum == PacketRef(packet, 20).rep->checksum);
+  PacketEditor editor(corrupt.data(), corrupt.size());
+  editor.FillChecksum();
+  ASSERT(verdict.expected_checksum == editor.ref().rep->checksum);
+  corrupt[sizeof(packet) - 1] ^= 0x01;
+  verdict = Validate(PacketRef(corrupt.data(), corrupt.size()));
+  ASSERT(verdict.status == kBadSegmentChecksum);
+  ASSERT(verdict.actual_checksum == 0xffff);
+}
+
 }  // namespace
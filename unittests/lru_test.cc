@@ -3,6 +3,7 @@
 // the LICENSE file.
 
 #include <algorithm>
+#include <random>
 #include <vector>
 
 #include "kale/lru.h"
@@ -11,6 +12,8 @@
 
 namespace {
 
+class T {};
+
 TEST(kale::LRU, Constructor, 16) {}
 
 TEST(kale::LRU, CheckSize, 1024) {
@@ -48,4 +51,54 @@ TEST(kale::LRU, GetLRU1, 16) {
   }
 }
 
+TEST(kale::ArenaLRU, ArenaCheckSize, 1024) {
+  for (size_t i = 0; i < 1024; ++i) {
+    Use(i);
+  }
+  ASSERT(!Use(1024));
+  uint32_t p = head_;
+  size_t size = 0;
+  while (p != kNil) {
+    ++size;
+    p = nodes_[p].next;
+  }
+  ASSERT(size == 1024);
+  ASSERT(Head() == 1023);
+}
+
+TEST(kale::ArenaLRU, Drop, 16) {
+  ASSERT(Drop(7));
+  ASSERT(Tail() == 7);
+  ASSERT(GetLRU() == 7);
+  ASSERT(Head() == 7);
+  // The only one left behind it
+  ASSERT(Drop(Tail()));
+  ASSERT(!Drop(16));
+  uint32_t p = tail_;
+  size_t size = 0;
+  while (p != kNil) {
+    ++size;
+    p = nodes_[p].prev;
+  }
+  ASSERT(size == 16);
+}
+
+// Same order as LRU under any sequence of operations.
+TEST(T, ArenaMatchesLRU) {
+  const size_t kSize = 257;
+  kale::LRU lru(kSize);
+  kale::ArenaLRU arena(kSize);
+  std::mt19937 rng(3);
+  for (int i = 0; i < 100000; ++i) {
+    if (rng() % 4 == 0) {
+      ASSERT(lru.GetLRU() == arena.GetLRU());
+    } else {
+      uint32_t v = rng() % kSize;
+      ASSERT(lru.Use(v) == arena.Use(v));
+    }
+    ASSERT(lru.Head() == arena.Head());
+    ASSERT(lru.Tail() == arena.Tail());
+  }
+}
+
 }  // namespace
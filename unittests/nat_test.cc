@@ -0,0 +1,198 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <arpa/inet.h>
+
+#include <map>
+#include <random>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "kale/nat.h"
+#include "kl/logger.h"
+#include "kl/testkit.h"
+
+namespace {
+
+class T {};
+
+const std::vector<uint32_t> kAddrs = {htonl(0xc0a80001)};
+
+kale::FlowKey MakeKey(uint32_t peer, uint16_t peer_port, uint32_t subnet,
+                      uint16_t subnet_port) {
+  kale::FlowKey key;
+  key.peer_addr = htonl(peer);
+  key.peer_port = htons(peer_port);
+  key.subnet_addr = htonl(subnet);
+  key.subnet_port = htons(subnet_port);
+  return key;
+}
+
+kale::Endpoint Local(uint16_t port, uint32_t addr = kAddrs[0]) {
+  kale::Endpoint local;
+  local.addr = addr;
+  local.port = port;
+  return local;
+}
+
+TEST(kale::Nat, Constructor, kAddrs, 60000, 60255, 120) {}
+
+TEST(T, MapAndQuery) {
+  kale::Nat nat(kAddrs, 60000, 60255, 120);
+  auto key = MakeKey(0x01020304, 4000, 0x0a000001, 80);
+  kale::Endpoint local;
+  ASSERT(!nat.QueryEndpoint(key, &local));
+  auto map = nat.Map(key);
+  ASSERT(map);
+  local = *map;
+  ASSERT(local.addr == kAddrs[0]);
+  ASSERT(local.port >= 60000 && local.port <= 60255);
+  ASSERT(nat.Size() == 1);
+  ASSERT((*nat.Map(key)).port == local.port);
+  kale::Endpoint query;
+  ASSERT(nat.QueryEndpoint(key, &query));
+  ASSERT(query.addr == local.addr && query.port == local.port);
+  kale::FlowKey flow;
+  ASSERT(nat.QueryFlow(local, &flow));
+  ASSERT(flow == key);
+  ASSERT(!nat.QueryFlow(Local(local.port == 60000 ? 60001 : 60000), &flow));
+  ASSERT(!nat.QueryFlow(Local(1024), &flow));
+  ASSERT(!nat.QueryFlow(Local(local.port, htonl(0x7f000001)), &flow));
+  ASSERT(nat.Remove(local));
+  ASSERT(!nat.Remove(local));
+  ASSERT(!nat.QueryEndpoint(key, &query));
+  ASSERT(nat.Size() == 0);
+}
+
+// Live mappings are never taken over, released ports are reused last.
+TEST(T, Exhaustion) {
+  kale::Nat nat(kAddrs, 1000, 1003, 60);
+  uint16_t ports[4];
+  for (int i = 0; i < 4; ++i) {
+    auto map = nat.Map(MakeKey(1, 1, 2, i));
+    ASSERT(map);
+    ports[i] = (*map).port;
+  }
+  ASSERT(!nat.Map(MakeKey(1, 1, 2, 4)));
+  ASSERT(nat.Remove(Local(ports[1])));
+  auto map = nat.Map(MakeKey(1, 1, 2, 4));
+  ASSERT(map);
+  ASSERT((*map).port == ports[1]);
+  ASSERT(nat.Remove(Local(ports[2])));
+  ASSERT(nat.Remove(Local(ports[0])));
+  ASSERT((*nat.Map(MakeKey(1, 1, 2, 5))).port == ports[2]);
+  ASSERT((*nat.Map(MakeKey(1, 1, 2, 6))).port == ports[0]);
+}
+
+TEST(T, IdleExpiry) {
+  const uint32_t kTimeout = 30;
+  kale::Nat nat(kAddrs, 1000, 1003, kTimeout);
+  auto busy = MakeKey(1, 1, 2, 0), idle = MakeKey(1, 1, 2, 1);
+  kale::Endpoint busy_local = *nat.Map(busy);
+  kale::Endpoint idle_local = *nat.Map(idle);
+  kale::FlowKey flow;
+  for (uint64_t now = 1; now < kTimeout; ++now) {
+    ASSERT(nat.Advance(now) == 0);
+    ASSERT(nat.QueryFlow(busy_local, &flow));
+  }
+  ASSERT(nat.Advance(kTimeout) == 1);
+  ASSERT(!nat.QueryFlow(idle_local, &flow));
+  ASSERT(nat.Size() == 1);
+  // Seen at kTimeout - 1
+  ASSERT(nat.Advance(2 * kTimeout - 2) == 0);
+  ASSERT(nat.Advance(2 * kTimeout - 1) == 1);
+  ASSERT(nat.Size() == 0);
+  ASSERT(!nat.QueryFlow(busy_local, &flow));
+}
+
+// Flows of a host share its address, hosts spread over the addresses, and
+// a full address lends ports of the others.
+TEST(T, AddressPool) {
+  const std::vector<uint32_t> kPool = {htonl(0xc0a80001), htonl(0xc0a80002),
+                                       htonl(0xc0a80003), htonl(0xc0a80004)};
+  const uint16_t kPorts = 64;
+  kale::Nat nat(kPool, 1000, 1000 + kPorts - 1, 60);
+  std::set<uint32_t> used;
+  for (uint32_t host = 0; host < 16; ++host) {
+    uint32_t addr = (*nat.Map(MakeKey(1, 1, host, 0))).addr;
+    used.insert(addr);
+    for (uint16_t port = 1; port < 4; ++port) {
+      ASSERT((*nat.Map(MakeKey(1, 1, host, port))).addr == addr);
+    }
+  }
+  ASSERT(used.size() > 1);
+  // One host takes every endpoint
+  kale::Nat small(kPool, 1000, 1000 + kPorts - 1, 60);
+  std::map<uint32_t, int> per_addr;
+  for (int i = 0; i < kPorts * 4; ++i) {
+    auto map = small.Map(MakeKey(1, 1, 2, i));
+    ASSERT(map);
+    kale::FlowKey flow;
+    ASSERT(small.QueryFlow(*map, &flow));
+    ASSERT(flow == MakeKey(1, 1, 2, i));
+    ++per_addr[(*map).addr];
+  }
+  ASSERT(per_addr.size() == kPool.size());
+  for (const auto &entry : per_addr) {
+    ASSERT(entry.second == kPorts);
+  }
+  ASSERT(!small.Map(MakeKey(1, 1, 2, kPorts * 4)));
+}
+
+// Random churn checked against std::map.
+TEST(T, Churn) {
+  const std::vector<uint32_t> kPool = {htonl(0x0a000001), htonl(0x0a000002)};
+  const uint16_t kPortMin = 20000, kPortMax = 20499;
+  const uint32_t kTimeout = 100;
+  kale::Nat nat(kPool, kPortMin, kPortMax, kTimeout);
+  // (addr, port) -> (flow, last seen)
+  std::map<std::pair<uint32_t, uint16_t>, std::pair<uint32_t, uint64_t>>
+      expected;
+  std::mt19937 rng(7);
+  uint64_t now = 0;
+  for (int i = 0; i < 200000; ++i) {
+    if (i % 64 == 0) {
+      nat.Advance(++now);
+      for (auto iter = expected.begin(); iter != expected.end();) {
+        if (iter->second.second + kTimeout <= now) {
+          iter = expected.erase(iter);
+        } else {
+          ++iter;
+        }
+      }
+      ASSERT(nat.Size() == expected.size());
+    }
+    uint32_t flow = rng() % 4096;
+    auto key = MakeKey(flow, flow >> 4, ~flow, flow & 0xf);
+    if (rng() % 8 == 0) {
+      kale::Endpoint local;
+      if (nat.QueryEndpoint(key, &local)) {
+        ASSERT(nat.Remove(local));
+        expected.erase(std::make_pair(local.addr, local.port));
+      }
+      continue;
+    }
+    auto map = nat.Map(key);
+    if (!map) {
+      ASSERT(expected.size() == kPool.size() * (kPortMax - kPortMin + 1u));
+      continue;
+    }
+    expected[std::make_pair((*map).addr, (*map).port)] =
+        std::make_pair(flow, now);
+  }
+  ASSERT(nat.Size() == expected.size());
+  for (const auto &entry : expected) {
+    uint32_t flow = entry.second.first;
+    auto key = MakeKey(flow, flow >> 4, ~flow, flow & 0xf);
+    kale::Endpoint local;
+    ASSERT(nat.QueryEndpoint(key, &local));
+    ASSERT(local.addr == entry.first.first && local.port == entry.first.second);
+    kale::FlowKey query;
+    ASSERT(nat.QueryFlow(local, &query));
+    ASSERT(query == key);
+  }
+}
+
+}  // namespace
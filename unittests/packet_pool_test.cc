@@ -0,0 +1,128 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "kale/packet_pool.h"
+#include "kl/logger.h"
+#include "kl/testkit.h"
+
+namespace {
+
+class T {};
+
+TEST(T, Rooms) {
+  kale::PacketPool pool(2, 1500, 32, 16);
+  kale::PacketBuffer packet;
+  ASSERT(pool.Get(&packet));
+  ASSERT(packet.Length() == 0);
+  ASSERT(packet.Headroom() == 32);
+  ASSERT(packet.Tailroom() >= 1500 + 16);
+  ASSERT(reinterpret_cast<uintptr_t>(packet.Data() - packet.Headroom()) %
+             kale::kCacheLineSize ==
+         0);
+  const char kPayload[] = "payload";
+  packet.SetLength(sizeof(kPayload));
+  std::memcpy(packet.Data(), kPayload, sizeof(kPayload));
+  uint8_t *header = packet.Prepend(4);
+  ASSERT(packet.Headroom() == 28);
+  ASSERT(packet.Length() == sizeof(kPayload) + 4);
+  ASSERT(std::memcmp(header + 4, kPayload, sizeof(kPayload)) == 0);
+  packet.Consume(4);
+  ASSERT(packet.Data() == header + 4);
+  ASSERT(packet.Capacity() == packet.Length() + packet.Tailroom());
+}
+
+TEST(T, RefCount) {
+  kale::PacketPool pool(2, 1500);
+  kale::PacketBuffer a, b;
+  ASSERT(pool.Get(&a));
+  ASSERT(pool.Get(&b));
+  kale::PacketBuffer c;
+  ASSERT(!pool.Get(&c));
+  c = a;
+  ASSERT(a.Shared() && c.Shared());
+  ASSERT(c.Data() == a.Data());
+  a.Reset();
+  ASSERT(!c.Shared());
+  ASSERT(pool.Available() == 0);
+  kale::PacketBuffer d(std::move(c));
+  ASSERT(!c.Valid());
+  d.Reset();
+  ASSERT(pool.Available() == 1);
+  b = kale::PacketBuffer();
+  ASSERT(pool.Available() == 2);
+}
+
+TEST(T, Cache) {
+  kale::PacketPool pool(64, 1500);
+  {
+    kale::PacketPool::Cache cache(&pool, 8);
+    std::vector<kale::PacketBuffer> packets(10);
+    for (auto &packet : packets) {
+      ASSERT(cache.Get(&packet));
+    }
+    // Refilled by 4 at a time
+    ASSERT(cache.Size() == 2);
+    ASSERT(pool.Available() == 52);
+    kale::PacketBuffer shared = packets[0];
+    for (auto &packet : packets) {
+      cache.Recycle(&packet);
+      ASSERT(!packet.Valid());
+    }
+    ASSERT(cache.Size() <= 8);
+    ASSERT(pool.Available() + cache.Size() == 63);
+    cache.Recycle(&shared);
+    ASSERT(pool.Available() + cache.Size() == 64);
+  }
+  ASSERT(pool.Available() == 64);
+}
+
+// Buffers got by one thread's cache are recycled by another's.
+TEST(T, Threads) {
+  const int kRounds = 1 << 14;
+  kale::PacketPool pool(256, 1500);
+  std::vector<kale::PacketBuffer> handoff;
+  std::mutex mutex;
+  std::thread producer([&] {
+    kale::PacketPool::Cache cache(&pool, 32);
+    for (int i = 0; i < kRounds;) {
+      kale::PacketBuffer packet;
+      if (!cache.Get(&packet)) {
+        std::this_thread::yield();
+        continue;
+      }
+      packet.SetLength(sizeof(i));
+      std::memcpy(packet.Data(), &i, sizeof(i));
+      std::lock_guard<std::mutex> guard(mutex);
+      handoff.push_back(std::move(packet));
+      ++i;
+    }
+  });
+  kale::PacketPool::Cache cache(&pool, 32);
+  int expected = 0;
+  while (expected < kRounds) {
+    std::vector<kale::PacketBuffer> got;
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      got.swap(handoff);
+    }
+    if (got.empty()) {
+      std::this_thread::yield();
+    }
+    for (auto &packet : got) {
+      int v;
+      std::memcpy(&v, packet.Data(), sizeof(v));
+      ASSERT(v == expected++);
+      cache.Recycle(&packet);
+    }
+  }
+  producer.join();
+}
+
+}  // namespace
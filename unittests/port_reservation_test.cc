@@ -0,0 +1,132 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <unistd.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include "kale/port_reservation.h"
+#include "kl/logger.h"
+#include "kl/testkit.h"
+
+namespace {
+
+class T {};
+
+std::string ReadAll(const char *path) {
+  std::ifstream in(path);
+  std::string line;
+  std::getline(in, line);
+  return line;
+}
+
+// A stand-in for ip_local_reserved_ports
+class ReservedPortsFile {
+ public:
+  explicit ReservedPortsFile(const char *content) {
+    char path[] = "/tmp/kale_reserved_ports_XXXXXX";
+    int fd = ::mkstemp(path);
+    ASSERT(fd >= 0);
+    ::close(fd);
+    path_ = path;
+    std::ofstream(path_) << content;
+  }
+  ~ReservedPortsFile() { ::unlink(path_.c_str()); }
+  const char *path() const { return path_.c_str(); }
+
+ private:
+  std::string path_;
+};
+
+TEST(T, ParsePorts) {
+  auto ports = kale::ports::ParsePorts("4000,60001-60002,60000");
+  ASSERT(ports);
+  ASSERT((*ports)[4000] && !(*ports)[4001]);
+  ASSERT(kale::ports::FormatPorts(*ports) == "4000,60000-60002");
+  ASSERT(kale::ports::ParsePorts("")->size() == 65536);
+  ASSERT(!kale::ports::ParsePorts("60002-60001"));
+  ASSERT(!kale::ports::ParsePorts("65536"));
+  ASSERT(!kale::ports::ParsePorts("port"));
+}
+
+TEST(T, ReserveLocalPorts) {
+  ReservedPortsFile file("\n");
+  auto reserve = kale::ports::ReserveLocalPorts(60000, 60255, file.path());
+  ASSERT(reserve);
+  ASSERT(kale::ports::FormatPorts(*reserve) == "60000-60255");
+  ASSERT(ReadAll(file.path()) == "60000-60255");
+  // Already there
+  reserve = kale::ports::ReserveLocalPorts(60000, 60255, file.path());
+  ASSERT(reserve && kale::ports::FormatPorts(*reserve).empty());
+  ASSERT(ReadAll(file.path()) == "60000-60255");
+  ASSERT(kale::ports::ReserveLocalPorts(4000, 4000, file.path()));
+  ASSERT(ReadAll(file.path()) == "4000,60000-60255");
+}
+
+TEST(T, ReleaseLocalPorts) {
+  ReservedPortsFile file("22,60000-60255,4000\n");
+  auto ports = kale::ports::ParsePorts("60000-60255");
+  ASSERT(kale::ports::ReleaseLocalPorts(*ports, file.path()));
+  ASSERT(ReadAll(file.path()) == "22,4000");
+  // Not there
+  ASSERT(kale::ports::ReleaseLocalPorts(*ports, file.path()));
+  ASSERT(ReadAll(file.path()) == "22,4000");
+  ASSERT(!kale::ports::ReleaseLocalPorts(*ports, "/nonexistent/kale/ports"));
+}
+
+// The kernel merges what's written into ranges, the ports someone else
+// reserved must survive the release
+TEST(T, ReleaseMergedPorts) {
+  ReservedPortsFile file("60256-60300,60100\n");
+  auto reserve = kale::ports::ReserveLocalPorts(60000, 60255, file.path());
+  ASSERT(reserve);
+  ASSERT(kale::ports::FormatPorts(*reserve) == "60000-60099,60101-60255");
+  ASSERT(ReadAll(file.path()) == "60000-60300");
+  ASSERT(kale::ports::ReleaseLocalPorts(*reserve, file.path()));
+  ASSERT(ReadAll(file.path()) == "60100,60256-60300");
+}
+
+TEST(T, ReserveMissingFile) {
+  ASSERT(!kale::ports::ReserveLocalPorts(1, 2, "/nonexistent/kale/ports"));
+}
+
+TEST(T, IptablesRules) {
+  std::string rules =
+      kale::ports::DropRules(kale::ports::kIptables, 30000, 59999);
+  KL_DEBUG("\n%s", rules.c_str());
+  ASSERT(rules.find(":KALE_30000_59999 - [0:0]\n") != std::string::npos);
+  ASSERT(rules.find("-p tcp -m tcp --dport 30000:59999 -j DROP\n") !=
+         std::string::npos);
+  ASSERT(rules.find("-p udp -m udp --dport 30000:59999 -j DROP\n") !=
+         std::string::npos);
+  ASSERT(rules.find("-I INPUT -j KALE_30000_59999\n") != std::string::npos);
+  ASSERT(rules.substr(rules.size() - 7) == "COMMIT\n");
+  rules = kale::ports::DropRules(kale::ports::kIptables, 30000, 59999, false);
+  ASSERT(rules.find("INPUT") == std::string::npos);
+}
+
+TEST(T, NftablesRules) {
+  std::string rules =
+      kale::ports::DropRules(kale::ports::kNftables, 30000, 59999);
+  KL_DEBUG("\n%s", rules.c_str());
+  ASSERT(rules.find("delete table ip KALE_30000_59999\n") != std::string::npos);
+  ASSERT(rules.find("tcp dport 30000-59999 drop\n") != std::string::npos);
+  ASSERT(rules.find("udp dport 30000-59999 drop\n") != std::string::npos);
+}
+
+TEST(T, DeleteRules) {
+  std::string rules =
+      kale::ports::DeleteRules(kale::ports::kIptables, 30000, 59999);
+  ASSERT(rules == "*filter\n"
+                  "-D INPUT -j KALE_30000_59999\n"
+                  "-F KALE_30000_59999\n"
+                  "-X KALE_30000_59999\n"
+                  "COMMIT\n");
+  rules = kale::ports::DeleteRules(kale::ports::kNftables, 30000, 59999);
+  ASSERT(rules == "delete table ip KALE_30000_59999\n");
+}
+
+}  // namespace
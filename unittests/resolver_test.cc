@@ -2,8 +2,19 @@
 // Use of this source code is governed by the BSD license that can be found in
 // the LICENSE file.
 
+#include <poll.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <random>
+#include <thread>
+
 #include "kale/resolver.h"
 #include "kale/ip.h"
+#include "kl/inet.h"
 #include "kl/logger.h"
 #include "kl/testkit.h"
 #include "kl/udp.h"
@@ -11,6 +22,94 @@
 namespace {
 class T {};
 
+// Answers @query with one A record of @ttl, or @rcode.
+std::vector<uint8_t> BuildResponse(const uint8_t *query, size_t len,
+                                   uint32_t ttl, uint8_t rcode = 0) {
+  std::vector<uint8_t> response(query, query + len);
+  response[2] = 0x81;
+  response[3] = 0x80 | rcode;
+  if (rcode != 0) {
+    return response;
+  }
+  response[7] = 1;
+  const uint8_t answer[] = {0xc0, 0x0c, 0, 1, 0, 1,
+                            static_cast<uint8_t>(ttl >> 24),
+                            static_cast<uint8_t>(ttl >> 16),
+                            static_cast<uint8_t>(ttl >> 8),
+                            static_cast<uint8_t>(ttl), 0, 4, 10, 0, 0, 1};
+  response.insert(response.end(), answer, answer + sizeof(answer));
+  return response;
+}
+
+// Answers queries on a local port from its own thread after @delay
+// milliseconds, dropping @loss percent of them.
+class StubServer {
+public:
+  explicit StubServer(int loss = 0, int delay = 0)
+      : fd_(*kl::udp::Socket()),
+        loss_(loss),
+        delay_(delay),
+        stop_(false),
+        queries_(0) {
+    ASSERT(kl::inet::Bind(fd_, "127.0.0.1", 0));
+    port_ = std::get<1>(*kl::inet::InetAddr(fd_));
+    thread_ = std::thread([this] { Serve(); });
+  }
+  ~StubServer() {
+    stop_ = true;
+    thread_.join();
+    ::close(fd_);
+  }
+  uint16_t Port() const { return port_; }
+  int Queries() const { return queries_; }
+
+private:
+  using Clock = std::chrono::steady_clock;
+  struct Delayed {
+    Clock::time_point due;
+    std::vector<uint8_t> response;
+    struct sockaddr_in addr;
+  };
+  void Serve() {
+    std::mt19937 rng(port_);
+    std::deque<Delayed> delayed;
+    while (!stop_) {
+      while (!delayed.empty() && delayed.front().due <= Clock::now()) {
+        Delayed &front = delayed.front();
+        ::sendto(fd_, front.response.data(), front.response.size(), 0,
+                 reinterpret_cast<struct sockaddr *>(&front.addr),
+                 sizeof(front.addr));
+        delayed.pop_front();
+      }
+      struct pollfd pfd = {fd_, POLLIN, 0};
+      if (::poll(&pfd, 1, delayed.empty() ? 10 : 1) <= 0) {
+        continue;
+      }
+      uint8_t buf[512];
+      struct sockaddr_in addr;
+      socklen_t addr_len = sizeof(addr);
+      int nread = ::recvfrom(fd_, buf, sizeof(buf), 0,
+                             reinterpret_cast<struct sockaddr *>(&addr),
+                             &addr_len);
+      if (nread <= 0) {
+        continue;
+      }
+      ++queries_;
+      if (static_cast<int>(rng() % 100) < loss_) {
+        continue;
+      }
+      delayed.push_back({Clock::now() + std::chrono::milliseconds(delay_),
+                         BuildResponse(buf, nread, 300), addr});
+    }
+  }
+  int fd_;
+  uint16_t port_;
+  int loss_, delay_;
+  std::atomic<bool> stop_;
+  std::atomic<int> queries_;
+  std::thread thread_;
+};
+
 TEST(T, BuildQuery) {
   auto query = kale::Resolver::BuildQuery("www.google.com", 0x2c13);
   const char *origin = "\x2c\x13\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00\x03"
@@ -40,6 +139,200 @@ TEST(T, DNSName) {
   ASSERT(skip == static_cast<int>(name.size()));
 }
 
+TEST(T, ParseResponse) {
+  // www.example.com CNAME example.com, example.com A 10.0.0.1
+  const uint8_t packet[] = {
+      0x12, 0x34, 0x81, 0x80, 0, 1, 0, 2, 0, 0, 0, 0,
+      3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o',
+      'm', 0, 0, 1, 0, 1,
+      0xc0, 0x0c, 0, 5, 0, 1, 0, 0, 0x0e, 0x10, 0, 2, 0xc0, 0x10,
+      0xc0, 0x10, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 10, 0, 0, 1};
+  std::string name;
+  uint16_t type;
+  auto parse = kale::Resolver::ParseResponse(packet, sizeof(packet), &name,
+                                             &type);
+  ASSERT(parse);
+  ASSERT(parse->first == 0x1234);
+  ASSERT(name == "www.example.com" && type == 1);
+  ASSERT(parse->second.rcode == 0 && parse->second.ttl == 60);
+  ASSERT(parse->second.records.size() == 1);
+  ASSERT(parse->second.records[0] == "10.0.0.1");
+  auto query = kale::Resolver::BuildQuery("nowhere.example", 7);
+  auto nxdomain = BuildResponse(query.data(), query.size(), 0, 3);
+  parse = kale::Resolver::ParseResponse(nxdomain.data(), nxdomain.size());
+  ASSERT(parse);
+  ASSERT(parse->first == 7 && parse->second.rcode == 3);
+}
+
+// A second lookup is answered from the cache, without a query.
+TEST(T, LookupCached) {
+  StubServer server;
+  auto udp_sock = kl::udp::Socket();
+  ASSERT(udp_sock);
+  kale::Resolver resolver(*udp_sock);
+  for (int i = 0; i < 3; ++i) {
+    auto lookup =
+        resolver.Lookup("cached.example", "127.0.0.1", server.Port(), 1000);
+    ASSERT(lookup);
+    ASSERT(lookup->size() == 1 && (*lookup)[0] == "10.0.0.1");
+  }
+  ASSERT(server.Queries() == 1);
+}
+
+// Every query is completed once, answered or timed out if the socket
+// buffers drop it.
+TEST(T, ResolveConcurrently) {
+  StubServer server;
+  auto udp_sock = kl::udp::Socket();
+  ASSERT(udp_sock);
+  kale::Resolver resolver(*udp_sock);
+  const int kQueries = 2000;
+  std::atomic<int> completed(0), answered(0);
+  for (int i = 0; i < kQueries; ++i) {
+    std::string name = "host" + std::to_string(i) + ".example";
+    resolver.Resolve(
+        name.c_str(), "127.0.0.1", server.Port(), 500,
+        [&](kl::Result<std::vector<std::string>> result) {
+          answered += result ? 1 : 0;
+          ++completed;
+        });
+  }
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (completed < kQueries && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ASSERT(completed == kQueries);
+  ASSERT(answered > 0);
+  ASSERT(resolver.Pending() == 0);
+}
+
+// Queries nobody answers are failed at their timeout and free their slots.
+TEST(T, ResolveTimeout) {
+  StubServer server(100);
+  auto udp_sock = kl::udp::Socket();
+  ASSERT(udp_sock);
+  kale::Resolver resolver(*udp_sock);
+  auto start = std::chrono::steady_clock::now();
+  auto result = resolver.Resolve("lost.example", "127.0.0.1", server.Port(),
+                                 50);
+  ASSERT(resolver.Pending() == 1);
+  ASSERT(!result.get());
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  ASSERT(elapsed >= std::chrono::milliseconds(50));
+  ASSERT(elapsed < std::chrono::milliseconds(1000));
+  ASSERT(resolver.Pending() == 0);
+  auto query = resolver.SendQuery("lost.example", "127.0.0.1", server.Port());
+  ASSERT(query);
+  ASSERT(!resolver.WaitForResult(*query, 10));
+  ASSERT(!resolver.WaitForResult(*query, 10));
+}
+
+// The silent upstream is queried first, the answer comes from the hedge.
+TEST(T, HedgeAcrossUpstreams) {
+  StubServer silent(100), server;
+  auto udp_sock = kl::udp::Socket();
+  ASSERT(udp_sock);
+  kale::Resolver resolver(*udp_sock);
+  ASSERT(resolver.SetUpstreams({{"127.0.0.1", silent.Port()},
+                                {"127.0.0.1", server.Port()}},
+                               20));
+  auto start = std::chrono::steady_clock::now();
+  auto lookup = resolver.Lookup("hedged.example", 1000);
+  ASSERT(lookup);
+  ASSERT(lookup->size() == 1 && (*lookup)[0] == "10.0.0.1");
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  ASSERT(elapsed >= std::chrono::milliseconds(20));
+  ASSERT(elapsed < std::chrono::milliseconds(500));
+  ASSERT(silent.Queries() == 1 && server.Queries() == 1);
+  auto stats = resolver.Stats(1);
+  ASSERT(stats.sent == 1 && stats.answered == 1 && stats.srtt > 0);
+  stats = resolver.Stats(0);
+  ASSERT(stats.sent == 1 && stats.unanswered == 1 && stats.loss > 0);
+  // Now expected to answer sooner, the answering upstream goes first
+  for (int i = 0; i < 10; ++i) {
+    std::string name = "host" + std::to_string(i) + ".example";
+    ASSERT(resolver.Lookup(name.c_str(), 1000));
+  }
+  ASSERT(silent.Queries() == 1 && server.Queries() == 11);
+  ASSERT(resolver.Stats(1).answered == 11);
+}
+
+// Racing every upstream at once, one dropping everything costs nothing.
+TEST(T, RaceUpstreams) {
+  StubServer silent(100), server(0, 30);
+  auto udp_sock = kl::udp::Socket();
+  ASSERT(udp_sock);
+  kale::Resolver resolver(*udp_sock);
+  ASSERT(resolver.SetUpstreams({{"127.0.0.1", silent.Port()},
+                                {"127.0.0.1", server.Port()}},
+                               0));
+  auto lookup = resolver.Lookup("raced.example", 1000);
+  ASSERT(lookup);
+  ASSERT(silent.Queries() == 1 && server.Queries() == 1);
+  auto stats = resolver.Stats(1);
+  ASSERT(stats.answered == 1 && stats.srtt >= 30000);
+  ASSERT(!resolver.SetUpstreams({{"not an address", 53}}));
+}
+
+// A full set of silent upstreams is hedged through, then retried on the
+// best one until the timeout.
+TEST(T, HedgeFullSet) {
+  std::vector<std::unique_ptr<StubServer>> servers;
+  std::vector<kale::Resolver::Upstream> upstreams;
+  for (size_t i = 0; i < kale::Resolver::kMaxUpstreams; ++i) {
+    servers.emplace_back(new StubServer(100));
+    upstreams.push_back({"127.0.0.1", servers.back()->Port()});
+  }
+  auto udp_sock = kl::udp::Socket();
+  ASSERT(udp_sock);
+  kale::Resolver resolver(*udp_sock);
+  ASSERT(resolver.SetUpstreams(upstreams, 1));
+  ASSERT(!resolver.Lookup("nowhere.example", 200));
+  uint64_t sent = 0;
+  for (size_t i = 0; i < upstreams.size(); ++i) {
+    auto stats = resolver.Stats(i);
+    ASSERT(stats.sent >= 1 && stats.unanswered == 1);
+    sent += stats.sent;
+  }
+  ASSERT(sent > upstreams.size());
+  ASSERT(resolver.Pending() == 0);
+}
+
+// Retried on a lossy upstream with adaptive hedging, every lookup completes
+// well before its timeout.
+TEST(T, RetryLossyUpstream) {
+  StubServer server(30);
+  auto udp_sock = kl::udp::Socket();
+  ASSERT(udp_sock);
+  kale::Resolver resolver(*udp_sock);
+  ASSERT(resolver.SetUpstreams({{"127.0.0.1", server.Port()}}));
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 50; ++i) {
+    std::string name = "lossy" + std::to_string(i) + ".example";
+    ASSERT(resolver.Lookup(name.c_str(), 5000));
+  }
+  ASSERT(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+  auto stats = resolver.Stats(0);
+  ASSERT(stats.answered == 50 && stats.sent > 50);
+  ASSERT(resolver.Pending() == 0);
+}
+
+// The answers come back as soon as the queries are sent
+TEST(T, QueryAnsweredAtOnce) {
+  StubServer server;
+  auto udp_sock = kl::udp::Socket();
+  ASSERT(udp_sock);
+  kale::Resolver resolver(*udp_sock);
+  for (int i = 0; i < 100; ++i) {
+    std::string name = "quick" + std::to_string(i) + ".example";
+    auto query = resolver.SendQuery(name.c_str(), "127.0.0.1", server.Port());
+    ASSERT(query);
+    auto response = resolver.WaitForResult(*query, 5000);
+    ASSERT(response && response->size() == 1);
+    ASSERT(response->front() == "10.0.0.1");
+  }
+}
+
 TEST(T, Query) {
   auto udp_sock = kl::udp::Socket();
   ASSERT(udp_sock);
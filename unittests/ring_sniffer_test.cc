@@ -0,0 +1,150 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <unistd.h>
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kale/ip.h"
+#include "kale/ipv4.h"
+#include "kale/ring_sniffer.h"
+#include "kl/env.h"
+#include "kl/inet.h"
+#include "kl/logger.h"
+#include "kl/string.h"
+#include "kl/testkit.h"
+#include "kl/udp.h"
+
+namespace {
+
+class T {};
+
+TEST(kale::RingSniffer, Constructor, "lo") {}
+
+TEST(T, CompileAndInstall) {
+  kale::RingSniffer sniffer("lo");
+  ASSERT(sniffer.CompileAndInstall("udp and portrange 50000-65535"));
+  ASSERT(!sniffer.CompileAndInstall("udp and portrange 50000-65536"));
+}
+
+TEST(T, Timeout) {
+  kale::RingSniffer sniffer("lo");
+  // Nothing can match
+  ASSERT(sniffer.CompileAndInstall("udp and port 1 and port 2"));
+  std::vector<kale::PacketView> packets;
+  auto next = sniffer.NextBlock(10, &packets);
+  ASSERT(next);
+  ASSERT(*next == 0);
+  ASSERT(packets.empty());
+  sniffer.ReleaseBlock();
+}
+
+TEST(T, UDPDump) {
+  const std::string message("wtf~imfao~rofl");
+  const uint16_t port = 4001;
+  const int kNumOfPackets = 1 << 12;
+  kale::RingSniffer::Options options = kale::RingSniffer::DefaultOptions();
+  options.block_size = 1 << 16;
+  options.block_count = 16;
+  kale::RingSniffer sniffer("lo", options);
+  auto compile = sniffer.CompileAndInstall(
+      kl::string::FormatString("udp and dst port %u", port).c_str());
+  ASSERT(compile);
+  auto send_thread = std::thread([port, message] {
+    auto sock = kl::udp::Socket();
+    ASSERT(sock);
+    kl::env::Defer defer([fd = *sock] { ::close(fd); });
+    for (int i = 0; i < kNumOfPackets; ++i) {
+      auto send = kl::inet::Sendto(*sock, message.c_str(), message.size(), 0,
+                                   "127.0.0.1", port);
+      ASSERT(send);
+      // Don't overrun the small ring
+      if (i % 256 == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+  });
+  std::vector<kale::PacketView> packets;
+  int counter = 0, blocks = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (counter < kNumOfPackets &&
+         std::chrono::steady_clock::now() < deadline) {
+    auto next = sniffer.NextBlock(1000, &packets);
+    ASSERT(next);
+    for (const auto &packet : packets) {
+      ASSERT(kale::ipv4::PacketRef(packet.data, packet.len).IsUDP());
+      ASSERT(packet.capacity >= packet.len);
+      ASSERT(std::string(packet.data + packet.len - message.size(),
+                         packet.data + packet.len) == message);
+    }
+    counter += *next;
+    ++blocks;
+    sniffer.ReleaseBlock();
+  }
+  std::chrono::duration<float> diff =
+      std::chrono::high_resolution_clock::now() - start;
+  KL_DEBUG("%d packets in %d blocks costs %fs", counter, blocks, diff.count());
+  ASSERT(counter == kNumOfPackets);
+  send_thread.join();
+}
+
+// Sockets of one group share the traffic, every packet of a flow reaches the
+// same one of them.
+TEST(T, Fanout) {
+  const std::string message("wtf~imfao~rofl");
+  const uint16_t port = 4002;
+  const uint16_t kGroup = 0x6b61;
+  const int kNumOfFlows = 64, kPacketsPerFlow = 16;
+  const int kNumOfPackets = kNumOfFlows * kPacketsPerFlow;
+  kale::RingSniffer::Options options = kale::RingSniffer::DefaultOptions();
+  options.block_size = 1 << 16;
+  options.block_count = 16;
+  std::vector<std::unique_ptr<kale::RingSniffer>> sniffers;
+  for (int i = 0; i < 2; ++i) {
+    sniffers.emplace_back(new kale::RingSniffer("lo", options));
+    ASSERT(sniffers.back()->CompileAndInstall(
+        kl::string::FormatString("udp and dst port %u", port).c_str()));
+    ASSERT(sniffers.back()->JoinFanout(kGroup, kale::kFanoutHash));
+  }
+  // Every socket is a flow of its own
+  for (int i = 0; i < kNumOfFlows; ++i) {
+    auto sock = kl::udp::Socket();
+    ASSERT(sock);
+    kl::env::Defer defer([fd = *sock] { ::close(fd); });
+    for (int j = 0; j < kPacketsPerFlow; ++j) {
+      ASSERT(kl::inet::Sendto(*sock, message.c_str(), message.size(), 0,
+                              "127.0.0.1", port));
+    }
+  }
+  std::vector<kale::PacketView> packets;
+  int counters[2] = {0, 0};
+  // Sniffer each flow landed on, by source port
+  std::map<uint16_t, int> flows;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (counters[0] + counters[1] < kNumOfPackets &&
+         std::chrono::steady_clock::now() < deadline) {
+    for (int i = 0; i < 2; ++i) {
+      auto next = sniffers[i]->NextBlock(10, &packets);
+      ASSERT(next);
+      for (const auto &packet : packets) {
+        uint16_t port = kale::ip::UDPSrcPort(packet.data, packet.len);
+        ASSERT(flows.emplace(port, i).first->second == i);
+      }
+      counters[i] += *next;
+      sniffers[i]->ReleaseBlock();
+    }
+  }
+  KL_DEBUG("fanout %d + %d packets", counters[0], counters[1]);
+  ASSERT(counters[0] > 0 && counters[1] > 0);
+  ASSERT(counters[0] + counters[1] == kNumOfPackets);
+  ASSERT(flows.size() == static_cast<size_t>(kNumOfFlows));
+}
+
+}  // namespace
@@ -0,0 +1,158 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "kale/ring.h"
+#include "kl/logger.h"
+#include "kl/testkit.h"
+
+namespace {
+
+class T {};
+
+TEST(T, SPSCFull) {
+  kale::SPSCRing<int> ring(4);
+  for (int i = 0; i < 4; ++i) {
+    ASSERT(ring.Push(i));
+  }
+  ASSERT(!ring.Push(4));
+  ASSERT(ring.Size() == 4);
+  int v;
+  ASSERT(ring.Pop(&v) && v == 0);
+  ASSERT(ring.Push(4));
+  int batch[8];
+  ASSERT(ring.PopBatch(batch, 8) == 4);
+  for (int i = 0; i < 4; ++i) {
+    ASSERT(batch[i] == i + 1);
+  }
+  ASSERT(!ring.Pop(&v));
+  ASSERT(ring.PushBatch(batch, 8) == 4);
+}
+
+TEST(T, MPSCFull) {
+  kale::MPSCRing<int> ring(4);
+  int batch[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+  ASSERT(ring.PushBatch(batch, 3) == 3);
+  ASSERT(ring.PushBatch(batch + 3, 5) == 1);
+  ASSERT(!ring.Push(8));
+  int v;
+  ASSERT(ring.Pop(&v) && v == 0);
+  ASSERT(ring.Push(8));
+  ASSERT(ring.PopBatch(batch, 8) == 4);
+  ASSERT(batch[0] == 1 && batch[3] == 8);
+  ASSERT(ring.Size() == 0);
+}
+
+TEST(T, SPSCThreads) {
+  const uint32_t kCount = 1 << 16;
+  kale::SPSCRing<uint32_t> ring(256);
+  std::thread producer([&ring] {
+    uint32_t batch[32];
+    uint32_t next = 0;
+    while (next < kCount) {
+      size_t n = 0;
+      while (n < 32 && next + n < kCount) {
+        batch[n] = next + n;
+        ++n;
+      }
+      size_t pushed = ring.PushBatch(batch, n);
+      if (pushed == 0) {
+        std::this_thread::yield();
+      }
+      next += pushed;
+    }
+  });
+  uint32_t expected = 0;
+  uint32_t batch[16];
+  while (expected < kCount) {
+    size_t n = ring.PopBatch(batch, 16);
+    if (n == 0) {
+      std::this_thread::yield();
+    }
+    for (size_t i = 0; i < n; ++i) {
+      ASSERT(batch[i] == expected++);
+    }
+  }
+  producer.join();
+}
+
+// Elements of each producer come out in the order they were pushed.
+TEST(T, MPSCThreads) {
+  const int kProducers = 4;
+  const uint32_t kCount = 1 << 14;
+  kale::MPSCRing<uint32_t> ring(128);
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kProducers; ++p) {
+    producers.emplace_back([&ring, p] {
+      uint32_t next = 0;
+      while (next < kCount) {
+        uint32_t batch[8];
+        size_t n = 0;
+        while (n < 8 && next + n < kCount) {
+          batch[n] = (p << 24) | (next + n);
+          ++n;
+        }
+        size_t pushed = ring.PushBatch(batch, n);
+        if (pushed == 0) {
+          std::this_thread::yield();
+        }
+        next += pushed;
+      }
+    });
+  }
+  std::vector<uint32_t> expected(kProducers, 0);
+  uint32_t total = 0;
+  uint32_t batch[32];
+  while (total < kProducers * kCount) {
+    size_t n = ring.PopBatch(batch, 32);
+    if (n == 0) {
+      std::this_thread::yield();
+    }
+    for (size_t i = 0; i < n; ++i) {
+      uint32_t p = batch[i] >> 24;
+      ASSERT(p < kProducers);
+      ASSERT((batch[i] & 0xffffff) == expected[p]++);
+    }
+    total += n;
+  }
+  for (auto &producer : producers) {
+    producer.join();
+  }
+}
+
+TEST(T, BufferPool) {
+  kale::BufferPool pool(4, 2048);
+  std::vector<uint32_t> buffers;
+  uint32_t buffer;
+  while (pool.Get(&buffer)) {
+    buffers.push_back(buffer);
+  }
+  ASSERT(buffers.size() == 4);
+  ASSERT(pool.Data(buffers[1]) - pool.Data(buffers[0]) ==
+         static_cast<int>(2048 * (buffers[1] - buffers[0])));
+  kale::PacketDesc desc = {buffers[2], 100};
+  ASSERT(pool.Data(desc) == pool.Data(buffers[2]));
+  // Buffers come back from another stage
+  std::thread sender([&pool, &buffers] {
+    for (uint32_t b : buffers) {
+      pool.Put(b);
+    }
+  });
+  sender.join();
+  ASSERT(pool.Available() == 4);
+  ASSERT(pool.Get(&buffer) && buffer == buffers[0]);
+  // Every buffer starts on a cache line
+  kale::BufferPool odd(2, 100);
+  ASSERT(odd.BufferSize() == 100);
+  for (uint32_t i = 0; i < 2; ++i) {
+    ASSERT(reinterpret_cast<uintptr_t>(odd.Data(i)) %
+               kale::kCacheLineSize ==
+           0);
+  }
+}
+
+}  // namespace
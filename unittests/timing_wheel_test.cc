@@ -0,0 +1,103 @@
+// Copyright (c) 2017 Kai Luo <gluokai@gmail.com>. All rights reserved.
+// Use of this source code is governed by the BSD license that can be found in
+// the LICENSE file.
+
+#include <random>
+#include <vector>
+
+#include "kale/timing_wheel.h"
+#include "kl/logger.h"
+#include "kl/testkit.h"
+
+namespace {
+
+class T {};
+
+TEST(kale::TimingWheel, Constructor, 16) {}
+
+TEST(T, ScheduleAndCancel) {
+  kale::TimingWheel wheel(4);
+  wheel.Schedule(0, 10);
+  wheel.Schedule(1, 5);
+  wheel.Schedule(2, 5);
+  wheel.Cancel(2);
+  ASSERT(wheel.Size() == 2);
+  ASSERT(!wheel.Scheduled(2));
+  std::vector<uint32_t> fired;
+  auto record = [&fired](uint32_t id) { fired.push_back(id); };
+  wheel.Advance(4, record);
+  ASSERT(fired.empty());
+  wheel.Advance(5, record);
+  ASSERT(fired.size() == 1 && fired[0] == 1);
+  // Rescheduling moves the timer
+  wheel.Schedule(0, 20);
+  wheel.Advance(19, record);
+  ASSERT(fired.size() == 1);
+  wheel.Advance(20, record);
+  ASSERT(fired.size() == 2 && fired[1] == 0);
+  ASSERT(wheel.Size() == 0);
+  // Already due fires on the next advance
+  wheel.Schedule(3, 1);
+  wheel.Advance(wheel.Now(), record);
+  ASSERT(fired.size() == 3 && fired[2] == 3);
+}
+
+TEST(T, NextExpiry) {
+  kale::TimingWheel wheel(4);
+  ASSERT(wheel.NextExpiry() == UINT64_MAX);
+  wheel.Schedule(0, 1000);
+  // Not before the next turn of the lowest wheel
+  ASSERT(wheel.NextExpiry() == 64);
+  wheel.Schedule(1, 30);
+  wheel.Schedule(2, 10);
+  ASSERT(wheel.NextExpiry() == 10);
+  wheel.Cancel(2);
+  ASSERT(wheel.NextExpiry() == 30);
+  auto ignore = [](uint32_t) {};
+  wheel.Advance(30, ignore);
+  ASSERT(wheel.NextExpiry() == 64);
+  wheel.Advance(990, ignore);
+  ASSERT(wheel.NextExpiry() == 1000);
+}
+
+// A timer rescheduled from its callback a whole turn later fires again.
+TEST(T, Periodic) {
+  const uint64_t kPeriod = 64;
+  kale::TimingWheel wheel(1);
+  wheel.Schedule(0, kPeriod);
+  int count = 0;
+  for (uint64_t now = 0; now <= 10 * kPeriod; ++now) {
+    wheel.Advance(now, [&](uint32_t id) {
+      ASSERT(now % kPeriod == 0);
+      ++count;
+      wheel.Schedule(id, now + kPeriod);
+    });
+  }
+  ASSERT(count == 10);
+}
+
+// Every timer fires exactly at its tick, across all wheels.
+TEST(T, Random) {
+  const size_t kTimers = 4096;
+  kale::TimingWheel wheel(kTimers);
+  std::mt19937 rng(13);
+  std::vector<uint64_t> expires(kTimers);
+  for (uint32_t i = 0; i < kTimers; ++i) {
+    // Spread over the first three wheels
+    expires[i] = 1 + rng() % (1 << 18);
+    wheel.Schedule(i, expires[i]);
+  }
+  size_t fired = 0;
+  uint64_t now = 0;
+  while (wheel.Size() > 0) {
+    now += 1 + rng() % 100;
+    wheel.Advance(now, [&](uint32_t id) {
+      // Now() is past the tick being fired
+      ASSERT(expires[id] == wheel.Now() - 1);
+      ++fired;
+    });
+  }
+  ASSERT(fired == kTimers);
+}
+
+}  // namespace
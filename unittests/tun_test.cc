@@ -36,6 +36,18 @@ TEST(T, Allocation) {
   ::close(*alloc);
 }
 
+TEST(T, MultiQueueAllocation) {
+  std::string tun_name(kale::RandomTunName());
+  auto alloc = kale::AllocateMultiQueueTun(tun_name.c_str(), 4);
+  ASSERT(alloc);
+  ASSERT(alloc->size() == 4);
+  auto ifindex = kl::netdev::RetrieveIFIndex(tun_name.c_str());
+  ASSERT(ifindex);
+  for (int fd : *alloc) {
+    ::close(fd);
+  }
+}
+
 TEST(T, ReadWriteTun) {
   const int kNumOfPackets = 1 << 10;
   const std::string message("imfao|wtf|rofl~~|rekt");